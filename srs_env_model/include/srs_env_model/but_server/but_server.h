@@ -58,6 +58,11 @@
 #include <visualization_msgs/MarkerArray.h>
 #include <std_msgs/ColorRGBA.h>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 //#include <sensor_msgs/CameraInfo.h>
 //#include <std_srvs/Empty.h>
 
@@ -110,6 +115,9 @@ protected:
     //! Publish all
     void publishAll(const ros::Time& rostime = ros::Time::now());
 
+    //! Publish plugins not crawling the map (on the callback thread)
+    void publishNonCrawling(const ros::Time& rostime);
+
     /**
  * @brief Find speckle nodes (single occupied voxels with no neighbors). Only works on lowest resolution!
  * @param key
@@ -120,6 +128,9 @@ protected:
     //! On octomap data changed
     void onOcMapDataChanged( const tButServerOcMap & mapdata );
 
+    //! Publishing thread main loop
+    void publisherThread();
+
     /// On reset service call
     bool onReset(std_srvs::Empty::Request& request, std_srvs::Empty::Response& response){ reset(); return true; }
 
@@ -136,6 +147,33 @@ protected:
     //! Current frame counter
     int m_frameCounter;
 
+    //======================================================================================================
+    // Publishing thread
+
+    /// Should be data published in the separate thread?
+    bool m_bPublishInThread;
+
+    /// Maximal publishing rate [Hz] (zero or negative - not limited)
+    double m_maxPublishRate;
+
+    /// Publishing thread
+    boost::scoped_ptr< boost::thread > m_publisherThread;
+
+    /// Publishing request mutex
+    boost::mutex m_publishRequestMutex;
+
+    /// Publishing request condition
+    boost::condition_variable m_publishRequestCondition;
+
+    /// Is new publishing requested? (more requests are merged into one)
+    bool m_bPublishRequested;
+
+    /// Should publishing thread quit?
+    bool m_bStopPublisher;
+
+    /// Held while plugins are crawled and published or reset
+    boost::mutex m_lockPublish;
+
     //======================================================================================================
     // Services
 
@@ -51,6 +51,7 @@ public:
     virtual bool interfereWithBox(const Box &box) const;
     virtual bool isSimilar(const Object *object) const;
     virtual bool isPointInside(float x, float y, float z) const;
+    virtual Box boundingBox() const;
 
     const Box& box() const;
 
@@ -29,6 +29,8 @@
 #ifndef OBJTREE_BOX_H
 #define OBJTREE_BOX_H
 
+#include <vector>
+
 namespace objtree
 {
 
@@ -66,6 +68,52 @@ struct Box
     }
 };
 
+/**
+ * Array of boxes stored as a structure of arrays.
+ * Each coordinate is stored in its own contiguous array, so filters can test several boxes at once.
+ */
+
+struct BoxArray
+{
+    std::vector<float> x, y, z;
+    std::vector<float> w, h, d;
+
+    inline unsigned int size() const
+    {
+        return x.size();
+    }
+
+    inline void resize(unsigned int size)
+    {
+        x.resize(size);
+        y.resize(size);
+        z.resize(size);
+        w.resize(size);
+        h.resize(size);
+        d.resize(size);
+    }
+
+    inline void clear()
+    {
+        resize(0);
+    }
+
+    inline void set(unsigned int i, const Box &box)
+    {
+        x[i] = box.x;
+        y[i] = box.y;
+        z[i] = box.z;
+        w[i] = box.w;
+        h[i] = box.h;
+        d[i] = box.d;
+    }
+
+    inline Box get(unsigned int i) const
+    {
+        return Box(x[i], y[i], z[i], w[i], h[i], d[i]);
+    }
+};
+
 }
 
 #endif // OBJTREE_BOX_H
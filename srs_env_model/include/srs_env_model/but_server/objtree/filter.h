@@ -48,7 +48,11 @@ public:
         SPHERE = 3
     };
 
+    /// Number of boxes tested by one filterBlock() call (one block of node children)
+    static const unsigned int BLOCK_SIZE = 8;
+
     virtual bool filter(const Box &dim) const = 0;
+    virtual unsigned int filterBlock(const BoxArray &dims, unsigned int first) const;
     virtual Type type() const = 0;
 };
 
@@ -63,6 +67,7 @@ private:
 public:
     FilterBox(const Box &box);
     virtual bool filter(const Box &dim) const;
+    virtual unsigned int filterBlock(const BoxArray &dims, unsigned int first) const;
 
     virtual Type type() const
     {
@@ -82,6 +87,7 @@ private:
 public:
     FilterPlane(float posX, float posY, float posZ, float vecX, float vecY, float vecZ);
     virtual bool filter(const Box &dim) const;
+    virtual unsigned int filterBlock(const BoxArray &dims, unsigned int first) const;
 
     virtual Type type() const
     {
@@ -96,6 +102,7 @@ class FilterZero : public Filter
 {
 public:
     virtual bool filter(const Box &dim) const;
+    virtual unsigned int filterBlock(const BoxArray &dims, unsigned int first) const;
 
     virtual Type type() const
     {
@@ -115,6 +122,7 @@ private:
 public:
     FilterSphere(float x, float y, float z, float radius);
     virtual bool filter(const Box &dim) const;
+    virtual unsigned int filterBlock(const BoxArray &dims, unsigned int first) const;
 
     virtual Type type() const
     {
@@ -29,8 +29,7 @@
 #ifndef OBJTREE_NODE_H
 #define OBJTREE_NODE_H
 
-#include <cstdio>
-#include <list>
+#include <vector>
 #include <srs_env_model/but_server/objtree/object.h>
 
 namespace objtree
@@ -38,6 +37,8 @@ namespace objtree
 
 /**
  * Octree node class.
+ * Nodes are stored in a contiguous array owned by Octree and refer to each other by indices.
+ * Children of a node are always allocated as one block of CHILDREN consecutive nodes.
  */
 
 class Node
@@ -46,18 +47,13 @@ public:
     static const unsigned int CHILDREN = 8;
     static const unsigned int NEIGHBORS = 26;
 
+    /// Invalid node index
+    static const unsigned int NONE = (unsigned int)-1;
+
 private:
-    unsigned char m_place;
-    Node* m_parent;
+    friend class Octree;
 
-    /*
-     * Neighbors ids (from top view)
-     * Top part:  Middle part:  Bottom part:
-     *  6  7  8     14 15 16      23 24 25
-     *  3  4  5     12    13      20 21 22
-     *  0  1  2      9 10 11      17 18 19
-    */
-    Node* m_neighbors[NEIGHBORS];
+    unsigned int m_parent;
 
     /*
      * Node children ids (from top view)
@@ -65,24 +61,29 @@ private:
      *   2  3         6  7
      *   0  1         4  5
      *
+     * Index of the first node of children block, child i is stored at m_children+i
     */
-    Node* m_children[CHILDREN];
-    std::list<Object*> m_objects;
+    unsigned int m_children;
+
+    /// Bit mask of existing children
+    unsigned char m_childMask;
+
+    unsigned char m_place;
+    unsigned char m_depth;
+
+    /// Node position in the grid of all nodes in the same depth
+    unsigned short m_cell[3];
 
-    static unsigned char reverseNeighborId(unsigned char dir);
-    Node* parentNeighborChild(unsigned char parentNeighbor, unsigned char child);
-    Node* computeNeighbor(unsigned char dir);
+    std::vector<Object*> m_objects;
 
 public:
-    Node(unsigned char place = 0, Node *parent = NULL);
-    ~Node();
-    Node* parent();
-    Node* child(unsigned char place, bool createNew = false);
-    Node* neighbor(unsigned char dir);
-    const std::list<Object*>& objects() const;
-    void add(Object* object);
-    void removeObject(Object *object);
-    void deleteIfEmpty();
+    Node();
+    unsigned int parent() const;
+    unsigned int child(unsigned char place) const;
+    bool hasChildren() const;
+    unsigned char place() const;
+    unsigned char depth() const;
+    const std::vector<Object*>& objects() const;
 
     static Box& getChildBox(unsigned char place, Box &childBox, const Box &parentBox);
 };
@@ -29,17 +29,16 @@
 #ifndef OBJTREE_OBJECT_H
 #define OBJTREE_OBJECT_H
 
-#include <list>
+#include <vector>
 #include <srs_env_model/but_server/objtree/box.h>
 #include <srs_env_model/but_server/objtree/history.h>
 
 namespace objtree
 {
 
-class Node;
-
 /**
  * Abstract object class. Base class for all objects saved in octree.
+ * Objects inserted into octree must be removed through Octree, which unlinks them from nodes.
  */
 
 class Object
@@ -52,7 +51,7 @@ public:
     };
 
 private:
-    std::list<Node*> m_inNodes;
+    std::vector<unsigned int> m_inNodes;
     unsigned int m_id;
 
 protected:
@@ -63,21 +62,23 @@ protected:
 
 public:
     Object();
-    ~Object();
+    virtual ~Object();
 
     virtual bool fitsIntoBox(const Box &box) const = 0;
     virtual bool interfereWithBox(const Box &box) const = 0;
     virtual bool isSimilar(const Object *object) const = 0;
     virtual bool isPointInside(float x, float y, float z) const = 0;
+    virtual Box boundingBox() const = 0;
 
     void setId(unsigned int id);
     unsigned int id() const;
     bool hasId() const;
     Type type() const;
 
-    void newNode(Node *node);
-    void removeNode(Node *node);
+    void newNode(unsigned int node);
+    void removeNode(unsigned int node);
 
+    const std::vector<unsigned int>& inNodes() const;
     unsigned int inNodesCount() const;
 
 #if HISTORY_ENABLED
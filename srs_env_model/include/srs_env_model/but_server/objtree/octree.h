@@ -30,19 +30,21 @@
 #define OBJTREE_OCTREE_H
 
 #include <map>
-#include <list>
-#include <set>
+#include <vector>
+#include <boost/cstdint.hpp>
 #include <srs_env_model/but_server/objtree/box.h>
+#include <srs_env_model/but_server/objtree/node.h>
 
 namespace objtree
 {
 
-class Node;
 class Object;
 class Filter;
 
 /**
  * Main objtree class. Provides interface for working with octree.
+ * Nodes are stored in a contiguous array, node bounding boxes in a separate structure of arrays,
+ * so children of a node can be tested by filters at once.
  */
 
 class Octree
@@ -50,13 +52,47 @@ class Octree
 public:
     static const unsigned int DEFAULT_MAX_DEPTH = 4;
 
+    /// Index of root node
+    static const unsigned int ROOT = 0;
+
+    /// Depth limit of the growing tree, leaf grid cells have to fit in 16 bits
+    static const unsigned int MAX_DEPTH = 15;
+
 private:
-    Node *m_root;
+    std::vector<Node> m_nodes;
+    BoxArray m_bounds;
+    std::vector<unsigned int> m_freeBlocks;
+
     Box m_rootSize;
+    Box m_initialRootSize;
     unsigned int m_maxId;
     unsigned int m_maxDepth;    
+    unsigned int m_initialMaxDepth;
     std::map<unsigned int, Object*> m_objects;
 
+    /// Ids of objects changed since the last takeChanges() call
+    std::vector<unsigned int> m_changes;
+
+    /// Batch insertion workers
+    struct CellWorker;
+    struct MatchWorker;
+
+    void init();
+    unsigned int allocateBlock(unsigned int node);
+    void updateBlock(unsigned int node, unsigned int first);
+    void grow(const Box &box);
+    unsigned int fitNode(const Object *object);
+    unsigned int child(unsigned int node, unsigned char place, bool createNew = false);
+    unsigned int findNode(unsigned int depth, int x, int y, int z) const;
+    unsigned int neighbor(unsigned int node, unsigned char dir) const;
+    void addToNode(unsigned int node, Object *object);
+    void unlinkObject(Object *object);
+    void deleteIfEmpty(unsigned int node);
+    Object* findSimilar(const Object *object, unsigned int node) const;
+    void traverse(std::vector<Box> *nodesList, std::vector<Object*> &objectList, const Filter *filter) const;
+    void leafCells(const Object *object, Box box, unsigned int depth, unsigned int x, unsigned int y, unsigned int z, std::vector<boost::uint64_t> &cells) const;
+    void neighborhoodCells(const std::vector<boost::uint64_t> &cells, std::vector<boost::uint64_t> &neighborhood) const;
+
 public:
     Octree(unsigned int maxDepth = DEFAULT_MAX_DEPTH);
     Octree(const Box &rootSize, unsigned int maxDepth = DEFAULT_MAX_DEPTH);
@@ -66,28 +102,32 @@ public:
 
     unsigned int insert(Object* object);
     unsigned int insertOnFit(Object* object);
-    unsigned int insertOnInterfere(Object* object, Node *node, Box box, unsigned int depth = 0);
+    unsigned int insertOnInterfere(Object* object, unsigned int node, Box box, unsigned int depth = 0);
 
     unsigned int insertUpdate(Object* object);
     unsigned int insertUpdate2(Object* object);
-    unsigned int insertUpdateOnInterfere(Object* object, Node *node, Box box, bool &inserted, unsigned int depth = 0);
+    unsigned int insertUpdateOnInterfere(Object* object, unsigned int node, Box box, bool &inserted, unsigned int depth = 0);
+    void insertUpdate(const std::vector<Object*> &objects, std::vector<unsigned int> &ids, unsigned int numThreads = 1);
 
     Object* getSimilarObject(const Object *object);
-    Object* getSimilarObject(const Object *object, Node *node, Box box, unsigned int depth = 0);
+    Object* getSimilarObject(const Object *object, unsigned int node, Box box, unsigned int depth = 0);
     bool isPositionFree(float x, float y, float z);
 
-    Node* root() const;
+    const Box& rootSize() const;
+    unsigned int maxDepth() const;
+    const Node& node(unsigned int index) const;
+    Box nodeBox(unsigned int index) const;
     unsigned int maxId() const;
     unsigned int count() const;
 
     const Object* object(unsigned int id) const;
     bool removeObject(unsigned int id);
 
-    void nodes(std::list<Box> &nodesList, std::set<Object*> &objectList, const Filter *filter);
-    void nodes(std::list<Box> &nodesList, std::set<Object*> &objectList, const Filter *filter, Box dim, Node *node);
-    void objects(std::set<Object*> &objectList, const Filter *filter);
+    void nodes(std::vector<Box> &nodesList, std::vector<Object*> &objectList, const Filter *filter) const;
+    void objects(std::vector<Object*> &objectList, const Filter *filter) const;
 
     const std::map<unsigned int, Object*>& objectsAll() const;
+    void takeChanges(std::vector<unsigned int> &ids);
 };
 
 }
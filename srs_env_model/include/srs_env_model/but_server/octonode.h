@@ -31,13 +31,38 @@
 #include <octomap_ros/OctomapROS.h>
 #include <octomap/OcTreeStamped.h>
 
+#include <ctime>
+
 namespace srs_env_model {
 
+#ifdef EMODEL_COMPACT_NODE
+//! Compact node base - stamped node with color and timestamp packed to 4 bytes
+typedef octomap::OcTreeNode EModelTreeNodeBase;
+
+//! Compact node timestamps older than this (in seconds) are saturated by the tree sweep
+#define EMODEL_STAMP_MAX_AGE 127
+
+//! Minimal period of the timestamp saturation sweep (in seconds)
+#define EMODEL_STAMP_SWEEP_PERIOD 32
+
+//! Stored value of the saturated timestamp
+#define EMODEL_STAMP_SATURATED 255
+#else
+typedef octomap::OcTreeNodeStamped EModelTreeNodeBase;
+#endif
+
 /**
  * Nodes to be used in a environment model server.
  *
+ * Nodes are allocated from the pool shared by all trees. If EMODEL_COMPACT_NODE
+ * is defined, alpha is not stored (always 255) and the timestamp is kept in
+ * 8 bits as time modulo 255, so the node fits to 24 bytes instead of 32 on
+ * 64-bit systems. The tree marks old nodes as saturated before their age can
+ * wrap (see EMOcTree::saturateTimestamps()). Saturated nodes report timestamp 0,
+ * so they are always outdated. Ages of the other nodes are exact, and only nodes
+ * older than EMODEL_STAMP_MAX_AGE - EMODEL_STAMP_SWEEP_PERIOD (95 s) are saturated.
  */
-class EModelTreeNode: public octomap::OcTreeNodeStamped {
+class EModelTreeNode: public EModelTreeNodeBase {
 
 public:
 
@@ -53,6 +78,10 @@ public:
 
 	bool createChild(unsigned int i);
 
+	//! Nodes are allocated from the pool
+	static void * operator new(size_t size);
+	static void operator delete(void * p, size_t size);
+
 	// overloaded, so that the return type is correct:
 	inline EModelTreeNode* getChild(unsigned int i) {
 		return static_cast<EModelTreeNode*> (octomap::OcTreeDataNode<float>::getChild(i));
@@ -73,7 +102,11 @@ public:
 		return m_b;
 	}
 	unsigned char a() const {
+#ifdef EMODEL_COMPACT_NODE
+		return 255;
+#else
 		return m_a;
+#endif
 	}
 
 	//! Get color components - reference version
@@ -86,9 +119,11 @@ public:
 	unsigned char & b() {
 		return m_b;
 	}
+#ifndef EMODEL_COMPACT_NODE
 	unsigned char & a() {
 		return m_a;
 	}
+#endif
 
 	//! Set color components
 	void setColor(unsigned char r, unsigned char g, unsigned char b,
@@ -96,9 +131,35 @@ public:
 		m_r = r;
 		m_g = g;
 		m_b = b;
+#ifndef EMODEL_COMPACT_NODE
 		m_a = a;
+#endif
+	}
+
+#ifdef EMODEL_COMPACT_NODE
+	//! Timestamp interface of the OcTreeNodeStamped
+	unsigned int getTimestamp() const {
+		if (m_stamp == EMODEL_STAMP_SATURATED)
+			return 0;
+
+		unsigned int now = (unsigned int) time(NULL);
+		return now - getAge(now);
+	}
+	void updateTimestamp() {
+		m_stamp = (unsigned char) (time(NULL) % 255);
+	}
+	void setTimestamp(unsigned int timestamp) {
+		m_stamp = (unsigned char) (timestamp % 255);
 	}
 
+	//! Saturate timestamps older than EMODEL_STAMP_MAX_AGE in this subtree (all of them if bAll is set)
+	void saturateTimestamps(unsigned int now, bool bAll);
+	void updateOccupancyChildren() {
+		this->setLogOdds(this->getMaxChildLogOdds()); // conservative
+		updateTimestamp();
+	}
+#endif
+
 	// has any color been integrated? (pure white is very unlikely...)
 	inline bool isColorSet() const {
 		return ((m_r != 255) || (m_g != 255) || (m_b != 255));
@@ -110,6 +171,12 @@ public:
 	// overloaded tree expanding taking care of node colors
 	void expandNode();
 
+	// delete child with its subtree, children array is freed with the last child
+	void removeChild(unsigned int i);
+
+	// copy occupancy, color and timestamp of the other node (children are not touched)
+	void copyData(const EModelTreeNode& node);
+
 	// update node color
 	void updateColorChildren();
 
@@ -118,7 +185,19 @@ public:
 
 protected:
 	//! Color data
+#ifdef EMODEL_COMPACT_NODE
+	unsigned char m_r, m_g, m_b;
+
+	//! Timestamp modulo 255 or EMODEL_STAMP_SATURATED
+	unsigned char m_stamp;
+
+	//! Age of the not saturated timestamp (valid up to 254 s)
+	unsigned int getAge(unsigned int now) const {
+		return (now % 255 + 255 - m_stamp) % 255;
+	}
+#else
 	unsigned char m_r, m_g, m_b, m_a;
+#endif
 
 }; // class EModelTreeNode
 
@@ -222,6 +301,11 @@ public:
 	//! \return timestamp of last update
 	unsigned int getLastUpdateTime();
 
+	// compact nodes only: mark nodes older than EMODEL_STAMP_MAX_AGE as saturated before their
+	// 8-bit timestamps wrap. Must be called before timestamps are updated or read, it sweeps
+	// the tree at most once per EMODEL_STAMP_SWEEP_PERIOD (does nothing for full nodes).
+	void saturateTimestamps();
+
 	void degradeOutdatedNodes(unsigned int time_thres);
 
 	virtual void
@@ -234,9 +318,123 @@ public:
 			const octomap::point3d& sensor_origin, double maxrange = -1.,
 			bool pruning = true, bool lazy_eval = false);
 
+	// Inserts colored scan, rays are traced by numThreads threads into
+	// per-thread key sets which are merged and applied in one batch
+	void insertColoredScanParallel(const typePointCloud& coloredScan,
+			const octomap::point3d& sensor_origin, unsigned numThreads,
+			double maxrange = -1., bool pruning = true, bool lazy_eval = false);
+
+	// trace rays of scan points [begin, end) into the given key sets (thread safe)
+	void computeUpdatePart(const octomap::Pointcloud& scan,
+			const octomap::point3d& origin, size_t begin, size_t end,
+			double maxrange, octomap::KeySet& free_cells,
+			octomap::KeySet& occupied_cells) const;
+
+	// change detection - keys of modified leaves are collected until reset
+	void enableChangeDetection(bool enable) {
+		m_bTrackChanges = enable;
+		m_bAllChanged = true;
+		m_changedKeys.clear();
+	}
+
+	bool isChangeDetectionEnabled() const {
+		return m_bTrackChanges;
+	}
+
+	// mark leaf containing given key as changed
+	void markChanged(const octomap::OcTreeKey& key) {
+		if (!m_bTrackChanges || m_bAllChanged)
+			return;
+
+		if (m_changedKeys.empty()) {
+			m_changedMin = m_changedMax = key;
+		} else {
+			for (unsigned i = 0; i < 3; ++i) {
+				if (key[i] < m_changedMin[i])
+					m_changedMin[i] = key[i];
+				if (key[i] > m_changedMax[i])
+					m_changedMax[i] = key[i];
+			}
+		}
+		m_changedKeys.insert(key);
+	}
+
+	// mark leaf which is going to be updated by updateNode() as changed, the whole
+	// box of a pruned leaf is marked because the update expands it
+	void markUpdated(const octomap::OcTreeKey& key);
+
+	// whole tree has changed (reset, load...)
+	void markAllChanged() {
+		m_bAllChanged = true;
+		m_changedKeys.clear();
+	}
+
+	// is the change set unusable (whole tree changed or tracking is disabled)?
+	bool isAllChanged() const {
+		return m_bAllChanged || !m_bTrackChanges;
+	}
+
+	bool hasChanges() const {
+		return isAllChanged() || !m_changedKeys.empty();
+	}
+
+	// keys of changed leaves (lowest level keys, pruned leaves are represented by one inner key)
+	const octomap::KeySet& getChangedKeys() const {
+		return m_changedKeys;
+	}
+
+	// metric bounding box of all changed keys, false if there is nothing changed
+	bool getChangedBBX(octomap::point3d& min, octomap::point3d& max) const;
+
+	// start new change set
+	void resetChangeDetection() {
+		m_bAllChanged = false;
+		m_changedKeys.clear();
+	}
+
+	// keys of the occupied cells updated by the last inserted scan
+	const octomap::KeySet& getLastOccupiedKeys() const {
+		return m_lastOccupiedKeys;
+	}
+
+	// insert subtree stored by writeBinaryNode (children of the node with given
+	// lower corner key and depth) to the tree, used by the tiled map loader.
+	// Returns false if the place is already occupied by existing nodes.
+	bool readSubtree(std::istream& s, const octomap::OcTreeKey& key,
+			unsigned int depth, float logOdds, bool hasChildren);
+
+	// node of the given depth containing the key, NULL if the path ends by a larger leaf
+	EModelTreeNode* getSubtree(const octomap::OcTreeKey& key, unsigned int depth) const;
+
+	// delete subtree of the node of the given depth containing the key (used by the tiled
+	// map to evict tiles). Parents left without children are deleted too.
+	bool deleteSubtree(const octomap::OcTreeKey& key, unsigned int depth);
+
+	// make this tree a copy of the source tree, parameters included
+	void copyTree(const EMOcTree& src);
+
+	// make the nodes intersecting the metric box equal to the nodes of the source tree,
+	// the rest of the tree is kept (used to update the snapshot crawled by the publisher)
+	void copyBox(const EMOcTree& src, const octomap::point3d& min, const octomap::point3d& max);
+
 protected:
 	void updateInnerOccupancyRecurs(EModelTreeNode* node, unsigned int depth);
 
+	// copy probabilities and thresholds of the source tree
+	void copyParameters(const EMOcTree& src);
+
+	// copy node of the source tree and its children intersecting the key box [min, max]
+	// (whole subtree if inside is set), lower is the lower corner key of the node
+	void copyBoxRecurs(EModelTreeNode* node, const EModelTreeNode* srcNode,
+			const octomap::OcTreeKey& lower, unsigned int depth,
+			const octomap::OcTreeKey& min, const octomap::OcTreeKey& max, bool inside);
+
+	// update tree nodes from the key sets and integrate colors of the scan
+	void applyColoredUpdate(const typePointCloud& coloredScan,
+			const std::vector<octomap::KeySet>& free_cells,
+			const std::vector<octomap::KeySet>& occupied_cells,
+			bool pruning, bool lazy_eval);
+
 	/**
 	 * Static member object which ensures that this EMOcTree prototype
 	 * ends up in the classIDMapping only once
@@ -251,6 +449,24 @@ protected:
 
 	/// to ensure static initialization (only once)
 	static StaticMemberInitializer ocTreeMemberInit;
+
+	//! Is change detection enabled?
+	bool m_bTrackChanges;
+
+	//! Has whole tree changed since last reset of change detection?
+	bool m_bAllChanged;
+
+	//! Changed leaf keys
+	octomap::KeySet m_changedKeys;
+
+	//! Changed keys bounding box
+	octomap::OcTreeKey m_changedMin, m_changedMax;
+
+	//! Occupied cells of the last inserted scan
+	octomap::KeySet m_lastOccupiedKeys;
+
+	//! Time of the last timestamp saturation sweep
+	unsigned int m_lastStampSweep;
 }; // class EMOcTree
 
 }
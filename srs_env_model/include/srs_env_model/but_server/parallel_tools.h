@@ -0,0 +1,89 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id:$
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Vit Stancl (stancl@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: dd/mm/2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef PARALLEL_TOOLS_H_INCLUDED
+#define PARALLEL_TOOLS_H_INCLUDED
+
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace srs_env_model
+{
+	/**
+	 * @brief Get number of worker threads to use.
+	 *
+	 * @param requested Requested number of threads, zero or negative means "use all cores"
+	 */
+	inline unsigned getNumThreads( int requested )
+	{
+		if( requested > 0 )
+			return requested;
+
+		unsigned hw( boost::thread::hardware_concurrency() );
+		return hw > 0 ? hw : 1;
+	}
+
+	/**
+	 * @brief Run functor on numThreads threads and wait for all of them.
+	 *
+	 * Functor is called as functor( threadIndex, numThreads ). The calling thread
+	 * is used as the thread number zero, so no thread is created if numThreads is 1.
+	 * Functor is passed by reference, so all threads share the same object.
+	 */
+	template< class tpFunctor >
+	void runParallel( unsigned numThreads, tpFunctor & functor )
+	{
+		if( numThreads <= 1 )
+		{
+			functor( 0, 1 );
+			return;
+		}
+
+		boost::thread_group threads;
+		for( unsigned i = 1; i < numThreads; ++i )
+			threads.create_thread( boost::bind< void >( boost::ref( functor ), i, numThreads ) );
+
+		functor( 0, numThreads );
+		threads.join_all();
+	}
+
+	/**
+	 * @brief Get range of items processed by given thread (items are split to continuous blocks).
+	 */
+	inline void getThreadRange( size_t count, unsigned thread, unsigned numThreads, size_t & begin, size_t & end )
+	{
+		size_t block( (count + numThreads - 1) / numThreads );
+		begin = std::min( count, block * thread );
+		end = std::min( count, begin + block );
+	}
+
+} // namespace srs_env_model
+
+// PARALLEL_TOOLS_H_INCLUDED
+#endif
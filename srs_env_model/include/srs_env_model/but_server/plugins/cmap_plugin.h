@@ -31,11 +31,15 @@
 #include <srs_env_model/but_server/server_tools.h>
 #include <srs_env_model/GetCollisionMap.h>
 #include <srs_env_model/IsNewCollisionMap.h>
+#include <srs_env_model/GetCollisionMapDelta.h>
 
 #include <arm_navigation_msgs/CollisionMap.h>
 #include <tf/transform_listener.h>
 #include <tf/message_filter.h>
 
+#include <boost/cstdint.hpp>
+#include <deque>
+
 namespace srs_env_model
 {
 
@@ -60,20 +64,57 @@ namespace srs_env_model
         //! Set used octomap frame id and timestamp
         virtual void onFrameStart( const SMapParameters & par );
 
-        /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-        virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp);
+        /// Called when crawling is finished - builds collision map from the robot surroundings.
+        virtual void handlePostNodeTraversal(const SMapParameters & mp);
+
+        /// Collision map is always built from the whole robot surroundings, crawl type does not matter
+        virtual bool canCrawlDelta() const { return true; }
 
         /// Is something to publish and some subscriber to publish to?
         virtual bool shouldPublish(  );
 
 
     protected:
-        //! Compare two collision maps and test if they are the same
-        bool sameCMaps( arm_navigation_msgs::CollisionMap * map1, arm_navigation_msgs::CollisionMap * map2 );
+        /// Hash of the quantized boxes
+        typedef boost::uint64_t tHash;
+
+        /// Box hash and its index in the map
+        typedef std::pair< tHash, std::size_t > tBoxKey;
+
+        /// Collision map version stored in the history
+        struct SMapVersion
+        {
+            /// Version number
+            long int version;
+
+            /// Map boxes
+            arm_navigation_msgs::CollisionMap::_boxes_type boxes;
+
+            /// Box keys sorted by hash
+            std::vector< tBoxKey > keys;
+        };
+
+        //! Compute hash of the whole collision map (map is built in deterministic order)
+        static tHash hashCMap( const arm_navigation_msgs::CollisionMap & map );
+
+        //! Compute hash of one box
+        static tHash hashBox( const arm_navigation_msgs::OrientedBoundingBox & box );
+
+        //! Store current map as the new version in the history
+        void pushVersion();
 
         //! Test collision point if it is in the collision distance from the robot
         bool isNearRobot( const btVector3 & point, double extent );
 
+        /**
+         * @brief Merge neighbouring voxels of the same size to the boxes and add them to the collision map buffer
+         *
+         * @param cells Grid coordinates of the voxels (octomap keys shifted by level), emptied by the call
+         * @param level Voxel size level (voxel size is resolution * 2^level)
+         * @param mp Map parameters
+         */
+        void addMergedBoxes( octomap::KeySet & cells, unsigned level, const SMapParameters & mp );
+
         /**
         * @brief Get collision map service call
         *
@@ -89,6 +130,14 @@ namespace srs_env_model
          */
         bool isNewCmapSrvCallback( srs_env_model::IsNewCollisionMap::Request & req, srs_env_model::IsNewCollisionMap::Response & res );
 
+        /**
+         * @brief Get collision map delta service call
+         *
+         * @param req request - caller's map version
+         * @param res response - boxes added and removed since the caller's version (whole map if the version is too old)
+         */
+        bool getCollisionMapDeltaSrvCallback( srs_env_model::GetCollisionMapDelta::Request & req, srs_env_model::GetCollisionMapDelta::Response & res );
+
     protected:
         //! Collision map publisher name
         std::string m_cmapPublisherName;
@@ -123,6 +172,18 @@ namespace srs_env_model
         //! Is new cmap service
         ros::ServiceServer m_serviceIsNewCMap;
 
+        //! Get collision map delta service
+        ros::ServiceServer m_serviceGetCollisionMapDelta;
+
+        /// Hash of the current collision map
+        tHash m_dataHash;
+
+        /// Last map versions, the current one is at the back
+        std::deque< SMapVersion > m_history;
+
+        /// Number of versions kept in the history
+        int m_historySize;
+
         //! Transform listener
         tf::TransformListener m_tfListener;
 
@@ -142,6 +203,10 @@ namespace srs_env_model
         /// Current cmap timestamp
         ros::Time m_mapTime;
 
+        /// Box orientation in the collision map frame (voxels are axis aligned in the octomap frame)
+        Eigen::Vector3f m_boxAxis;
+        float m_boxAngle;
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -158,7 +223,7 @@ namespace srs_env_model
     public:
         /// Create holder
         SCMapPluginHolder( const std::string & name )
-        : tCMPHolder(  name,  tCMPHolder::ON_START | tCMPHolder::ON_OCCUPIED )
+        : tCMPHolder(  name,  tCMPHolder::ON_START | tCMPHolder::ON_STOP )
         {
 
         }
@@ -62,11 +62,17 @@ namespace srs_env_model
         virtual void onFrameStart( const SMapParameters & par );
 
         /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-        virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp);
+        virtual void handleOccupiedNode(tButServerOcIterator & it, const SMapParameters & mp);
 
         /// Called when all nodes was visited.
         virtual void handlePostNodeTraversal(const SMapParameters & mp);
 
+        /// Boxes can be patched only if they are not transformed to other frame
+        virtual bool canCrawlDelta() const { return m_ocFrameId == m_coFrameId; }
+
+        /// Boxes of the parallel crawl are stored to the partition buffers
+        virtual bool canCrawlParallel() const { return true; }
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -101,6 +107,12 @@ namespace srs_env_model
         /// Does point need to be converted from ocmap frame id to the collision objects frame id?
         bool m_bConvert;
 
+        /// Shapes crawled by the parallel crawl - one buffer for each partition
+        std::vector< std::vector< arm_navigation_msgs::Shape > > m_partShapes;
+
+        /// Poses crawled by the parallel crawl - one buffer for each partition
+        std::vector< std::vector< geometry_msgs::Pose > > m_partPoses;
+
     }; // class CCollisionObjectPlugin
 
     /// Declare holder object - partial specialization of the default holder with predefined connection settings
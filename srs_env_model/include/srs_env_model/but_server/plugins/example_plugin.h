@@ -101,7 +101,7 @@ public:
 	{ m_frame_id = par.frameId; m_time_stamp = par.currentTime; }
 
 	//! Handle free node - set its color to the green.
-	virtual void handleFreeNode(tButServerOcTree::iterator & it, const SMapParameters & mp )
+	virtual void handleFreeNode(tButServerOcIterator & it, const SMapParameters & mp )
 	{
 		it->r() = 0;
 		it->g() = 255;
@@ -109,11 +109,11 @@ public:
 	}
 
 	/// Hook that is called when traversing all nodes of the updated Octree (does nothing here)
-	virtual void handleNode(srs::tButServerOcTree::iterator& it, const SMapParameters & mp) {};
+	virtual void handleNode(srs::tButServerOcIterator & it, const SMapParameters & mp) {};
 
 	/// Hook that is called when traversing occupied nodes of the updated Octree.
 	/// We set node color to the stored one.
-	virtual void handleOccupiedNode(srs::tButServerOcTree::iterator& it, const SMapParameters & mp)
+	virtual void handleOccupiedNode(srs::tButServerOcIterator & it, const SMapParameters & mp)
 	{
 		it->r() = (*m_data)[0];
 		it->g() = (*m_data)[1];
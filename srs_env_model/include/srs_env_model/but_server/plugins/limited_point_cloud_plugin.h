@@ -55,8 +55,8 @@ public:
 	//! Set used octomap frame id and timestamp
 	virtual void onFrameStart( const SMapParameters & par );
 
-	/// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-	virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp);
+	/// Called when crawling is finished - visible part of the map is traversed here
+	virtual void handlePostNodeTraversal(const SMapParameters & mp);
 
 	//! Called when new scan was inserted and now all can be published
 	virtual void onPublish(const ros::Time & timestamp);
@@ -65,6 +65,42 @@ public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 protected:
+	/// Node waiting for the traversal
+	struct STraversedNode
+	{
+		/// Node
+		const tButServerOcTree::NodeType * node;
+
+		/// Node center and size
+		Eigen::Vector3f center;
+		float size;
+
+		/// Planes the node is completely in front of (bit mask)
+		unsigned inside;
+
+		/// Projected size - nodes with the largest one are refined first
+		float priority;
+
+		bool operator<( const STraversedNode & n ) const { return priority < n.priority; }
+	};
+
+	/// Camera frustum planes (normal and d), inner side is positive
+	typedef std::vector< Eigen::Vector4f, Eigen::aligned_allocator< Eigen::Vector4f > > tPlanes;
+
+	/// Build frustum planes from the current camera
+	void buildFrustum();
+
+	/**
+	 * @brief Test node box against the frustum planes
+	 *
+	 * @param node Tested node, inside mask is updated
+	 * @return false if node is completely outside
+	 */
+	bool testFrustum( STraversedNode & node ) const;
+
+	/// Add node to the output points
+	void addPoint( const STraversedNode & node );
+
 	/// On camera position changed callback
 	void onCameraPositionChangedCB(const srs_env_model_msgs::RVIZCameraPosition::ConstPtr& position);
 
@@ -83,6 +119,27 @@ protected:
 	/// Camera normalized normal - part of the plane equation
 	Eigen::Vector3f m_normal, m_normalBuf;
 
+	/// Camera position and up vector
+	Eigen::Vector3f m_position, m_positionBuf, m_up, m_upBuf;
+
+	/// Camera frustum planes
+	tPlanes m_frustum;
+
+	/// Horizontal field of view (radians, pi or more disables side planes)
+	double m_fov;
+
+	/// Width to height ratio of the view
+	double m_aspect;
+
+	/// Far plane distance (zero - no far plane)
+	double m_maxDistance;
+
+	/// Level of detail - nodes seen under smaller angle are not refined (zero - full detail)
+	double m_lodAngle;
+
+	/// Maximal number of output points (zero - unlimited)
+	int m_maxPoints;
+
 	/// Last part of the plane equation
 	float m_d, m_dBuf;
 
@@ -102,8 +159,6 @@ protected:
 	/// Counters
 	long m_countVisible, m_countHidden;
 
-	float min, max;
-
 	//! Spin out own input callback thread
 	bool m_bSpinThread;
 
@@ -113,7 +168,7 @@ protected:
 	ros::CallbackQueue callback_queue_;
 	volatile bool need_to_terminate_;
 
-	// Mutex used to lock camera position parameters
+	// Mutex used to lock camera position parameters, frame id and transform (shared by the callback and publishing threads)
 	boost::recursive_mutex m_camPosMutex;
 };
 
@@ -128,7 +183,7 @@ protected:
 public:
 	/// Create holder
 	SLimitedPointCloudPluginHolder( const std::string & name )
-	: tHolder(  name,  tHolder::ON_START | tHolder::ON_OCCUPIED | tHolder::ON_STOP)
+	: tHolder(  name,  tHolder::ON_START | tHolder::ON_STOP)
 	{
 
 	}
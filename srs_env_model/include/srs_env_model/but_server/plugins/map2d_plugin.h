@@ -62,14 +62,30 @@ namespace srs_env_model
         virtual void onFrameStart( const SMapParameters & par );
 
         //! Handle free node (does nothing here)
-        virtual void handleFreeNode(tButServerOcTree::iterator & it, const SMapParameters & mp );
+        virtual void handleFreeNode(tButServerOcIterator & it, const SMapParameters & mp );
 
         /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-        virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp);
+        virtual void handleOccupiedNode(tButServerOcIterator & it, const SMapParameters & mp);
 
         /// Called when all nodes was visited.
         virtual void handlePostNodeTraversal(const SMapParameters & mp);
 
+        /// Partitions are map columns, so threads never write the same grid cell
+        virtual bool canCrawlParallel() const { return true; }
+
+        /// Grid is kept between crawls, only changed columns are recomputed
+        virtual bool canCrawlDelta() const { return true; }
+
+    protected:
+        /// Resize grid to the given key range, the old cells are kept on their places
+        void resizeGrid( const octomap::OcTreeKey & minKey, const octomap::OcTreeKey & maxKey, unsigned treeDepth );
+
+        /// Write node square to the grid (occupied cells are overwritten, free ones only fill unknown cells)
+        void setCells( const octomap::OcTreeKey & minKey, int size, bool occupied );
+
+        /// Recompute grid columns intersecting the delta crawled box. Returns false if there is nothing to update.
+        bool updateColumns( const SMapParameters & mp );
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -101,9 +117,21 @@ namespace srs_env_model
         /// Transformation from octomap to the collision object frame id - translation
         Eigen::Vector3f m_ocToMap2DTrans;
 
-        /// Padded key minimum
+        /// Padded key minimum - key of the grid cell (0, 0)
         octomap::OcTreeKey m_paddedMinKey;
 
+        /// Is grid filled by some previous crawl?
+        bool m_bGridValid;
+
+        /// Resolution the grid was built with (message keeps only float precision, so it is not compared)
+        double m_gridResolution;
+
+        /// Has grid changed since the last publishing?
+        bool m_bChanged;
+
+        /// Number of subscribers at the last publishing
+        unsigned m_numSubscribers;
+
         /// Map limits
         double m_minSizeX;
         double m_minSizeY;
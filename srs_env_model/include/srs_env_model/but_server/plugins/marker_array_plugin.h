@@ -62,15 +62,27 @@ namespace srs_env_model
         virtual void onFrameStart( const SMapParameters & par );
 
         /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-        virtual void handleNode(const tButServerOcTree::iterator& it, const SMapParameters & mp);
+        virtual void handleNode(const tButServerOcIterator & it, const SMapParameters & mp);
 
         /// Called when all nodes was visited.
         virtual void handlePostNodeTraversal(const SMapParameters & mp);
 
+        /// Cubes can be patched only if they are not transformed to other frame
+        virtual bool canCrawlDelta() const { return m_ocFrameId == m_markerArrayFrameId; }
+
+        /// Cubes of the parallel crawl are stored to the partition buffers
+        virtual bool canCrawlParallel() const { return true; }
+
     protected:
         /// Compute color from the height
         std_msgs::ColorRGBA heightMapColor(double h) const;
 
+        /// Compute height map color of the cube center
+        std_msgs::ColorRGBA cubeColor(const geometry_msgs::Point & center) const;
+
+        /// Remove cubes intersecting crawled box (delta crawl)
+        void removeCrawledCubes(const SMapParameters & par);
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -117,6 +129,9 @@ namespace srs_env_model
         /// Markers color
         std_msgs::ColorRGBA m_color;
 
+        /// Cubes crawled by the parallel crawl - one marker array for each partition
+        std::vector< visualization_msgs::MarkerArray > m_partMarkers;
+
     }; // class CMarkerArrayPlugin
 
     /// Declare holder object - partial specialization of the default holder with predefined connection settings
@@ -29,11 +29,14 @@
 #ifndef SRS_ENV_MODEL_BUT_SERVER_PLUGINS_OBJTREEPLUGIN_H
 #define SRS_ENV_MODEL_BUT_SERVER_PLUGINS_OBJTREEPLUGIN_H
 
+#include <set>
 #include <message_filters/subscriber.h>
 #include <interactive_markers/interactive_marker_server.h>
+#include <visualization_msgs/MarkerArray.h>
 
 #include <srs_env_model/but_server/server_tools.h>
 #include <srs_env_model/but_server/objtree/octree.h>
+#include <srs_env_model/but_server/objtree/plane.h>
 #include <srs_env_model/GetPlane.h>
 #include <srs_env_model/GetAlignedBox.h>
 #include <srs_env_model/InsertPlane.h>
@@ -84,6 +87,8 @@ protected:
     bool srvGetSimilarPlane(srs_env_model::InsertPlane::Request &req, srs_env_model::InsertPlane::Response &res);
     /// Insert planes array
     bool srvInsertPlanes(srs_env_model::InsertPlanes::Request &req, srs_env_model::InsertPlanes::Response &res);
+    /// Insert planes array at once, update planes if similar planes exist
+    bool srvInsertPlanesByPosition(srs_env_model::InsertPlanes::Request &req, srs_env_model::InsertPlanes::Response &res);
     /// Insert new axis aligned box, update if plane with same id exists
     bool srvInsertABox(srs_env_model::InsertAlignedBox::Request &req, srs_env_model::InsertAlignedBox::Response &res);
     /// Insert new axis aligned box, update if similar plane exists
@@ -108,11 +113,13 @@ protected:
     bool srvGetObjectsInSphere(srs_env_model::GetObjectsInSphere::Request &req, srs_env_model::GetObjectsInSphere::Response &res);
 
     //Helper methods
+    objtree::Plane* createPlane(const srs_env_model_msgs::PlaneDesc &plane);
     unsigned int insertPlane(const srs_env_model_msgs::PlaneDesc &plane, Operation op);
     unsigned int insertABox(unsigned int id, const geometry_msgs::Point32 &position, const geometry_msgs::Vector3 &scale, Operation op);
     void showObject(unsigned int id);
     void removeObject(unsigned int id);
     void showObjtree();
+    void publishChanges();
     void getObjects(const objtree::Filter *filter, std::vector<unsigned int> &output);
 
     //Service servers
@@ -128,6 +135,7 @@ protected:
     ros::ServiceServer m_serviceGetSimilarPlane;
     ros::ServiceServer m_serviceGetSimilarABox;
     ros::ServiceServer m_serviceInsertPlanes;
+    ros::ServiceServer m_serviceInsertPlanesByPosition;
     ros::ServiceServer m_serviceShowObject;
     ros::ServiceServer m_serviceShowObjtree;
     ros::ServiceServer m_serviceRemoveObject;
@@ -137,14 +145,30 @@ protected:
     ros::ServiceClient m_clientAddBoundingBox;
     ros::ServiceClient m_clientRemovePrimitive;
 
-    ros::Publisher m_markerPub;
+    /// Publisher of object markers, only changed objects are sent
+    ros::Publisher m_markerArrayPub;
 
     objtree::Octree m_octree;
 
+    /// Number of threads used for similarity search of inserted planes array (0 = all cores)
+    int m_insertThreads;
+
+    /// Is octree structure published with changes?
+    bool m_bShowObjtree;
+
+    /// Are all inserted objects shown as interactive primitives? (one service call per changed object, off by default)
+    bool m_bShowPrimitives;
+
+    /// Ids of objects shown as interactive primitives (on insert or on request)
+    std::set<unsigned int> m_primitives;
+
 private:
     void publishLine(visualization_msgs::Marker &lines, float x1, float y1, float z1, float x2, float y2, float z2);
     void publishCube(visualization_msgs::Marker &lines, float x, float y, float z, float w, float h, float d);
-    void publishOctree(const std::list<objtree::Box> &nodes);
+    void octreeMarker(visualization_msgs::Marker &lines);
+    void objectMarker(const objtree::Object *object, visualization_msgs::Marker &marker);
+    void objectMarkers(const std::vector<unsigned int> &ids, visualization_msgs::MarkerArray &markers);
+    void onMarkersSubscribe(const ros::SingleSubscriberPublisher &pub);
 
     void removePrimitiveMarker(unsigned int id);
 };
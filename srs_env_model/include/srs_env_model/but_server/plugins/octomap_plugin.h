@@ -29,6 +29,8 @@
 #define OCTOMAPPLUGIN_H_INCLUDED
 
 #include <srs_env_model/but_server/server_tools.h>
+#include <srs_env_model/but_server/parallel_tools.h>
+#include <srs_env_model/but_server/tiled_octree_file.h>
 #include <srs_env_model/but_server/plugins/octomap_plugin_tools/testing_oriented_box.h>
 #include <srs_env_model/but_server/plugins/octomap_plugin_tools/testing_sphere.h>
 #include <srs_env_model/but_server/plugins/octomap_plugin_tools/testing_polymesh.h>
@@ -55,17 +57,53 @@ public:
 	typedef boost::signal< void (const SMapParameters &) > tSigOnStart;
 
 	/// On node
-	typedef boost::signal< void (tButServerOcTree::iterator &, const SMapParameters & ) > tSigOnNode;
+	typedef boost::signal< void (tButServerOcIterator &, const SMapParameters & ) > tSigOnNode;
 
 	/// On free node
-	typedef boost::signal< void (tButServerOcTree::iterator &, const SMapParameters & ) > tSigOnFreeNode;
+	typedef boost::signal< void (tButServerOcIterator &, const SMapParameters & ) > tSigOnFreeNode;
 
 	/// On occupied node
-	typedef boost::signal< void (tButServerOcTree::iterator &, const SMapParameters & ) > tSigOnOccupiedNode;
+	typedef boost::signal< void (tButServerOcIterator &, const SMapParameters & ) > tSigOnOccupiedNode;
 
 	/// Post node traversal
 	typedef boost::signal< void (const SMapParameters &) > tSigOnPost;
 
+	/**
+	 * @brief Crawler visitor emitting crawling signals.
+	 *
+	 * Used to dispatch nodes to the plugins connected dynamically through the signals.
+	 * Can be used as the last visitor in the CCrawlerVisitor list.
+	 */
+	class CSignalVisitor
+	{
+	public:
+		/// Constructor - node signals without slots are not emitted at all
+		CSignalVisitor( COctoMapPlugin & source )
+		: m_source( &source )
+		, m_bNode( !source.m_sigOnNode.empty() )
+		, m_bFreeNode( !source.m_sigOnFreeNode.empty() )
+		, m_bOccupiedNode( !source.m_sigOnOccupiedNode.empty() )
+		{ }
+
+		void onStart( const SMapParameters & mp ) const { m_source->m_sigOnStart( mp ); }
+		void onNode( tButServerOcIterator & it, const SMapParameters & mp ) const { if( m_bNode ) m_source->m_sigOnNode( it, mp ); }
+		void onFreeNode( tButServerOcIterator & it, const SMapParameters & mp ) const { if( m_bFreeNode ) m_source->m_sigOnFreeNode( it, mp ); }
+		void onOccupiedNode( tButServerOcIterator & it, const SMapParameters & mp ) const { if( m_bOccupiedNode ) m_source->m_sigOnOccupiedNode( it, mp ); }
+		void onPost( const SMapParameters & mp ) const { m_source->m_sigOnPost( mp ); }
+
+		/// Node signals are not emitted from more threads
+		bool canCrawlParallel() const { return !m_bNode && !m_bFreeNode && !m_bOccupiedNode; }
+
+	protected:
+		/// Signals source
+		COctoMapPlugin * m_source;
+
+		/// Have node signals any slots?
+		bool m_bNode, m_bFreeNode, m_bOccupiedNode;
+	};
+
+	friend class CSignalVisitor;
+
 public:
 	/// Constructor
 	COctoMapPlugin(const std::string & name);
@@ -88,14 +126,27 @@ public:
 	//! Get current octomap size
 	unsigned getSize() { return m_data->octree.size(); }
 
+	//! Get number of map file tiles not loaded to the octomap yet
+	size_t getNumUnloadedTiles() const { return m_tiledMap.getNumUnloaded(); }
+
 	//! Get current tree depth
 	unsigned getTreeDepth() { return m_mapParameters.treeDepth; }
 
 	/// Get octomap resolution
 	double getResolution(){ return m_mapParameters.resolution; }
 
-	/// Crawl octomap
-	void crawl( const ros::Time & currentTime );
+	/// Crawl octomap. If delta is allowed, only part of the map changed since the last crawl is visited.
+	void crawl( const ros::Time & currentTime, bool bAllowDelta = false );
+
+	/// Crawl octomap, nodes are passed to the statically composed visitor (see CCrawlerVisitor)
+	template< class tpVisitor >
+	void crawl( const ros::Time & currentTime, const tpVisitor & visitor, bool bAllowDelta = false );
+
+	/// Get visitor emitting crawling signals
+	CSignalVisitor getSignalVisitor() { return CSignalVisitor( *this ); }
+
+	/// Get id of the last finished crawl
+	unsigned long getCrawlId() const { return m_crawlId; }
 
 	tSigOnStart & getSigOnStart() { return m_sigOnStart; }
 
@@ -124,22 +175,85 @@ protected:
 	void insertScan(const tf::Point& sensorOriginTf, const tPointCloud& ground, const tPointCloud& nonground);
 
 	/// label the input cloud "pc" into ground and nonground. Should be in the robot's fixed frame (not world!)
-	void filterGroundPlane(const tPointCloud& pc, tPointCloud& ground, tPointCloud& nonground) const;
-
-	/// On octomap crawling start
-	void onCrawlStart(const ros::Time & currentTime);
-
-	/// Handle node
-	void handleNode(tButServerOcTree::iterator & it, const SMapParameters & mp);
-
-	/// Handle free node
-	void handleFreeNode(tButServerOcTree::iterator & it, const SMapParameters & mp);
-
-	/// Handle occupied node
-	void handleOccupiedNode(tButServerOcTree::iterator & it, const SMapParameters & mp);
-
-	/// Called when all nodes was visited.
-	virtual void handlePostNodeTraversal(const SMapParameters & mp);
+	void filterGroundPlane(const tPointCloud& pc, const tf::Transform& cloudToMap, tPointCloud& ground, tPointCloud& nonground);
+
+	/// Is plane (in the cloud frame) accepted as the ground plane?
+	bool isGroundPlane(const Eigen::Vector3f& normal, float d) const;
+
+	/// Changes of the map taken for the crawl
+	struct SCrawlChanges
+	{
+		/// Has whole map changed?
+		bool bAllChanged;
+
+		/// Has something changed?
+		bool bChanged;
+
+		/// Box of changed keys
+		octomap::point3d min, max;
+	};
+
+	/// Take changes made since the last crawl, start collecting new ones, decide crawl type and update
+	/// the crawled snapshot of the map. Returns false if no node should be visited.
+	bool takeChanges(const ros::Time & currentTime, bool bAllowDelta);
+
+	/// Decide crawl type and fill crawl parameters. Returns false if no node should be visited.
+	bool startCrawl(const SCrawlChanges & changes, bool bAllowDelta);
+
+	/// Pass node to the visitor
+	template< class tpVisitor >
+	void visitNode(const tpVisitor & visitor, tButServerOcIterator & it, const SMapParameters & mp)
+	{
+		visitor.onNode(it, mp);
+
+		// Node is occupied?
+		if (m_crawlData->octree.isNodeOccupied(*it))
+			visitor.onOccupiedNode(it, mp);
+		else
+			visitor.onFreeNode(it, mp);
+	}
+
+	/// Part of the map crawled by one thread - slab of the map columns
+	struct SCrawlPartition
+	{
+		/// Crawled box
+		octomap::point3d min, max;
+
+		/// Range of the x keys
+		unsigned keyMin, keyMax;
+	};
+
+	/// List of leafs
+	typedef std::vector< tButServerOcTree::leaf_bbx_iterator > tLeafList;
+
+	/// Split map to the partitions for the parallel crawl, returns number of partitions
+	unsigned computePartitions(unsigned numPartitions);
+
+	/// Crawl one partition, leafs larger than the partition column are only stored to the deferred list
+	template< class tpVisitor >
+	void crawlPartition(const tpVisitor & visitor, unsigned partition, tLeafList & deferred);
+
+	/// Crawl all partitions in parallel
+	template< class tpVisitor >
+	void crawlParallel(const tpVisitor & visitor);
+
+	/// Parallel crawl worker - each thread crawls one partition
+	template< class tpVisitor >
+	struct SCrawlWorker
+	{
+		COctoMapPlugin * plugin;
+		const tpVisitor * visitor;
+		std::vector< tLeafList > * deferred;
+
+		void operator()( unsigned thread, unsigned numThreads )
+		{
+			plugin->crawlPartition( *visitor, thread, (*deferred)[thread] );
+		}
+	};
+
+	/// Compute box crawled by the delta crawl from the box of changed keys
+	void computeCrawledBox(const octomap::point3d & changed_min, const octomap::point3d & changed_max,
+			octomap::point3d & bbx_min, octomap::point3d & bbx_max);
 
 	/// Fill map parameters
 	void fillMapParameters(const ros::Time & time);
@@ -153,8 +267,33 @@ protected:
 	// ------------------------------------------------------------------------
 	// Obstacle cleaning
 
-	/// Remove outdated nodes
-	void degradeOutdatedRaycasting(const std_msgs::Header& sensor_header, const octomap::point3d& sensor_origin);
+	/// Remove outdated nodes seen through by the sensor (cloud must be in the sensor frame)
+	void degradeOutdatedRaycasting(const std_msgs::Header& sensor_header, const tPointCloud& cloud);
+
+	/// Occupied node not updated by the last scan
+	struct SOutdatedNode
+	{
+		/// Tree node
+		tButServerOcTree::NodeType * node;
+
+		/// Node key
+		octomap::OcTreeKey key;
+
+		/// Node center in the sensor frame
+		octomap::point3d position;
+
+		/// Is node seen through by the sensor?
+		bool bSeenThrough;
+	};
+
+	/// Tests outdated nodes against the depth buffer in parallel
+	struct SOutdatedTestWorker;
+
+	/// Rasterize scan points (in the sensor frame) to the depth buffer
+	void fillDepthBuffer(const tPointCloud& cloud);
+
+	/// Is point (in the sensor frame) in the sensor cone and in front of the measured depth?
+	bool isSeenThrough(const octomap::point3d& p) const;
 
 	/// Remove speckles
 	void degradeSingleSpeckles();
@@ -165,9 +304,6 @@ protected:
 	/// Is point in sensor cone?
 	bool inSensorCone(const cv::Point2d& uv) const;
 
-	/// Return true, if occupied cell is between origin and p
-	bool isOccludedMap(const octomap::point3d& sensor_origin, const octomap::point3d& p) const;
-
 	/// Get used sensor origin
 	octomap::point3d getSensorOrigin(const std_msgs::Header& sensor_header);
 
@@ -192,6 +328,19 @@ protected:
     double m_groundFilterAngle;
     double m_groundFilterPlaneDistance;
 
+    /// Previous ground plane is used while the inlier fraction is at least this ratio of the one RANSAC found
+    double m_groundFilterMinInlierRatio;
+
+    /// Last ground plane found by RANSAC (in the map frame)
+    Eigen::Vector3f m_groundPlaneNormal;
+    float m_groundPlaneD;
+
+    /// Is last ground plane valid?
+    bool m_bGroundPlaneValid;
+
+    /// Fraction of the scan points lying on the ground plane when RANSAC found it
+    double m_groundPlaneInlierFraction;
+
     /// Temporary storage for ray casting
     octomap::KeyRay m_keyRay;
 
@@ -213,6 +362,12 @@ protected:
     /// Octomap parameters
     SMapParameters m_mapParameters;
 
+    /// Parameters of the running crawl - used by the crawling thread only, copied from m_mapParameters under the data lock
+    SMapParameters m_crawlParameters;
+
+    /// Snapshot of the map crawled by the publishing thread, changed part is copied from the map under the data lock
+    tButServerOcMap * m_crawlData;
+
     //! Transform listener
     tf::TransformListener m_tfListener;
 
@@ -236,8 +391,47 @@ protected:
     /// Remove specle nodes now
     bool m_removeSpecles;
 
+    /// Number of threads used for ray insertion (0 - all cores, 1 - single threaded)
+    int m_insertThreads;
+
+    /// Is delta crawling (only changed part of the map is crawled) enabled?
+    bool m_bDeltaCrawl;
+
+    /// Every n-th crawl is the full one (0 - never)
+    int m_fullCrawlPeriod;
+
+    /// Number of delta crawls since the last full one
+    int m_deltaCrawlCounter;
+
+    /// Id of the last finished crawl
+    unsigned long m_crawlId;
+
+    /// Number of threads used for the full crawl (0 - all cores, 1 - single threaded)
+    int m_crawlThreads;
+
+    /// Partitions of the current parallel crawl
+    std::vector< SCrawlPartition > m_partitions;
+
+    /// Depth of the partition columns, larger leafs are visited serially
+    unsigned m_partitionDepth;
+
     int filecounter;
 
+    //=========================================================================
+    // Static map
+
+    /// Tiled map file, tiles are loaded when some operation touches them
+    CTiledOcTreeFile m_tiledMap;
+
+    /// Was map loaded from file?
+    bool m_bMapFromFile;
+
+    /// Should all tiles be loaded before the full crawl?
+    bool m_bLoadTilesOnFullCrawl;
+
+    /// Unchanged tiles not touched for this time (in seconds) are removed from the tree, 0 disables eviction
+    int m_tileEvictAge;
+
     //=========================================================================
     // Filtering
 
@@ -271,6 +465,9 @@ protected:
     /// Camera offsets
     int m_camera_stereo_offset_left, m_camera_stereo_offset_right;
 
+    /// Depth of the nearest scan point for each camera pixel (row major)
+    std::vector< float > m_depthBuffer;
+
     /// Filtering object
     CTestingObjectBase * m_removeTester;
 
@@ -282,6 +479,101 @@ protected:
 
 }; // class COctoMapPlugin;
 
+/**
+ * Crawl octomap, nodes are passed to the statically composed visitor
+ */
+template< class tpVisitor >
+void COctoMapPlugin::crawl( const ros::Time & currentTime, const tpVisitor & visitor, bool bAllowDelta )
+{
+	// Changes made after this are crawled next time. Crawl traverses the snapshot, so scans
+	// can be inserted while crawling.
+	bool bVisitNodes( takeChanges( currentTime, bAllowDelta ) );
+
+	// Only full crawl is worth of splitting, delta crawls are small
+	unsigned numThreads( getNumThreads( m_crawlThreads ) );
+	if( bVisitNodes && !m_crawlParameters.bDeltaCrawl && numThreads > 1 && visitor.canCrawlParallel() )
+		computePartitions( numThreads );
+	else
+		m_partitions.clear();
+
+	m_crawlParameters.numPartitions = m_partitions.empty() ? 1 : m_partitions.size();
+	m_crawlParameters.partition = 0;
+
+	visitor.onStart( m_crawlParameters );
+
+	if( bVisitNodes && !m_partitions.empty() )
+	{
+		crawlParallel( visitor );
+	}
+	else if( bVisitNodes && !m_crawlParameters.bDeltaCrawl )
+	{
+		// Crawl through all nodes
+		for( tButServerOcTree::leaf_iterator it = m_crawlData->octree.begin_leafs(), end = m_crawlData->octree.end_leafs(); it != end; ++it )
+			visitNode( visitor, it, m_crawlParameters );
+	}
+	else if( bVisitNodes )
+	{
+		// Crawl through changed part only
+		for( tButServerOcTree::leaf_bbx_iterator it = m_crawlData->octree.begin_leafs_bbx( m_crawlParameters.crawlMin, m_crawlParameters.crawlMax ),
+				end = m_crawlData->octree.end_leafs_bbx(); it != end; ++it )
+		{
+			if( m_crawlParameters.isInCrawledBox( it.getX(), it.getY(), it.getZ(), it.getSize() ) )
+				visitNode( visitor, it, m_crawlParameters );
+		}
+	}
+
+	visitor.onPost( m_crawlParameters );
+
+	++m_crawlId;
+}
+
+/**
+ * Crawl all partitions in parallel
+ */
+template< class tpVisitor >
+void COctoMapPlugin::crawlParallel( const tpVisitor & visitor )
+{
+	std::vector< tLeafList > deferred( m_partitions.size() );
+
+	SCrawlWorker< tpVisitor > worker = { this, &visitor, &deferred };
+	runParallel( m_partitions.size(), worker );
+
+	// Leafs covering more partitions are visited serially, after the nodes of their partition
+	SMapParameters mp( m_crawlParameters );
+	for( unsigned p = 0; p < deferred.size(); ++p )
+	{
+		mp.partition = p;
+		for( tLeafList::iterator it = deferred[p].begin(), end = deferred[p].end(); it != end; ++it )
+			visitNode( visitor, *it, mp );
+	}
+}
+
+/**
+ * Crawl one partition
+ */
+template< class tpVisitor >
+void COctoMapPlugin::crawlPartition( const tpVisitor & visitor, unsigned partition, tLeafList & deferred )
+{
+	const SCrawlPartition & part( m_partitions[partition] );
+
+	SMapParameters mp( m_crawlParameters );
+	mp.partition = partition;
+
+	for( tButServerOcTree::leaf_bbx_iterator it = m_crawlData->octree.begin_leafs_bbx( part.min, part.max ),
+			end = m_crawlData->octree.end_leafs_bbx(); it != end; ++it )
+	{
+		if( it.getDepth() >= m_partitionDepth )
+		{
+			visitNode( visitor, it, mp );
+			continue;
+		}
+
+		// Large leaf is visited by all partitions it intersects, the one containing its first column owns it
+		if( std::max< unsigned >( it.getIndexKey()[0], m_partitions.front().keyMin ) >= part.keyMin )
+			deferred.push_back( it );
+	}
+}
+
 
 }
 
@@ -67,6 +67,9 @@ namespace srs_env_model
         //! Initialize plugin - called in server constructor
         virtual void init(ros::NodeHandle & node_handle);
 
+        //! Set input downsampling voxel size (octomap resolution)
+        void setInputVoxelSize( double size ){ m_inputVoxelSize = size; }
+
         //! Initialize plugin - called in server constructor, enable or disable subscription.
         virtual void init(ros::NodeHandle & node_handle, bool subscribe){ m_bSubscribe = subscribe; init(node_handle); }
 
@@ -77,11 +80,17 @@ namespace srs_env_model
         virtual void onFrameStart( const SMapParameters & par );
 
         /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-        virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp);
+        virtual void handleOccupiedNode(tButServerOcIterator & it, const SMapParameters & mp);
 
         /// Called when all nodes was visited.
         virtual void handlePostNodeTraversal(const SMapParameters & mp);
 
+        /// Octomap points are cached, so the delta crawl can be used
+        virtual bool canCrawlDelta() const { return true; }
+
+        /// Points of the parallel crawl are stored to the partition buffers
+        virtual bool canCrawlParallel() const { return true; }
+
     protected:
 
 
@@ -97,6 +106,14 @@ namespace srs_env_model
          */
         bool isRGBCloud( const tIncommingPointCloud::ConstPtr& cloud );
 
+        /**
+         * @brief Write crawled points to the new output message (transformed to the output frame)
+         *
+         * Message is published as a shared pointer and never modified after that,
+         * so the subscribers in the same process can use it without copying.
+         */
+        tIncommingPointCloud::Ptr createOutputCloud( const ros::Time & timestamp );
+
     protected:
         //! Is publishing enabled?
         bool m_publishPointCloud;
@@ -153,6 +170,36 @@ namespace srs_env_model
         //! Pointcloud working mode
         bool m_bAsInput;
 
+        //! Crawled points in the octomap frame (kept between crawls)
+        tPointCloud m_ocPoints;
+
+        //! Crawled nodes sizes (one for each point in m_ocPoints)
+        std::vector<float> m_ocSizes;
+
+        //! Points crawled by the parallel crawl - one buffer for each partition
+        std::vector< tPointCloud::VectorType > m_partPoints;
+
+        //! Node sizes crawled by the parallel crawl - one buffer for each partition
+        std::vector< std::vector<float> > m_partSizes;
+
+        //! Should be crawled points transformed to the output frame?
+        bool m_bTransformOutput;
+
+        //! Is output transform known (crawled points can be published)?
+        bool m_bOutputValid;
+
+        //! Should be input cloud downsampled?
+        bool m_bDownsampleInput;
+
+        //! Input downsampling voxel size
+        double m_inputVoxelSize;
+
+        //! Octomap to the output frame transformation - rotation
+        Eigen::Matrix3f m_ocToPcRot;
+
+        //! Octomap to the output frame transformation - translation
+        Eigen::Vector3f m_ocToPcTrans;
+
     }; // class CPointCloudPlugin
 
     /// Declare holder object - partial specialization of the default holder with predefined connection settings
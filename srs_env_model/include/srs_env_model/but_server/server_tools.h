@@ -32,6 +32,8 @@
 
 #include <boost/signal.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 // Small double number
 #define SMALL_DOUBLE double(0.00000001);
@@ -56,6 +58,9 @@ namespace srs_env_model
 	//! Define node type
 	typedef tButServerOcTree::NodeType tButServerOcNode;
 
+	//! Define crawled node iterator type (common base of the leaf and bounding box iterators)
+	typedef tButServerOcTree::iterator_base tButServerOcIterator;
+
 	//! Define pcl point type
 	typedef pcl::PointXYZRGB tPclPoint;
 
@@ -102,6 +107,30 @@ namespace srs_env_model
 		/// Map pointer
 		const tButServerOcMap * map;
 
+		/// Is only changed part of the map crawled?
+		bool bDeltaCrawl;
+
+		/// Crawled box - valid for the delta crawl only. All leafs intersecting it are visited.
+		octomap::point3d crawlMin, crawlMax;
+
+		/// Number of partitions of the parallel crawl (1 for the serial crawl)
+		unsigned numPartitions;
+
+		/// Partition the visited node belongs to (always 0 in onFrameStart and handlePostNodeTraversal)
+		unsigned partition;
+
+		/// Does node (given by center and size) intersect crawled box? Always true for the full crawl.
+		bool isInCrawledBox( double x, double y, double z, double size ) const
+		{
+			if( !bDeltaCrawl )
+				return true;
+
+			double half( 0.5 * size );
+			return x + half > crawlMin.x() && x - half < crawlMax.x()
+				&& y + half > crawlMin.y() && y - half < crawlMax.y()
+				&& z + half > crawlMin.z() && z - half < crawlMax.z();
+		}
+
 	}; // struct SMapParameters.
 
 	///////////////////////////////////////////////////////////////////////////
@@ -157,17 +186,37 @@ namespace srs_env_model
 			{ m_frame_id = par.frameId; m_time_stamp = par.currentTime; }
 
 		//! Handle free node (does nothing here)
-		virtual void handleFreeNode(tButServerOcTree::iterator & it, const SMapParameters & mp ){}
+		virtual void handleFreeNode(tButServerOcIterator & it, const SMapParameters & mp ){}
 
 		/// hook that is called when traversing all nodes of the updated Octree (does nothing here)
-		virtual void handleNode(tButServerOcTree::iterator& it, const SMapParameters & mp) {};
+		virtual void handleNode(tButServerOcIterator& it, const SMapParameters & mp) {};
 
 		/// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-		virtual void handleOccupiedNode(tButServerOcTree::iterator& it, const SMapParameters & mp){}
+		virtual void handleOccupiedNode(tButServerOcIterator& it, const SMapParameters & mp){}
 
 		/// Called when all nodes was visited.
 		virtual void handlePostNodeTraversal(const SMapParameters & mp){}
 
+		/**
+		 * @brief Can plugin patch its data by the delta crawl?
+		 *
+		 * In the delta crawl (SMapParameters::bDeltaCrawl is set) only leafs intersecting
+		 * the crawled box are visited. Plugin must remove its data intersecting this box
+		 * in onFrameStart and keep the rest of it from the previous crawl.
+		 */
+		virtual bool canCrawlDelta() const { return false; }
+
+		/**
+		 * @brief Can plugin handle nodes from more threads at once?
+		 *
+		 * In the parallel crawl node handlers are called concurrently, each thread
+		 * visits nodes of one partition (SMapParameters::partition). Handlers may write
+		 * only to the per-partition buffers, which are merged in partition order
+		 * in handlePostNodeTraversal. Partitions are columns of the map, nodes
+		 * with the same x and y coordinates always belong to the same partition.
+		 */
+		virtual bool canCrawlParallel() const { return false; }
+
 	protected:
 		//! Octomap frame_id
 		std::string m_frame_id;
@@ -192,6 +241,10 @@ namespace srs_env_model
 			ON_STOP = 16,
 			ALL	= ON_START | ON_NODE | ON_FREE | ON_OCCUPIED | ON_STOP
 		};
+
+		/// Plugin type
+		typedef tpPlugin tPlugin;
+
 	public:
 
 		/// Creating constructor
@@ -200,6 +253,7 @@ namespace srs_env_model
 		, m_source( 0 )
 		, m_connected( false )
 		, m_flags( flags )
+		, m_lastCrawlId( 0 )
 		{
 		    assert( m_plugin != 0 );
 		    m_bDeletePlugin = true;
@@ -210,6 +264,7 @@ namespace srs_env_model
 		, m_source(0)
 		, m_connected( false )
 		, m_flags(flags)
+		, m_lastCrawlId( 0 )
 		{
 		    assert( plugin != 0 );
 		    m_bDeletePlugin = deletePlugin;
@@ -221,6 +276,7 @@ namespace srs_env_model
 		, m_source(0)
 		, m_connected( false )
 		, m_flags(flags)
+		, m_lastCrawlId( 0 )
 		{
 		    assert( plugin != 0 );
 		    connect(source);
@@ -236,7 +292,7 @@ namespace srs_env_model
 		}
 
 		/// Connect plugin to the data
-		void connect( tpOctomapPlugin * source )
+		void connect( tpOctomapPlugin * source, bool bSignals = true )
 		{
 			if( m_connected )
 				disconnect();
@@ -247,21 +303,37 @@ namespace srs_env_model
 			if( source != 0 )
 			{
 				m_source = source;
+				m_connected = true;
+
+				// Plugin is called by the static visitor
+				if( !bSignals )
+					return;
 
 				if( m_flags & ON_START)	m_conStart = m_source->getSigOnStart().connect( boost::bind(&tpPlugin::onFrameStart, m_plugin, _1 ) );
 				if( m_flags & ON_NODE)	m_conNode = source->getSigOnNode().connect( boost::bind(&tpPlugin::handleNode, m_plugin, _1, _2 ) );
 				if( m_flags & ON_FREE)	m_conFreeNode = source->getSigOnFreeNode().connect( boost::bind(&tpPlugin::handleFreeNode, m_plugin, _1, _2 ) );
 				if( m_flags & ON_OCCUPIED)	m_conOccupiedNode = source->getSigOnOccupiedNode().connect( boost::bind(&tpPlugin::handleOccupiedNode, m_plugin, _1, _2 ) );
 				if( m_flags & ON_STOP)	m_conStop = m_source->getSigOnPost().connect( boost::bind(&tpPlugin::handlePostNodeTraversal, m_plugin, _1 ) );
-				m_connected = true;
 			}
 		}
 
+		/// Activate plugin for the crawl by the static visitor (CCrawlerVisitor) - no signals are connected
+		void activate( tpOctomapPlugin * source ) { connect( source, false ); }
+
+		/// Is plugin connected or activated?
+		bool isActive() const { return m_connected; }
+
+		/// Get connection flags
+		int getFlags() const { return m_flags; }
+
 		/// Disconnect plugin
 		void disconnect()
 		{
 			if( m_connected && m_source != 0 )
 			{
+				// Remember crawl the plugin data comes from
+				m_lastCrawlId = m_source->getCrawlId();
+
 				m_conStart.disconnect();
 				m_conNode.disconnect();
 				m_conFreeNode.disconnect();
@@ -283,6 +355,20 @@ namespace srs_env_model
 		/// Get plugin pointer
 		tpPlugin * getPlugin( ) { return m_plugin; }
 
+		/**
+		 * @brief Can the next crawl be the delta one?
+		 *
+		 * Disconnected plugin does not care. Connected plugin must support it and must
+		 * have been connected during the previous crawl, otherwise its data are outdated.
+		 */
+		bool acceptsDeltaCrawl() const
+		{
+			if( !m_connected )
+				return true;
+
+			return m_plugin->canCrawlDelta() && m_lastCrawlId == m_source->getCrawlId();
+		}
+
 	protected:
 		/// Plugin pointer
 		tpPlugin * m_plugin;
@@ -301,8 +387,115 @@ namespace srs_env_model
 
 		/// Delete plugin data on exit?
 		bool m_bDeletePlugin;
+
+		/// Id of the last crawl the plugin was connected to
+		unsigned long m_lastCrawlId;
+	};
+
+	/**
+	 * @brief Crawler visitor list terminator
+	 */
+	struct CCrawlerVisitorEnd
+	{
+		void onStart( const SMapParameters & mp ) const {}
+		void onNode( tButServerOcIterator & it, const SMapParameters & mp ) const {}
+		void onFreeNode( tButServerOcIterator & it, const SMapParameters & mp ) const {}
+		void onOccupiedNode( tButServerOcIterator & it, const SMapParameters & mp ) const {}
+		void onPost( const SMapParameters & mp ) const {}
+		bool canCrawlParallel() const { return true; }
+	};
+
+	/**
+	 * @brief Statically composed crawler visitor
+	 *
+	 * Calls handlers of the plugin in the given holder and then passes the node to the
+	 * next visitor in the list. Handlers are called directly (non-virtually), so they can be
+	 * inlined, instead of going through the boost signals. Only handlers selected by the
+	 * holder flags are called and only if the holder is active.
+	 */
+	template< class tpHolder, class tpNext = CCrawlerVisitorEnd >
+	class CCrawlerVisitor
+	{
+	public:
+		/// Plugin type
+		typedef typename tpHolder::tPlugin tPlugin;
+
+		/// Next visitor type
+		typedef tpNext tNext;
+
+	public:
+		/// Constructor
+		CCrawlerVisitor( tpHolder & holder, const tpNext & next = tpNext() )
+		: m_plugin( holder.getPlugin() )
+		, m_flags( holder.isActive() ? holder.getFlags() : 0 )
+		, m_next( next )
+		{ }
+
+		void onStart( const SMapParameters & mp ) const
+		{
+			if( m_flags & tpHolder::ON_START ) m_plugin->tPlugin::onFrameStart( mp );
+			m_next.onStart( mp );
+		}
+
+		void onNode( tButServerOcIterator & it, const SMapParameters & mp ) const
+		{
+			if( m_flags & tpHolder::ON_NODE ) m_plugin->tPlugin::handleNode( it, mp );
+			m_next.onNode( it, mp );
+		}
+
+		void onFreeNode( tButServerOcIterator & it, const SMapParameters & mp ) const
+		{
+			if( m_flags & tpHolder::ON_FREE ) m_plugin->tPlugin::handleFreeNode( it, mp );
+			m_next.onFreeNode( it, mp );
+		}
+
+		void onOccupiedNode( tButServerOcIterator & it, const SMapParameters & mp ) const
+		{
+			if( m_flags & tpHolder::ON_OCCUPIED ) m_plugin->tPlugin::handleOccupiedNode( it, mp );
+			m_next.onOccupiedNode( it, mp );
+		}
+
+		void onPost( const SMapParameters & mp ) const
+		{
+			if( m_flags & tpHolder::ON_STOP ) m_plugin->tPlugin::handlePostNodeTraversal( mp );
+			m_next.onPost( mp );
+		}
+
+		/// Can all visitors in the list be called from more threads at once?
+		bool canCrawlParallel() const
+		{
+			const int nodeFlags( tpHolder::ON_NODE | tpHolder::ON_FREE | tpHolder::ON_OCCUPIED );
+			if( (m_flags & nodeFlags) != 0 && !m_plugin->canCrawlParallel() )
+				return false;
+
+			return m_next.canCrawlParallel();
+		}
+
+	protected:
+		/// Plugin pointer
+		tPlugin * m_plugin;
+
+		/// Used flags (zero if holder is not active)
+		int m_flags;
+
+		/// Next visitor
+		tpNext m_next;
 	};
 
+	/// Create visitor of the holder followed by the next visitor
+	template< class tpHolder, class tpNext >
+	CCrawlerVisitor< tpHolder, tpNext > makeCrawlerVisitor( tpHolder & holder, const tpNext & next )
+	{
+		return CCrawlerVisitor< tpHolder, tpNext >( holder, next );
+	}
+
+	/// Create visitor of the holder
+	template< class tpHolder >
+	CCrawlerVisitor< tpHolder > makeCrawlerVisitor( tpHolder & holder )
+	{
+		return CCrawlerVisitor< tpHolder >( holder );
+	}
+
 	/**
 	 * @brief Data holder policy
 	 */
@@ -343,8 +536,8 @@ namespace srs_env_model
 		/// Data changed signal
 		tSigDataHasChanged m_sigDataChanged;
 
-		/// You can use this mutex to lock data
-		boost::mutex m_lockData;
+		/// You can use this mutex to lock data (shared lock for reading, unique lock for writing)
+		boost::shared_mutex m_lockData;
 	};
 
 } // namespace srs_env_model
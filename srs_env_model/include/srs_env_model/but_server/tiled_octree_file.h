@@ -0,0 +1,163 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id:$
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Vit Stancl (stancl@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: dd/mm/2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef TILED_OCTREE_FILE_H_INCLUDED
+#define TILED_OCTREE_FILE_H_INCLUDED
+
+#include <srs_env_model/but_server/octonode.h>
+
+#include <string>
+#include <vector>
+
+namespace srs_env_model
+{
+	/**
+	 * @brief Tiled octomap file.
+	 *
+	 * Tree is stored as independent subtrees (tiles) of the given depth, each of them
+	 * in the octomap binary format, preceded by an index of the tiles. File is memory
+	 * mapped when opened and only the index is read, tiles are inserted to the tree
+	 * when some part of the map touches them (see loadBox). Unloaded tiles look like
+	 * unknown space to the tree. Loaded tiles which were not touched for a while and
+	 * whose data were not changed are removed from the tree again (see evictUntouched).
+	 *
+	 * File layout (little endian):
+	 *  - header: magic "EMTILES", version (uint32), resolution (double), tree depth (uint32), number of tiles (uint32)
+	 *  - index: for each tile key of its lower corner (3x uint16), depth (uint8), has children flag (uint8),
+	 *    log-odds of the tile root (float), offset and size of the tile data (2x uint64)
+	 *  - tile data: children of the tile root written by writeBinaryNode (empty for leaf tiles)
+	 */
+	class CTiledOcTreeFile
+	{
+	public:
+		/// Constructor
+		CTiledOcTreeFile();
+
+		/// Destructor - closes file
+		~CTiledOcTreeFile();
+
+		/// Is the file tiled octomap file? (tests the header)
+		static bool isTiledFile( const std::string & filename );
+
+		/// Write tree to the tiled file. Tiles are subtrees of the tileDepth depth (larger leafs are stored as single tiles).
+		static bool write( const EMOcTree & tree, const std::string & filename, unsigned tileDepth = 8 );
+
+		/// Open and map file, read tiles index
+		bool open( const std::string & filename );
+
+		/// Unmap file
+		void close();
+
+		/// Is file open?
+		bool isOpen() const { return m_data != 0; }
+
+		/// Get map resolution
+		double getResolution() const { return m_resolution; }
+
+		/// Get depth of the stored tree
+		unsigned getTreeDepth() const { return m_treeDepth; }
+
+		/// Get number of tiles
+		size_t getNumTiles() const { return m_tiles.size(); }
+
+		/// Get number of tiles not inserted to the tree yet
+		size_t getNumUnloaded() const { return m_numUnloaded; }
+
+		/// Insert all not loaded tiles intersecting the box to the tree and mark all tiles in the box as touched. Returns number of loaded tiles.
+		size_t loadBox( EMOcTree & tree, const octomap::point3d & min, const octomap::point3d & max );
+
+		/// Insert all not loaded tiles to the tree. Returns number of loaded tiles.
+		size_t loadAll( EMOcTree & tree );
+
+		/// Drop the stored map, so its tiles are never inserted or evicted (tree was reset)
+		void discardAll();
+
+		/// Remove loaded tiles not touched for maxAge seconds from the tree. Tiles changed since they were loaded stay in the tree. Returns number of evicted tiles.
+		size_t evictUntouched( EMOcTree & tree, unsigned maxAge );
+
+	protected:
+		/// Tile index entry
+		struct STile
+		{
+			/// Key of the lower corner
+			octomap::OcTreeKey key;
+
+			/// Depth of the tile root
+			unsigned depth;
+
+			/// Has tile root children?
+			bool bInner;
+
+			/// Tile root log-odds
+			float logOdds;
+
+			/// Tile data
+			size_t offset, size;
+
+			/// Tile box
+			octomap::point3d min, max;
+
+			/// Is tile inserted to the tree?
+			bool bLoaded;
+
+			/// Was tile data changed in the tree? (it cannot be evicted then)
+			bool bModified;
+
+			/// Time of the last touch (seconds)
+			unsigned lastTouch;
+		};
+
+		/// Insert tile to the tree
+		bool loadTile( EMOcTree & tree, STile & tile );
+
+		/// Is tile subtree in the tree the same as the stored one?
+		bool isTileUnchanged( const EMOcTree & tree, const STile & tile ) const;
+
+	protected:
+		/// Mapped file data
+		char * m_data;
+
+		/// Mapped file size
+		size_t m_size;
+
+		/// Map resolution
+		double m_resolution;
+
+		/// Stored tree depth
+		unsigned m_treeDepth;
+
+		/// Tiles index
+		std::vector< STile > m_tiles;
+
+		/// Number of tiles not inserted to the tree
+		size_t m_numUnloaded;
+	};
+
+} // namespace srs_env_model
+
+// TILED_OCTREE_FILE_H_INCLUDED
+#endif
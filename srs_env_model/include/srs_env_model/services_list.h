@@ -47,6 +47,7 @@ namespace srs_env_model
     static const std::string InsertPlaneByPosition_SRV = PACKAGE_NAME_PREFIX + std::string("/insert_plane_by_position");
     static const std::string GetSimilarPlane_SRV = PACKAGE_NAME_PREFIX + std::string("/get_similar_plane");
     static const std::string InsertPlanes_SRV = PACKAGE_NAME_PREFIX + std::string("/insert_planes");
+    static const std::string InsertPlanesByPosition_SRV = PACKAGE_NAME_PREFIX + std::string("/insert_planes_by_position");
     static const std::string InsertAlignedBox_SRV = PACKAGE_NAME_PREFIX + std::string("/insert_aligned_box");
     static const std::string InsertAlignedBoxByPosition_SRV = PACKAGE_NAME_PREFIX + std::string("/insert_aligned_box_by_position");
     static const std::string GetSimilarAlignedBox_SRV = PACKAGE_NAME_PREFIX + std::string("/get_similar_aligned_box");
@@ -59,6 +60,7 @@ namespace srs_env_model
      */
 	static const std::string GetCollisionMap_SRV = PACKAGE_NAME_PREFIX + std::string("/get_collision_map");
 	static const std::string IsNewCMap_SRV = PACKAGE_NAME_PREFIX + std::string("/is_new_collision_map");
+	static const std::string GetCollisionMapDelta_SRV = PACKAGE_NAME_PREFIX + std::string("/get_collision_map_delta");
 
 	/**
      * octomap_plugin - services
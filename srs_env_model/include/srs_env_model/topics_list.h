@@ -77,6 +77,11 @@ namespace srs_env_model
 	static const std::string MAP2D_PUBLISHER_NAME = PACKAGE_NAME_PREFIX + std::string("/map2d_object");
 	static const std::string MAP2D_FRAME_ID       = "/map";
 
+	/**
+     * objtree_plugin
+     */
+	static const std::string OBJTREE_MARKERS_PUBLISHER_NAME = PACKAGE_NAME_PREFIX + std::string("/objtree_markers");
+
 	/**
      * octomap_plugin
      */
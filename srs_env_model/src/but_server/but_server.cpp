@@ -66,11 +66,15 @@ srs_env_model::CButServer::CButServer(const std::string& filename) :
 			m_nh(),
 			m_latchedTopics(false),
 			m_numPCFramesProcessed(1.0), m_frameCounter(0),
+			m_bPublishInThread( true ),
+			m_maxPublishRate( 5.0 ),
+			m_bPublishRequested( false ),
+			m_bStopPublisher( false ),
 			m_plugCMapHolder("CMAP"),
 			m_plugInputPointCloudHolder("PCIN"),
 			m_plugOcMapPointCloudHolder("PCOC"),
 			m_plugVisiblePointCloudHolder("PCVIS"),
-			m_plugOctoMap("OCM"),
+			m_plugOctoMap("OCM", filename),
 			m_plugCollisionObjectHolder("COB"),
 			m_plugMap2DHolder("M2D"),
 			m_plugIMarkers(0),
@@ -96,6 +100,8 @@ srs_env_model::CButServer::CButServer(const std::string& filename) :
 	m_latchedTopics = staticMap;
 	private_nh.param("latch", m_latchedTopics, m_latchedTopics);
 	private_nh.param<bool>("use_old_im", m_bUseOldIMP, m_bUseOldIMP);
+	private_nh.param("publish_in_thread", m_bPublishInThread, m_bPublishInThread);
+	private_nh.param("max_publish_rate", m_maxPublishRate, m_maxPublishRate);
 
 	std::cerr << "BUTSERVER: Initializing plugins " << std::endl;
 
@@ -133,12 +139,18 @@ srs_env_model::CButServer::CButServer(const std::string& filename) :
 
 	std::cerr << "BUTSERVER: All plugins initialized. Starting server. " << std::endl;
 
+	// Input points are merged to the map voxels
+	m_plugInputPointCloudHolder.getPlugin()->setInputVoxelSize( m_plugOctoMap.getResolution() );
+
 	// Connect input point cloud input with octomap
 	m_plugInputPointCloudHolder.getPlugin()->getSigDataChanged().connect( boost::bind( &COctoMapPlugin::insertCloud, &m_plugOctoMap, _1 ));
 
 	// Connect octomap data changed signal with server publish
 	m_plugOctoMap.getSigDataChanged().connect( boost::bind( &CButServer::onOcMapDataChanged, this, _1 ));
 
+	// Start publishing thread
+	if( m_bPublishInThread )
+		m_publisherThread.reset( new boost::thread( boost::bind( &CButServer::publisherThread, this ) ) );
 
 } // Constructor
 
@@ -148,6 +160,16 @@ srs_env_model::CButServer::CButServer(const std::string& filename) :
  */
 srs_env_model::CButServer::~CButServer()
 {
+	// Stop publishing thread
+	if( m_publisherThread )
+	{
+		{
+			boost::mutex::scoped_lock lock( m_publishRequestMutex );
+			m_bStopPublisher = true;
+		}
+		m_publishRequestCondition.notify_all();
+		m_publisherThread->join();
+	}
 
 	if( m_plugOldIMarkers != 0 )
 		delete m_plugOldIMarkers;
@@ -166,11 +188,14 @@ srs_env_model::CButServer::~CButServer()
  */
 void srs_env_model::CButServer::publishAll(const ros::Time& rostime) {
 
+	// Plugins can be reset from other thread
+	boost::mutex::scoped_lock publishLock( m_lockPublish );
+
 	// Store start time
 	ros::WallTime startTime = ros::WallTime::now();
 
 	// If no data, do nothing
-	if (m_plugOctoMap.getSize() <= 1) {
+	if (m_plugOctoMap.getSize() <= 1 && m_plugOctoMap.getNumUnloadedTiles() == 0) {
 		ROS_WARN("Nothing to publish, octree is empty");
 		return;
 	}
@@ -185,19 +210,40 @@ void srs_env_model::CButServer::publishAll(const ros::Time& rostime) {
 	//=========================================================================
 	// Plugins frame start
 
-	m_plugOcMapPointCloudHolder.connect( & m_plugOctoMap );
-	m_plugCollisionObjectHolder.connect( & m_plugOctoMap );
-	m_plugCMapHolder.connect( & m_plugOctoMap );
-	m_plugMap2DHolder.connect( & m_plugOctoMap );
-    m_plugMarkerArrayHolder.connect( & m_plugOctoMap );
-    m_plugVisiblePointCloudHolder.connect( & m_plugOctoMap );
+	// Built-in plugins are called by the static visitor, no signals are connected
+	m_plugOcMapPointCloudHolder.activate( & m_plugOctoMap );
+	m_plugCollisionObjectHolder.activate( & m_plugOctoMap );
+	m_plugCMapHolder.activate( & m_plugOctoMap );
+	m_plugMap2DHolder.activate( & m_plugOctoMap );
+    m_plugMarkerArrayHolder.activate( & m_plugOctoMap );
+    m_plugVisiblePointCloudHolder.activate( & m_plugOctoMap );
 
 #ifdef _EXAMPLES_
     m_plugExampleCrawlerHolder.connect( & m_plugOctoMap );
 #endif
 
-	// Crawl octomap
-	m_plugOctoMap.crawl( rostime );
+	// Only changed part of the map is crawled if all connected plugins can handle it
+	bool bAllowDelta( m_plugOcMapPointCloudHolder.acceptsDeltaCrawl()
+			&& m_plugCollisionObjectHolder.acceptsDeltaCrawl()
+			&& m_plugCMapHolder.acceptsDeltaCrawl()
+			&& m_plugMap2DHolder.acceptsDeltaCrawl()
+			&& m_plugMarkerArrayHolder.acceptsDeltaCrawl()
+			&& m_plugVisiblePointCloudHolder.acceptsDeltaCrawl() );
+
+#ifdef _EXAMPLES_
+	bAllowDelta = bAllowDelta && m_plugExampleCrawlerHolder.acceptsDeltaCrawl();
+#endif
+
+	// Crawl octomap, plugins connected by signals are called last
+	m_plugOctoMap.crawl( rostime,
+			makeCrawlerVisitor( m_plugOcMapPointCloudHolder,
+			makeCrawlerVisitor( m_plugCollisionObjectHolder,
+			makeCrawlerVisitor( m_plugCMapHolder,
+			makeCrawlerVisitor( m_plugMap2DHolder,
+			makeCrawlerVisitor( m_plugMarkerArrayHolder,
+			makeCrawlerVisitor( m_plugVisiblePointCloudHolder,
+			m_plugOctoMap.getSignalVisitor() ) ) ) ) ) ),
+			bAllowDelta );
 
 #ifdef _EXAMPLES_
 	m_plugExampleCrawlerHolder.disconnect();
@@ -236,6 +282,19 @@ void srs_env_model::CButServer::publishAll(const ros::Time& rostime) {
 	double total_elapsed = (ros::WallTime::now() - startTime).toSec();
 	ROS_DEBUG("Map publishing in CButServer took %f sec", total_elapsed);
 
+#ifdef _EXAMPLES_
+	m_plugExampleCrawlerHolder.publish(rostime);
+#endif
+}
+
+/**
+ Publish plugins which do not crawl the map. They are called on the callback thread,
+ so they never run concurrently with their own service callbacks.
+ */
+void srs_env_model::CButServer::publishNonCrawling(const ros::Time& rostime) {
+
+	// Reset runs on the callback thread too, so the publishing lock is not needed (it would wait for the crawl)
+
 	// Publish interactive markers
 	if( m_plugIMarkers != 0 && m_plugIMarkers->shouldPublish() )
 		m_plugIMarkers->onPublish( rostime );
@@ -248,8 +307,6 @@ void srs_env_model::CButServer::publishAll(const ros::Time& rostime) {
 	// Publish data
 	if( m_plugExample.shouldPublish() )
 	  m_plugExample.onPublish(rostime);
-
-	m_plugExampleCrawlerHolder.publish(rostime);
 #endif
 }
 
@@ -259,8 +316,56 @@ void srs_env_model::CButServer::publishAll(const ros::Time& rostime) {
  */
 void srs_env_model::CButServer::onOcMapDataChanged( const tButServerOcMap & mapdata )
 {
-	// Publish all data
-	publishAll(ros::Time::now() );
+	ros::Time rostime( ros::Time::now() );
+
+	// Plugins with their own callbacks are published here, on the callback thread
+	publishNonCrawling( rostime );
+
+	if( !m_publisherThread )
+	{
+		// Publish all data
+		publishAll( rostime );
+		return;
+	}
+
+	// Wake up publishing thread
+	{
+		boost::mutex::scoped_lock lock( m_publishRequestMutex );
+		m_bPublishRequested = true;
+	}
+	m_publishRequestCondition.notify_one();
+}
+
+/**
+ * Publishing thread - publishes data when requested, but not more often than m_maxPublishRate
+ */
+void srs_env_model::CButServer::publisherThread()
+{
+	while( true )
+	{
+		// Wait for the request
+		{
+			boost::mutex::scoped_lock lock( m_publishRequestMutex );
+			while( !m_bPublishRequested && !m_bStopPublisher )
+				m_publishRequestCondition.wait( lock );
+
+			if( m_bStopPublisher )
+				return;
+
+			m_bPublishRequested = false;
+		}
+
+		boost::system_time nextPublish( boost::get_system_time() );
+		if( m_maxPublishRate > 0.0 )
+			nextPublish += boost::posix_time::microseconds( long(1000000.0 / m_maxPublishRate) );
+
+		publishAll( ros::Time::now() );
+
+		// Keep publishing rate, requests coming meanwhile are merged
+		boost::mutex::scoped_lock lock( m_publishRequestMutex );
+		while( !m_bStopPublisher && m_publishRequestCondition.timed_wait( lock, nextPublish ) )
+			;
+	}
 }
 
 /**
@@ -270,6 +375,8 @@ void srs_env_model::CButServer::reset()
 {
   ROS_DEBUG("Reseting environment server...");
 
+  boost::mutex::scoped_lock publishLock( m_lockPublish );
+
   FOR_ALL_PLUGINS(reset());
 
   ROS_DEBUG("Environment server reset finished.");
@@ -126,4 +126,13 @@ const Box& BBox::box() const
     return m_box;
 }
 
+/**
+ * Returns axis aligned bounding box of the object.
+ * @return bounding box
+ */
+Box BBox::boundingBox() const
+{
+    return m_box;
+}
+
 }
@@ -27,9 +27,35 @@
 
 #include <srs_env_model/but_server/objtree/filter.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 namespace objtree
 {
 
+/**
+ * Tests a block of BLOCK_SIZE boxes stored in a box array.
+ * Default implementation calls filter() for every box, derived filters test four boxes at once.
+ * @param dims array of node sizes
+ * @param first index of the first tested box
+ * @return bit mask, i-th bit is set if the box first+i passes the filter
+ */
+unsigned int Filter::filterBlock(const BoxArray &dims, unsigned int first) const
+{
+    unsigned int mask = 0;
+
+    for(unsigned int i = 0; i < BLOCK_SIZE; i++)
+    {
+        if(filter(dims.get(first+i)))
+        {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+}
+
 /**
  * A constructor.
  * Creates a box filter. The filter returns true for nodes inside this box.
@@ -57,6 +83,40 @@ bool FilterBox::filter(const Box &dim) const
     return true;
 }
 
+/**
+ * Tests a block of boxes, see Filter::filterBlock().
+ * @param dims array of node sizes
+ * @param first index of the first tested box
+ * @return bit mask of boxes interfering with box
+ */
+unsigned int FilterBox::filterBlock(const BoxArray &dims, unsigned int first) const
+{
+#ifdef __SSE__
+    const __m128 minX = _mm_set1_ps(m_box.x), maxX = _mm_set1_ps(m_box.x+m_box.w);
+    const __m128 minY = _mm_set1_ps(m_box.y), maxY = _mm_set1_ps(m_box.y+m_box.h);
+    const __m128 minZ = _mm_set1_ps(m_box.z), maxZ = _mm_set1_ps(m_box.z+m_box.d);
+
+    unsigned int mask = 0;
+
+    for(unsigned int i = 0; i < BLOCK_SIZE; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&dims.x[first+i]);
+        __m128 y = _mm_loadu_ps(&dims.y[first+i]);
+        __m128 z = _mm_loadu_ps(&dims.z[first+i]);
+
+        __m128 in = _mm_and_ps(_mm_cmple_ps(x, maxX), _mm_cmpge_ps(_mm_add_ps(x, _mm_loadu_ps(&dims.w[first+i])), minX));
+        in = _mm_and_ps(in, _mm_and_ps(_mm_cmple_ps(y, maxY), _mm_cmpge_ps(_mm_add_ps(y, _mm_loadu_ps(&dims.h[first+i])), minY)));
+        in = _mm_and_ps(in, _mm_and_ps(_mm_cmple_ps(z, maxZ), _mm_cmpge_ps(_mm_add_ps(z, _mm_loadu_ps(&dims.d[first+i])), minZ)));
+
+        mask |= _mm_movemask_ps(in) << i;
+    }
+
+    return mask;
+#else
+    return Filter::filterBlock(dims, first);
+#endif
+}
+
 /**
  * A constructor.
  * Creates a plane filter. The filter returns true for nodes in front of this plane.
@@ -101,16 +161,62 @@ bool FilterPlane::filter(const Box &dim) const
     return false;
 }
 
+/**
+ * Tests a block of boxes, see Filter::filterBlock().
+ * @param dims array of node sizes
+ * @param first index of the first tested box
+ * @return bit mask of boxes in front of a plane
+ */
+unsigned int FilterPlane::filterBlock(const BoxArray &dims, unsigned int first) const
+{
+#ifdef __SSE__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 vecX = _mm_set1_ps(m_vecX), vecY = _mm_set1_ps(m_vecY), vecZ = _mm_set1_ps(m_vecZ);
+
+    //Box corner furthest along the normal - size is added only where normal component is non-negative
+    const __m128 useW = _mm_cmpge_ps(vecX, zero), useH = _mm_cmpge_ps(vecY, zero), useD = _mm_cmpge_ps(vecZ, zero);
+    const __m128 d = _mm_set1_ps(m_vecX*m_posX+m_vecY*m_posY+m_vecZ*m_posZ);
+
+    unsigned int mask = 0;
+
+    for(unsigned int i = 0; i < BLOCK_SIZE; i += 4)
+    {
+        __m128 pointX = _mm_add_ps(_mm_loadu_ps(&dims.x[first+i]), _mm_and_ps(_mm_loadu_ps(&dims.w[first+i]), useW));
+        __m128 pointY = _mm_add_ps(_mm_loadu_ps(&dims.y[first+i]), _mm_and_ps(_mm_loadu_ps(&dims.h[first+i]), useH));
+        __m128 pointZ = _mm_add_ps(_mm_loadu_ps(&dims.z[first+i]), _mm_and_ps(_mm_loadu_ps(&dims.d[first+i]), useD));
+
+        __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pointX, vecX), _mm_mul_ps(pointY, vecY)), _mm_mul_ps(pointZ, vecZ));
+
+        mask |= _mm_movemask_ps(_mm_cmpgt_ps(dot, d)) << i;
+    }
+
+    return mask;
+#else
+    return Filter::filterBlock(dims, first);
+#endif
+}
+
 /**
  * Always returns true - no filter.
  * @param dim node size
  * @return true
  */
-bool FilterZero::filter(const Box &dim) const
+bool FilterZero::filter(const Box &/*dim*/) const
 {
     return true;
 }
 
+/**
+ * Always passes all boxes - no filter.
+ * @param dims array of node sizes
+ * @param first index of the first tested box
+ * @return bit mask with all boxes set
+ */
+unsigned int FilterZero::filterBlock(const BoxArray &/*dims*/, unsigned int /*first*/) const
+{
+    return (1 << BLOCK_SIZE)-1;
+}
+
 /**
  * A constructor.
  * Creates a sphere filter. The filter returns true for nodes inside this sphere.
@@ -158,4 +264,40 @@ bool FilterSphere::filter(const Box &dim) const
     return false;
 }
 
+/**
+ * Tests a block of boxes, see Filter::filterBlock().
+ * @param dims array of node sizes
+ * @param first index of the first tested box
+ * @return bit mask of boxes inside a sphere
+ */
+unsigned int FilterSphere::filterBlock(const BoxArray &dims, unsigned int first) const
+{
+#ifdef __SSE__
+    const __m128 centerX = _mm_set1_ps(m_x), centerY = _mm_set1_ps(m_y), centerZ = _mm_set1_ps(m_z);
+    const __m128 radiusSquare = _mm_set1_ps(m_radiusSquare);
+
+    unsigned int mask = 0;
+
+    for(unsigned int i = 0; i < BLOCK_SIZE; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&dims.x[first+i]);
+        __m128 y = _mm_loadu_ps(&dims.y[first+i]);
+        __m128 z = _mm_loadu_ps(&dims.z[first+i]);
+
+        //Nearest box point is the sphere center clamped to the box
+        __m128 xDist = _mm_sub_ps(centerX, _mm_min_ps(_mm_max_ps(centerX, x), _mm_add_ps(x, _mm_loadu_ps(&dims.w[first+i]))));
+        __m128 yDist = _mm_sub_ps(centerY, _mm_min_ps(_mm_max_ps(centerY, y), _mm_add_ps(y, _mm_loadu_ps(&dims.h[first+i]))));
+        __m128 zDist = _mm_sub_ps(centerZ, _mm_min_ps(_mm_max_ps(centerZ, z), _mm_add_ps(z, _mm_loadu_ps(&dims.d[first+i]))));
+
+        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(xDist, xDist), _mm_mul_ps(yDist, yDist)), _mm_mul_ps(zDist, zDist));
+
+        mask |= _mm_movemask_ps(_mm_cmple_ps(dist, radiusSquare)) << i;
+    }
+
+    return mask;
+#else
+    return Filter::filterBlock(dims, first);
+#endif
+}
+
 }
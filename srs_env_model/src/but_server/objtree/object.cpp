@@ -25,7 +25,7 @@
  * along with this file.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <srs_env_model/but_server/objtree/node.h>
+#include <algorithm>
 #include <srs_env_model/but_server/objtree/object.h>
 
 namespace objtree
@@ -44,15 +44,9 @@ Object::Object()
 
 /**
  * A destructor.
- * Removes object from octree.
  */
 Object::~Object()
 {
-    for(std::list<Node*>::iterator i = m_inNodes.begin(); i != m_inNodes.end(); i++)
-    {
-        (*i)->removeObject(this);
-    }
-
 #if HISTORY_ENABLED
     if(m_history)
     {
@@ -99,20 +93,29 @@ unsigned int Object::id() const
 
 /**
  * Informs object it is include in a new node.
- * @param pointer to node
+ * @param node index of node
  */
-void Object::newNode(Node *node)
+void Object::newNode(unsigned int node)
 {
     m_inNodes.push_back(node);
 }
 
 /**
  * Informs object it is removed from node.
- * @param pointer to node
+ * @param node index of node
+ */
+void Object::removeNode(unsigned int node)
+{
+    m_inNodes.erase(std::remove(m_inNodes.begin(), m_inNodes.end(), node), m_inNodes.end());
+}
+
+/**
+ * Returns indices of nodes containing the object.
+ * @return vector of node indices
  */
-void Object::removeNode(Node *node)
+const std::vector<unsigned int>& Object::inNodes() const
 {
-    m_inNodes.remove(node);
+    return m_inNodes;
 }
 
 /**
@@ -25,39 +25,163 @@
  * along with this file.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <cstdio>
+#include <algorithm>
 #include <srs_env_model/but_server/objtree/octree.h>
 #include <srs_env_model/but_server/objtree/filter.h>
 #include <srs_env_model/but_server/objtree/node.h>
+#include <srs_env_model/but_server/parallel_tools.h>
 
 namespace objtree
 {
 
+const unsigned int Octree::ROOT;
+const unsigned int Octree::MAX_DEPTH;
+
+namespace
+{
+    /// Number of bits of one coordinate in the leaf cell key
+    const unsigned int CELL_BITS = 21;
+    const boost::uint64_t CELL_MASK = (boost::uint64_t(1) << CELL_BITS)-1;
+
+    /// Packs leaf cell coordinates to one key
+    inline boost::uint64_t cellKey(unsigned int x, unsigned int y, unsigned int z)
+    {
+        return boost::uint64_t(x) | (boost::uint64_t(y) << CELL_BITS) | (boost::uint64_t(z) << 2*CELL_BITS);
+    }
+
+    /// Leaf cell key and index of the batch object interfering with the cell
+    typedef std::pair<boost::uint64_t, unsigned int> tCellBin;
+
+    /// Existing object id and pointer, id is needed to test if the object still exists
+    typedef std::pair<unsigned int, Object*> tIdObject;
+}
+
+/**
+ * Batch insertion worker - computes leaf cells of a continuous block of objects.
+ */
+struct Octree::CellWorker
+{
+    const Octree *tree;
+    const std::vector<Object*> *objects;
+    std::vector<std::vector<boost::uint64_t> > *cells;
+
+    void operator()(unsigned thread, unsigned numThreads)
+    {
+        size_t begin, end;
+        srs_env_model::getThreadRange(objects->size(), thread, numThreads, begin, end);
+
+        for(size_t i = begin; i < end; i++)
+        {
+            std::vector<boost::uint64_t> &objectCells((*cells)[i]);
+
+            tree->leafCells((*objects)[i], tree->m_rootSize, 0, 0, 0, 0, objectCells);
+            std::sort(objectCells.begin(), objectCells.end());
+        }
+    }
+};
+
+/**
+ * Batch insertion worker - finds objects similar to a continuous block of objects.
+ * Objects are compared with tree objects and with preceding batch objects in the neighborhood of their leaves.
+ * Tree is only read here.
+ */
+struct Octree::MatchWorker
+{
+    const Octree *tree;
+    const std::vector<Object*> *objects;
+    const std::vector<std::vector<boost::uint64_t> > *cells;
+    const std::vector<tCellBin> *bins;
+    std::vector<std::vector<tIdObject> > *similar;
+    std::vector<std::vector<unsigned int> > *batchSimilar;
+
+    void operator()(unsigned thread, unsigned numThreads)
+    {
+        size_t begin, end;
+        srs_env_model::getThreadRange(objects->size(), thread, numThreads, begin, end);
+
+        std::vector<boost::uint64_t> neighborhood;
+        std::vector<Object*> candidates;
+        std::vector<unsigned int> batchCandidates;
+
+        for(size_t i = begin; i < end; i++)
+        {
+            const Object *object = (*objects)[i];
+
+            neighborhood.clear();
+            candidates.clear();
+            batchCandidates.clear();
+
+            tree->neighborhoodCells((*cells)[i], neighborhood);
+
+            for(std::vector<boost::uint64_t>::const_iterator c = neighborhood.begin(); c != neighborhood.end(); c++)
+            {
+                unsigned int node = tree->findNode(tree->m_maxDepth+1, *c & CELL_MASK, (*c >> CELL_BITS) & CELL_MASK, *c >> 2*CELL_BITS);
+
+                if(node != Node::NONE)
+                {
+                    const std::vector<Object*> &objects(tree->m_nodes[node].m_objects);
+                    candidates.insert(candidates.end(), objects.begin(), objects.end());
+                }
+
+                //Only preceding objects of the batch are already inserted when this one is applied
+                for(std::vector<tCellBin>::const_iterator b = std::lower_bound(bins->begin(), bins->end(), tCellBin(*c, 0));
+                        b != bins->end() && b->first == *c && b->second < i; b++)
+                {
+                    batchCandidates.push_back(b->second);
+                }
+            }
+
+            //Each candidate is tested once even if it is stored in several leaves
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            for(std::vector<Object*>::const_iterator j = candidates.begin(); j != candidates.end(); j++)
+            {
+                if(*j != object && (*j)->isSimilar(object))
+                {
+                    (*similar)[i].push_back(tIdObject((*j)->id(), *j));
+                }
+            }
+
+            std::sort((*similar)[i].begin(), (*similar)[i].end());
+
+            std::sort(batchCandidates.begin(), batchCandidates.end());
+            batchCandidates.erase(std::unique(batchCandidates.begin(), batchCandidates.end()), batchCandidates.end());
+
+            for(std::vector<unsigned int>::const_iterator j = batchCandidates.begin(); j != batchCandidates.end(); j++)
+            {
+                if((*objects)[*j]->isSimilar(object))
+                {
+                    (*batchSimilar)[i].push_back(*j);
+                }
+            }
+        }
+    }
+};
+
 /**
  * Default constructor.
- * Creates octree with default sized root node (16.0 x 16.0 x 16.0).
- * @param maxDepth maximum octree depth
+ * Creates octree with default sized root node (16.0 x 16.0 x 16.0). Root grows when objects don't fit into it.
+ * @param maxDepth initial maximum octree depth
  */
 Octree::Octree(unsigned int maxDepth) :
-    m_rootSize(0.0f, 0.0f, 0.0f, 16.0f, 16.0f, 16.0f)
+    m_initialRootSize(0.0f, 0.0f, 0.0f, 16.0f, 16.0f, 16.0f)
 {
-    m_root = new Node;
-    m_maxId = 0;
-    m_maxDepth = maxDepth;
+    m_initialMaxDepth = maxDepth;
+    init();
 }
 
 /**
  * A constructor.
- * Creates octree with custom sized root node.
- * @param rootSize root node bounding box
- * @param maxDepth maximum octree depth
+ * Creates octree with custom sized root node. Root grows when objects don't fit into it.
+ * @param rootSize initial root node bounding box
+ * @param maxDepth initial maximum octree depth
  */
 Octree::Octree(const Box &rootSize, unsigned int maxDepth) :
-    m_rootSize(rootSize)
+    m_initialRootSize(rootSize)
 {
-    m_root = new Node;
-    m_maxId = 0;
-    m_maxDepth = maxDepth;
+    m_initialMaxDepth = maxDepth;
+    init();
 }
 
 /**
@@ -65,7 +189,23 @@ Octree::Octree(const Box &rootSize, unsigned int maxDepth) :
  */
 Octree::~Octree()
 {
-    delete m_root;
+    clear();
+}
+
+/**
+ * Creates empty tree containing only the root node of initial size.
+ */
+void Octree::init()
+{
+    m_rootSize = m_initialRootSize;
+    m_maxDepth = m_initialMaxDepth;
+
+    m_nodes.assign(1, Node());
+    m_bounds.resize(1);
+    m_bounds.set(ROOT, m_rootSize);
+    m_freeBlocks.clear();
+
+    m_maxId = 0;
 }
 
 /**
@@ -73,41 +213,499 @@ Octree::~Octree()
  */
 void Octree::clear()
 {
-    delete m_root;
+    //Object can be stored in several nodes, delete each of them only once
+    std::vector<Object*> objects;
+
+    for(std::map<unsigned int, Object*>::const_iterator i = m_objects.begin(); i != m_objects.end(); i++)
+    {
+        objects.push_back(i->second);
+        m_changes.push_back(i->first);
+    }
+
+    for(std::vector<Node>::const_iterator i = m_nodes.begin(); i != m_nodes.end(); i++)
+    {
+        objects.insert(objects.end(), i->m_objects.begin(), i->m_objects.end());
+    }
+
+    std::sort(objects.begin(), objects.end());
+    objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+
+    for(std::vector<Object*>::iterator i = objects.begin(); i != objects.end(); i++)
+    {
+        delete *i;
+    }
+
     m_objects.clear();
+    init();
+}
 
-    m_root = new Node;
-    m_maxId = 0;
+/**
+ * Allocates block of children for a node. Children are not marked as existing in the parent.
+ * All children bounding boxes are computed at once.
+ * @param node parent node index
+ * @return index of the first node of the block
+ */
+unsigned int Octree::allocateBlock(unsigned int node)
+{
+    unsigned int first;
+
+    if(!m_freeBlocks.empty())
+    {
+        first = m_freeBlocks.back();
+        m_freeBlocks.pop_back();
+    }
+    else
+    {
+        //Node references are not valid after this
+        first = m_nodes.size();
+        m_nodes.resize(first+Node::CHILDREN);
+        m_bounds.resize(first+Node::CHILDREN);
+    }
+
+    for(unsigned char i = 0; i < Node::CHILDREN; i++)
+    {
+        Node &childNode = m_nodes[first+i];
+
+        childNode.m_parent = node;
+        childNode.m_children = Node::NONE;
+        childNode.m_childMask = 0;
+        childNode.m_place = i;
+    }
+
+    updateBlock(node, first);
+
+    return first;
 }
 
 /**
- * Inserts object into the biggest node that fits entire object.
+ * Computes depth, grid cells and bounding boxes of a children block from its parent.
+ * @param node parent node index
+ * @param first index of the first node of the block
+ */
+void Octree::updateBlock(unsigned int node, unsigned int first)
+{
+    const Node &parent = m_nodes[node];
+    Box box(m_bounds.get(node));
+    Box childBox;
+
+    for(unsigned char i = 0; i < Node::CHILDREN; i++)
+    {
+        Node &childNode = m_nodes[first+i];
+
+        childNode.m_depth = parent.m_depth+1;
+        childNode.m_cell[0] = (parent.m_cell[0] << 1) | (i & 1);
+        childNode.m_cell[1] = (parent.m_cell[1] << 1) | ((i >> 1) & 1);
+        childNode.m_cell[2] = (parent.m_cell[2] << 1) | ((i >> 2) & 1);
+
+        m_bounds.set(first+i, Node::getChildBox(i, childBox, box));
+    }
+}
+
+/**
+ * Returns index of the child node.
+ * Children are allocated as a whole block, so all their bounding boxes are computed at once.
+ * @param node parent node index
+ * @param place child position
+ * @param createNew if true non-existing childs are created
+ * @return child index, Node::NONE if child doesn't exist
+ */
+unsigned int Octree::child(unsigned int node, unsigned char place, bool createNew)
+{
+    unsigned int index = m_nodes[node].child(place);
+
+    if(index != Node::NONE || !createNew)
+    {
+        return index;
+    }
+
+    if(m_nodes[node].m_children == Node::NONE)
+    {
+        unsigned int first = allocateBlock(node);
+        m_nodes[node].m_children = first;
+    }
+
+    m_nodes[node].m_childMask |= 1 << place;
+
+    return m_nodes[node].m_children+place;
+}
+
+/*
+ * Neighbors ids (from top view)
+ * Top part:  Middle part:  Bottom part:
+ *  6  7  8     14 15 16      23 24 25
+ *  3  4  5     12    13      20 21 22
+ *  0  1  2      9 10 11      17 18 19
+ */
+
+/**
+ * Returns index of the node in selected grid cell.
+ * Node is found by descending from the root.
+ * @param depth node depth
+ * @param x
+ * @param y
+ * @param z
+ * @return node index or Node::NONE if node doesn't exists
+ */
+unsigned int Octree::findNode(unsigned int depth, int x, int y, int z) const
+{
+    int size = 1 << depth;
+
+    if(x < 0 || x >= size || y < 0 || y >= size || z < 0 || z >= size)
+    {
+        return Node::NONE;
+    }
+
+    unsigned int index = ROOT;
+
+    for(int bit = depth-1; bit >= 0 && index != Node::NONE; bit--)
+    {
+        unsigned char place = ((x >> bit) & 1) | (((y >> bit) & 1) << 1) | (((z >> bit) & 1) << 2);
+        index = m_nodes[index].child(place);
+    }
+
+    return index;
+}
+
+/**
+ * Returns index of the neighbor node in the same depth.
+ * @param node node index
+ * @param dir neighbor direction (0-25)
+ * @return neighbor index or Node::NONE if neighbor doesn't exists
+ */
+unsigned int Octree::neighbor(unsigned int node, unsigned char dir) const
+{
+    if(dir >= 13) dir++;
+
+    const Node &current = m_nodes[node];
+
+    return findNode(current.m_depth, current.m_cell[0] + dir%3 - 1, current.m_cell[1] + (dir%9)/3 - 1, current.m_cell[2] + dir/9 - 1);
+}
+
+/**
+ * Computes leaf cells the object would be inserted to by insertOnInterfere().
+ * Leaves don't have to exist.
  * @param object object to insert
- * @return inserted object id
+ * @param box bounding box of current node
+ * @param depth current depth
+ * @param x current node grid cell
+ * @param y
+ * @param z
+ * @param cells output leaf cell keys
  */
-unsigned int Octree::insertOnFit(Object* object)
+void Octree::leafCells(const Object *object, Box box, unsigned int depth, unsigned int x, unsigned int y, unsigned int z, std::vector<boost::uint64_t> &cells) const
+{
+    Box childBox;
+
+    for(unsigned char i = 0; i < Node::CHILDREN; i++)
+    {
+        if(object->interfereWithBox(Node::getChildBox(i, childBox, box)))
+        {
+            unsigned int childX = (x << 1) | (i & 1);
+            unsigned int childY = (y << 1) | ((i >> 1) & 1);
+            unsigned int childZ = (z << 1) | ((i >> 2) & 1);
+
+            if(depth < m_maxDepth)
+            {
+                leafCells(object, childBox, depth+1, childX, childY, childZ, cells);
+            }
+            else
+            {
+                cells.push_back(cellKey(childX, childY, childZ));
+            }
+        }
+    }
+}
+
+/**
+ * Computes leaf cells and all their neighbors.
+ * @param cells leaf cell keys
+ * @param neighborhood output sorted cell keys without duplicates
+ */
+void Octree::neighborhoodCells(const std::vector<boost::uint64_t> &cells, std::vector<boost::uint64_t> &neighborhood) const
+{
+    int size = 1 << (m_maxDepth+1);
+
+    for(std::vector<boost::uint64_t>::const_iterator c = cells.begin(); c != cells.end(); c++)
+    {
+        int x = *c & CELL_MASK;
+        int y = (*c >> CELL_BITS) & CELL_MASK;
+        int z = *c >> 2*CELL_BITS;
+
+        for(int nz = std::max(z-1, 0); nz <= std::min(z+1, size-1); nz++)
+        {
+            for(int ny = std::max(y-1, 0); ny <= std::min(y+1, size-1); ny++)
+            {
+                for(int nx = std::max(x-1, 0); nx <= std::min(x+1, size-1); nx++)
+                {
+                    neighborhood.push_back(cellKey(nx, ny, nz));
+                }
+            }
+        }
+    }
+
+    std::sort(neighborhood.begin(), neighborhood.end());
+    neighborhood.erase(std::unique(neighborhood.begin(), neighborhood.end()), neighborhood.end());
+}
+
+/**
+ * Adds object to the node.
+ * @param node node index
+ * @param object object to add
+ */
+void Octree::addToNode(unsigned int node, Object *object)
+{
+    m_nodes[node].m_objects.push_back(object);
+    object->newNode(node);
+}
+
+/**
+ * Removes object from all nodes. Nodes which remain empty are removed too.
+ * @param object pointer to the object
+ */
+void Octree::unlinkObject(Object *object)
+{
+    std::vector<unsigned int> inNodes(object->inNodes());
+
+    for(std::vector<unsigned int>::iterator i = inNodes.begin(); i != inNodes.end(); i++)
+    {
+        std::vector<Object*> &objects(m_nodes[*i].m_objects);
+        objects.erase(std::remove(objects.begin(), objects.end(), object), objects.end());
+
+        object->removeNode(*i);
+        deleteIfEmpty(*i);
+    }
+}
+
+/**
+ * Removes node if it doesn't contain any children and objects.
+ * Children block is returned to the free list when the last child is removed.
+ * @param node node index
+ */
+void Octree::deleteIfEmpty(unsigned int node)
 {
-    Node *node = m_root;
+    //We don't want to delete root node
+    while(node != ROOT)
+    {
+        const Node &current = m_nodes[node];
+
+        if(current.m_childMask != 0 || current.m_objects.size() != 0)
+        {
+            return;
+        }
+
+        Node &parent = m_nodes[current.m_parent];
+        parent.m_childMask &= ~(1 << current.m_place);
+
+        if(parent.m_childMask == 0)
+        {
+            m_freeBlocks.push_back(parent.m_children);
+            parent.m_children = Node::NONE;
+        }
+
+        node = current.m_parent;
+    }
+}
+
+/**
+ * Finds object similar to the selected one in a node and its neighbors.
+ * @param object object to compare
+ * @param node node index
+ * @return similar object pointer, NULL if not found
+ */
+Object* Octree::findSimilar(const Object *object, unsigned int node) const
+{
+    const std::vector<Object*> &objects(m_nodes[node].m_objects);
+
+    for(std::vector<Object*>::const_iterator j = objects.begin(); j != objects.end(); j++)
+    {
+        if(*j != object && (*j)->isSimilar(object))
+        {
+            return *j;
+        }
+    }
+
+    for(unsigned char n = 0; n < Node::NEIGHBORS; n++)
+    {
+        unsigned int neighborId = neighbor(node, n);
+
+        if(neighborId == Node::NONE) continue;
+
+        const std::vector<Object*> &neighborObjects(m_nodes[neighborId].m_objects);
+
+        for(std::vector<Object*>::const_iterator j = neighborObjects.begin(); j != neighborObjects.end(); j++)
+        {
+            if(*j != object && (*j)->isSimilar(object))
+            {
+                return *j;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Grows root node until the box fits into it.
+ * Old root becomes a child of the new root on the side away from the box, depth of the tree is increased,
+ * so leaves keep their size. Objects that didn't fit into the old root are pushed down from the new root.
+ * @param box box which should fit into the root
+ */
+void Octree::grow(const Box &box)
+{
+    while(m_maxDepth < MAX_DEPTH
+            && (box.x < m_rootSize.x || box.y < m_rootSize.y || box.z < m_rootSize.z
+                || box.x+box.w > m_rootSize.x+m_rootSize.w || box.y+box.h > m_rootSize.y+m_rootSize.h || box.z+box.d > m_rootSize.z+m_rootSize.d))
+    {
+        unsigned char place = 0;
+        Box rootSize(m_rootSize);
+
+        if(box.x < m_rootSize.x)
+        {
+            place += 1;
+            rootSize.x -= m_rootSize.w;
+        }
+
+        if(box.y < m_rootSize.y)
+        {
+            place += 2;
+            rootSize.y -= m_rootSize.h;
+        }
+
+        if(box.z < m_rootSize.z)
+        {
+            place += 4;
+            rootSize.z -= m_rootSize.d;
+        }
+
+        rootSize.w *= 2.0f;
+        rootSize.h *= 2.0f;
+        rootSize.d *= 2.0f;
+
+        unsigned int children = m_nodes[ROOT].m_children;
+        unsigned char childMask = m_nodes[ROOT].m_childMask;
+
+        m_rootSize = rootSize;
+        m_bounds.set(ROOT, rootSize);
+        m_maxDepth++;
+
+        //Move old root content into a new child
+        unsigned int first = allocateBlock(ROOT);
+        unsigned int oldRoot = first+place;
+
+        Node &root = m_nodes[ROOT];
+        Node &moved = m_nodes[oldRoot];
+
+        moved.m_children = children;
+        moved.m_childMask = childMask;
+        moved.m_objects.swap(root.m_objects);
+
+        root.m_children = first;
+        root.m_childMask = 1 << place;
+
+        if(children != Node::NONE)
+        {
+            for(unsigned char i = 0; i < Node::CHILDREN; i++)
+            {
+                m_nodes[children+i].m_parent = oldRoot;
+            }
+        }
+
+        for(std::vector<Object*>::iterator i = moved.m_objects.begin(); i != moved.m_objects.end(); i++)
+        {
+            (*i)->removeNode(ROOT);
+            (*i)->newNode(oldRoot);
+        }
+
+        //Depths, cells and bounding boxes of the whole old tree have changed
+        std::vector<unsigned int> stack(1, oldRoot);
+
+        while(!stack.empty())
+        {
+            unsigned int index = stack.back();
+            stack.pop_back();
+
+            const Node &node = m_nodes[index];
+
+            if(node.m_children == Node::NONE) continue;
+
+            updateBlock(index, node.m_children);
+
+            for(unsigned char i = 0; i < Node::CHILDREN; i++)
+            {
+                if(node.m_childMask & (1 << i))
+                {
+                    stack.push_back(node.m_children+i);
+                }
+            }
+        }
+
+        //Objects which didn't fit into the old root can be pushed down now
+        Box oldRootSize(m_bounds.get(oldRoot));
+        std::vector<Object*> overflow;
+
+        for(std::vector<Object*>::const_iterator i = m_nodes[oldRoot].m_objects.begin(); i != m_nodes[oldRoot].m_objects.end(); i++)
+        {
+            if(!(*i)->fitsIntoBox(oldRootSize))
+            {
+                overflow.push_back(*i);
+            }
+        }
+
+        for(std::vector<Object*>::iterator i = overflow.begin(); i != overflow.end(); i++)
+        {
+            std::vector<Object*> &objects(m_nodes[oldRoot].m_objects);
+            objects.erase(std::remove(objects.begin(), objects.end(), *i), objects.end());
+            (*i)->removeNode(oldRoot);
+
+            addToNode(fitNode(*i), *i);
+        }
+
+        deleteIfEmpty(oldRoot);
+    }
+}
+
+/**
+ * Finds the smallest node the object fits into, missing nodes are created.
+ * @param object object to insert
+ * @return node index
+ */
+unsigned int Octree::fitNode(const Object *object)
+{
+    unsigned int node = ROOT;
 
     Box box(m_rootSize);
     Box childBox;
 
-    bool fits = true;
-    unsigned char i;
-
-    while(fits)
+    for(unsigned int depth = 0; depth <= m_maxDepth; depth++)
     {
-        for(i = 0; !(fits = object->fitsIntoBox(Node::getChildBox(i, childBox, box))) && i < Node::CHILDREN; i++);
+        unsigned char i;
+
+        for(i = 0; i < Node::CHILDREN && !object->fitsIntoBox(Node::getChildBox(i, childBox, box)); i++);
 
-        if(fits)
+        if(i == Node::CHILDREN)
         {
-            node = node->child(i, true);
-            box = childBox;
+            break;
         }
+
+        node = child(node, i, true);
+        box = childBox;
     }
 
-    node->add(object);
+    return node;
+}
+
+/**
+ * Inserts object into the biggest node that fits entire object.
+ * @param object object to insert
+ * @return inserted object id
+ */
+unsigned int Octree::insertOnFit(Object* object)
+{
+    grow(object->boundingBox());
+
+    addToNode(fitNode(object), object);
     m_objects[m_maxId] = object;
+    m_changes.push_back(m_maxId);
     object->setId(m_maxId++);
 
     return object->id();
@@ -115,29 +713,35 @@ unsigned int Octree::insertOnFit(Object* object)
 
 /**
  * Inserts object into all intersected leaf nodes.
+ * Object reaching out of the root (root can't grow over MAX_DEPTH) is kept in the root too, so it is returned by all queries.
  * @param object object to insert
  * @param node current node in recursion
  * @param box bounding box of current node
  * @param depth current depth
  * @return inserted object id
  */
-unsigned int Octree::insertOnInterfere(Object* object, Node *node, Box box, unsigned int depth)
+unsigned int Octree::insertOnInterfere(Object* object, unsigned int node, Box box, unsigned int depth)
 {
     Box childBox;
 
+    if(depth == 0 && !object->fitsIntoBox(box))
+    {
+        addToNode(node, object);
+    }
+
     for(unsigned char i = 0; i < Node::CHILDREN; i++)
     {
         if(object->interfereWithBox(Node::getChildBox(i, childBox, box)))
         {
-            Node *child = node->child(i, true);
+            unsigned int childId = child(node, i, true);
 
             if(depth < m_maxDepth)
             {
-                insertOnInterfere(object, child, childBox, depth+1);
+                insertOnInterfere(object, childId, childBox, depth+1);
             }
             else
             {
-                child->add(object);
+                addToNode(childId, object);
             }
         }
     }
@@ -148,6 +752,7 @@ unsigned int Octree::insertOnInterfere(Object* object, Node *node, Box box, unsi
 /**
  * Inserts or updates object into all intersected leaf nodes.
  * Updates object if there exists a similar object. Inserts otherwise.
+ * Object reaching out of the root is kept in the root too, similar objects are searched in the intersected leaves only.
  * @param object object to insert
  * @param node current node in recursion
  * @param box bounding box of current node
@@ -155,7 +760,7 @@ unsigned int Octree::insertOnInterfere(Object* object, Node *node, Box box, unsi
  * @param inserted has been new object inserted?
  * @return inserted object id
  */
-unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box, bool &inserted, unsigned int depth)
+unsigned int Octree::insertUpdateOnInterfere(Object* object, unsigned int node, Box box, bool &inserted, unsigned int depth)
 {
     Box childBox;
 
@@ -163,43 +768,18 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
     {
         if(object->interfereWithBox(Node::getChildBox(i, childBox, box)))
         {
-            Node *child = node->child(i, true);
+            unsigned int childId = child(node, i, true);
 
             if(depth < m_maxDepth)
             {
-                insertUpdateOnInterfere(object, child, childBox, inserted, depth+1);
+                insertUpdateOnInterfere(object, childId, childBox, inserted, depth+1);
             }
             else
             {
                 //Find similar object
-                Object *similar = NULL;
-
-                for(std::list<Object*>::const_iterator j = child->objects().begin(); j != child->objects().end() && !similar; j++)
-                {
-                    if(*j != object && (*j)->isSimilar(object))
-                    {
-                        similar = *j;
-                    }
-                }
+                Object *similar = findSimilar(object, childId);
 
-                for(unsigned int n = 0; n < Node::NEIGHBORS && !similar; n++)
-                {
-                    Node *neighbor = child->neighbor(n);
-                    if(neighbor == NULL)
-                    {
-                        continue;
-                    }
-
-                    for(std::list<Object*>::const_iterator j = neighbor->objects().begin(); j != neighbor->objects().end() && !similar; j++)
-                    {
-                        if(*j != object && (*j)->isSimilar(object))
-                        {
-                            similar = *j;
-                        }
-                    }
-                }
-
-                child->add(object);
+                addToNode(childId, object);
 
                 //We have found a similar object
                 if(similar != NULL)
@@ -208,6 +788,7 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
                     if(!inserted)
                     {
                         m_objects[similar->id()] = object;
+                        m_changes.push_back(similar->id());
                         object->setId(similar->id());
                         inserted = true;
 #if HISTORY_ENABLED
@@ -217,9 +798,11 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
                     //We have already replaced other object
                     else
                     {
+                        m_changes.push_back(similar->id());
                         m_objects.erase(similar->id());
                     }
 
+                    unlinkObject(similar);
                     delete similar;
                 }
                 //Similar object hasn't been found
@@ -230,11 +813,13 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
                         if(!object->hasId())
                         {
                             m_objects[m_maxId] = object;
+                            m_changes.push_back(m_maxId);
                             object->setId(m_maxId++);
                         }
                         else
                         {
                             m_objects[object->id()] = object;
+                            m_changes.push_back(object->id());
                         }
                     }
                 }
@@ -242,9 +827,173 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
         }
     }
 
+    if(depth == 0 && !object->fitsIntoBox(box))
+    {
+        addToNode(node, object);
+
+        if(!inserted)
+        {
+            if(!object->hasId())
+            {
+                m_objects[m_maxId] = object;
+                m_changes.push_back(m_maxId);
+                object->setId(m_maxId++);
+            }
+            else
+            {
+                m_objects[object->id()] = object;
+                m_changes.push_back(object->id());
+            }
+
+            inserted = true;
+        }
+    }
+
     return object->id();
 }
 
+/**
+ * Inserts or updates several objects at once.
+ * The result is similar to calling insertUpdate() for each object in order. Objects are binned by leaf cells,
+ * similar objects are searched in parallel and the merges are then applied serially.
+ * Each tree object is tested for similarity once per inserted object, even if it is stored in several leaves.
+ * Objects merged into a later object of the batch are deleted, so only returned ids can be used after the call.
+ * @param objects objects to insert
+ * @param ids output inserted objects ids
+ * @param numThreads number of threads used for similarity search
+ */
+void Octree::insertUpdate(const std::vector<Object*> &objects, std::vector<unsigned int> &ids, unsigned int numThreads)
+{
+    unsigned int count = objects.size();
+    ids.resize(count);
+
+    if(count == 0) return;
+
+    // not worth spawning threads for a few objects
+    numThreads = std::max(1u, std::min(numThreads, count));
+
+    //Leaf cells are valid only if the tree doesn't grow during insertion
+    for(unsigned int i = 0; i < count; i++)
+    {
+        grow(objects[i]->boundingBox());
+    }
+
+    //Bin objects by leaf cells
+    std::vector<std::vector<boost::uint64_t> > cells(count);
+
+    CellWorker cellWorker;
+    cellWorker.tree = this;
+    cellWorker.objects = &objects;
+    cellWorker.cells = &cells;
+    srs_env_model::runParallel(numThreads, cellWorker);
+
+    std::vector<tCellBin> bins;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        for(std::vector<boost::uint64_t>::const_iterator c = cells[i].begin(); c != cells[i].end(); c++)
+        {
+            bins.push_back(tCellBin(*c, i));
+        }
+    }
+
+    std::sort(bins.begin(), bins.end());
+
+    //Find similar objects
+    std::vector<std::vector<tIdObject> > similar(count);
+    std::vector<std::vector<unsigned int> > batchSimilar(count);
+
+    MatchWorker matchWorker;
+    matchWorker.tree = this;
+    matchWorker.objects = &objects;
+    matchWorker.cells = &cells;
+    matchWorker.bins = &bins;
+    matchWorker.similar = &similar;
+    matchWorker.batchSimilar = &batchSimilar;
+    srs_env_model::runParallel(numThreads, matchWorker);
+
+    //Tree modification itself is not thread safe
+    std::vector<bool> inTree(count, false);
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        Object *object = objects[i];
+        std::vector<Object*> targets;
+
+        //Tree object could have been already merged into a preceding batch object
+        for(std::vector<tIdObject>::const_iterator j = similar[i].begin(); j != similar[i].end(); j++)
+        {
+            std::map<unsigned int, Object*>::const_iterator found = m_objects.find(j->first);
+
+            if(found != m_objects.end() && found->second == j->second)
+            {
+                targets.push_back(j->second);
+            }
+        }
+
+        for(std::vector<unsigned int>::const_iterator j = batchSimilar[i].begin(); j != batchSimilar[i].end(); j++)
+        {
+            if(inTree[*j])
+            {
+                targets.push_back(objects[*j]);
+                inTree[*j] = false;
+            }
+        }
+
+        bool inserted = false;
+
+        for(std::vector<Object*>::iterator j = targets.begin(); j != targets.end(); j++)
+        {
+            Object *target = *j;
+
+            //Replace first similar object in objects list
+            if(!inserted)
+            {
+                m_objects[target->id()] = object;
+                m_changes.push_back(target->id());
+                object->setId(target->id());
+                inserted = true;
+#if HISTORY_ENABLED
+                object->takeHistory(target);
+#endif
+            }
+            else
+            {
+                std::map<unsigned int, Object*>::iterator found = m_objects.find(target->id());
+
+                if(found != m_objects.end() && found->second == target)
+                {
+                    m_changes.push_back(found->first);
+                    m_objects.erase(found);
+                }
+            }
+
+            unlinkObject(target);
+            delete target;
+        }
+
+        if(!inserted)
+        {
+            if(!object->hasId())
+            {
+                m_objects[m_maxId] = object;
+                m_changes.push_back(m_maxId);
+                object->setId(m_maxId++);
+            }
+            else
+            {
+                m_objects[object->id()] = object;
+                m_changes.push_back(object->id());
+            }
+        }
+
+        insertOnInterfere(object, ROOT, m_rootSize);
+
+        inTree[i] = true;
+        ids[i] = object->id();
+    }
+}
+
 /**
  * Returns similar object to selected one.
  * @param object object to compare
@@ -253,49 +1002,29 @@ unsigned int Octree::insertUpdateOnInterfere(Object* object, Node *node, Box box
  * @param depth current depth
  * @return similar object pointer, NULL if not found
  */
-Object* Octree::getSimilarObject(const Object *object, Node *node, Box box, unsigned int depth)
+Object* Octree::getSimilarObject(const Object *object, unsigned int node, Box box, unsigned int depth)
 {
     Box childBox;
     Object *similar;
 
     for(unsigned char i = 0; i < Node::CHILDREN; i++)
     {
-        Node *child = node->child(i);
+        unsigned int childId = m_nodes[node].child(i);
 
-        if(!child) continue;
+        if(childId == Node::NONE) continue;
 
         if(object->interfereWithBox(Node::getChildBox(i, childBox, box)))
         {
             if(depth < m_maxDepth)
             {
-                similar = getSimilarObject(object, child, childBox, depth+1);
-                if(similar) return similar;
+                similar = getSimilarObject(object, childId, childBox, depth+1);
             }
             else
             {
-                for(std::list<Object*>::const_iterator j = node->objects().begin(); j != node->objects().end(); j++)
-                {
-                    if(*j != object && (*j)->isSimilar(object))
-                    {
-                        return *j;
-                    }
-                }
-
-                for(unsigned int n = 0; n < Node::NEIGHBORS; n++)
-                {
-                    Node *neighbor = child->neighbor(n);
-
-                    if(!neighbor) continue;
-
-                    for(std::list<Object*>::const_iterator j = neighbor->objects().begin(); j != neighbor->objects().end(); j++)
-                    {
-                        if(*j != object && (*j)->isSimilar(object))
-                        {
-                            return *j;
-                        }
-                    }
-                }
+                similar = findSimilar(object, childId);
             }
+
+            if(similar) return similar;
         }
     }
 
@@ -309,7 +1038,7 @@ Object* Octree::getSimilarObject(const Object *object, Node *node, Box box, unsi
  */
 Object* Octree::getSimilarObject(const Object* object)
 {
-    return getSimilarObject(object, m_root, m_rootSize);
+    return getSimilarObject(object, ROOT, m_rootSize);
 }
 
 /**
@@ -319,17 +1048,21 @@ Object* Octree::getSimilarObject(const Object* object)
  */
 unsigned int Octree::insert(Object* object)
 {
+    grow(object->boundingBox());
+
     if(!object->hasId())
     {
         m_objects[m_maxId] = object;
+        m_changes.push_back(m_maxId);
         object->setId(m_maxId++);
     }
     else
     {
         m_objects[object->id()] = object;
+        m_changes.push_back(object->id());
     }
 
-    return insertOnInterfere(object, m_root, m_rootSize);
+    return insertOnInterfere(object, ROOT, m_rootSize);
 }
 
 /**
@@ -340,8 +1073,10 @@ unsigned int Octree::insert(Object* object)
  */
 unsigned int Octree::insertUpdate(Object* object)
 {
+    grow(object->boundingBox());
+
     bool inserted = false;
-    return insertUpdateOnInterfere(object, m_root, m_rootSize, inserted);
+    return insertUpdateOnInterfere(object, ROOT, m_rootSize, inserted);
 }
 
 /**
@@ -353,22 +1088,27 @@ unsigned int Octree::insertUpdate(Object* object)
  */
 unsigned int Octree::insertUpdate2(Object* object)
 {
-    Object *similar = getSimilarObject(object, m_root, m_rootSize);
+    grow(object->boundingBox());
+
+    Object *similar = getSimilarObject(object, ROOT, m_rootSize);
 
     if(similar)
     {
         m_objects[similar->id()] = object;
+        m_changes.push_back(similar->id());
         object->setId(similar->id());
 
+        unlinkObject(similar);
         delete similar;
     }
     else
     {
         m_objects[m_maxId] = object;
+        m_changes.push_back(m_maxId);
         object->setId(m_maxId++);
     }
 
-    return insertOnInterfere(object, m_root, m_rootSize);
+    return insertOnInterfere(object, ROOT, m_rootSize);
 }
 
 /**
@@ -380,89 +1120,113 @@ unsigned int Octree::insertUpdate2(Object* object)
  */
 bool Octree::isPositionFree(float x, float y, float z)
 {
-    Node *node = m_root;
+    unsigned int node = ROOT;
 
-    Box box(m_rootSize);
+    if(x < m_rootSize.x || y < m_rootSize.y || z < m_rootSize.z
+            || x > m_rootSize.x+m_rootSize.w || y > m_rootSize.y+m_rootSize.h || z > m_rootSize.z+m_rootSize.d)
+    {
+        return true;
+    }
 
     for(;;)
     {
+        Box box(m_bounds.get(node));
         unsigned char id = 0;
 
         if(x >= box.x+box.w/2.0f) id += 1;
         if(y >= box.y+box.h/2.0f) id += 2;
         if(z >= box.z+box.d/2.0f) id += 4;
 
-        node = node->child(id);
+        node = m_nodes[node].child(id);
 
-        if(node == NULL)
+        if(node == Node::NONE)
         {
             return true;
         }
 
-        for(std::list<Object*>::const_iterator i = node->objects().begin(); i != node->objects().end(); i++)
+        const std::vector<Object*> &objects(m_nodes[node].m_objects);
+
+        for(std::vector<Object*>::const_iterator i = objects.begin(); i != objects.end(); i++)
         {
             if((*i)->isPointInside(x, y, z))
             {
                 return false;
             }
         }
-
-        Node::getChildBox(id, box, box);
     }
 }
 
 /**
- * Returns nodes and objects in area filtered by filter.
- * @param nodesList output list of nodes
- * @param objectList output set of objects
- * @param filter pointer to a filter class
- */
-void Octree::nodes(std::list<Box> &nodesList, std::set<Object*> &objectList, const Filter *filter)
-{
-    nodes(nodesList, objectList, filter, m_rootSize, m_root);
-}
-
-/**
- * Returns nodes and objects in area filtered by filter.
- * @param nodesList output list of nodes
- * @param objectList output set of objects
+ * Traverses nodes accepted by filter. Children of a node are tested by filter at once.
+ * Objects of the root are always listed, they can reach out of the root box.
+ * Output object list is sorted and doesn't contain duplicates.
+ * @param nodesList output list of nodes, can be NULL
+ * @param objectList output list of objects
  * @param filter pointer to a filter class
- * @param dim recursion node bounding box
- * @param node recursion node
  */
-void Octree::nodes(std::list<Box> &nodesList, std::set<Object*> &objectList, const Filter *filter, Box dim, Node *node)
+void Octree::traverse(std::vector<Box> *nodesList, std::vector<Object*> &objectList, const Filter *filter) const
 {
-    if(!filter->filter(dim)) return;
-
-    for(std::list<Object*>::const_iterator i = node->objects().begin(); i != node->objects().end(); i++)
+    if(!filter->filter(m_bounds.get(ROOT)))
     {
-        objectList.insert(*i);
+        objectList.insert(objectList.end(), m_nodes[ROOT].m_objects.begin(), m_nodes[ROOT].m_objects.end());
+        std::sort(objectList.begin(), objectList.end());
+        objectList.erase(std::unique(objectList.begin(), objectList.end()), objectList.end());
+        return;
     }
 
-    nodesList.push_back(dim);
+    std::vector<unsigned int> stack(1, ROOT);
 
-    for(unsigned int i = 0; i < Node::CHILDREN; i++)
+    while(!stack.empty())
     {
-        Node *child = node->child(i);
+        unsigned int index = stack.back();
+        stack.pop_back();
 
-        if(child)
+        const Node &node = m_nodes[index];
+
+        objectList.insert(objectList.end(), node.m_objects.begin(), node.m_objects.end());
+
+        if(nodesList)
         {
-            Box newDim;
-            Node::getChildBox(i, newDim, dim);
-            nodes(nodesList, objectList, filter, newDim, child);
+            nodesList->push_back(m_bounds.get(index));
+        }
+
+        if(node.m_childMask == 0) continue;
+
+        unsigned int mask = node.m_childMask & filter->filterBlock(m_bounds, node.m_children);
+
+        //Push in reverse order, so children are visited in the same order as by recursion
+        for(unsigned int i = Node::CHILDREN; i-- > 0;)
+        {
+            if(mask & (1 << i))
+            {
+                stack.push_back(node.m_children+i);
+            }
         }
     }
+
+    std::sort(objectList.begin(), objectList.end());
+    objectList.erase(std::unique(objectList.begin(), objectList.end()), objectList.end());
 }
 
 /**
- * Returns objects in area filtered by filter.
+ * Returns nodes and objects in area filtered by filter.
  * @param nodesList output list of nodes
+ * @param objectList output list of objects, each object is listed once
+ * @param filter pointer to a filter class
+ */
+void Octree::nodes(std::vector<Box> &nodesList, std::vector<Object*> &objectList, const Filter *filter) const
+{
+    traverse(&nodesList, objectList, filter);
+}
+
+/**
+ * Returns objects in area filtered by filter.
+ * @param objectList output list of objects, each object is listed once
  * @param filter pointer to a filter class
  */
-void Octree::objects(std::set<Object*> &objectList, const Filter *filter)
+void Octree::objects(std::vector<Object*> &objectList, const Filter *filter) const
 {
-    std::list<Box> nodesList;
-    nodes(nodesList, objectList, filter, m_rootSize, m_root);
+    traverse(NULL, objectList, filter);
 }
 
 const Object* Octree::object(unsigned int id) const
@@ -484,7 +1248,9 @@ bool Octree::removeObject(unsigned int id)
 
     if(i != m_objects.end())
     {
+        unlinkObject(i->second);
         delete i->second;
+        m_changes.push_back(i->first);
         m_objects.erase(i);
 
         return true;
@@ -496,12 +1262,41 @@ bool Octree::removeObject(unsigned int id)
 }
 
 /**
- * Returns root node.
- * @return root node
+ * Returns node with selected index.
+ * @param index node index, Octree::ROOT for root node
+ * @return node
  */
-Node* Octree::root() const
+const Node& Octree::node(unsigned int index) const
 {
-    return m_root;
+    return m_nodes[index];
+}
+
+/**
+ * Returns bounding box of node with selected index.
+ * @param index node index
+ * @return node bounding box
+ */
+Box Octree::nodeBox(unsigned int index) const
+{
+    return m_bounds.get(index);
+}
+
+/**
+ * Returns current root node bounding box.
+ * @return root node bounding box
+ */
+const Box& Octree::rootSize() const
+{
+    return m_rootSize;
+}
+
+/**
+ * Returns current maximum depth, it is increased each time the root grows.
+ * @return maximum octree depth
+ */
+unsigned int Octree::maxDepth() const
+{
+    return m_maxDepth;
 }
 
 /**
@@ -522,6 +1317,19 @@ unsigned int Octree::count() const
     return m_objects.size();
 }
 
+/**
+ * Returns ids of objects inserted, replaced or removed since the last call.
+ * @param ids output sorted ids without duplicates
+ */
+void Octree::takeChanges(std::vector<unsigned int> &ids)
+{
+    ids.swap(m_changes);
+    m_changes.clear();
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
 /**
  * Returns all objects in objtree.
  * @return objects map
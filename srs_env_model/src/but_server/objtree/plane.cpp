@@ -101,13 +101,24 @@ Plane::Plane(const Point &center, const Vector &normal, const Point &scale)
 
 /**
  * Returns true if plane fits into a box.
- * TODO: Not implemented.
+ * Plane bounding box is tested.
  * @param box box for test
  * @return true if plane fits into a box, false otherwise
  */
 bool Plane::fitsIntoBox(const Box &box) const
 {
-    return false;
+    return m_boundingMin.x >= box.x && m_boundingMin.y >= box.y && m_boundingMin.z >= box.z
+            && m_boundingMax.x <= box.x+box.w && m_boundingMax.y <= box.y+box.h && m_boundingMax.z <= box.z+box.d;
+}
+
+/**
+ * Returns axis aligned bounding box of the plane.
+ * @return bounding box
+ */
+Box Plane::boundingBox() const
+{
+    return Box(m_boundingMin.x, m_boundingMin.y, m_boundingMin.z,
+               m_boundingMax.x-m_boundingMin.x, m_boundingMax.y-m_boundingMin.y, m_boundingMax.z-m_boundingMin.z);
 }
 
 /**
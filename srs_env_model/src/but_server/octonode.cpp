@@ -26,13 +26,79 @@
  */
 
 #include <srs_env_model/but_server/octonode.h>
+#include <srs_env_model/but_server/parallel_tools.h>
+
+#include <boost/pool/singleton_pool.hpp>
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+namespace
+{
+	//! Tag of the node pool
+	struct SNodePoolTag {};
+
+	//! Pool of the tree nodes, shared by all trees (nodes are deleted one by one, so no arena is needed)
+	typedef boost::singleton_pool<SNodePoolTag, sizeof(srs_env_model::EModelTreeNode)> tNodePool;
+}
 
 /**
  * Constructor
  */
+#ifdef EMODEL_COMPACT_NODE
+srs_env_model::EModelTreeNode::EModelTreeNode() :
+	EModelTreeNodeBase(), m_r(255), m_g(255), m_b(255), m_stamp(0) {
+	updateTimestamp();
+}
+#else
 srs_env_model::EModelTreeNode::EModelTreeNode() :
-	OcTreeNodeStamped(), m_r(255), m_g(255), m_b(255), m_a(255) {
+	EModelTreeNodeBase(), m_r(255), m_g(255), m_b(255), m_a(255) {
+
+}
+#endif
+
+#ifdef EMODEL_COMPACT_NODE
+/**
+ * Saturate old timestamps of the subtree
+ */
+void srs_env_model::EModelTreeNode::saturateTimestamps(unsigned int now, bool bAll) {
+	if (m_stamp != EMODEL_STAMP_SATURATED && (bAll || getAge(now) > EMODEL_STAMP_MAX_AGE))
+		m_stamp = EMODEL_STAMP_SATURATED;
+
+	if (!hasChildren())
+		return;
+
+	for (unsigned int i = 0; i < 8; ++i)
+		if (childExists(i))
+			getChild(i)->saturateTimestamps(now, bAll);
+}
+#endif
+
+/**
+ * Allocate node from the pool
+ */
+void * srs_env_model::EModelTreeNode::operator new(size_t size) {
+	// derived classes are larger
+	if (size != sizeof(EModelTreeNode))
+		return ::operator new(size);
+
+	void * p = tNodePool::malloc();
+	if (p == 0)
+		throw std::bad_alloc();
+	return p;
+}
 
+/**
+ * Return node to the pool
+ */
+void srs_env_model::EModelTreeNode::operator delete(void * p, size_t size) {
+	if (p == 0)
+		return;
+
+	if (size != sizeof(EModelTreeNode))
+		::operator delete(p);
+	else
+		tNodePool::free(p);
 }
 
 /**
@@ -87,6 +153,32 @@ void srs_env_model::EModelTreeNode::expandNode() {
 	}
 }
 
+void srs_env_model::EModelTreeNode::removeChild(unsigned int i) {
+	assert(childExists(i));
+
+	delete itsChildren[i];
+	itsChildren[i] = NULL;
+
+	// last child removed, node becomes a leaf
+	for (unsigned int k = 0; k < 8; k++) {
+		if (itsChildren[k] != NULL)
+			return;
+	}
+	delete[] itsChildren;
+	itsChildren = NULL;
+}
+
+void srs_env_model::EModelTreeNode::copyData(const EModelTreeNode& node) {
+	setValue(node.getValue());
+	setColor(node.m_r, node.m_g, node.m_b);
+#ifdef EMODEL_COMPACT_NODE
+	m_stamp = node.m_stamp;
+#else
+	m_a = node.m_a;
+	timestamp = node.timestamp;
+#endif
+}
+
 void srs_env_model::EModelTreeNode::setAverageChildColor() {
 	int mr(0), mg(0), mb(0), ma(0);
 	int c(0);
@@ -105,10 +197,6 @@ void srs_env_model::EModelTreeNode::setAverageChildColor() {
 		mb /= c;
 		ma /= c;
 
-		m_r = mr;
-		m_g = mg;
-		m_b = mb;
-		m_a = ma;
 		setColor((unsigned char) mr, (unsigned char) mg, (unsigned char) mb,
 				(unsigned char) ma);
 	} else { // no child had a color other than white
@@ -122,7 +210,8 @@ void srs_env_model::EModelTreeNode::setAverageChildColor() {
  * @param _resolution
  */
 srs_env_model::EMOcTree::EMOcTree(double _resolution) :
-	OccupancyOcTreeBase<srs_env_model::EModelTreeNode> (_resolution) {
+	OccupancyOcTreeBase<srs_env_model::EModelTreeNode> (_resolution),
+	m_bTrackChanges(false), m_bAllChanged(true), m_lastStampSweep((unsigned int) time(NULL)) {
 	itsRoot = new EModelTreeNode();
 	tree_size++;
 }
@@ -133,7 +222,8 @@ srs_env_model::EMOcTree::EMOcTree(double _resolution) :
  *
  */
 srs_env_model::EMOcTree::EMOcTree(std::string _filename) :
-	OccupancyOcTreeBase<srs_env_model::EModelTreeNode> (0.1) { // resolution will be set according to tree file
+	OccupancyOcTreeBase<srs_env_model::EModelTreeNode> (0.1), // resolution will be set according to tree file
+	m_bTrackChanges(false), m_bAllChanged(true), m_lastStampSweep((unsigned int) time(NULL)) {
 	itsRoot = new EModelTreeNode();
 	tree_size++;
 
@@ -224,13 +314,288 @@ void srs_env_model::EMOcTree::updateInnerOccupancyRecurs(EModelTreeNode* node,
 	}
 }
 
+namespace
+{
+	// number of nodes in the subtree (including its root)
+	size_t countSubtreeNodes(const srs_env_model::EModelTreeNode* node) {
+		size_t count(1);
+		for (unsigned int i = 0; i < 8; i++) {
+			if (node->childExists(i))
+				count += countSubtreeNodes(node->getChild(i));
+		}
+		return count;
+	}
+}
+
+bool srs_env_model::EMOcTree::readSubtree(std::istream& s,
+		const octomap::OcTreeKey& key, unsigned int depth, float logOdds,
+		bool hasChildren) {
+	if (depth > tree_depth)
+		return false;
+
+	// create path from the root to the subtree root
+	std::vector<EModelTreeNode*> path;
+	path.reserve(depth + 1);
+
+	EModelTreeNode* node = itsRoot;
+	bool created = false;
+	for (unsigned int d = 0; d < depth; d++) {
+		// existing leaf (pruned by an update) already covers the subtree
+		if (!created && d > 0 && !node->hasChildren())
+			return false;
+
+		path.push_back(node);
+
+		unsigned int level = tree_depth - 1 - d;
+		unsigned int pos = 0;
+		if (key[0] & (1 << level)) pos += 1;
+		if (key[1] & (1 << level)) pos += 2;
+		if (key[2] & (1 << level)) pos += 4;
+
+		if (!node->childExists(pos)) {
+			node->createChild(pos);
+			tree_size++;
+			created = true;
+		}
+		node = node->getChild(pos);
+	}
+
+	// subtree place is already used by the newer data
+	if (!created && (depth > 0 || node->hasChildren()))
+		return false;
+
+	node->setLogOdds(logOdds);
+	if (hasChildren) {
+		readBinaryNode(s, node);
+		tree_size += countSubtreeNodes(node) - 1;
+		updateInnerOccupancyRecurs(node, depth);
+	}
+	size_changed = true;
+
+	// parents occupancy
+	for (std::vector<EModelTreeNode*>::reverse_iterator it = path.rbegin(); it
+			!= path.rend(); ++it)
+		(*it)->updateOccupancyChildren();
+
+	// subtree box changed
+	octomap::OcTreeKey last(key);
+	unsigned short int size = (unsigned short int) ((1 << (tree_depth - depth)) - 1);
+	for (unsigned int i = 0; i < 3; i++)
+		last[i] = key[i] + size;
+	markChanged(key);
+	markChanged(last);
+
+	return true;
+}
+
+srs_env_model::EModelTreeNode* srs_env_model::EMOcTree::getSubtree(
+		const octomap::OcTreeKey& key, unsigned int depth) const {
+	if (depth > tree_depth)
+		return NULL;
+
+	EModelTreeNode* node = itsRoot;
+	for (unsigned int d = 0; d < depth; d++) {
+		unsigned int level = tree_depth - 1 - d;
+		unsigned int pos = 0;
+		if (key[0] & (1 << level)) pos += 1;
+		if (key[1] & (1 << level)) pos += 2;
+		if (key[2] & (1 << level)) pos += 4;
+
+		if (!node->childExists(pos))
+			return NULL;
+		node = node->getChild(pos);
+	}
+
+	return node;
+}
+
+bool srs_env_model::EMOcTree::deleteSubtree(const octomap::OcTreeKey& key,
+		unsigned int depth) {
+	if (depth > tree_depth)
+		return false;
+
+	// path from the root to the subtree root and child indices along it
+	std::vector<EModelTreeNode*> path;
+	std::vector<unsigned int> childIdx;
+	path.reserve(depth + 1);
+	childIdx.reserve(depth);
+
+	EModelTreeNode* node = itsRoot;
+	for (unsigned int d = 0; d < depth; d++) {
+		unsigned int level = tree_depth - 1 - d;
+		unsigned int pos = 0;
+		if (key[0] & (1 << level)) pos += 1;
+		if (key[1] & (1 << level)) pos += 2;
+		if (key[2] & (1 << level)) pos += 4;
+
+		if (!node->childExists(pos))
+			return false;
+
+		path.push_back(node);
+		childIdx.push_back(pos);
+		node = node->getChild(pos);
+	}
+
+	if (depth == 0) {
+		// whole tree, only the root stays
+		for (unsigned int i = 0; i < 8; i++) {
+			if (itsRoot->childExists(i)) {
+				tree_size -= countSubtreeNodes(itsRoot->getChild(i));
+				itsRoot->removeChild(i);
+			}
+		}
+	} else {
+		tree_size -= countSubtreeNodes(node);
+
+		// remove the subtree and parents which would become leafs without data
+		int d = depth - 1;
+		path[d]->removeChild(childIdx[d]);
+		while (d > 0 && !path[d]->hasChildren()) {
+			path[d - 1]->removeChild(childIdx[d - 1]);
+			--tree_size;
+			--d;
+		}
+
+		// remaining parents occupancy
+		for (; d >= 0; --d) {
+			if (path[d]->hasChildren())
+				path[d]->updateOccupancyChildren();
+		}
+	}
+	size_changed = true;
+
+	// subtree box changed
+	octomap::OcTreeKey last(key);
+	unsigned short int size = (unsigned short int) ((1 << (tree_depth - depth)) - 1);
+	for (unsigned int i = 0; i < 3; i++)
+		last[i] = key[i] + size;
+	markChanged(key);
+	markChanged(last);
+
+	return true;
+}
+
+void srs_env_model::EMOcTree::copyParameters(const EMOcTree& src) {
+	setOccupancyThres(src.getOccupancyThres());
+	setProbHit(src.getProbHit());
+	setProbMiss(src.getProbMiss());
+	setClampingThresMin(src.getClampingThresMin());
+	setClampingThresMax(src.getClampingThresMax());
+}
+
+void srs_env_model::EMOcTree::copyTree(const EMOcTree& src) {
+	clear();
+	if (resolution != src.resolution)
+		setResolution(src.resolution);
+	copyParameters(src);
+
+	octomap::OcTreeKey zero(0, 0, 0);
+	copyBoxRecurs(itsRoot, src.itsRoot, zero, 0, zero, zero, true);
+	size_changed = true;
+}
+
+void srs_env_model::EMOcTree::copyBox(const EMOcTree& src,
+		const octomap::point3d& min, const octomap::point3d& max) {
+	// nodes of different size can't be merged
+	if (resolution != src.resolution) {
+		copyTree(src);
+		return;
+	}
+	copyParameters(src);
+
+	// keys of the voxels containing the box corners, clamped to the tree
+	octomap::OcTreeKey kmin, kmax;
+	double keyMax = 2.0 * tree_max_val - 1.0;
+	for (unsigned int i = 0; i < 3; i++) {
+		if (min(i) > max(i))
+			return;
+		double lo = std::floor(min(i) / resolution) + tree_max_val;
+		double hi = std::floor(max(i) / resolution) + tree_max_val;
+		kmin[i] = (unsigned short int) std::max(0.0, std::min(lo, keyMax));
+		kmax[i] = (unsigned short int) std::max(0.0, std::min(hi, keyMax));
+	}
+
+	copyBoxRecurs(itsRoot, src.itsRoot, octomap::OcTreeKey(0, 0, 0), 0, kmin, kmax, false);
+	size_changed = true;
+}
+
+void srs_env_model::EMOcTree::copyBoxRecurs(EModelTreeNode* node,
+		const EModelTreeNode* srcNode, const octomap::OcTreeKey& lower,
+		unsigned int depth, const octomap::OcTreeKey& min,
+		const octomap::OcTreeKey& max, bool inside) {
+	node->copyData(*srcNode);
+	if (depth == tree_depth)
+		return;
+
+	// node was pruned or expanded, children outside the box changed too
+	if (node->hasChildren() != srcNode->hasChildren())
+		inside = true;
+
+	unsigned int half = 1 << (tree_depth - depth - 1);
+	for (unsigned int i = 0; i < 8; i++) {
+		octomap::OcTreeKey childLower(lower);
+		if (i & 1) childLower[0] += half;
+		if (i & 2) childLower[1] += half;
+		if (i & 4) childLower[2] += half;
+
+		// children outside the box are kept
+		bool childInside = inside;
+		if (!inside) {
+			bool outside = false;
+			childInside = true;
+			for (unsigned int k = 0; k < 3; k++) {
+				unsigned int childUpper = childLower[k] + half - 1;
+				if (childUpper < min[k] || childLower[k] > max[k])
+					outside = true;
+				if (childLower[k] < min[k] || childUpper > max[k])
+					childInside = false;
+			}
+			if (outside)
+				continue;
+		}
+
+		if (srcNode->childExists(i)) {
+			if (!node->childExists(i)) {
+				node->createChild(i);
+				tree_size++;
+			}
+			copyBoxRecurs(node->getChild(i), srcNode->getChild(i), childLower,
+					depth + 1, min, max, childInside);
+		} else if (node->childExists(i)) {
+			tree_size -= countSubtreeNodes(node->getChild(i));
+			node->removeChild(i);
+		}
+	}
+}
+
 unsigned int srs_env_model::EMOcTree::getLastUpdateTime() {
+	saturateTimestamps();
+
 	// this value is updated whenever inner nodes are
 	// updated using updateOccupancyChildren()
 	return itsRoot->getTimestamp();
 }
 
+void srs_env_model::EMOcTree::saturateTimestamps() {
+#ifdef EMODEL_COMPACT_NODE
+	unsigned int now = (unsigned int) time(NULL);
+	unsigned int elapsed = now - m_lastStampSweep;
+	if (elapsed < EMODEL_STAMP_SWEEP_PERIOD)
+		return;
+
+	// Not saturated nodes were at most EMODEL_STAMP_MAX_AGE old at the last sweep, so their ages
+	// are still below 255 s. If the tree was not swept for longer, nodes were not updated for at
+	// least elapsed - EMODEL_STAMP_SWEEP_PERIOD seconds and their ages may have wrapped - all are old.
+	if (itsRoot != NULL)
+		itsRoot->saturateTimestamps(now, elapsed > EMODEL_STAMP_MAX_AGE);
+
+	m_lastStampSweep = now;
+#endif
+}
+
 void srs_env_model::EMOcTree::degradeOutdatedNodes(unsigned int time_thres) {
+	saturateTimestamps();
+
 	unsigned int query_time = (unsigned int) time(NULL);
 
 	for (leaf_iterator it = this->begin_leafs(), end = this->end_leafs(); it
@@ -238,8 +603,76 @@ void srs_env_model::EMOcTree::degradeOutdatedNodes(unsigned int time_thres) {
 		if (this->isNodeOccupied(*it) && ((query_time - it->getTimestamp())
 				> time_thres)) {
 			integrateMissNoTime(&*it);
+			markChanged(it.getKey());
+		}
+	}
+}
+
+void srs_env_model::EMOcTree::markUpdated(const octomap::OcTreeKey& key) {
+	if (isAllChanged())
+		return;
+
+	// find depth of the leaf containing the key
+	EModelTreeNode* node = itsRoot;
+	unsigned int depth = 0;
+	for (; depth < tree_depth; depth++) {
+		// pruned leaf, updateNode() expands it to all eight children
+		if (depth > 0 && !node->hasChildren())
+			break;
+
+		unsigned int level = tree_depth - 1 - depth;
+		unsigned int pos = 0;
+		if (key[0] & (1 << level)) pos += 1;
+		if (key[1] & (1 << level)) pos += 2;
+		if (key[2] & (1 << level)) pos += 4;
+
+		// new nodes are created, nothing is expanded
+		if (!node->childExists(pos)) {
+			depth = tree_depth;
+			break;
 		}
+		node = node->getChild(pos);
+	}
+
+	if (depth == tree_depth) {
+		markChanged(key);
+		return;
 	}
+
+	// children of the expanded leaf replace it in the whole leaf box
+	unsigned short int mask = (unsigned short int) ((1 << (tree_depth - depth)) - 1);
+	octomap::OcTreeKey first(key), last(key);
+	for (unsigned int i = 0; i < 3; i++) {
+		first[i] = key[i] & ~mask;
+		last[i] = first[i] | mask;
+	}
+	markChanged(first);
+	markChanged(last);
+}
+
+bool srs_env_model::EMOcTree::getChangedBBX(octomap::point3d& min,
+		octomap::point3d& max) const {
+	if (isAllChanged()) {
+		double x, y, z;
+		getMetricMin(x, y, z);
+		min = octomap::point3d(x, y, z);
+		getMetricMax(x, y, z);
+		max = octomap::point3d(x, y, z);
+		return true;
+	}
+
+	if (m_changedKeys.empty())
+		return false;
+
+	// key coordinates are voxel centers
+	genCoords(m_changedMin, tree_depth, min);
+	genCoords(m_changedMax, tree_depth, max);
+
+	float half(0.5 * resolution);
+	min -= octomap::point3d(half, half, half);
+	max += octomap::point3d(half, half, half);
+
+	return true;
 }
 
 void srs_env_model::EMOcTree::updateNodeLogOdds(EModelTreeNode* node,
@@ -255,6 +688,7 @@ void srs_env_model::EMOcTree::integrateMissNoTime(EModelTreeNode* node) const {
 void srs_env_model::EMOcTree::insertColoredScan(const typePointCloud& coloredScan,
 		const octomap::point3d& sensor_origin, double maxrange, bool pruning,
 		bool lazy_eval) {
+	saturateTimestamps();
 
 	// convert colored scan to octomap pcl
 	octomap::Pointcloud scan;
@@ -266,13 +700,18 @@ void srs_env_model::EMOcTree::insertColoredScan(const typePointCloud& coloredSca
 
 	// insert data into tree  -----------------------
 	for (octomap::KeySet::iterator it = free_cells.begin(); it != free_cells.end(); ++it) {
+		markUpdated(*it);
 		updateNode(*it, false, lazy_eval);
 	}
 	for (octomap::KeySet::iterator it = occupied_cells.begin(); it
 			!= occupied_cells.end(); ++it) {
+		markUpdated(*it);
 		updateNode(*it, true, lazy_eval);
 	}
 
+	// remember occupied cells of this scan
+	m_lastOccupiedKeys.swap(occupied_cells);
+
 	// TODO: does pruning make sense if we used "lazy_eval"?
 	if (pruning)
 		this->prune();
@@ -285,3 +724,165 @@ void srs_env_model::EMOcTree::insertColoredScan(const typePointCloud& coloredSca
 	}
 
 }
+
+namespace
+{
+	/**
+	 * Ray tracing worker - each thread traces its own continuous block of scan points.
+	 */
+	struct SRayTraceWorker
+	{
+		const srs_env_model::EMOcTree * tree;
+		const octomap::Pointcloud * scan;
+		octomap::point3d origin;
+		double maxrange;
+		std::vector<octomap::KeySet> * free_cells;
+		std::vector<octomap::KeySet> * occupied_cells;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(scan->size(), thread, numThreads, begin, end);
+			tree->computeUpdatePart(*scan, origin, begin, end, maxrange,
+					(*free_cells)[thread], (*occupied_cells)[thread]);
+		}
+	};
+
+	/**
+	 * Key merging worker - thread i collects keys with hash % numThreads == i
+	 * from all per-thread sets, so the output sets are disjoint.
+	 */
+	struct SKeyMergeWorker
+	{
+		const std::vector<octomap::KeySet> * traced_free;
+		const std::vector<octomap::KeySet> * traced_occupied;
+		std::vector<octomap::KeySet> * free_cells;
+		std::vector<octomap::KeySet> * occupied_cells;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			octomap::OcTreeKey::KeyHash hash;
+			octomap::KeySet & occupied((*occupied_cells)[thread]);
+			octomap::KeySet & free((*free_cells)[thread]);
+
+			for (size_t i = 0; i < traced_occupied->size(); ++i) {
+				const octomap::KeySet & keys((*traced_occupied)[i]);
+				for (octomap::KeySet::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+					if (hash(*it) % numThreads == thread)
+						occupied.insert(*it);
+				}
+			}
+
+			// prefer occupied cells over free ones
+			for (size_t i = 0; i < traced_free->size(); ++i) {
+				const octomap::KeySet & keys((*traced_free)[i]);
+				for (octomap::KeySet::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+					if (hash(*it) % numThreads == thread && occupied.find(*it) == occupied.end())
+						free.insert(*it);
+				}
+			}
+		}
+	};
+}
+
+void srs_env_model::EMOcTree::insertColoredScanParallel(const typePointCloud& coloredScan,
+		const octomap::point3d& sensor_origin, unsigned numThreads,
+		double maxrange, bool pruning, bool lazy_eval) {
+	saturateTimestamps();
+
+	// convert colored scan to octomap pcl
+	octomap::Pointcloud scan;
+	octomap::pointcloudPCLToOctomap(coloredScan, scan);
+
+	// not worth spawning threads for a few points
+	numThreads = std::max(1u, std::min<unsigned>(numThreads, scan.size()));
+
+	// trace rays, each thread into its own key sets
+	std::vector<octomap::KeySet> traced_free(numThreads), traced_occupied(numThreads);
+
+	SRayTraceWorker tracer;
+	tracer.tree = this;
+	tracer.scan = &scan;
+	tracer.origin = sensor_origin;
+	tracer.maxrange = maxrange;
+	tracer.free_cells = &traced_free;
+	tracer.occupied_cells = &traced_occupied;
+	runParallel(numThreads, tracer);
+
+	// merge per-thread sets into disjoint duplicate-free sets
+	std::vector<octomap::KeySet> free_cells(numThreads), occupied_cells(numThreads);
+
+	SKeyMergeWorker merger;
+	merger.traced_free = &traced_free;
+	merger.traced_occupied = &traced_occupied;
+	merger.free_cells = &free_cells;
+	merger.occupied_cells = &occupied_cells;
+	runParallel(numThreads, merger);
+
+	// tree modification itself is not thread safe
+	applyColoredUpdate(coloredScan, free_cells, occupied_cells, pruning, lazy_eval);
+}
+
+void srs_env_model::EMOcTree::computeUpdatePart(const octomap::Pointcloud& scan,
+		const octomap::point3d& origin, size_t begin, size_t end,
+		double maxrange, octomap::KeySet& free_cells,
+		octomap::KeySet& occupied_cells) const {
+
+	// own ray buffer, the tree one is shared
+	octomap::KeyRay keyray;
+
+	octomap::Pointcloud::const_iterator it_end = scan.begin() + end;
+	for (octomap::Pointcloud::const_iterator it = scan.begin() + begin; it != it_end; ++it) {
+		const octomap::point3d& p = *it;
+
+		if ((maxrange < 0.0) || ((p - origin).norm() <= maxrange)) {
+			// free cells
+			if (computeRayKeys(origin, p, keyray)) {
+				free_cells.insert(keyray.begin(), keyray.end());
+			}
+			// occupied endpoint
+			octomap::OcTreeKey key;
+			if (genKey(p, key)) {
+				occupied_cells.insert(key);
+			}
+		} else {
+			// user set a maxrange and length is above
+			octomap::point3d new_end = origin + (p - origin).normalized() * maxrange;
+			if (computeRayKeys(origin, new_end, keyray)) {
+				free_cells.insert(keyray.begin(), keyray.end());
+			}
+		}
+	}
+}
+
+void srs_env_model::EMOcTree::applyColoredUpdate(const typePointCloud& coloredScan,
+		const std::vector<octomap::KeySet>& free_cells,
+		const std::vector<octomap::KeySet>& occupied_cells,
+		bool pruning, bool lazy_eval) {
+
+	// insert data into tree  -----------------------
+	for (size_t i = 0; i < free_cells.size(); ++i) {
+		for (octomap::KeySet::const_iterator it = free_cells[i].begin(); it != free_cells[i].end(); ++it) {
+			markUpdated(*it);
+			updateNode(*it, false, lazy_eval);
+		}
+	}
+	m_lastOccupiedKeys.clear();
+	for (size_t i = 0; i < occupied_cells.size(); ++i) {
+		for (octomap::KeySet::const_iterator it = occupied_cells[i].begin(); it
+				!= occupied_cells[i].end(); ++it) {
+			markUpdated(*it);
+			updateNode(*it, true, lazy_eval);
+		}
+		m_lastOccupiedKeys.insert(occupied_cells[i].begin(), occupied_cells[i].end());
+	}
+
+	if (pruning)
+		this->prune();
+
+	// update node colors
+	BOOST_FOREACH (const pcl::PointXYZRGB& pt, coloredScan.points)
+	{
+		averageNodeColor(pt.x, pt.y, pt.z, (unsigned char)pt.r, (unsigned char)pt.g, (unsigned char)pt.b, (unsigned char)255);
+	}
+}
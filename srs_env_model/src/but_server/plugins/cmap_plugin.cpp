@@ -30,6 +30,82 @@
 
 #include <pcl_ros/transforms.h>
 
+#include <algorithm>
+#include <cmath>
+
+#include <boost/cstdint.hpp>
+
+namespace
+{
+	/// Order of the voxels for merging - rows along x, then y, then z
+	struct SCellOrder
+	{
+		bool operator()( const octomap::OcTreeKey & a, const octomap::OcTreeKey & b ) const
+		{
+			if( a[2] != b[2] )
+				return a[2] < b[2];
+			if( a[1] != b[1] )
+				return a[1] < b[1];
+			return a[0] < b[0];
+		}
+	};
+
+	/// Are all cells of the rectangle [x, x + nx) x [y, y + ny) in the given z layer in the set?
+	bool hasCells( const octomap::KeySet & cells, unsigned x, unsigned y, unsigned z, unsigned nx, unsigned ny )
+	{
+		for( unsigned j = 0; j < ny; ++j )
+			for( unsigned i = 0; i < nx; ++i )
+				if( cells.find( octomap::OcTreeKey( x + i, y + j, z ) ) == cells.end() )
+					return false;
+
+		return true;
+	}
+
+	/// Round coordinate to the 0.1mm
+	long int quantize( double value )
+	{
+		return (long int)std::floor( value * 10000.0 + 0.5 );
+	}
+
+	/// Mix 64-bit value (splitmix64 finalizer, a bijection with good avalanche)
+	boost::uint64_t mix64( boost::uint64_t x )
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	/// Add 64-bit value to the hash
+	void hashCombine( boost::uint64_t & seed, boost::uint64_t value )
+	{
+		seed = mix64( seed ^ ( value * 0x9e3779b97f4a7c15ULL ) );
+	}
+
+	/// Add coordinate rounded to the 0.1mm to the hash
+	void hashValue( boost::uint64_t & seed, double value )
+	{
+		hashCombine( seed, boost::uint64_t( quantize( value ) ) );
+	}
+
+	/// Are boxes same with the hash precision?
+	bool isSameBox( const arm_navigation_msgs::OrientedBoundingBox & a, const arm_navigation_msgs::OrientedBoundingBox & b )
+	{
+		return quantize( a.center.x ) == quantize( b.center.x ) &&
+			   quantize( a.center.y ) == quantize( b.center.y ) &&
+			   quantize( a.center.z ) == quantize( b.center.z ) &&
+			   quantize( a.extents.x ) == quantize( b.extents.x ) &&
+			   quantize( a.extents.y ) == quantize( b.extents.y ) &&
+			   quantize( a.extents.z ) == quantize( b.extents.z ) &&
+			   quantize( a.axis.x ) == quantize( b.axis.x ) &&
+			   quantize( a.axis.y ) == quantize( b.axis.y ) &&
+			   quantize( a.axis.z ) == quantize( b.axis.z ) &&
+			   quantize( a.angle ) == quantize( b.angle );
+	}
+}
+
 srs_env_model::CCMapPlugin::CCMapPlugin(const std::string & name)
 : srs_env_model::CServerPluginBase(name)
 , m_cmapPublisherName(COLLISION_MAP_PUBLISHER_NAME)
@@ -39,7 +115,11 @@ srs_env_model::CCMapPlugin::CCMapPlugin(const std::string & name)
 , m_publishCollisionMap( true )
 , m_latchedTopics(false)
 , m_bConvertPoint( false )
+, m_boxAxis( 0.0, 0.0, 1.0 )
+, m_boxAngle( 0.0 )
 , m_mapTime(0)
+, m_dataHash(0)
+, m_historySize(10)
 {
 	// Create collision map and the buffer
 	m_data = new arm_navigation_msgs::CollisionMap();
@@ -52,6 +132,7 @@ void srs_env_model::CCMapPlugin::init(ros::NodeHandle & node_handle)
 	m_collisionMapVersion = 0;
 	m_dataBuffer->boxes.clear();
 	m_data->boxes.clear();
+	m_dataHash = hashCMap( *m_data );
 
 	// Read parameters
 
@@ -64,6 +145,13 @@ void srs_env_model::CCMapPlugin::init(ros::NodeHandle & node_handle)
 	// Get FID to which will be points transformed when publishing collision map
 	node_handle.param("collisionmap_frame_id", m_cmapFrameId, COLLISION_MAP_FRAME_ID ); //
 
+	// Number of map versions the delta service can compute the changes from
+	node_handle.param("collision_map_history", m_historySize, m_historySize );
+
+	// Empty map is the first version
+	m_history.clear();
+	pushVersion();
+
 	// Connect publisher
 	m_cmapPublisher = node_handle.advertise<arm_navigation_msgs::CollisionMap> (	m_cmapPublisherName, 100, m_latchedTopics);
 
@@ -72,6 +160,9 @@ void srs_env_model::CCMapPlugin::init(ros::NodeHandle & node_handle)
 
 	// Create and publish service - is new collision map
 	m_serviceIsNewCMap = node_handle.advertiseService( IsNewCMap_SRV, &CCMapPlugin::isNewCmapSrvCallback, this );
+
+	// Create and publish service - get collision map delta
+	m_serviceGetCollisionMapDelta = node_handle.advertiseService( GetCollisionMapDelta_SRV, &CCMapPlugin::getCollisionMapDeltaSrvCallback, this );
 }
 
 //! Called when new scan was inserted and now all can be published
@@ -81,12 +172,20 @@ void srs_env_model::CCMapPlugin::onPublish(const ros::Time & timestamp)
 	bool publishCollisionMap = m_publishCollisionMap && (m_latchedTopics || m_cmapPublisher.getNumSubscribers() > 0);
 
 	// Test collision maps and swap them, if needed
-	if( ! sameCMaps( m_data, m_dataBuffer ) )
+	// 64-bit hash of the quantized boxes, a collision hiding a change is practically impossible
+	tHash hash( hashCMap( *m_dataBuffer ) );
+	if( hash != m_dataHash )
 	{
 		// CMaps differs, increase version index and swap them
-		++m_collisionMapVersion;
-		m_mapTime = timestamp;
-		swap( m_data, m_dataBuffer );
+		{
+			// Services can read data from other thread
+			boost::unique_lock<boost::shared_mutex> lock( m_lockData );
+			++m_collisionMapVersion;
+			m_mapTime = timestamp;
+			m_dataHash = hash;
+			swap( m_data, m_dataBuffer );
+			pushVersion();
+		}
 
 		// Call invalidation
 		invalidate();
@@ -141,6 +240,11 @@ void srs_env_model::CCMapPlugin::onFrameStart( const SMapParameters & par )
 
 	m_bConvertPoint = m_cmapFrameId != par.frameId;
 
+	// Merged boxes are not cubes, so their orientation matters
+	Eigen::AngleAxisf rotation( m_worldToCMapRot );
+	m_boxAngle = m_bConvertPoint ? rotation.angle() : 0.0;
+	m_boxAxis = m_bConvertPoint ? rotation.axis() : Eigen::Vector3f( 0.0, 0.0, 1.0 );
+
 	// Compute robot position in the collision map coordinate system
 	geometry_msgs::TransformStamped msg;
 	tf::transformStampedTFToMsg(baseToOmapTf, msg);
@@ -150,85 +254,178 @@ void srs_env_model::CCMapPlugin::onFrameStart( const SMapParameters & par )
 
 }
 
-/// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-void srs_env_model::CCMapPlugin::handleOccupiedNode(srs_env_model::tButServerOcTree::iterator& it, const SMapParameters & mp)
+/// Called when crawling is finished
+void srs_env_model::CCMapPlugin::handlePostNodeTraversal(const SMapParameters & mp)
 {
 	// Should we publish something?
-	if (! m_publishCollisionMap)
+	if( ! m_publishCollisionMap || mp.map == 0 )
 		return;
 
-	// Is this point near enough to the robot?
-	if( ! isNearRobot( btVector3( it.getX(), it.getY(), it.getZ() ), it.getSize() ) )
-		return;
+	const tButServerOcTree & tree( mp.map->octree );
+
+	// Visit only the box around the robot instead of the whole map
+	octomap::point3d center( m_robotBasePosition.x(), m_robotBasePosition.y(), m_robotBasePosition.z() );
+	octomap::point3d extent( m_collisionMapLimitRadius, m_collisionMapLimitRadius, m_collisionMapLimitRadius );
 
-	Eigen::Vector3f point( it.getX(), it.getY(), it.getZ() );
+	// Occupied voxels sorted by their size (root leaf is never occupied)
+	std::vector< octomap::KeySet > cells( mp.treeDepth );
 
-	if( m_bConvertPoint )
+	for( tButServerOcTree::leaf_bbx_iterator it = tree.begin_leafs_bbx( center - extent, center + extent ), end = tree.end_leafs_bbx();
+		 it != end; ++it )
 	{
-	    // Transform point from the world to the CMap TF
-	    point = m_worldToCMapRot * point + m_worldToCMapTrans;
-	}
+		if( ! tree.isNodeOccupied( *it ) )
+			continue;
 
-	// Add point to the collision map
-	arm_navigation_msgs::OrientedBoundingBox box;
-	double size = it.getSize();
-	box.extents.x = box.extents.y = box.extents.z = size;
-	box.axis.x = box.axis.y = 0.0;
-	box.axis.z = 1.0;
-	box.angle = 0.0;
-	box.center.x = point[0];
-	box.center.y = point[1];
-	box.center.z = point[2];
+		// Is this point near enough to the robot?
+		if( ! isNearRobot( btVector3( it.getX(), it.getY(), it.getZ() ), it.getSize() ) )
+			continue;
 
+		// Voxel grid coordinates on its level
+		unsigned level( mp.treeDepth - it.getDepth() );
+		if( level >= cells.size() )
+			continue;
+
+		octomap::OcTreeKey key( it.getKey() );
+		for( unsigned i = 0; i < 3; ++i )
+			key[i] >>= level;
+
+		cells[level].insert( key );
+	}
 
-	m_dataBuffer->boxes.push_back(box);
+	for( unsigned level = 0; level < cells.size(); ++level )
+		addMergedBoxes( cells[level], level, mp );
 }
 
 /**
- * @brief Compare two collision maps
+ * @brief Merge voxels by the greedy meshing
  *
- * @param map1 First map to compare
- * @param map2 Second map to compare
- * @return true if maps are the same
+ * Voxels are taken in the row order, each one is grown to the longest run along x,
+ * then the run is grown along y and the rectangle along z while all covered voxels exist.
  */
-bool srs_env_model::CCMapPlugin::sameCMaps( arm_navigation_msgs::CollisionMap * map1, arm_navigation_msgs::CollisionMap * map2 )
+void srs_env_model::CCMapPlugin::addMergedBoxes( octomap::KeySet & cells, unsigned level, const SMapParameters & mp )
 {
-	// Wrong input
-	if( map1 == 0 || map2 == 0 )
-	{
-//		std::cerr << "Some null. map1: " << map1 << ", map2: " << map2 << std::endl;
-		return false;
-	}
+	if( cells.empty() )
+		return;
 
-	// Two maps cannot be the same, if differs in the size
-	if( map1->boxes.size() != map2->boxes.size() )
-	{
-//		std::cerr << "Maps size different. map1: " << map1->boxes.size() << ", map2: " << map2->boxes.size() << std::endl;
-		return false;
-	}
+	std::vector< octomap::OcTreeKey > order( cells.begin(), cells.end() );
+	std::sort( order.begin(), order.end(), SCellOrder() );
 
-	// Compare maps box by box
-	arm_navigation_msgs::CollisionMap::_boxes_type::iterator icm1, icm2;
-	arm_navigation_msgs::CollisionMap::_boxes_type::iterator end1( map1->boxes.end());
+	double size( mp.resolution * double( 1 << level ) );
+	double offset( double( 1 << (mp.treeDepth - 1 - level) ) );
 
-	long num( 0 );
-	for( icm1 = map1->boxes.begin(), icm2 = map2->boxes.begin(); icm1 != end1; ++icm1, ++icm2 )
+	for( std::vector< octomap::OcTreeKey >::iterator it = order.begin(); it != order.end(); ++it )
 	{
-		if( isGreat( icm1->center.x - icm2->center.x ) ||
-				isGreat( icm1->center.y - icm2->center.y ) ||
-				isGreat( icm1->center.z - icm2->center.z ) ||
-				isGreat( icm1->extents.x - icm2->extents.x ) )
+		// Already merged to some box
+		if( cells.find( *it ) == cells.end() )
+			continue;
+
+		unsigned x( (*it)[0] ), y( (*it)[1] ), z( (*it)[2] );
+		unsigned nx( 1 ), ny( 1 ), nz( 1 );
+
+		while( hasCells( cells, x + nx, y, z, 1, 1 ) )
+			++nx;
+
+		while( hasCells( cells, x, y + ny, z, nx, 1 ) )
+			++ny;
+
+		while( hasCells( cells, x, y, z + nz, nx, ny ) )
+			++nz;
+
+		// Remove merged cells
+		for( unsigned k = 0; k < nz; ++k )
+			for( unsigned j = 0; j < ny; ++j )
+				for( unsigned i = 0; i < nx; ++i )
+					cells.erase( octomap::OcTreeKey( x + i, y + j, z + k ) );
+
+		Eigen::Vector3f point( ( x - offset + 0.5 * nx ) * size, ( y - offset + 0.5 * ny ) * size, ( z - offset + 0.5 * nz ) * size );
+
+		if( m_bConvertPoint )
 		{
-//			std::cerr << "Point number " << num << " different." << std::endl;
-			return false;
+		    // Transform point from the world to the CMap TF
+		    point = m_worldToCMapRot * point + m_worldToCMapTrans;
 		}
-		++num;
+
+		// Add box to the collision map
+		arm_navigation_msgs::OrientedBoundingBox box;
+		box.extents.x = nx * size;
+		box.extents.y = ny * size;
+		box.extents.z = nz * size;
+		box.axis.x = m_boxAxis[0];
+		box.axis.y = m_boxAxis[1];
+		box.axis.z = m_boxAxis[2];
+		box.angle = m_boxAngle;
+		box.center.x = point[0];
+		box.center.y = point[1];
+		box.center.z = point[2];
+
+		m_dataBuffer->boxes.push_back(box);
 	}
 
-	return true;
+	cells.clear();
 }
 
+/**
+ * @brief Compute collision map hash
+ *
+ * @param map Collision map
+ * @return Hash combined from the hashes of all boxes in the map order
+ */
+srs_env_model::CCMapPlugin::tHash srs_env_model::CCMapPlugin::hashCMap( const arm_navigation_msgs::CollisionMap & map )
+{
+	boost::uint64_t seed( 0 );
+	hashCombine( seed, map.boxes.size() );
 
+	arm_navigation_msgs::CollisionMap::_boxes_type::const_iterator it, end( map.boxes.end() );
+	for( it = map.boxes.begin(); it != end; ++it )
+		hashCombine( seed, hashBox( *it ) );
+
+	return seed;
+}
+
+/**
+ * @brief Compute box hash
+ *
+ * @param box Box
+ * @return Hash of the box position, size and orientation
+ */
+srs_env_model::CCMapPlugin::tHash srs_env_model::CCMapPlugin::hashBox( const arm_navigation_msgs::OrientedBoundingBox & box )
+{
+	boost::uint64_t seed( 0 );
+
+	hashValue( seed, box.center.x );
+	hashValue( seed, box.center.y );
+	hashValue( seed, box.center.z );
+	hashValue( seed, box.extents.x );
+	hashValue( seed, box.extents.y );
+	hashValue( seed, box.extents.z );
+	hashValue( seed, box.axis.x );
+	hashValue( seed, box.axis.y );
+	hashValue( seed, box.axis.z );
+	hashValue( seed, box.angle );
+
+	return seed;
+}
+
+/**
+ * @brief Store current map to the history
+ */
+void srs_env_model::CCMapPlugin::pushVersion()
+{
+	m_history.push_back( SMapVersion() );
+
+	SMapVersion & version( m_history.back() );
+	version.version = m_collisionMapVersion;
+	version.boxes = m_data->boxes;
+
+	version.keys.reserve( version.boxes.size() );
+	for( std::size_t i = 0; i < version.boxes.size(); ++i )
+		version.keys.push_back( tBoxKey( hashBox( version.boxes[i] ), i ) );
+
+	std::sort( version.keys.begin(), version.keys.end() );
+
+	while( m_history.size() > (std::size_t)std::max( m_historySize, 1 ) )
+		m_history.pop_front();
+}
 
 /**
  * @brief Test collision object if it is in the collision distance from the robot
@@ -255,6 +452,8 @@ bool srs_env_model::CCMapPlugin::getCollisionMapSrvCallback( srs_env_model::GetC
 
 	PERROR( "Get collision map service called" );
 
+	boost::shared_lock<boost::shared_mutex> lock( m_lockData );
+
 	// Response map version should be current version number
 	res.current_version = m_collisionMapVersion;
 
@@ -287,9 +486,75 @@ bool srs_env_model::CCMapPlugin::isNewCmapSrvCallback( srs_env_model::IsNewColli
 {
 	PERROR( "Is new cmap service called ");
 
+	boost::shared_lock<boost::shared_mutex> lock( m_lockData );
+
 	res.is_newer = req.my_time < m_mapTime;
 	res.current_time = m_mapTime;
 
 	return true;
 }
 
+/**
+ * @brief Get collision map delta service call
+ *
+ * @param req request - caller's map version
+ * @param res response - boxes added and removed since the caller's version (whole map if the version is too old)
+ */
+bool srs_env_model::CCMapPlugin::getCollisionMapDeltaSrvCallback( srs_env_model::GetCollisionMapDelta::Request & req, srs_env_model::GetCollisionMapDelta::Response & res )
+{
+	boost::shared_lock<boost::shared_mutex> lock( m_lockData );
+
+	res.current_version = m_collisionMapVersion;
+	res.header.frame_id = m_cmapFrameId;
+	res.header.stamp = m_mapTime;
+	res.full_map = false;
+
+	// Caller has current map
+	if( req.my_version == m_collisionMapVersion )
+		return true;
+
+	// Find callers version
+	std::deque< SMapVersion >::const_iterator old( m_history.begin() );
+	while( old != m_history.end() && old->version != req.my_version )
+		++old;
+
+	if( old == m_history.end() || m_history.empty() )
+	{
+		// Too old version - send whole map
+		res.full_map = true;
+		res.added = m_data->boxes;
+		return true;
+	}
+
+	// Compare sorted box hashes of both versions
+	const SMapVersion & current( m_history.back() );
+	std::vector< tBoxKey >::const_iterator io( old->keys.begin() ), ic( current.keys.begin() );
+
+	while( io != old->keys.end() || ic != current.keys.end() )
+	{
+		if( ic == current.keys.end() || ( io != old->keys.end() && io->first < ic->first ) )
+		{
+			res.removed.push_back( old->boxes[io->second] );
+			++io;
+		}
+		else if( io == old->keys.end() || ic->first < io->first )
+		{
+			res.added.push_back( current.boxes[ic->second] );
+			++ic;
+		}
+		else
+		{
+			// Same box in both versions, unless hashes collide
+			if( !isSameBox( old->boxes[io->second], current.boxes[ic->second] ) )
+			{
+				res.removed.push_back( old->boxes[io->second] );
+				res.added.push_back( current.boxes[ic->second] );
+			}
+
+			++io;
+			++ic;
+		}
+	}
+
+	return true;
+}
@@ -88,6 +88,33 @@ void srs_env_model::CCollisionObjectPlugin::onFrameStart(const SMapParameters &
 
 	m_bConvert = m_ocFrameId != m_coFrameId;
 
+	if( !par.bDeltaCrawl )
+	{
+		m_data->shapes.clear();
+		m_data->poses.clear();
+	}
+	else
+	{
+		// Remove boxes which will be crawled again (frames are the same here)
+		size_t n( 0 );
+		for( size_t i = 0; i < m_data->poses.size(); ++i )
+		{
+			const geometry_msgs::Point & position( m_data->poses[i].position );
+			if( par.isInCrawledBox( position.x, position.y, position.z, m_data->shapes[i].dimensions[0] ) )
+				continue;
+
+			m_data->poses[n] = m_data->poses[i];
+			m_data->shapes[n] = m_data->shapes[i];
+			++n;
+		}
+		m_data->poses.resize( n );
+		m_data->shapes.resize( n );
+	}
+
+	// Partition buffers are used by the parallel crawl only
+	m_partShapes.resize( par.numPartitions > 1 ? par.numPartitions : 0 );
+	m_partPoses.resize( m_partShapes.size() );
+
 	/// We need no transformation - frames are the same...
 	if( ! m_bConvert )
 	    return;
@@ -120,7 +147,7 @@ void srs_env_model::CCollisionObjectPlugin::onFrameStart(const SMapParameters &
 
 
 
-void srs_env_model::CCollisionObjectPlugin::handleOccupiedNode(srs_env_model::tButServerOcTree::iterator & it, const SMapParameters & mp)
+void srs_env_model::CCollisionObjectPlugin::handleOccupiedNode(srs_env_model::tButServerOcIterator & it, const SMapParameters & mp)
 {
 	// Transform input point
 	Eigen::Vector3f point( it.getX(), it.getY(), it.getZ() );
@@ -134,7 +161,6 @@ void srs_env_model::CCollisionObjectPlugin::handleOccupiedNode(srs_env_model::tB
 	shape.type = arm_navigation_msgs::Shape::BOX;
 	shape.dimensions.resize(3);
 	shape.dimensions[0] = shape.dimensions[1] = shape.dimensions[2] = it.getSize();
-	m_data->shapes.push_back(shape);
 
 	// Add pose
 	geometry_msgs::Pose pose;
@@ -142,6 +168,16 @@ void srs_env_model::CCollisionObjectPlugin::handleOccupiedNode(srs_env_model::tB
 	pose.position.x = point.x();
 	pose.position.y = point.y();
 	pose.position.z = point.z();
+
+	if( mp.numPartitions > 1 )
+	{
+		// Parallel crawl - buffers are merged in handlePostNodeTraversal
+		m_partShapes[mp.partition].push_back(shape);
+		m_partPoses[mp.partition].push_back(pose);
+		return;
+	}
+
+	m_data->shapes.push_back(shape);
 	m_data->poses.push_back(pose);
 }
 
@@ -149,5 +185,14 @@ void srs_env_model::CCollisionObjectPlugin::handleOccupiedNode(srs_env_model::tB
 
 void srs_env_model::CCollisionObjectPlugin::handlePostNodeTraversal(const SMapParameters & mp)
 {
+	// Merge partitions of the parallel crawl in partition order
+	for( size_t i = 0; i < m_partShapes.size(); ++i )
+	{
+		m_data->shapes.insert( m_data->shapes.end(), m_partShapes[i].begin(), m_partShapes[i].end() );
+		m_data->poses.insert( m_data->poses.end(), m_partPoses[i].begin(), m_partPoses[i].end() );
+		m_partShapes[i].clear();
+		m_partPoses[i].clear();
+	}
+
 	invalidate();
 }
@@ -31,12 +31,28 @@
 #include <pcl_ros/transforms.h>
 #include <Eigen/src/Geometry/Quaternion.h>
 
+#include <algorithm>
+#include <cmath>
+
 /**
  * Constructor
  */
 srs_env_model::CLimitedPointCloudPlugin::CLimitedPointCloudPlugin( const std::string & name )
 : srs_env_model::CPointCloudPlugin( name, false )
 , m_bTransformCamera( false )
+, m_normal( 0.0, 0.0, 1.0 )
+, m_normalBuf( 0.0, 0.0, 1.0 )
+, m_d( 0.0 )
+, m_dBuf( 0.0 )
+, m_position( 0.0, 0.0, 0.0 )
+, m_positionBuf( 0.0, 0.0, 0.0 )
+, m_up( 0.0, 1.0, 0.0 )
+, m_upBuf( 0.0, 1.0, 0.0 )
+, m_fov( M_PI / 2.0 )
+, m_aspect( 4.0 / 3.0 )
+, m_maxDistance( 0.0 )
+, m_lodAngle( 0.0 )
+, m_maxPoints( 0 )
 , m_bSpinThread( true )
 {
 
@@ -90,6 +106,15 @@ void srs_env_model::CLimitedPointCloudPlugin::init(ros::NodeHandle & node_handle
     // Point cloud publishing topic name
     node_handle.param("pointcloud_centers_publisher", m_pcPublisherName, VISIBLE_POINTCLOUD_CENTERS_PUBLISHER_NAME );
 
+    // View frustum
+    node_handle.param("visible_pointcloud/fov", m_fov, m_fov );
+    node_handle.param("visible_pointcloud/aspect", m_aspect, m_aspect );
+    node_handle.param("visible_pointcloud/max_distance", m_maxDistance, m_maxDistance );
+
+    // Level of detail and points budget
+    node_handle.param("visible_pointcloud/lod_angle", m_lodAngle, m_lodAngle );
+    node_handle.param("visible_pointcloud/max_points", m_maxPoints, m_maxPoints );
+
     // Create publisher
     m_pcPublisher = node_handle.advertise<sensor_msgs::PointCloud2> (m_pcPublisherName, 100, m_latchedTopics);
 
@@ -123,23 +148,29 @@ void srs_env_model::CLimitedPointCloudPlugin::onFrameStart( const SMapParameters
     // Reset counters
     m_countVisible = m_countHidden = 0;
 
-    min = 10000000;
-    max = -10000000;
-
     // Call parent frame start
     CPointCloudPlugin::onFrameStart( par );
 
-    if( m_cameraFrameId.size() == 0 )
+    // Camera state is shared with the camera position callback, which runs on its own thread
+    std::string cameraFrameId;
+    {
+        boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
+        cameraFrameId = m_cameraFrameId;
+    }
+
+    if( cameraFrameId.size() == 0 )
     {
         PERROR("Wrong camera frame id...");
+        boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
         m_bTransformCamera = false;
         return;
     }
 
-    m_bTransformCamera = m_cameraFrameId != m_ocFrameId;
+    bool bTransformCamera( cameraFrameId != m_ocFrameId );
 
-    // If different frame id
-    if( m_bTransformCamera )
+    // Transform is looked up without the lock, tf can wait for it
+    Eigen::Matrix4f cameraToOcTM;
+    if( bTransformCamera )
     {
 
         // Some transforms
@@ -148,23 +179,33 @@ void srs_env_model::CLimitedPointCloudPlugin::onFrameStart( const SMapParameters
         // Get transforms
         try {
             // Transformation - from, to, time, waiting time
-            m_tfListener.waitForTransform(m_ocFrameId, m_cameraFrameId,
+            m_tfListener.waitForTransform(m_ocFrameId, cameraFrameId,
                     par.currentTime, ros::Duration(0.2));
 
-            m_tfListener.lookupTransform(m_ocFrameId, m_cameraFrameId,
+            m_tfListener.lookupTransform(m_ocFrameId, cameraFrameId,
                     par.currentTime, camToOcTf);
 
         } catch (tf::TransformException& ex) {
             ROS_ERROR_STREAM( m_name << ": Transform error - " << ex.what() << ", quitting callback");
-            PERROR( "Camera FID: " << m_cameraFrameId << ", Octomap FID: " << m_ocFrameId );
+            PERROR( "Camera FID: " << cameraFrameId << ", Octomap FID: " << m_ocFrameId );
+
+            // Last known transform is still used
+            boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
+            m_bTransformCamera = true;
             return;
         }
  //       PERROR( "Camera FID: " << m_cameraFrameId << ", Octomap FID: " << m_ocFrameId );
 
         // Get transformation matrix
-        Eigen::Matrix4f cameraToOcTM;
         pcl_ros::transformAsMatrix(camToOcTf, cameraToOcTM); // Sensor TF to defined base TF
+    }
+
+    // Store transform and copy buffered camera normal and d parameter
+    boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
 
+    m_bTransformCamera = bTransformCamera;
+    if( m_bTransformCamera )
+    {
         // Get translation and rotation
         m_camToOcRot  = cameraToOcTM.block<3, 3> (0, 0);
         m_camToOcTrans = cameraToOcTM.block<3, 1> (0, 3);
@@ -172,39 +213,204 @@ void srs_env_model::CLimitedPointCloudPlugin::onFrameStart( const SMapParameters
 //        PERROR( "Camera position: " << m_camToOcTrans );
     }
 
-    // Copy buffered camera normal and d parameter
-    boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
-
   //  PERROR( "Copy position...");
     m_d = m_dBuf;
     m_normal = m_normalBuf;
+    m_position = m_positionBuf;
+    m_up = m_upBuf;
+
+    buildFrustum();
 }
 
 /**
- * hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
+ * Build frustum planes
  */
-void srs_env_model::CLimitedPointCloudPlugin::handleOccupiedNode(srs_env_model::tButServerOcTree::iterator& it, const SMapParameters & mp)
+void srs_env_model::CLimitedPointCloudPlugin::buildFrustum()
 {
-    Eigen::Vector3f p( it.getX(), it.getY(), it.getZ() );
+    m_frustum.clear();
 
-     float f( p.dot( m_normal ) + m_d);
-    if( f > max )
-        max = f;
-    if( f < min)
-        min = f;
+    // Near plane is the camera plane
+    m_frustum.push_back( Eigen::Vector4f( m_normal[0], m_normal[1], m_normal[2], m_d ) );
 
-    // Test if point is in front of camera
-    if( (p.dot( m_normal ) + m_d) > 0 )
+    // Far plane
+    if( m_maxDistance > 0.0 )
     {
-        // Ok, add it...
-        CPointCloudPlugin::handleOccupiedNode( it, mp );
-        ++m_countVisible;
+        float d( m_position.dot( m_normal ) + m_maxDistance );
+        m_frustum.push_back( Eigen::Vector4f( -m_normal[0], -m_normal[1], -m_normal[2], d ) );
     }
-    else
+
+    if( m_fov >= M_PI )
+        return;
+
+    // Camera axes
+    Eigen::Vector3f up( m_up - m_normal * m_up.dot( m_normal ) );
+    if( up.norm() < 0.001 )
+        up = Eigen::Vector3f::UnitZ() - m_normal * m_normal[2];
+    if( up.norm() < 0.001 )
+        up = Eigen::Vector3f::UnitY();
+    up.normalize();
+
+    Eigen::Vector3f right( m_normal.cross( up ) );
+
+    // Side planes go through the camera position
+    float h( 0.5 * m_fov ), v( std::atan( std::tan( h ) / std::max( m_aspect, 0.01 ) ) );
+    Eigen::Vector3f normals[4] = {
+        m_normal * std::sin( h ) + right * std::cos( h ),
+        m_normal * std::sin( h ) - right * std::cos( h ),
+        m_normal * std::sin( v ) + up * std::cos( v ),
+        m_normal * std::sin( v ) - up * std::cos( v ) };
+
+    for( unsigned i = 0; i < 4; ++i )
+        m_frustum.push_back( Eigen::Vector4f( normals[i][0], normals[i][1], normals[i][2], -normals[i].dot( m_position ) ) );
+}
+
+/**
+ * Test node box against the frustum
+ */
+bool srs_env_model::CLimitedPointCloudPlugin::testFrustum( STraversedNode & node ) const
+{
+    float half( 0.5 * node.size );
+
+    for( unsigned i = 0; i < m_frustum.size(); ++i )
     {
-        ++m_countHidden;
-  //      PERROR( "Point behind camera... ");
+        // Node is in front of this plane together with its parent
+        if( node.inside & (1 << i) )
+            continue;
+
+        const Eigen::Vector4f & plane( m_frustum[i] );
+        float distance( plane.head<3>().dot( node.center ) + plane[3] );
+        float radius( half * plane.head<3>().cwiseAbs().sum() );
+
+        if( distance < -radius )
+            return false;
+
+        if( distance >= radius )
+            node.inside |= 1 << i;
     }
+
+    return true;
+}
+
+/**
+ * Add node to the output points
+ */
+void srs_env_model::CLimitedPointCloudPlugin::addPoint( const STraversedNode & node )
+{
+    tPclPoint point;
+
+    // Set position
+    point.x = node.center[0];
+    point.y = node.center[1];
+    point.z = node.center[2];
+
+    // Set color
+    point.r = node.node->r();
+    point.g = node.node->g();
+    point.b = node.node->b();
+
+    m_ocPoints.points.push_back( point );
+    m_ocSizes.push_back( node.size );
+}
+
+/**
+ * Traverse visible part of the octree
+ *
+ * Subtrees outside of the view frustum are skipped whole. Nodes seen under an angle smaller
+ * than the level of detail angle are not refined, occupied ones are sent as one point. If the
+ * points budget is set, nodes are refined in the order of their projected size (largest first)
+ * while the refined cut of the tree fits into the budget.
+ */
+void srs_env_model::CLimitedPointCloudPlugin::handlePostNodeTraversal(const SMapParameters & mp)
+{
+    // Points are collected again in every crawl - camera moves
+    m_ocPoints.points.clear();
+    m_ocSizes.clear();
+    m_countVisible = m_countHidden = 0;
+
+    if( mp.map != 0 && mp.map->octree.getRoot() != 0 )
+    {
+        const tButServerOcTree & tree( mp.map->octree );
+        bool bBudget( m_maxPoints > 0 );
+        size_t maxPoints( std::max( m_maxPoints, 1 ) );
+
+        // Stack for the depth first traversal, heap if there is the points budget
+        std::vector< STraversedNode > open;
+
+        STraversedNode root;
+        root.node = tree.getRoot();
+        root.center = Eigen::Vector3f::Zero();
+        root.size = mp.resolution * double( 1 << mp.treeDepth );
+        root.inside = 0;
+        root.priority = 0.0;
+
+        if( testFrustum( root ) )
+            open.push_back( root );
+
+        while( !open.empty() )
+        {
+            if( bBudget )
+                std::pop_heap( open.begin(), open.end() );
+
+            STraversedNode node( open.back() );
+            open.pop_back();
+
+            // Refine inner nodes seen under large enough angle
+            bool bRefine( node.node->hasChildren() &&
+                          ( m_lodAngle <= 0.0 || node.size > m_lodAngle * ( node.center - m_position ).norm() ) );
+
+            STraversedNode children[8];
+            unsigned numChildren( 0 );
+
+            if( bRefine )
+            {
+                float quarter( 0.25 * node.size );
+                for( unsigned i = 0; i < 8; ++i )
+                {
+                    if( !node.node->childExists( i ) )
+                        continue;
+
+                    STraversedNode & child( children[numChildren] );
+                    child.node = node.node->getChild( i );
+                    child.size = 0.5 * node.size;
+                    child.center = node.center + Eigen::Vector3f( i & 1 ? quarter : -quarter, i & 2 ? quarter : -quarter, i & 4 ? quarter : -quarter );
+                    child.inside = node.inside;
+
+                    // Free subtrees contain no occupied leaf
+                    if( !tree.isNodeOccupied( *child.node ) || !testFrustum( child ) )
+                    {
+                        ++m_countHidden;
+                        continue;
+                    }
+
+                    child.priority = child.size / std::max( ( child.center - m_position ).norm(), 0.001f );
+                    ++numChildren;
+                }
+
+                // Whole refined cut must fit into the budget
+                if( bBudget && m_ocPoints.size() + open.size() + numChildren > maxPoints )
+                    bRefine = false;
+            }
+
+            if( !bRefine )
+            {
+                if( tree.isNodeOccupied( *node.node ) )
+                {
+                    addPoint( node );
+                    ++m_countVisible;
+                }
+                continue;
+            }
+
+            for( unsigned i = 0; i < numChildren; ++i )
+            {
+                open.push_back( children[i] );
+                if( bBudget )
+                    std::push_heap( open.begin(), open.end() );
+            }
+        }
+    }
+
+    CPointCloudPlugin::handlePostNodeTraversal( mp );
 }
 
 /**
@@ -212,6 +418,9 @@ void srs_env_model::CLimitedPointCloudPlugin::handleOccupiedNode(srs_env_model::
  */
 void srs_env_model::CLimitedPointCloudPlugin::onCameraPositionChangedCB(const srs_env_model_msgs::RVIZCameraPosition::ConstPtr& cameraPosition)
 {
+    // Camera state is shared with the publishing thread (onFrameStart)
+    boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
+
     // Set camera position frame id
     m_cameraFrameId = cameraPosition->header.frame_id;
 
@@ -240,9 +449,17 @@ void srs_env_model::CLimitedPointCloudPlugin::onCameraPositionChangedCB(const sr
     normal.normalize();
 
     // Set parameters to the buffer
-    boost::recursive_mutex::scoped_lock lock( m_camPosMutex );
-
     m_normalBuf = normal;
+    m_positionBuf = point;
+
+    // Camera up vector
+    const srs_env_model_msgs::RVIZCameraPosition::_orientation_type & o( cameraPosition->orientation );
+    Eigen::Quaternionf orientation( o.w, o.x, o.y, o.z );
+    if( orientation.norm() > 0.001 )
+    {
+        Eigen::Vector3f up( orientation.normalized() * Eigen::Vector3f::UnitY() );
+        m_upBuf = m_bTransformCamera ? Eigen::Vector3f( m_camToOcRot * up ) : up;
+    }
 
     // Compute last plane equation parameter
     m_dBuf = - point.dot( normal );
@@ -254,7 +471,7 @@ void srs_env_model::CLimitedPointCloudPlugin::onCameraPositionChangedCB(const sr
 //! Called when new scan was inserted and now all can be published
 void srs_env_model::CLimitedPointCloudPlugin::onPublish(const ros::Time & timestamp)
 {
-//    PERROR( "Visible: " << m_countVisible << ", hidden: " << m_countHidden << ", min: " << min << ", max: " << max );
+//    PERROR( "Visible: " << m_countVisible << ", hidden: " << m_countHidden );
 //    PERROR( "Num of points: " << m_data->size() );
     srs_env_model::CPointCloudPlugin::onPublish( timestamp );
 }
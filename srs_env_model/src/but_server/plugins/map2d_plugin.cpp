@@ -30,6 +30,8 @@
 
 #include <pcl_ros/transforms.h>
 
+#include <algorithm>
+
 
 srs_env_model::CMap2DPlugin::CMap2DPlugin(const std::string & name)
 : srs_env_model::CServerPluginBase(name)
@@ -39,6 +41,10 @@ srs_env_model::CMap2DPlugin::CMap2DPlugin(const std::string & name)
 , m_map2DFrameId(MAP2D_FRAME_ID)
 , m_minSizeX(0.0)
 , m_minSizeY(0.0)
+, m_bGridValid(false)
+, m_gridResolution(0.0)
+, m_bChanged(false)
+, m_numSubscribers(0)
 {
 	m_data = new tData;
 	assert( m_data != 0 );
@@ -54,7 +60,9 @@ srs_env_model::CMap2DPlugin::~CMap2DPlugin()
 
 bool srs_env_model::CMap2DPlugin::shouldPublish()
 {
-	return( m_publishMap2D && m_map2DPublisher.getNumSubscribers() > 0 );
+	// Unchanged grid is sent to the new subscribers only
+	unsigned numSubscribers( m_map2DPublisher.getNumSubscribers() );
+	return( m_publishMap2D && numSubscribers > 0 && ( m_bChanged || numSubscribers > m_numSubscribers ) );
 }
 
 
@@ -75,15 +83,23 @@ void srs_env_model::CMap2DPlugin::init(ros::NodeHandle & node_handle)
 void srs_env_model::CMap2DPlugin::onPublish(const ros::Time & timestamp)
 {
 	m_map2DPublisher.publish(*m_data);
+
+	m_bChanged = false;
+	m_numSubscribers = m_map2DPublisher.getNumSubscribers();
 }
 
 
 
 void srs_env_model::CMap2DPlugin::onFrameStart(const SMapParameters & par)
 {
+	// Grid is built again by the full crawl or if it is not compatible with the map
+	bool bReset( !par.bDeltaCrawl || !m_bGridValid || m_gridResolution != par.resolution ||
+				 m_data->header.frame_id != m_map2DFrameId );
+
 	m_data->header.frame_id = m_map2DFrameId;
 	m_data->header.stamp = par.currentTime;
 	m_data->info.resolution = par.resolution;
+	m_gridResolution = par.resolution;
 
 	m_ocFrameId = par.frameId;
 	ros::Time timestamp( par.currentTime );
@@ -154,9 +170,9 @@ void srs_env_model::CMap2DPlugin::onFrameStart(const SMapParameters & par)
 	minPt = octomap::point3d(minX, minY, minZ);
 	maxPt = octomap::point3d(maxX, maxY, maxZ);
 
-	octomap::OcTreeKey paddedMaxKey;
+	octomap::OcTreeKey paddedMinKey, paddedMaxKey;
 
-	if (!map.octree.genKey(minPt, m_paddedMinKey)) {
+	if (!map.octree.genKey(minPt, paddedMinKey)) {
 		ROS_ERROR("Could not create padded min OcTree key at %f %f %f", minPt.x(), minPt.y(), minPt.z());
 		return;
 	}
@@ -166,83 +182,169 @@ void srs_env_model::CMap2DPlugin::onFrameStart(const SMapParameters & par)
 		return;
 	}
 
-	ROS_DEBUG("Padded MinKey: %d %d %d / padded MaxKey: %d %d %d", m_paddedMinKey[0], m_paddedMinKey[1],
-			m_paddedMinKey[2], paddedMaxKey[0], paddedMaxKey[1], paddedMaxKey[2]);
+	ROS_DEBUG("Padded MinKey: %d %d %d / padded MaxKey: %d %d %d", paddedMinKey[0], paddedMinKey[1],
+			paddedMinKey[2], paddedMaxKey[0], paddedMaxKey[1], paddedMaxKey[2]);
 
 	assert(paddedMaxKey[0] >= maxKey[0] && paddedMaxKey[1] >= maxKey[1]);
 
-	m_data->info.width = paddedMaxKey[0] - m_paddedMinKey[0] + 1;
-	m_data->info.height = paddedMaxKey[1] - m_paddedMinKey[1] + 1;
+	if( bReset )
+	{
+		// Drop the old grid
+		m_data->info.width = m_data->info.height = 0;
+		m_data->data.clear();
+		m_paddedMinKey[0] = m_paddedMinKey[1] = 0;
+		resizeGrid( paddedMinKey, paddedMaxKey, par.treeDepth );
 
-	int mapOriginX = minKey[0] - m_paddedMinKey[0];
-	int mapOriginY = minKey[1] - m_paddedMinKey[1];
+		m_bGridValid = true;
+		return;
+	}
 
-	assert(mapOriginX >= 0 && mapOriginY >= 0);
+	// Grow grid in place if the octree has grown
+	octomap::OcTreeKey gridMinKey( m_paddedMinKey ), gridMaxKey( m_paddedMinKey );
+	gridMaxKey[0] += m_data->info.width - 1;
+	gridMaxKey[1] += m_data->info.height - 1;
 
-	// might not exactly be min / max of octree:
-	octomap::point3d origin;
-	map.octree.genCoords(m_paddedMinKey, par.treeDepth, origin);
+	for( unsigned i = 0; i < 2; ++i )
+	{
+		gridMinKey[i] = std::min( gridMinKey[i], paddedMinKey[i] );
+		gridMaxKey[i] = std::max( gridMaxKey[i], paddedMaxKey[i] );
+	}
+
+	resizeGrid( gridMinKey, gridMaxKey, par.treeDepth );
+}
+
+/**
+ * Resize grid, old data are moved to the new positions
+ */
+void srs_env_model::CMap2DPlugin::resizeGrid( const octomap::OcTreeKey & minKey, const octomap::OcTreeKey & maxKey, unsigned treeDepth )
+{
+	unsigned width( maxKey[0] - minKey[0] + 1 ), height( maxKey[1] - minKey[1] + 1 );
 
-	m_data->info.origin.position.x = origin.x() - par.resolution* 0.5;
-	m_data->info.origin.position.y = origin.y() - par.resolution * 0.5;
+	// Nothing to do
+	if( minKey[0] == m_paddedMinKey[0] && minKey[1] == m_paddedMinKey[1] &&
+		width == m_data->info.width && height == m_data->info.height )
+		return;
 
 	// Allocate space to hold the data (init to unknown)
-	m_data->data.resize(m_data->info.width * m_data->info.height, -1);
-}
+	std::vector< signed char > data( width * height, -1 );
 
+	// Copy old rows (new grid always contains the old one)
+	int offsetX( m_paddedMinKey[0] - minKey[0] ), offsetY( m_paddedMinKey[1] - minKey[1] );
+	for( unsigned j = 0; j < m_data->info.height; ++j )
+	{
+		std::vector< signed char >::const_iterator row( m_data->data.begin() + j * m_data->info.width );
+		std::copy( row, row + m_data->info.width, data.begin() + ( j + offsetY ) * width + offsetX );
+	}
+
+	m_data->data.swap( data );
+	m_data->info.width = width;
+	m_data->info.height = height;
+	m_paddedMinKey = minKey;
 
+	// might not exactly be min / max of octree:
+	double resolution( m_gridResolution );
+	double offset( 1 << (treeDepth - 1) );
+	m_data->info.origin.position.x = ( double( minKey[0] ) - offset ) * resolution;
+	m_data->info.origin.position.y = ( double( minKey[1] ) - offset ) * resolution;
 
-void srs_env_model::CMap2DPlugin::handleOccupiedNode(srs_env_model::tButServerOcTree::iterator & it, const SMapParameters & mp)
+	m_bChanged = true;
+}
+
+/**
+ * Write node to the grid
+ */
+void srs_env_model::CMap2DPlugin::setCells( const octomap::OcTreeKey & minKey, int size, bool occupied )
 {
-	if (it.getDepth() == mp.treeDepth)
-	{
+	int width( m_data->info.width ), height( m_data->info.height );
+
+	int minI( std::max( int( minKey[0] ) - int( m_paddedMinKey[0] ), 0 ) );
+	int minJ( std::max( int( minKey[1] ) - int( m_paddedMinKey[1] ), 0 ) );
+	int maxI( std::min( int( minKey[0] ) + size - int( m_paddedMinKey[0] ), width ) );
+	int maxJ( std::min( int( minKey[1] ) + size - int( m_paddedMinKey[1] ), height ) );
 
-		octomap::OcTreeKey nKey = it.getKey(); // TODO: remove intermedate obj (1.4)
-		int i = nKey[0] - m_paddedMinKey[0];
-		int j = nKey[1] - m_paddedMinKey[1];
-		m_data->data[m_data->info.width * j + i] = 100;
-
-	} else {
-
-		int intSize = 1 << (mp.treeDepth - it.getDepth());
-		octomap::OcTreeKey minKey = it.getIndexKey();
-		for (int dx = 0; dx < intSize; dx++) {
-			int i = minKey[0] + dx - m_paddedMinKey[0];
-			for (int dy = 0; dy < intSize; dy++) {
-				int j = minKey[1] + dy - m_paddedMinKey[1];
-				m_data->data[m_data->info.width * j + i] = 100;
-			}
+	for( int j = minJ; j < maxJ; ++j )
+	{
+		signed char * cell( &m_data->data[width * j + minI] );
+		for( int i = minI; i < maxI; ++i, ++cell )
+		{
+			if( occupied )
+				*cell = 100;
+			else if( *cell == -1 )
+				*cell = 0;
 		}
 	}
 }
 
+/**
+ * Recompute changed columns
+ */
+bool srs_env_model::CMap2DPlugin::updateColumns( const SMapParameters & mp )
+{
+	// Nothing changed
+	if( mp.crawlMin.x() > mp.crawlMax.x() || mp.crawlMin.y() > mp.crawlMax.y() || mp.map == 0 )
+		return false;
+
+	const tButServerOcTree & tree( mp.map->octree );
+
+	// Whole columns of the changed box
+	double minX, minY, minZ, maxX, maxY, maxZ;
+	tree.getMetricMin(minX, minY, minZ);
+	tree.getMetricMax(maxX, maxY, maxZ);
+
+	octomap::point3d minPt( mp.crawlMin.x(), mp.crawlMin.y(), minZ );
+	octomap::point3d maxPt( mp.crawlMax.x(), mp.crawlMax.y(), maxZ );
+
+	octomap::OcTreeKey minKey, maxKey;
+	if( !tree.genKey( minPt, minKey ) || !tree.genKey( maxPt, maxKey ) )
+		return false;
+
+	// Clear changed cells
+	int width( m_data->info.width ), height( m_data->info.height );
+	int minI( std::max( int( minKey[0] ) - int( m_paddedMinKey[0] ), 0 ) );
+	int minJ( std::max( int( minKey[1] ) - int( m_paddedMinKey[1] ), 0 ) );
+	int maxI( std::min( int( maxKey[0] ) - int( m_paddedMinKey[0] ) + 1, width ) );
+	int maxJ( std::min( int( maxKey[1] ) - int( m_paddedMinKey[1] ) + 1, height ) );
+
+	if( minI >= maxI || minJ >= maxJ )
+		return false;
+
+	for( int j = minJ; j < maxJ; ++j )
+		std::fill( m_data->data.begin() + width * j + minI, m_data->data.begin() + width * j + maxI, -1 );
+
+	// Project all leafs of the columns
+	for( tButServerOcTree::leaf_bbx_iterator it = tree.begin_leafs_bbx( minPt, maxPt ), end = tree.end_leafs_bbx(); it != end; ++it )
+		setCells( it.getIndexKey(), 1 << (mp.treeDepth - it.getDepth()), tree.isNodeOccupied( *it ) );
+
+	return true;
+}
 
-void srs_env_model::CMap2DPlugin::handleFreeNode(srs_env_model::tButServerOcTree::iterator & it, const SMapParameters & mp )
+void srs_env_model::CMap2DPlugin::handleOccupiedNode(srs_env_model::tButServerOcIterator & it, const SMapParameters & mp)
 {
-	if (it.getDepth() == mp.treeDepth) {
-		octomap::OcTreeKey nKey = it.getKey(); //TODO: remove intermedate obj (1.4)
-		int i = nKey[0] - m_paddedMinKey[0];
-		int j = nKey[1] - m_paddedMinKey[1];
-		if (m_data->data[m_data->info.width * j + i] == -1) {
-			m_data->data[m_data->info.width * j + i] = 0;
-		}
-	} else {
-		int intSize = 1 << (mp.treeDepth - it.getDepth());
-		octomap::OcTreeKey minKey = it.getIndexKey();
-		for (int dx = 0; dx < intSize; dx++) {
-			int i = minKey[0] + dx - m_paddedMinKey[0];
-			for (int dy = 0; dy < intSize; dy++) {
-				int j = minKey[1] + dy - m_paddedMinKey[1];
-				if (m_data->data[m_data->info.width * j + i] == -1) {
-					m_data->data[m_data->info.width * j + i] = 0;
-				}
-			}
-		}
-	}
+	// Changed columns are recomputed at once after the delta crawl
+	if (mp.bDeltaCrawl)
+		return;
+
+	setCells(it.getIndexKey(), 1 << (mp.treeDepth - it.getDepth()), true);
+}
+
+
+void srs_env_model::CMap2DPlugin::handleFreeNode(srs_env_model::tButServerOcIterator & it, const SMapParameters & mp )
+{
+	// Changed columns are recomputed at once after the delta crawl
+	if (mp.bDeltaCrawl)
+		return;
+
+	setCells(it.getIndexKey(), 1 << (mp.treeDepth - it.getDepth()), false);
 }
 
 
 void srs_env_model::CMap2DPlugin::handlePostNodeTraversal(const SMapParameters & mp)
 {
+	if (mp.bDeltaCrawl) {
+		if (!updateColumns(mp))
+			return;
+	}
+
+	m_bChanged = true;
 	invalidate();
 }
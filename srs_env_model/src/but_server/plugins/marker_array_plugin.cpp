@@ -37,6 +37,7 @@ srs_env_model::CMarkerArrayPlugin::CMarkerArrayPlugin(const std::string & name)
 , m_markerArrayPublisherName(MARKERARRAY_PUBLISHER_NAME)
 , m_latchedTopics(false)
 , m_markerArrayFrameId(MARKERARRAY_FRAME_ID)
+, m_minX(0.0), m_minY(0.0), m_minZ(0.0), m_maxX(0.0), m_maxY(0.0), m_maxZ(0.0)
 , m_bHeightMap( true )
 , m_bTransform( false )
 , m_colorFactor(0.8)
@@ -98,10 +99,41 @@ void srs_env_model::CMarkerArrayPlugin::onFrameStart(const SMapParameters & par)
 
     m_ocFrameId = par.frameId;
 
+    double oldMinZ( m_minZ ), oldMaxZ( m_maxZ );
+
     // Get octomap parameters
     par.map->octree.getMetricMin(m_minX, m_minY, m_minZ);
     par.map->octree.getMetricMax(m_maxX, m_maxY, m_maxZ);
 
+    if( !par.bDeltaCrawl )
+    {
+        for( unsigned i = 0; i < m_data->markers.size(); ++i )
+        {
+            m_data->markers[i].points.clear();
+            m_data->markers[i].colors.clear();
+        }
+    }
+    else
+    {
+        removeCrawledCubes( par );
+
+        // Height range has changed - recolor kept cubes
+        if( m_bHeightMap && (oldMinZ != m_minZ || oldMaxZ != m_maxZ) )
+        {
+            for( unsigned i = 0; i < m_data->markers.size(); ++i )
+            {
+                visualization_msgs::Marker & marker( m_data->markers[i] );
+                for( size_t j = 0; j < marker.points.size(); ++j )
+                    marker.colors[j] = cubeColor( marker.points[j] );
+            }
+        }
+    }
+
+    // Partition buffers are used by the parallel crawl only
+    m_partMarkers.resize( par.numPartitions > 1 ? par.numPartitions : 0 );
+    for( unsigned i = 0; i < m_partMarkers.size(); ++i )
+        m_partMarkers[i].markers.resize( m_data->markers.size() );
+
     m_bTransform = m_ocFrameId != m_markerArrayFrameId;
 
     // Is transform needed?
@@ -143,7 +175,7 @@ void srs_env_model::CMarkerArrayPlugin::onFrameStart(const SMapParameters & par)
 
 
 
-void srs_env_model::CMarkerArrayPlugin::handleNode(const srs_env_model::tButServerOcTree::iterator & it, const SMapParameters & mp)
+void srs_env_model::CMarkerArrayPlugin::handleNode(const srs_env_model::tButServerOcIterator & it, const SMapParameters & mp)
 {
     unsigned idx = it.getDepth();
     assert(idx < m_data->markers.size());
@@ -157,9 +189,9 @@ void srs_env_model::CMarkerArrayPlugin::handleNode(const srs_env_model::tButServ
         // Transform input point
         Eigen::Vector3f point( it.getX(), it.getY(), it.getZ() );
         point = m_ocToMarkerArrayRot * point + m_ocToMarkerArrayTrans;
-        cubeCenter.x = it.getX();
-        cubeCenter.y = it.getY();
-        cubeCenter.z = it.getZ();
+        cubeCenter.x = point.x();
+        cubeCenter.y = point.y();
+        cubeCenter.z = point.z();
 
     }else{
         cubeCenter.x = it.getX();
@@ -167,11 +199,45 @@ void srs_env_model::CMarkerArrayPlugin::handleNode(const srs_env_model::tButServ
         cubeCenter.z = it.getZ();
     }
 
-    m_data->markers[idx].points.push_back(cubeCenter);
+    // Parallel crawl writes to the partition buffer, it is merged in handlePostNodeTraversal
+    visualization_msgs::Marker & marker( mp.numPartitions > 1 ? m_partMarkers[mp.partition].markers[idx] : m_data->markers[idx] );
+
+    marker.points.push_back(cubeCenter);
 
     if (m_bHeightMap){
-        double h = (1.0 - std::min(std::max((cubeCenter.z-m_minZ)/ (m_maxZ - m_minZ), 0.0), 1.0)) *m_colorFactor;
-        m_data->markers[idx].colors.push_back(heightMapColor(h));
+        marker.colors.push_back(cubeColor(cubeCenter));
+    }
+}
+
+std_msgs::ColorRGBA srs_env_model::CMarkerArrayPlugin::cubeColor(const geometry_msgs::Point & center) const
+{
+    double h = (1.0 - std::min(std::max((center.z-m_minZ)/ (m_maxZ - m_minZ), 0.0), 1.0)) *m_colorFactor;
+    return heightMapColor(h);
+}
+
+void srs_env_model::CMarkerArrayPlugin::removeCrawledCubes(const SMapParameters & par)
+{
+    for( unsigned i = 0; i < m_data->markers.size(); ++i )
+    {
+        visualization_msgs::Marker & marker( m_data->markers[i] );
+        double size( par.map->octree.getNodeSize(i) );
+        bool bColors( marker.colors.size() == marker.points.size() );
+
+        size_t n( 0 );
+        for( size_t j = 0; j < marker.points.size(); ++j )
+        {
+            const geometry_msgs::Point & center( marker.points[j] );
+            if( par.isInCrawledBox( center.x, center.y, center.z, size ) )
+                continue;
+
+            marker.points[n] = center;
+            if( bColors )
+                marker.colors[n] = marker.colors[j];
+            ++n;
+        }
+        marker.points.resize( n );
+        if( bColors )
+            marker.colors.resize( n );
     }
 }
 
@@ -179,6 +245,21 @@ void srs_env_model::CMarkerArrayPlugin::handleNode(const srs_env_model::tButServ
 
 void srs_env_model::CMarkerArrayPlugin::handlePostNodeTraversal(const SMapParameters & mp)
 {
+    // Merge partitions of the parallel crawl in partition order
+    for( unsigned p = 0; p < m_partMarkers.size(); ++p )
+    {
+        for( unsigned i = 0; i < m_data->markers.size(); ++i )
+        {
+            visualization_msgs::Marker & part( m_partMarkers[p].markers[i] );
+            visualization_msgs::Marker & marker( m_data->markers[i] );
+
+            marker.points.insert( marker.points.end(), part.points.begin(), part.points.end() );
+            marker.colors.insert( marker.colors.end(), part.colors.begin(), part.colors.end() );
+            part.points.clear();
+            part.colors.clear();
+        }
+    }
+
     for (unsigned i= 0; i < m_data->markers.size(); ++i){
         double size = mp.map->octree.getNodeSize(i);
 
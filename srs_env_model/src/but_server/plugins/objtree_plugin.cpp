@@ -25,12 +25,14 @@
  * along with this file.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <Eigen/Geometry>
+#include <boost/bind.hpp>
 
 #include <srs_env_model/services_list.h>
 #include <srs_env_model/topics_list.h>
 #include <srs_env_model/but_server/plugins/objtree_plugin.h>
-#include <srs_env_model/but_server/objtree/plane.h>
+#include <srs_env_model/but_server/parallel_tools.h>
 #include <srs_env_model/but_server/objtree/bbox.h>
 #include <srs_env_model/but_server/objtree/filter.h>
 
@@ -44,7 +46,8 @@ namespace srs_env_model
 {
 
 CObjTreePlugin::CObjTreePlugin(const std::string &name)
-    : CServerPluginBase(name), m_octree(objtree::Box(-10.0f, -10.0f, -10.0f, 20.0f, 20.0f, 20.0f))
+    : CServerPluginBase(name), m_octree(objtree::Box(-10.0f, -10.0f, -10.0f, 20.0f, 20.0f, 20.0f)), m_insertThreads(0)
+    , m_bShowObjtree(false), m_bShowPrimitives(false)
 {
 }
 
@@ -55,6 +58,9 @@ CObjTreePlugin::~CObjTreePlugin()
 
 void CObjTreePlugin::init(ros::NodeHandle &node_handle)
 {
+    node_handle.param("objtree/insert_threads", m_insertThreads, m_insertThreads);
+    node_handle.param("objtree/show_primitives", m_bShowPrimitives, m_bShowPrimitives);
+
     //Advertise services
     m_serviceGetObjectsInBox = node_handle.advertiseService(GetObjectsInBox_SRV, &CObjTreePlugin::srvGetObjectsInBox, this);
     m_serviceGetObjectsInHalfspace = node_handle.advertiseService(GetObjectsInHalfspace_SRV, &CObjTreePlugin::srvGetObjectsInHalfspace, this);
@@ -65,6 +71,7 @@ void CObjTreePlugin::init(ros::NodeHandle &node_handle)
     m_serviceInsertPlaneByPosition = node_handle.advertiseService(InsertPlaneByPosition_SRV, &CObjTreePlugin::srvInsertPlaneByPosition, this);
     m_serviceGetSimilarPlane = node_handle.advertiseService(GetSimilarPlane_SRV, &CObjTreePlugin::srvGetSimilarPlane, this);
     m_serviceInsertPlanes = node_handle.advertiseService(InsertPlanes_SRV, &CObjTreePlugin::srvInsertPlanes, this);
+    m_serviceInsertPlanesByPosition = node_handle.advertiseService(InsertPlanesByPosition_SRV, &CObjTreePlugin::srvInsertPlanesByPosition, this);
     m_serviceInsertABox = node_handle.advertiseService(InsertAlignedBox_SRV, &CObjTreePlugin::srvInsertABox, this);
     m_serviceInsertABoxByPosition = node_handle.advertiseService(InsertAlignedBoxByPosition_SRV, &CObjTreePlugin::srvInsertABoxByPosition, this);
     m_serviceGetSimilarABox = node_handle.advertiseService(GetSimilarAlignedBox_SRV, &CObjTreePlugin::srvGetSimilarABox, this);
@@ -76,28 +83,25 @@ void CObjTreePlugin::init(ros::NodeHandle &node_handle)
     m_clientAddBoundingBox = node_handle.serviceClient<srs_interaction_primitives::AddBoundingBox>(srs_interaction_primitives::AddBoundingBox_SRV);
     m_clientRemovePrimitive = node_handle.serviceClient<srs_interaction_primitives::RemovePrimitive>(srs_interaction_primitives::RemovePrimitive_SRV);
 
-    m_markerPub = node_handle.advertise<visualization_msgs::Marker>("visualization_marker", 100);
+    //New subscriber gets all objects, then only changes
+    m_markerArrayPub = node_handle.advertise<visualization_msgs::MarkerArray>(OBJTREE_MARKERS_PUBLISHER_NAME, 100,
+            boost::bind(&CObjTreePlugin::onMarkersSubscribe, this, _1));
 
     printf("ObjTree plugin initialized!\n");
 }
 
 void CObjTreePlugin::reset()
 {
-    std::map<unsigned int, objtree::Object*> objects(m_octree.objectsAll());
-
-    for(std::map<unsigned int, objtree::Object*>::iterator i = objects.begin(); i != objects.end(); i++)
-    {
-        removePrimitiveMarker(i->second->id());
-    }
-
     m_octree.clear();
+
+    publishChanges();
 }
 
 bool CObjTreePlugin::srvInsertPlane(srs_env_model::InsertPlane::Request &req, srs_env_model::InsertPlane::Response &res)
 {
     res.object_id = insertPlane(req.plane, INSERT);
 
-    showObject(res.object_id);
+    publishChanges();
 
     return true;
 }
@@ -106,37 +110,29 @@ bool CObjTreePlugin::srvInsertABox(srs_env_model::InsertAlignedBox::Request &req
 {
     res.object_id = insertABox(req.object_id, req.position, req.scale, INSERT);
 
-    showObject(res.object_id);
+    publishChanges();
 
     return true;
 }
 
 bool CObjTreePlugin::srvInsertPlaneByPosition(srs_env_model::InsertPlane::Request &req, srs_env_model::InsertPlane::Response &res)
 {
-    if(m_octree.removeObject(req.plane.id))
-        removePrimitiveMarker(req.plane.id);
+    m_octree.removeObject(req.plane.id);
 
     res.object_id = insertPlane(req.plane, UPDATE);
 
-    if((unsigned int)req.plane.id != res.object_id)
-        removePrimitiveMarker(res.object_id);
-
-    showObject(res.object_id);
+    publishChanges();
 
     return true;
 }
 
 bool CObjTreePlugin::srvInsertABoxByPosition(srs_env_model::InsertAlignedBox::Request &req, srs_env_model::InsertAlignedBox::Response &res)
 {
-    if(m_octree.removeObject(req.object_id))
-        removePrimitiveMarker(req.object_id);
+    m_octree.removeObject(req.object_id);
 
     res.object_id = insertABox(req.object_id, req.position, req.scale, UPDATE);
 
-    if((unsigned int)req.object_id != res.object_id)
-        removePrimitiveMarker(res.object_id);
-
-    showObject(res.object_id);
+    publishChanges();
 
     return true;
 }
@@ -164,10 +160,29 @@ bool CObjTreePlugin::srvInsertPlanes(srs_env_model::InsertPlanes::Request &req,
     {
         unsigned int id = insertPlane(*i, INSERT);
         res.object_ids.push_back(id);
+    }
 
-        showObject(id);
+    publishChanges();
+
+    return true;
+}
+
+bool CObjTreePlugin::srvInsertPlanesByPosition(srs_env_model::InsertPlanes::Request &req, srs_env_model::InsertPlanes::Response &res)
+{
+    std::vector<srs_env_model_msgs::PlaneDesc> &planes(req.plane_array.planes);
+    std::vector<objtree::Object*> objects(planes.size());
+
+    for(unsigned int i = 0; i < planes.size(); i++)
+    {
+        m_octree.removeObject(planes[i].id);
+
+        objects[i] = createPlane(planes[i]);
     }
 
+    m_octree.insertUpdate(objects, res.object_ids, getNumThreads(m_insertThreads));
+
+    publishChanges();
+
     return true;
 }
 
@@ -267,16 +282,8 @@ bool CObjTreePlugin::srvGetObjectsInSphere(srs_env_model::GetObjectsInSphere::Re
     return true;
 }
 
-unsigned int CObjTreePlugin::insertPlane(const srs_env_model_msgs::PlaneDesc &plane, CObjTreePlugin::Operation op)
+objtree::Plane* CObjTreePlugin::createPlane(const srs_env_model_msgs::PlaneDesc &plane)
 {
-    printf("insertPlane called, mode %d\n", op);
-
-    if(op == INSERT && m_octree.removeObject(plane.id))
-    {
-        //Updating existing plane
-        removePrimitiveMarker(plane.id);
-    }
-
     objtree::Point pos(plane.pose.position.x, plane.pose.position.y, plane.pose.position.z);
     objtree::Point scale(plane.scale.x, plane.scale.y, plane.scale.z);
 
@@ -288,6 +295,19 @@ unsigned int CObjTreePlugin::insertPlane(const srs_env_model_msgs::PlaneDesc &pl
     objtree::Plane *newPlane = new objtree::Plane(pos, objtree::Vector(normal.x(), normal.y(), normal.z()), scale);
     newPlane->setId(plane.id);
 
+    return newPlane;
+}
+
+unsigned int CObjTreePlugin::insertPlane(const srs_env_model_msgs::PlaneDesc &plane, CObjTreePlugin::Operation op)
+{
+    printf("insertPlane called, mode %d\n", op);
+
+    //Updating existing plane
+    if(op == INSERT)
+        m_octree.removeObject(plane.id);
+
+    objtree::Plane *newPlane = createPlane(plane);
+
     switch(op)
     {
         case INSERT: return m_octree.insert(newPlane);
@@ -313,11 +333,9 @@ unsigned int CObjTreePlugin::insertABox(unsigned int id, const geometry_msgs::Po
 {
     printf("insertAlignedBox called, mode %d\n", op);
 
-    if(op == INSERT && m_octree.removeObject(id))
-    {
-        //Updating existing box
-        removePrimitiveMarker(id);
-    }
+    //Updating existing box
+    if(op == INSERT)
+        m_octree.removeObject(id);
 
     objtree::BBox *newBox = new objtree::BBox(objtree::Box(position.x, position.y, position.z, scale.x, scale.y, scale.z));
     newBox->setId(id);
@@ -421,38 +439,168 @@ void CObjTreePlugin::showObject(unsigned int id)
         }
         break;
     }
+
+    m_primitives.insert(id);
 }
 
 void CObjTreePlugin::removeObject(unsigned int id)
 {
     m_octree.removeObject(id);
-    removePrimitiveMarker(id);
+
+    publishChanges();
 }
 
 void CObjTreePlugin::showObjtree()
 {
-    std::set<objtree::Object*> objects;
-    std::list<objtree::Box> nodes;
-    objtree::FilterZero filter;
+    //Octree structure is published with each change from now on
+    m_bShowObjtree = true;
 
-    m_octree.nodes(nodes, objects, &filter);
+    visualization_msgs::MarkerArray markers;
+    markers.markers.resize(1);
+    octreeMarker(markers.markers[0]);
+
+    m_markerArrayPub.publish(markers);
+
+    printf("Number of objects %u\n", m_octree.count());
+}
+
+void CObjTreePlugin::publishChanges()
+{
+    std::vector<unsigned int> changes;
+    m_octree.takeChanges(changes);
+
+    if(changes.empty()) return;
+
+    for(unsigned int i = 0; i < changes.size(); i++)
+    {
+        //Interactive primitive has to follow the object
+        if(m_bShowPrimitives || m_primitives.find(changes[i]) != m_primitives.end())
+        {
+            removePrimitiveMarker(changes[i]);
+
+            if(m_octree.object(changes[i]))
+                showObject(changes[i]);
+        }
+    }
+
+    if(m_markerArrayPub.getNumSubscribers() == 0) return;
 
-    publishOctree(nodes);
+    visualization_msgs::MarkerArray markers;
+    objectMarkers(changes, markers);
 
-    printf("Number of objects %zd\n", objects.size());
+    m_markerArrayPub.publish(markers);
+}
+
+void CObjTreePlugin::onMarkersSubscribe(const ros::SingleSubscriberPublisher &pub)
+{
+    const std::map<unsigned int, objtree::Object*> &objects(m_octree.objectsAll());
+    std::vector<unsigned int> ids;
+    ids.reserve(objects.size());
+
+    for(std::map<unsigned int, objtree::Object*>::const_iterator i = objects.begin(); i != objects.end(); i++)
+    {
+        ids.push_back(i->first);
+    }
+
+    visualization_msgs::MarkerArray markers;
+    objectMarkers(ids, markers);
+
+    //Send only to the new subscriber
+    pub.publish(markers);
+}
+
+void CObjTreePlugin::objectMarkers(const std::vector<unsigned int> &ids, visualization_msgs::MarkerArray &markers)
+{
+    markers.markers.resize(ids.size());
+
+    ros::Time stamp(ros::Time::now());
+
+    for(unsigned int i = 0; i < ids.size(); i++)
+    {
+        visualization_msgs::Marker &marker(markers.markers[i]);
+        const objtree::Object *object = m_octree.object(ids[i]);
+
+        marker.header.frame_id = IM_SERVER_FRAME_ID;
+        marker.header.stamp = stamp;
+        marker.ns = "objtree_objects";
+        marker.id = ids[i];
+
+        if(object)
+        {
+            objectMarker(object, marker);
+        }
+        else
+        {
+            marker.action = visualization_msgs::Marker::DELETE;
+        }
+    }
+
+    if(m_bShowObjtree)
+    {
+        markers.markers.push_back(visualization_msgs::Marker());
+        octreeMarker(markers.markers.back());
+    }
+}
+
+void CObjTreePlugin::objectMarker(const objtree::Object *object, visualization_msgs::Marker &marker)
+{
+    marker.action = visualization_msgs::Marker::ADD;
+    marker.type = visualization_msgs::Marker::CUBE;
+
+    marker.color.r = 1.0;
+    marker.color.g = marker.color.b = 0.0;
+    marker.color.a = 1.0;
+
+    switch(object->type())
+    {
+        case objtree::Object::BOUNDING_BOX:
+        {
+            const objtree::Box &box(((const objtree::BBox*)object)->box());
+
+            marker.pose.position.x = box.x+box.w/2;
+            marker.pose.position.y = box.y+box.h/2;
+            marker.pose.position.z = box.z+box.d/2;
+            marker.pose.orientation.w = 1.0;
+
+            marker.scale.x = box.w;
+            marker.scale.y = box.h;
+            marker.scale.z = box.d;
+        }
+        break;
+
+        case objtree::Object::PLANE:
+        {
+            const objtree::Plane *plane = (const objtree::Plane*)object;
+
+            const objtree::Point &bmin(plane->boundingMin());
+            const objtree::Point &bmax(plane->boundingMax());
+
+            //Plane keeps only its world aligned extents, so it is drawn as its (at least thin) bounding box
+            marker.pose.position.x = (bmin.x+bmax.x)/2;
+            marker.pose.position.y = (bmin.y+bmax.y)/2;
+            marker.pose.position.z = (bmin.z+bmax.z)/2;
+            marker.pose.orientation.w = 1.0;
+
+            marker.scale.x = std::max(bmax.x-bmin.x, 0.01f);
+            marker.scale.y = std::max(bmax.y-bmin.y, 0.01f);
+            marker.scale.z = std::max(bmax.z-bmin.z, 0.01f);
+
+            marker.color.a = 0.5;
+        }
+        break;
+    }
 }
 
 void CObjTreePlugin::getObjects(const objtree::Filter *filter, std::vector<unsigned int> &output)
 {
-    std::set<objtree::Object*> objects;
+    std::vector<objtree::Object*> objects;
 
     m_octree.objects(objects, filter);
     output.resize(objects.size());
 
-    unsigned int i = 0;
-    for(std::set<objtree::Object*>::iterator it = objects.begin(); it != objects.end(); it++, i++)
+    for(unsigned int i = 0; i < objects.size(); i++)
     {
-        output[i] = (*it)->id();
+        output[i] = objects[i]->id();
     }
 }
 
@@ -495,6 +643,10 @@ void CObjTreePlugin::publishCube(visualization_msgs::Marker &lines, float x, flo
 
 void CObjTreePlugin::removePrimitiveMarker(unsigned int id)
 {
+    //Only shown objects have an interactive primitive
+    if(m_primitives.erase(id) == 0)
+        return;
+
     srs_interaction_primitives::RemovePrimitive removePrimitiveSrv;
     char name[64];
     snprintf(name, sizeof(name), "imn%u", id);
@@ -503,9 +655,13 @@ void CObjTreePlugin::removePrimitiveMarker(unsigned int id)
     m_clientRemovePrimitive.call(removePrimitiveSrv);
 }
 
-void CObjTreePlugin::publishOctree(const std::list<objtree::Box> &nodes)
+void CObjTreePlugin::octreeMarker(visualization_msgs::Marker &lines)
 {
-    visualization_msgs::Marker lines;
+    std::vector<objtree::Object*> objects;
+    std::vector<objtree::Box> nodes;
+    objtree::FilterZero filter;
+
+    m_octree.nodes(nodes, objects, &filter);
 
     lines.header.frame_id = IM_SERVER_FRAME_ID;
     lines.header.stamp = ros::Time::now();
@@ -520,12 +676,13 @@ void CObjTreePlugin::publishOctree(const std::list<objtree::Box> &nodes)
 
     lines.scale.x = 0.03f;
 
-    for(std::list<objtree::Box>::const_iterator i = nodes.begin(); i != nodes.end(); i++)
+    //Each cube consists of 12 lines
+    lines.points.reserve(nodes.size()*24);
+
+    for(std::vector<objtree::Box>::const_iterator i = nodes.begin(); i != nodes.end(); i++)
     {
         publishCube(lines, i->x, i->y, i->z, i->w, i->h, i->d);
     }
-
-    m_markerPub.publish(lines);
 }
 
 }
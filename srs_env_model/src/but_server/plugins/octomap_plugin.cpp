@@ -27,6 +27,7 @@
 
 #include <srs_env_model/but_server/plugins/octomap_plugin.h>
 #include <srs_env_model/topics_list.h>
+#include <srs_env_model/but_server/parallel_tools.h>
 
 #include <pcl/sample_consensus/method_types.h>
 #include <pcl/sample_consensus/model_types.h>
@@ -35,6 +36,12 @@
 #include <pcl/filters/passthrough.h>
 #include <pcl_ros/transforms.h>
 
+#include <limits>
+#include <boost/unordered_map.hpp>
+#include <pcl/common/io.h>
+#include <algorithm>
+#include <iterator>
+
 // Filtering
 #include <visualization_msgs/MarkerArray.h>
 #include <visualization_msgs/Marker.h>
@@ -42,6 +49,15 @@
 // Interactive marker
 #include <srs_interaction_primitives/AddUnknownObject.h>
 
+namespace
+{
+	/// Deleter of shared pointers to data owned by someone else
+	struct SNullDeleter
+	{
+		void operator()(const void *) const {}
+	};
+}
+
 void srs_env_model::COctoMapPlugin::setDefaults() {
 	// Set octomap parameters
 	m_mapParameters.resolution = 0.1;
@@ -58,10 +74,34 @@ void srs_env_model::COctoMapPlugin::setDefaults() {
 	m_groundFilterDistance = 0.04;
 	m_groundFilterAngle = 0.15;
 	m_groundFilterPlaneDistance = 0.07;
+	m_groundFilterMinInlierRatio = 0.8;
+	m_bGroundPlaneValid = false;
+	m_groundPlaneD = 0.0;
+	m_groundPlaneInlierFraction = 0.0;
 	m_removeSpecles = false;
 
+	// Use all cores for ray insertion by default
+	m_insertThreads = 0;
+
+	// Crawl only changed parts of the map, do full crawl from time to time
+	m_bDeltaCrawl = true;
+	m_fullCrawlPeriod = 50;
+	m_deltaCrawlCounter = 0;
+	m_crawlId = 1;
+	m_mapParameters.bDeltaCrawl = false;
+
+	// Full crawls use all cores by default
+	m_crawlThreads = 0;
+	m_partitionDepth = 0;
+	m_mapParameters.numPartitions = 1;
+	m_mapParameters.partition = 0;
+
 	m_mapParameters.frameId = "/map";
 
+	m_bMapFromFile = false;
+	m_bLoadTilesOnFullCrawl = false;
+	m_tileEvictAge = 60;
+
 	m_bPublishOctomap = true;
 
 	// Filtering
@@ -96,11 +136,15 @@ srs_env_model::COctoMapPlugin::COctoMapPlugin(const std::string & name) :
 	m_data->octree.setOccupancyThres(m_mapParameters.thresOccupancy);
 	m_mapParameters.treeDepth = m_data->octree.getTreeDepth();
 	m_mapParameters.map = m_data;
+
+	// Snapshot crawled by the publishing thread
+	m_crawlData = new tButServerOcMap(m_mapParameters.resolution);
+	assert( m_crawlData != 0 );
 }
 
 srs_env_model::COctoMapPlugin::COctoMapPlugin(const std::string & name,
 		const std::string & filename) :
-	srs_env_model::CServerPluginBase(name) {
+	srs_env_model::CServerPluginBase(name), filecounter(0) {
 	setDefaults();
 
 	// Create octomap
@@ -112,12 +156,35 @@ srs_env_model::COctoMapPlugin::COctoMapPlugin(const std::string & name,
 	m_data->octree.setProbMiss(m_mapParameters.probMiss);
 	m_data->octree.setClampingThresMin(m_mapParameters.thresMin);
 	m_data->octree.setClampingThresMax(m_mapParameters.thresMax);
+	m_data->octree.setOccupancyThres(m_mapParameters.thresOccupancy);
 	m_mapParameters.treeDepth = m_data->octree.getTreeDepth();
+	m_mapParameters.map = m_data;
+
+	// Snapshot crawled by the publishing thread
+	m_crawlData = new tButServerOcMap(m_mapParameters.resolution);
+	assert( m_crawlData != 0 );
 
 	// is filename valid?
 	if (filename.length() > 0) {
-		// Try to load data
-		if (m_data->octree.readBinary(filename)) {
+		// Tiled map is only mapped, tiles are loaded on demand
+		if (CTiledOcTreeFile::isTiledFile(filename)) {
+			if (!m_tiledMap.open(filename) || m_tiledMap.getTreeDepth()
+					!= m_data->octree.getTreeDepth()) {
+				ROS_ERROR("Could not open requested tiled map file %s, exiting.", filename.c_str());
+				exit(-1);
+			}
+
+			ROS_INFO("Tiled octomap file %s opened (%zu tiles).", filename.c_str(), m_tiledMap.getNumTiles());
+
+			m_data->octree.setResolution(m_tiledMap.getResolution());
+			m_mapParameters.resolution = m_tiledMap.getResolution();
+			m_data->octree.markAllChanged();
+			m_bMapFromFile = true;
+
+			invalidate();
+
+		} else if (m_data->octree.readBinary(filename)) {
+			// Try to load data
 			ROS_INFO("Octomap file %s loaded (%zu nodes).", filename.c_str(), m_data->octree.size());
 
 			// get tree depth
@@ -126,6 +193,10 @@ srs_env_model::COctoMapPlugin::COctoMapPlugin(const std::string & name,
 			// get resolution
 			m_mapParameters.resolution = m_data->octree.getResolution();
 
+			// whole map is new
+			m_data->octree.markAllChanged();
+			m_bMapFromFile = true;
+
 			// We have new data
 			invalidate();
 
@@ -146,13 +217,17 @@ srs_env_model::COctoMapPlugin::~COctoMapPlugin() {
 	// Remove tester
 	if (m_removeTester != 0)
 		delete m_removeTester;
+
+	delete m_crawlData;
 }
 
 //! Initialize plugin - called in server constructor
 void srs_env_model::COctoMapPlugin::init(ros::NodeHandle & node_handle) {
 	PERROR( "Initializing OctoMapPlugin" );
 
-	reset();
+	// Do not throw away the loaded map
+	if (!m_bMapFromFile)
+		reset();
 
 	// Load parameters from the parameter server
 	node_handle.param("resolution", m_mapParameters.resolution,
@@ -183,6 +258,17 @@ void srs_env_model::COctoMapPlugin::init(ros::NodeHandle & node_handle) {
 				m_camera_stereo_offset_right, 0);
 	}
 
+	// Map resolution is given by the loaded file
+	if (m_bMapFromFile)
+		m_mapParameters.resolution = m_data->octree.getResolution();
+
+	// Should whole tiled map be loaded when it is crawled?
+	node_handle.param("tiled_map/load_on_full_crawl", m_bLoadTilesOnFullCrawl,
+			m_bLoadTilesOnFullCrawl);
+
+	// How long should unchanged tiles stay in the tree without being touched?
+	node_handle.param("tiled_map/evict_age", m_tileEvictAge, m_tileEvictAge);
+
 	// Set octomap parameters...
 	{
 		m_data->octree.setResolution(m_mapParameters.resolution);
@@ -204,6 +290,20 @@ void srs_env_model::COctoMapPlugin::init(ros::NodeHandle & node_handle) {
 	// distance of found plane from z=0 to be detected as ground (e.g. to exclude tables)
 	node_handle.param("ground_filter/plane_distance",
 			m_groundFilterPlaneDistance, m_groundFilterPlaneDistance);
+	// previous ground plane is kept while it has enough inliers (ratio > 1 means RANSAC in every scan)
+	node_handle.param("ground_filter/min_inlier_ratio",
+			m_groundFilterMinInlierRatio, m_groundFilterMinInlierRatio);
+
+	// Number of ray insertion threads
+	node_handle.param("insert_threads", m_insertThreads, m_insertThreads);
+
+	// Delta crawling
+	node_handle.param("delta_crawl", m_bDeltaCrawl, m_bDeltaCrawl);
+	node_handle.param("full_crawl_period", m_fullCrawlPeriod, m_fullCrawlPeriod);
+	m_data->octree.enableChangeDetection(m_bDeltaCrawl);
+
+	// Number of crawling threads
+	node_handle.param("crawl_threads", m_crawlThreads, m_crawlThreads);
 
 	// Octomap publishing topic
 	node_handle.param("octomap_publishing_topic", m_ocPublisherName,
@@ -237,23 +337,16 @@ void srs_env_model::COctoMapPlugin::insertCloud(const tPointCloud & cloud) {
 		return;
 
 	// Lock data
-	boost::mutex::scoped_lock lock(m_lockData);
+	boost::unique_lock<boost::shared_mutex> lock(m_lockData);
+
+	// Compact node timestamps are read by the outdated nodes test below
+	m_data->octree.saturateTimestamps();
 
 	ros::WallTime startTime = ros::WallTime::now();
 
 	tPointCloud pc_ground; // segmented ground plane
 	tPointCloud pc_nonground; // everything else
 
-	if (m_filterGroundPlane) {
-		filterGroundPlane(cloud, pc_ground, pc_nonground);
-
-	} else {
-		pc_nonground = cloud;
-		pc_ground.clear();
-		pc_ground.header = cloud.header;
-		pc_nonground.header = cloud.header;
-	}
-
 	tf::StampedTransform cloudToMapTf;
 
 	// Get transforms
@@ -271,6 +364,16 @@ void srs_env_model::COctoMapPlugin::insertCloud(const tPointCloud & cloud) {
 		return;
 	}
 
+	if (m_filterGroundPlane) {
+		filterGroundPlane(cloud, cloudToMapTf, pc_ground, pc_nonground);
+
+	} else {
+		pc_nonground = cloud;
+		pc_ground.clear();
+		pc_ground.header = cloud.header;
+		pc_nonground.header = cloud.header;
+	}
+
 	// transform clouds to world frame for insertion
 	if (m_mapParameters.frameId != cloud.header.frame_id) {
 		Eigen::Matrix4f c2mTM;
@@ -293,11 +396,7 @@ void srs_env_model::COctoMapPlugin::insertCloud(const tPointCloud & cloud) {
 	}
 
 	if (m_bRemoveOutdated) {
-		octomap::point3d sensor_origin = getSensorOrigin(cloud.header);
-		octomap::pose6d sensor_pose(sensor_origin.x(), sensor_origin.y(),
-				sensor_origin.z(), 0, 0, 0);
-
-		degradeOutdatedRaycasting(cloud.header, sensor_origin);
+		degradeOutdatedRaycasting(cloud.header, cloud);
 	}
 
 	double total_elapsed = (ros::WallTime::now() - startTime).toSec();
@@ -336,17 +435,41 @@ void srs_env_model::COctoMapPlugin::insertScan(
 	octomap::point3d sensorOrigin = octomap::pointTfToOctomap(sensorOriginTf);
 
 	double maxRange(m_mapParameters.maxRange);
+
+	// Load map tiles touched by the rays
+	if (m_tiledMap.isOpen()) {
+		octomap::point3d min(sensorOrigin), max(sensorOrigin);
+		for (tPointCloud::const_iterator it = nonground.begin(); it
+				!= nonground.end(); ++it) {
+			if (!pcl_isfinite(it->x))
+				continue;
+
+			min.x() = std::min(min.x(), it->x);
+			min.y() = std::min(min.y(), it->y);
+			min.z() = std::min(min.z(), it->z);
+			max.x() = std::max(max.x(), it->x);
+			max.y() = std::max(max.y(), it->y);
+			max.z() = std::max(max.z(), it->z);
+		}
+
+		m_tiledMap.loadBox(m_data->octree, min, max);
+	}
 	/*
 	 octomap::Pointcloud pcNonground;
 	 octomap::pointcloudPCLToOctomap( nonground, pcNonground );
 	 m_data->octree.insertScan( pcNonground, sensorOrigin, maxRange, true, false );
 	 */
-	m_data->octree.insertColoredScan(nonground, sensorOrigin, maxRange, true);
+	unsigned numThreads(getNumThreads(m_insertThreads));
+	if (numThreads > 1)
+		m_data->octree.insertColoredScanParallel(nonground, sensorOrigin, numThreads, maxRange, true);
+	else
+		m_data->octree.insertColoredScan(nonground, sensorOrigin, maxRange, true);
 
 }
 
 void srs_env_model::COctoMapPlugin::filterGroundPlane(const tPointCloud & pc,
-		tPointCloud & ground, tPointCloud & nonground) const {
+		const tf::Transform & cloudToMap, tPointCloud & ground,
+		tPointCloud & nonground) {
 	ground.header = pc.header;
 	nonground.header = pc.header;
 
@@ -354,112 +477,155 @@ void srs_env_model::COctoMapPlugin::filterGroundPlane(const tPointCloud & pc,
 		ROS_WARN("Pointcloud in OctomapServer too small, skipping ground plane extraction");
 		nonground = pc;
 	} else {
-		// plane detection for ground plane removal:
-		pcl::ModelCoefficients::Ptr coefficients(new pcl::ModelCoefficients);
-		pcl::PointIndices::Ptr inliers(new pcl::PointIndices);
-
-		// Create the segmentation object and set up:
-		pcl::SACSegmentation<tPclPoint> seg;
-		seg.setOptimizeCoefficients(true);
-		// TODO: maybe a filtering based on the surface normals might be more robust / accurate?
-		seg.setModelType(pcl::SACMODEL_PERPENDICULAR_PLANE);
-		seg.setMethodType(pcl::SAC_RANSAC);
-		seg.setMaxIterations(200);
-		seg.setDistanceThreshold(m_groundFilterDistance);
-		seg.setAxis(Eigen::Vector3f(0, 0, 1));
-		seg.setEpsAngle(m_groundFilterAngle);
-
-		tPointCloud cloud_filtered(pc);
-		// Create the filtering object
-		pcl::ExtractIndices<tPclPoint> extract;
+		// Cloud to map transformation
+		Eigen::Matrix4f c2mTM;
+		pcl_ros::transformAsMatrix(cloudToMap, c2mTM);
+		Eigen::Matrix3f c2mRot(c2mTM.block<3, 3> (0, 0));
+		Eigen::Vector3f c2mTrans(c2mTM.block<3, 1> (0, 3));
+
+		// Points are split by indices, clouds are built at the end only
+		std::vector<int> groundIndices, nongroundIndices;
 		bool groundPlaneFound = false;
 
-		while (cloud_filtered.size() > 10 && !groundPlaneFound) {
-			seg.setInputCloud(cloud_filtered.makeShared());
-			seg.segment(*inliers, *coefficients);
-			if (inliers->indices.size() == 0) {
-				ROS_WARN("No plane found in cloud.");
+		// Try the ground plane of the previous scan first
+		if (m_bGroundPlaneValid) {
+			Eigen::Vector3f normal(c2mRot.transpose() * m_groundPlaneNormal);
+			float d(m_groundPlaneNormal.dot(c2mTrans) + m_groundPlaneD);
+
+			if (isGroundPlane(normal, d)) {
+				for (size_t i = 0; i < pc.size(); ++i) {
+					const tPclPoint & point(pc.points[i]);
+					if (std::abs(normal.dot(point.getVector3fMap()) + d)
+							< m_groundFilterDistance)
+						groundIndices.push_back(i);
+					else
+						nongroundIndices.push_back(i);
+				}
 
-				break;
+				double fraction(double(groundIndices.size()) / pc.size());
+				groundPlaneFound = fraction >= m_groundFilterMinInlierRatio
+						* m_groundPlaneInlierFraction;
+
+				ROS_DEBUG("Previous ground plane: %zu/%zu inliers, %s", groundIndices.size(),
+						pc.size(), groundPlaneFound ? "used" : "rejected");
 			}
+		}
 
-			extract.setInputCloud(cloud_filtered.makeShared());
-			extract.setIndices(inliers);
-
-			if (std::abs(coefficients->values.at(3))
-					< m_groundFilterPlaneDistance) {
-				ROS_DEBUG("Ground plane found: %zu/%zu inliers. Coeff: %f %f %f %f", inliers->indices.size(),
-						cloud_filtered.size(), coefficients->values.at(0), coefficients->values.at(1),
-						coefficients->values.at(2), coefficients->values.at(3));
-				extract.setNegative(false);
-				extract.filter(ground);
-
-				// remove ground points from full pointcloud:
-				// workaround for PCL bug:
-				if (inliers->indices.size() != cloud_filtered.size()) {
-					extract.setNegative(true);
-					tPointCloud cloud_out;
-					extract.filter(cloud_out);
-					nonground += cloud_out;
-					cloud_filtered = cloud_out;
+		if (!groundPlaneFound) {
+			groundIndices.clear();
+			nongroundIndices.clear();
+			m_bGroundPlaneValid = false;
+
+			// plane detection for ground plane removal, cloud is not copied:
+			tPointCloud::ConstPtr cloud(&pc, SNullDeleter());
+			pcl::PointIndices::Ptr remaining(new pcl::PointIndices);
+			remaining->indices.resize(pc.size());
+			for (size_t i = 0; i < pc.size(); ++i)
+				remaining->indices[i] = i;
+
+			pcl::ModelCoefficients coefficients;
+			pcl::PointIndices inliers;
+
+			// Create the segmentation object and set up:
+			pcl::SACSegmentation<tPclPoint> seg;
+			seg.setOptimizeCoefficients(true);
+			// TODO: maybe a filtering based on the surface normals might be more robust / accurate?
+			seg.setModelType(pcl::SACMODEL_PERPENDICULAR_PLANE);
+			seg.setMethodType(pcl::SAC_RANSAC);
+			seg.setMaxIterations(200);
+			seg.setDistanceThreshold(m_groundFilterDistance);
+			seg.setAxis(Eigen::Vector3f(0, 0, 1));
+			seg.setEpsAngle(m_groundFilterAngle);
+			seg.setInputCloud(cloud);
+
+			while (remaining->indices.size() > 10 && !groundPlaneFound) {
+				seg.setIndices(remaining);
+				seg.segment(inliers, coefficients);
+				if (inliers.indices.size() == 0) {
+					ROS_WARN("No plane found in cloud.");
+
+					break;
 				}
 
-				groundPlaneFound = true;
-			} else {
-				ROS_DEBUG("Horizontal plane (not ground) found: %zu/%zu inliers. Coeff: %f %f %f %f", inliers->indices.size(),
-						cloud_filtered.size(), coefficients->values.at(0), coefficients->values.at(1),
-						coefficients->values.at(2), coefficients->values.at(3));
-				tPointCloud cloud_out;
-				extract.setNegative(false);
-				extract.filter(cloud_out);
-				nonground += cloud_out;
-				// debug
-				//            pcl::PCDWriter writer;
-				//            writer.write<tPclPoint>("nonground_plane.pcd",cloud_out, false);
-
-				// remove current plane from scan for next iteration:
-				// workaround for PCL bug:
-				if (inliers->indices.size() != cloud_filtered.size()) {
-					extract.setNegative(true);
-					cloud_out.points.clear();
-					extract.filter(cloud_out);
-					cloud_filtered = cloud_out;
+				// remove current plane from the searched indices
+				std::vector<int> rest;
+				rest.reserve(remaining->indices.size() - inliers.indices.size());
+				std::sort(inliers.indices.begin(), inliers.indices.end());
+				std::set_difference(remaining->indices.begin(),
+						remaining->indices.end(), inliers.indices.begin(),
+						inliers.indices.end(), std::back_inserter(rest));
+
+				ROS_DEBUG("%s plane found: %zu/%zu inliers. Coeff: %f %f %f %f",
+						std::abs(coefficients.values.at(3)) < m_groundFilterPlaneDistance ? "Ground" : "Horizontal (not ground)",
+						inliers.indices.size(), remaining->indices.size(),
+						coefficients.values.at(0), coefficients.values.at(1),
+						coefficients.values.at(2), coefficients.values.at(3));
+
+				remaining->indices.swap(rest);
+
+				if (std::abs(coefficients.values.at(3))
+						< m_groundFilterPlaneDistance) {
+					groundIndices.swap(inliers.indices);
+					groundPlaneFound = true;
+
+					// remember plane in the map frame for the next scans
+					Eigen::Vector3f normal(coefficients.values[0],
+							coefficients.values[1], coefficients.values[2]);
+					m_groundPlaneNormal = c2mRot * normal;
+					m_groundPlaneD = coefficients.values[3]
+							- m_groundPlaneNormal.dot(c2mTrans);
+					m_groundPlaneInlierFraction = double(groundIndices.size()) / pc.size();
+					m_bGroundPlaneValid = true;
 				} else {
-					cloud_filtered.points.clear();
+					nongroundIndices.insert(nongroundIndices.end(),
+							inliers.indices.begin(), inliers.indices.end());
 				}
 			}
 
+			nongroundIndices.insert(nongroundIndices.end(),
+					remaining->indices.begin(), remaining->indices.end());
 		}
+
 		// TODO: also do this if overall starting pointcloud too small?
 		if (!groundPlaneFound) { // no plane found or remaining points too small
 			ROS_WARN("No ground plane found in scan");
 
 			// do a rough filtering on height to prevent spurious obstacles
-			pcl::PassThrough<tPclPoint> second_pass;
-			second_pass.setFilterFieldName("z");
-			second_pass.setFilterLimits(-m_groundFilterPlaneDistance,
-					m_groundFilterPlaneDistance);
-			second_pass.setInputCloud(pc.makeShared());
-			second_pass.filter(ground);
-
-			second_pass.setFilterLimitsNegative(true);
-			second_pass.filter(nonground);
+			groundIndices.clear();
+			nongroundIndices.clear();
+			for (size_t i = 0; i < pc.size(); ++i) {
+				float z(pc.points[i].z);
+				if (z >= -m_groundFilterPlaneDistance && z
+						<= m_groundFilterPlaneDistance)
+					groundIndices.push_back(i);
+				else if (pcl_isfinite(z))
+					nongroundIndices.push_back(i);
+			}
 		}
 
-		// debug:
-		//        pcl::PCDWriter writer;
-		//        if (pc_ground.size() > 0)
-		//          writer.write<tPclPoint>("ground.pcd",pc_ground, false);
-		//        if (pc_nonground.size() > 0)
-		//          writer.write<tPclPoint>("nonground.pcd",pc_nonground, false);
-
+		pcl::copyPointCloud(pc, groundIndices, ground);
+		pcl::copyPointCloud(pc, nongroundIndices, nonground);
 	}
 }
 
+/**
+ * Is plane accepted as the ground plane? Tests the same constraints as RANSAC
+ * (plane perpendicular to the z axis and close enough to the origin).
+ */
+bool srs_env_model::COctoMapPlugin::isGroundPlane(
+		const Eigen::Vector3f& normal, float d) const {
+	return std::abs(normal.z()) >= std::cos(m_groundFilterAngle)
+			&& std::abs(d) < m_groundFilterPlaneDistance;
+}
+
 void srs_env_model::COctoMapPlugin::reset() {
 	// Lock data
-	boost::mutex::scoped_lock lock(m_lockData);
+	boost::unique_lock<boost::shared_mutex> lock(m_lockData);
 	m_data->octree.clear();
+	m_data->octree.markAllChanged();
+
+	// Reset drops the stored map too, so its tiles must not be loaded by the next crawl or insertion
+	m_tiledMap.discardAll();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -467,71 +633,158 @@ void srs_env_model::COctoMapPlugin::reset() {
 ///////////////////////////////////////////////////////////////////////////////
 
 /// Crawl octomap
-void srs_env_model::COctoMapPlugin::crawl(const ros::Time & currentTime) {
-	// Lock data
-	boost::mutex::scoped_lock lock(m_lockData);
+void srs_env_model::COctoMapPlugin::crawl(const ros::Time & currentTime, bool bAllowDelta) {
+	crawl(currentTime, getSignalVisitor(), bAllowDelta);
+}
 
-	// Fill needed structures
-	onCrawlStart(currentTime);
+/// Take changes made since the last crawl, start collecting new ones, decide crawl type and update the snapshot
+bool srs_env_model::COctoMapPlugin::takeChanges(const ros::Time & currentTime, bool bAllowDelta) {
+	boost::unique_lock<boost::shared_mutex> lock(m_lockData);
 
-	// Crawl through nodes
-	for (srs_env_model::tButServerOcTree::leaf_iterator it =
-			m_data->octree.begin_leafs(), end = m_data->octree.end_leafs(); it
-			!= end; ++it) {
+	// Map parameters are shared with the callbacks, crawl works on its own copy
+	fillMapParameters(currentTime);
+	m_crawlParameters = m_mapParameters;
 
-		// call general hook:
-		handleNode(it, m_mapParameters);
+	// Whole map will be crawled, so the rest of the tiled map must be loaded
+	if (m_bLoadTilesOnFullCrawl && m_data->octree.isAllChanged())
+		m_tiledMap.loadAll(m_data->octree);
 
-		// Node is occupied?
-		if (m_data->octree.isNodeOccupied(*it)) {
-			handleOccupiedNode(it, m_mapParameters);
-		} else { // node not occupied => mark as free in 2D map if unknown so far
+	// Keep only the working set of the tiled map in the tree, evicted tiles are part of the changes
+	if (m_tileEvictAge > 0 && m_tiledMap.isOpen())
+		m_tiledMap.evictUntouched(m_data->octree, m_tileEvictAge);
 
-			handleFreeNode(it, m_mapParameters);
-		} // Node is occupied?
-	} // Iterate through octree
+	SCrawlChanges changes;
+	changes.bAllChanged = m_data->octree.isAllChanged();
+	changes.bChanged = m_data->octree.getChangedBBX(changes.min, changes.max);
+	m_data->octree.resetChangeDetection();
 
-	handlePostNodeTraversal(m_mapParameters);
-	/*
-	 std::stringstream ss;
-	 ss << "/home/wik/output/octomap" << filecounter << ".bt";
+	bool bVisitNodes(startCrawl(changes, bAllowDelta));
 
-	 PERROR( "Writing: " << ss.str() );
-	 m_data->octree.writeBinary( ss.str() );
-	 ++filecounter;
-	 */
+	// Full crawl copies the whole map, so changes missed by the change detection are fixed too
+	if (!m_crawlParameters.bDeltaCrawl)
+		m_crawlData->octree.copyTree(m_data->octree);
+	else if (bVisitNodes)
+		m_crawlData->octree.copyBox(m_data->octree, m_crawlParameters.crawlMin, m_crawlParameters.crawlMax);
+
+	m_crawlParameters.map = m_crawlData;
+
+	return bVisitNodes;
 }
 
-/// On octomap crawling start
-void srs_env_model::COctoMapPlugin::onCrawlStart(const ros::Time & currentTime) {
+/// Decide crawl type and fill crawl parameters
+bool srs_env_model::COctoMapPlugin::startCrawl(const SCrawlChanges & changes, bool bAllowDelta) {
 
-	fillMapParameters(currentTime);
+	// Decide crawl type
+	bool bDelta(bAllowDelta && m_bDeltaCrawl && !changes.bAllChanged);
+	if (bDelta && m_fullCrawlPeriod > 0 && ++m_deltaCrawlCounter >= m_fullCrawlPeriod)
+		bDelta = false;
 
-	// Call signal
-	m_sigOnStart(m_mapParameters);
-}
+	if (!bDelta)
+		m_deltaCrawlCounter = 0;
 
-/// Handle node
-void srs_env_model::COctoMapPlugin::handleNode(tButServerOcTree::iterator & it,
-		const SMapParameters & mp) {
-	m_sigOnNode(it, mp);
-}
+	m_crawlParameters.bDeltaCrawl = bDelta;
+
+	if (bDelta) {
+		if (changes.bChanged)
+			computeCrawledBox(changes.min, changes.max, m_crawlParameters.crawlMin, m_crawlParameters.crawlMax);
+		else {
+			// Nothing changed - empty crawled box
+			m_crawlParameters.crawlMin = octomap::point3d(1.0, 1.0, 1.0);
+			m_crawlParameters.crawlMax = octomap::point3d(-1.0, -1.0, -1.0);
+		}
+	}
 
-/// Handle free node
-void srs_env_model::COctoMapPlugin::handleFreeNode(
-		tButServerOcTree::iterator & it, const SMapParameters & mp) {
-	m_sigOnFreeNode(it, mp);
+	return !bDelta || changes.bChanged;
 }
 
-/// Handle occupied node
-void srs_env_model::COctoMapPlugin::handleOccupiedNode(
-		tButServerOcTree::iterator & it, const SMapParameters & mp) {
-	m_sigOnOccupiedNode(it, mp);
+/**
+ * Compute box crawled by the delta crawl.
+ *
+ * Box of changed keys is enlarged to contain whole leafs intersecting it, so that
+ * pruned/expanded nodes are completely removed from the plugins data and crawled again.
+ */
+void srs_env_model::COctoMapPlugin::computeCrawledBox(
+		const octomap::point3d & changed_min, const octomap::point3d & changed_max,
+		octomap::point3d & bbx_min, octomap::point3d & bbx_max) {
+	tButServerOcTree & tree(m_data->octree);
+
+	bbx_min = changed_min;
+	bbx_max = changed_max;
+
+	for (srs_env_model::tButServerOcTree::leaf_bbx_iterator it =
+			tree.begin_leafs_bbx(changed_min, changed_max), end =
+			tree.end_leafs_bbx(); it != end; ++it) {
+		float half(0.5 * it.getSize());
+		octomap::point3d center(it.getCoordinate());
+
+		for (unsigned i = 0; i < 3; ++i) {
+			bbx_min(i) = std::min(bbx_min(i), center(i) - half);
+			bbx_max(i) = std::max(bbx_max(i), center(i) + half);
+		}
+	}
 }
 
-void srs_env_model::COctoMapPlugin::handlePostNodeTraversal(
-		const SMapParameters & mp) {
-	m_sigOnPost(mp);
+/**
+ * Split map to the partitions for the parallel crawl.
+ *
+ * Map is cut along the x axis to slabs made of whole columns of the partition depth
+ * nodes, so every leaf not larger than the column lies in exactly one partition.
+ * Returns number of partitions, zero if map is too small to be split.
+ */
+unsigned srs_env_model::COctoMapPlugin::computePartitions(unsigned numPartitions) {
+	m_partitions.clear();
+
+	const tButServerOcTree & tree(m_crawlData->octree);
+	if (numPartitions < 2 || tree.size() == 0)
+		return 0;
+
+	// Keys of the first and the last voxel of the map
+	double x, y, z;
+	float half(0.5 * tree.getResolution());
+	octomap::OcTreeKey minKey, maxKey;
+
+	tree.getMetricMin(x, y, z);
+	if (!tree.genKey(octomap::point3d(x + half, y + half, z + half), minKey))
+		return 0;
+
+	tree.getMetricMax(x, y, z);
+	if (!tree.genKey(octomap::point3d(x - half, y - half, z - half), maxKey))
+		return 0;
+
+	// Column size is the largest power of two giving at least two columns per partition
+	unsigned depth(tree.getTreeDepth());
+	unsigned width(maxKey[0] - minKey[0] + 1);
+	unsigned level(0);
+	while (level < depth && (2u << level) * 2 * numPartitions <= width)
+		++level;
+
+	m_partitionDepth = depth - level;
+
+	unsigned first(minKey[0] >> level), columns((maxKey[0] >> level) - first + 1);
+	numPartitions = std::min(numPartitions, columns);
+	if (numPartitions < 2)
+		return 0;
+
+	m_partitions.resize(numPartitions);
+	for (unsigned p = 0; p < numPartitions; ++p) {
+		SCrawlPartition & part(m_partitions[p]);
+
+		unsigned begin(first + columns * p / numPartitions);
+		unsigned end(first + columns * (p + 1) / numPartitions);
+		part.keyMin = std::max<unsigned>(begin << level, minKey[0]);
+		part.keyMax = std::min<unsigned>((end << level) - 1, maxKey[0]);
+
+		// Crawled box goes through voxel centers, so it contains whole voxels only
+		octomap::OcTreeKey key(minKey);
+		key[0] = part.keyMin;
+		tree.genCoords(key, depth, part.min);
+
+		key = maxKey;
+		key[0] = part.keyMax;
+		tree.genCoords(key, depth, part.max);
+	}
+
+	return numPartitions;
 }
 
 //! Should plugin publish data?
@@ -541,7 +794,7 @@ bool srs_env_model::COctoMapPlugin::shouldPublish() {
 
 void srs_env_model::COctoMapPlugin::onPublish(const ros::Time & timestamp) {
 	// Lock data
-	boost::mutex::scoped_lock lock(m_lockData);
+	boost::shared_lock<boost::shared_mutex> lock(m_lockData);
 	octomap_ros::OctomapBinary map;
 	map.header.frame_id = m_mapParameters.frameId;
 	map.header.stamp = timestamp;
@@ -592,11 +845,30 @@ void srs_env_model::COctoMapPlugin::cameraInfoCB(
 }
 
 /**
- * Remove outdated nodes
+ * Tests outdated nodes against the depth buffer, each thread tests continuous block of nodes
+ */
+struct srs_env_model::COctoMapPlugin::SOutdatedTestWorker {
+	const COctoMapPlugin * plugin;
+	std::vector<SOutdatedNode> * nodes;
+
+	void operator()(unsigned thread, unsigned numThreads) {
+		size_t begin, end;
+		getThreadRange(nodes->size(), thread, numThreads, begin, end);
+
+		for (size_t i = begin; i < end; ++i)
+			(*nodes)[i].bSeenThrough = plugin->isSeenThrough((*nodes)[i].position);
+	}
+};
+
+/**
+ * Remove outdated nodes.
+ *
+ * Occupied nodes in the sensor cone not updated by the last scan are degraded
+ * if the sensor has seen through them. Visibility is tested against the depth
+ * buffer of the scan instead of casting ray from each node to the sensor.
  */
 void srs_env_model::COctoMapPlugin::degradeOutdatedRaycasting(
-		const std_msgs::Header& sensor_header,
-		const octomap::point3d& sensor_origin) {
+		const std_msgs::Header& sensor_header, const tPointCloud& cloud) {
 	if (!m_bCamModelInitialized) {
 		ROS_INFO ("ERROR: camera model not initialized.");
 		return;
@@ -615,6 +887,15 @@ void srs_env_model::COctoMapPlugin::degradeOutdatedRaycasting(
 	octomap::point3d max;
 	computeBBX(sensor_header, min, max);
 
+	// Tested nodes must be in the tree
+	m_tiledMap.loadBox(tree, min, max);
+
+	// Rasterize current scan once instead of casting ray for each node
+	fillDepthBuffer(cloud);
+
+	// Collect outdated occupied nodes
+	std::vector<SOutdatedNode> nodes;
+
 	unsigned query_time = time(NULL);
 	unsigned max_update_time = 1;
 	for (tButServerOcTree::leaf_bbx_iterator it =
@@ -622,65 +903,148 @@ void srs_env_model::COctoMapPlugin::degradeOutdatedRaycasting(
 			!= end; ++it) {
 		if (tree.isNodeOccupied(*it) && ((query_time - it->getTimestamp())
 				> max_update_time)) {
-			tf::Point pos(it.getX(), it.getY(), it.getZ());
-			tf::Point posRel = to_sensor(pos);
-			cv::Point2d uv = m_camera_model.project3dToPixel(cv::Point3d(
-					posRel.x(), posRel.y(), posRel.z()));
+			tf::Point posRel = to_sensor(tf::Point(it.getX(), it.getY(), it.getZ()));
+
+			SOutdatedNode node;
+			node.node = &*it;
+			node.key = it.getKey();
+			node.position = octomap::point3d(posRel.x(), posRel.y(), posRel.z());
+			node.bSeenThrough = false;
+			nodes.push_back(node);
+		}
+	}
 
-			// ignore point if not in sensor cone
-			if (!inSensorCone(uv))
-				continue;
+	// Test nodes against the depth buffer, it is not worth of threads for few nodes
+	SOutdatedTestWorker worker = { this, &nodes };
+	runParallel(nodes.size() > 1000 ? getNumThreads(m_insertThreads) : 1, worker);
 
-			// ignore point if it is occluded in the map
-			if (isOccludedMap(sensor_origin, it.getCoordinate()))
-				continue;
+	// Degrade nodes the sensor has seen through
+	for (std::vector<SOutdatedNode>::const_iterator it = nodes.begin(); it
+			!= nodes.end(); ++it) {
+		if (it->bSeenThrough) {
+			tree.integrateMissNoTime(it->node);
+			tree.markChanged(it->key);
+		}
+	}
+}
+
+/**
+ * Rasterize scan points to the depth buffer.
+ *
+ * Each point is splatted to the area covered by the voxel (limited to few pixels),
+ * so that sparse or downsampled scans do not leave holes in the buffer.
+ */
+void srs_env_model::COctoMapPlugin::fillDepthBuffer(const tPointCloud& cloud) {
+	const int maxSplat(3);
+	int width(m_camera_size.width), height(m_camera_size.height);
+
+	m_depthBuffer.assign(width * height, std::numeric_limits<float>::max());
+
+	double voxelPixels(m_camera_model.fx() * m_mapParameters.resolution);
+
+	for (tPointCloud::const_iterator it = cloud.begin(); it != cloud.end(); ++it) {
+		// Skips also invalid (NaN) points
+		if (!(it->z > 0.0f))
+			continue;
 
-			// otherwise: degrade node
-			tree.integrateMissNoTime(&*it);
+		cv::Point2d uv = m_camera_model.project3dToPixel(cv::Point3d(it->x,
+				it->y, it->z));
+		if (uv.x < -maxSplat || uv.x > width + maxSplat || uv.y < -maxSplat
+				|| uv.y > height + maxSplat)
+			continue;
 
+		int u(cvRound(uv.x)), v(cvRound(uv.y));
+		int splat(std::min(maxSplat, int(0.5 * voxelPixels / it->z)));
+
+		for (int y = std::max(0, v - splat); y <= std::min(height - 1, v + splat); ++y) {
+			float * row(&m_depthBuffer[y * width]);
+			for (int x = std::max(0, u - splat); x <= std::min(width - 1, u + splat); ++x)
+				row[x] = std::min(row[x], it->z);
 		}
 	}
 }
 
 /**
- * Remove speckles
+ * Is point in the sensor cone and not occluded by the measured surface?
+ *
+ * Point is occluded if some scan point lies in front of it by more than the resolution.
+ */
+bool srs_env_model::COctoMapPlugin::isSeenThrough(const octomap::point3d& p) const {
+	if (p.z() <= 0.0)
+		return false;
+
+	cv::Point2d uv = m_camera_model.project3dToPixel(cv::Point3d(p.x(), p.y(), p.z()));
+
+	// ignore point if not in sensor cone
+	if (!inSensorCone(uv))
+		return false;
+
+	int u(cvRound(uv.x)), v(cvRound(uv.y));
+	if (u < 0 || u >= m_camera_size.width || v < 0 || v >= m_camera_size.height)
+		return false;
+
+	return m_depthBuffer[v * m_camera_size.width + u] > p.z() - m_mapParameters.resolution;
+}
+
+/**
+ * Remove speckles - occupied nodes without any occupied neighbor.
+ *
+ * Only occupied cells of the last scan are tested, older nodes were tested
+ * when they were inserted. Neighborhoods of adjacent cells overlap, so the
+ * occupancy of searched keys is cached for the whole pass.
  */
 void srs_env_model::COctoMapPlugin::degradeSingleSpeckles() {
 	tButServerOcTree & tree(m_data->octree);
+	const octomap::KeySet & keys(tree.getLastOccupiedKeys());
+
+	typedef boost::unordered_map<octomap::OcTreeKey, bool,
+			octomap::OcTreeKey::KeyHash> tOccupancyCache;
+	tOccupancyCache occupancy(keys.size() * 4);
+
+	for (octomap::KeySet::const_iterator it = keys.begin(), end = keys.end(); it
+			!= end; ++it) {
+		const octomap::OcTreeKey & nKey(*it);
 
-	for (tButServerOcTree::leaf_iterator it = m_data->octree.begin_leafs(),
-			end = m_data->octree.end_leafs(); it != end; ++it) {
 		// Test if node is occupied
-		if (m_data->octree.isNodeOccupied(*it)) {
-			octomap::OcTreeKey nKey = it.getKey();
-			octomap::OcTreeKey key;
-			bool neighborFound = false;
-
-			// Find neighbours
-			for (key[2] = nKey[2] - 1; !neighborFound && key[2] <= nKey[2] + 1; ++key[2]) {
-				for (key[1] = nKey[1] - 1; !neighborFound && key[1] <= nKey[1]
-						+ 1; ++key[1]) {
-					for (key[0] = nKey[0] - 1; !neighborFound && key[0]
-							<= nKey[0] + 1; ++key[0]) {
-						if (key != nKey) {
-							tButServerOcTree::NodeType* node = tree.search(key);
-							if (node && tree.isNodeOccupied(node)) {
-								// we have a neighbor => break!
-								neighborFound = true;
-							}
-						}
+		tButServerOcTree::NodeType* node = tree.search(nKey);
+		if (node == 0 || !tree.isNodeOccupied(node))
+			continue;
+
+		octomap::OcTreeKey key;
+		bool neighborFound = false;
+
+		// Find neighbours
+		for (key[2] = nKey[2] - 1; !neighborFound && key[2] <= nKey[2] + 1; ++key[2]) {
+			for (key[1] = nKey[1] - 1; !neighborFound && key[1] <= nKey[1]
+					+ 1; ++key[1]) {
+				for (key[0] = nKey[0] - 1; !neighborFound && key[0]
+						<= nKey[0] + 1; ++key[0]) {
+					if (key == nKey)
+						continue;
+
+					tOccupancyCache::iterator cached = occupancy.find(key);
+					if (cached == occupancy.end()) {
+						tButServerOcTree::NodeType* neighbor = tree.search(key);
+						cached = occupancy.insert(std::make_pair(key, neighbor
+								!= 0 && tree.isNodeOccupied(neighbor))).first;
 					}
+
+					// we have a neighbor => break!
+					neighborFound = cached->second;
 				}
 			}
+		}
 
-			// done with search, see if found and degrade otherwise:
-			if (!neighborFound) {
-				ROS_DEBUG("Degrading single speckle at (%f,%f,%f)", it.getX(), it.getY(), it.getZ());
+		// done with search, see if found and degrade otherwise:
+		if (!neighborFound) {
+			ROS_DEBUG("Degrading single speckle at key (%d,%d,%d)", nKey[0], nKey[1], nKey[2]);
 
-				// Remove it...
-				m_data->octree.integrateMissNoTime(&*it);
-			}
+			// Remove it...
+			tree.integrateMissNoTime(node);
+			tree.markChanged(nKey);
 
+			// Speckles tested later must see the degraded node
+			occupancy[nKey] = tree.isNodeOccupied(node);
 		}
 	}
 }
@@ -817,26 +1181,6 @@ bool srs_env_model::COctoMapPlugin::inSensorCone(const cv::Point2d& uv) const {
 			> 1) && (uv.y < m_camera_size.height - 2));
 }
 
-/**
- * Return true, if occupied cell is between origin and p
- */
-bool srs_env_model::COctoMapPlugin::isOccludedMap(
-		const octomap::point3d& sensor_origin, const octomap::point3d& p) const {
-
-	octomap::point3d direction(p - sensor_origin);
-	octomap::point3d obstacle;
-	double range = direction.norm() - m_mapParameters.resolution;
-
-	if (m_data->octree.castRay(sensor_origin, direction, obstacle, true, range)) {
-		// fprintf(stderr, "<%.2f , %.2f , %.2f> -> <%.2f , %.2f , %.2f> // obs at: <%.2f , %.2f , %.2f>, range: %.2f\n",
-		//         sensor_origin.x(), sensor_origin.y(), sensor_origin.z(),
-		//         p.x(), p.y(), p.z(),
-		//         obstacle.x(), obstacle.y(), obstacle.z(), (obstacle-p).norm());
-		return true;
-	}
-	return false;
-}
-
 octomap::point3d srs_env_model::COctoMapPlugin::getSensorOrigin(
 		const std_msgs::Header& sensor_header) {
 	geometry_msgs::PointStamped stamped_in;
@@ -900,6 +1244,7 @@ long int srs_env_model::COctoMapPlugin::doObjectTesting(
 			if (object->isIn(it.getX(), it.getY(), it.getZ())) {
 				// "Remove" node
 				m_data->octree.integrateMissNoTime(&*it);
+				m_data->octree.markChanged(it.getKey());
 				//				m_data->octree.updateNodeLogOdds(&*it, -0.8);
 				++counter;
 			}
@@ -926,12 +1271,19 @@ bool srs_env_model::COctoMapPlugin::removeCubeCB(
 	if (m_removeTester != 0)
 		delete m_removeTester;
 
+	// Time of the last crawl is written by the publishing thread
+	ros::Time currentTime;
+	{
+		boost::shared_lock<boost::shared_mutex> lock(m_lockData);
+		currentTime = m_mapParameters.currentTime;
+	}
+
 	// Test frame id
 	if (req.frame_id != m_mapParameters.frameId) {
 		// Transform pose
 		geometry_msgs::PoseStamped ps, psout;
 		ps.header.frame_id = req.frame_id;
-		ps.header.stamp = m_mapParameters.currentTime;
+		ps.header.stamp = currentTime;
 		ps.pose = req.pose;
 
 		m_tfListener.transformPose(m_mapParameters.frameId, ps, psout);
@@ -940,7 +1292,7 @@ bool srs_env_model::COctoMapPlugin::removeCubeCB(
 		// Transform size
 		geometry_msgs::PointStamped vs, vsout;
 		vs.header.frame_id = req.frame_id;
-		vs.header.stamp = m_mapParameters.currentTime;
+		vs.header.stamp = currentTime;
 		vs.point = req.size;
 
 		m_tfListener.transformPoint(m_mapParameters.frameId, vs, vsout);
@@ -949,6 +1301,18 @@ bool srs_env_model::COctoMapPlugin::removeCubeCB(
 		//		PERROR( "Transformed cube from octomap: " << req.pose << " --- " << req.size );
 	}
 
+	// Load map tiles around the cube (bounding sphere)
+	if (m_tiledMap.isOpen()) {
+		boost::unique_lock<boost::shared_mutex> lock(m_lockData);
+
+		Eigen::Vector3f size(G2EPOINT( req.size ));
+		float radius(0.5 * size.norm());
+		octomap::point3d center(req.pose.position.x, req.pose.position.y, req.pose.position.z);
+		octomap::point3d extent(radius, radius, radius);
+
+		m_tiledMap.loadBox(m_data->octree, center - extent, center + extent);
+	}
+
 	// Create new tester
 	m_removeTester = new srs_env_model::CTestingPolymesh(
 			G2EPOINT( req.pose.position ), G2EQUAT( req.pose.orientation ),
@@ -36,6 +36,131 @@
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
 
+#include <boost/unordered_map.hpp>
+#include <cmath>
+
+namespace
+{
+	/// Voxel of the input downsampling grid - sums of the point coordinates and colors
+	struct SInputVoxel
+	{
+		Eigen::Vector3f position;
+		float r, g, b;
+		unsigned count;
+	};
+
+	/// Get point color (points without color are black)
+	inline void getColor( const pcl::PointXYZ & point, float & r, float & g, float & b ) { r = g = b = 0.0; }
+	inline void getColor( const pcl::PointXYZRGB & point, float & r, float & g, float & b ) { r = point.r; g = point.g; b = point.b; }
+
+	/// Get voxel hash key (21 bits for each coordinate)
+	inline boost::uint64_t voxelKey( const Eigen::Vector4f & point, float invSize )
+	{
+		const boost::int64_t offset( 1 << 20 ), mask( (1 << 21) - 1 );
+		boost::int64_t x( (boost::int64_t)std::floor( point[0] * invSize ) + offset );
+		boost::int64_t y( (boost::int64_t)std::floor( point[1] * invSize ) + offset );
+		boost::int64_t z( (boost::int64_t)std::floor( point[2] * invSize ) + offset );
+
+		return ( (boost::uint64_t)(x & mask) << 42 ) | ( (boost::uint64_t)(y & mask) << 21 ) | (boost::uint64_t)(z & mask);
+	}
+
+	/**
+	 * Transform, filter and downsample input cloud in one pass.
+	 *
+	 * @param in Input cloud
+	 * @param toOutput Input to output frame transformation
+	 * @param filterZ Row of the input to filtering frame transformation giving z coordinate (zero vector disables filtering)
+	 * @param minZ, maxZ Filtering range
+	 * @param voxelSize Downsampling voxel size (zero or less disables downsampling)
+	 * @param out Output cloud
+	 */
+	template< class tpPoint >
+	void processInputCloud( const pcl::PointCloud< tpPoint > & in, const Eigen::Matrix4f & toOutput, const Eigen::Vector4f & filterZ,
+							double minZ, double maxZ, double voxelSize, srs_env_model::tPointCloud & out )
+	{
+		bool bFilter( !filterZ.isZero() );
+		bool bDownsample( voxelSize > 0.0 );
+		float invSize( bDownsample ? 1.0 / voxelSize : 0.0 );
+
+		std::vector< SInputVoxel > voxels;
+		boost::unordered_map< boost::uint64_t, size_t > voxelIndex;
+
+		out.points.clear();
+		out.points.reserve( bDownsample ? in.points.size() / 4 : in.points.size() );
+
+		for( typename pcl::PointCloud< tpPoint >::VectorType::const_iterator it = in.points.begin(); it != in.points.end(); ++it )
+		{
+			if( !pcl_isfinite( it->x ) || !pcl_isfinite( it->y ) || !pcl_isfinite( it->z ) )
+				continue;
+
+			// Homogeneous coordinates - 4x4 products are vectorized by Eigen
+			Eigen::Vector4f point( it->x, it->y, it->z, 1.0 );
+
+			if( bFilter )
+			{
+				float z( filterZ.dot( point ) );
+				if( z < minZ || z > maxZ )
+					continue;
+			}
+
+			Eigen::Vector4f transformed( toOutput * point );
+
+			float r, g, b;
+			getColor( *it, r, g, b );
+
+			if( !bDownsample )
+			{
+				srs_env_model::tPclPoint p;
+				p.x = transformed[0];
+				p.y = transformed[1];
+				p.z = transformed[2];
+				p.r = r;
+				p.g = g;
+				p.b = b;
+				out.points.push_back( p );
+				continue;
+			}
+
+			// Accumulate voxel
+			std::pair< boost::unordered_map< boost::uint64_t, size_t >::iterator, bool > inserted(
+					voxelIndex.insert( std::make_pair( voxelKey( transformed, invSize ), voxels.size() ) ) );
+
+			if( inserted.second )
+			{
+				SInputVoxel voxel = { transformed.head<3>(), r, g, b, 1 };
+				voxels.push_back( voxel );
+			}
+			else
+			{
+				SInputVoxel & voxel( voxels[inserted.first->second] );
+				voxel.position += transformed.head<3>();
+				voxel.r += r;
+				voxel.g += g;
+				voxel.b += b;
+				++voxel.count;
+			}
+		}
+
+		// Voxel centroids
+		for( std::vector< SInputVoxel >::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+		{
+			float inv( 1.0 / it->count );
+			srs_env_model::tPclPoint p;
+			p.x = it->position[0] * inv;
+			p.y = it->position[1] * inv;
+			p.z = it->position[2] * inv;
+			p.r = it->r * inv;
+			p.g = it->g * inv;
+			p.b = it->b * inv;
+			out.points.push_back( p );
+		}
+
+		out.width = out.points.size();
+		out.height = 1;
+		out.is_dense = true;
+	}
+}
+
 
 /// Constructor
 srs_env_model::CPointCloudPlugin::CPointCloudPlugin(const std::string & name, bool subscribe)
@@ -51,6 +176,10 @@ srs_env_model::CPointCloudPlugin::CPointCloudPlugin(const std::string & name, bo
 , m_pointcloudMaxZ(std::numeric_limits<double>::max())
 , m_bUseRGB( true )
 , m_bRGB_byParameter(false)
+, m_bTransformOutput(false)
+, m_bOutputValid(false)
+, m_bDownsampleInput(true)
+, m_inputVoxelSize(0.0)
 {
 	m_data = new tData;
 	assert( m_data != 0 );
@@ -85,6 +214,9 @@ void srs_env_model::CPointCloudPlugin::init(ros::NodeHandle & node_handle)
 	node_handle.param("pointcloud_min_z", m_pointcloudMinZ, m_pointcloudMinZ);
 	node_handle.param("pointcloud_max_z", m_pointcloudMaxZ, m_pointcloudMaxZ);
 
+	// Should be input downsampled to the map resolution?
+	node_handle.param("pointcloud_downsample", m_bDownsampleInput, m_bDownsampleInput);
+
 	// Contains input pointcloud RGB?
 	if( node_handle.hasParam("input_has_rgb") )
 	{
@@ -129,6 +261,13 @@ void srs_env_model::CPointCloudPlugin::onPublish(const ros::Time & timestamp)
 	if( ! shouldPublish() )
 		return;
 
+	// Crawled octomap points are written directly to the message
+	if( !m_bAsInput )
+	{
+		m_pcPublisher.publish( createOutputCloud( timestamp ) );
+		return;
+	}
+
 	// No data...
 	if( m_data->size() == 0 )
 		return;
@@ -144,6 +283,53 @@ void srs_env_model::CPointCloudPlugin::onPublish(const ros::Time & timestamp)
 
 }
 
+/**
+ * Write crawled points to the output message
+ */
+srs_env_model::CPointCloudPlugin::tIncommingPointCloud::Ptr srs_env_model::CPointCloudPlugin::createOutputCloud( const ros::Time & timestamp )
+{
+	tIncommingPointCloud::Ptr cloud( new tIncommingPointCloud );
+
+	cloud->header.frame_id = m_pcFrameId;
+	cloud->header.stamp = timestamp;
+
+	// Packed x, y, z, rgb floats
+	const char * names[] = { "x", "y", "z", "rgb" };
+	cloud->fields.resize( 4 );
+	for( unsigned i = 0; i < 4; ++i )
+	{
+		cloud->fields[i].name = names[i];
+		cloud->fields[i].offset = i * sizeof(float);
+		cloud->fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+		cloud->fields[i].count = 1;
+	}
+
+	size_t size( m_ocPoints.points.size() );
+	cloud->height = 1;
+	cloud->width = size;
+	cloud->is_bigendian = false;
+	cloud->point_step = 4 * sizeof(float);
+	cloud->row_step = cloud->point_step * size;
+	cloud->is_dense = true;
+	cloud->data.resize( cloud->row_step );
+
+	// Transform is done while writing
+	float * out( reinterpret_cast< float * >( cloud->data.empty() ? 0 : &cloud->data[0] ) );
+	for( tPointCloud::VectorType::const_iterator it = m_ocPoints.points.begin(); it != m_ocPoints.points.end(); ++it, out += 4 )
+	{
+		Eigen::Vector3f point( it->x, it->y, it->z );
+		if( m_bTransformOutput )
+			point = m_ocToPcRot * point + m_ocToPcTrans;
+
+		out[0] = point[0];
+		out[1] = point[1];
+		out[2] = point[2];
+		out[3] = it->rgb;
+	}
+
+	return cloud;
+}
+
 //! Set used octomap frame id and timestamp
 void srs_env_model::CPointCloudPlugin::onFrameStart( const SMapParameters & par )
 {
@@ -152,12 +338,39 @@ void srs_env_model::CPointCloudPlugin::onFrameStart( const SMapParameters & par
 	m_DataTimeStamp = m_time_stamp = par.currentTime;
 	counter = 0;
 
+	if( !par.bDeltaCrawl )
+	{
+		m_ocPoints.clear();
+		m_ocSizes.clear();
+	}
+	else
+	{
+		// Remove points which will be crawled again
+		size_t n( 0 );
+		for( size_t i = 0; i < m_ocPoints.size(); ++i )
+		{
+			const tPclPoint & point( m_ocPoints.points[i] );
+			if( par.isInCrawledBox( point.x, point.y, point.z, m_ocSizes[i] ) )
+				continue;
+
+			m_ocPoints.points[n] = point;
+			m_ocSizes[n] = m_ocSizes[i];
+			++n;
+		}
+		m_ocPoints.points.resize( n );
+		m_ocSizes.resize( n );
+	}
+
+	// Partition buffers are used by the parallel crawl only
+	m_partPoints.resize( par.numPartitions > 1 ? par.numPartitions : 0 );
+	m_partSizes.resize( m_partPoints.size() );
+
 	// Pointcloud is used as output for octomap...
 	m_bAsInput = false;
 }
 
 /// hook that is called when traversing occupied nodes of the updated Octree (does nothing here)
-void srs_env_model::CPointCloudPlugin::handleOccupiedNode(srs_env_model::tButServerOcTree::iterator& it, const SMapParameters & mp)
+void srs_env_model::CPointCloudPlugin::handleOccupiedNode(srs_env_model::tButServerOcIterator & it, const SMapParameters & mp)
 {
 //	std::cerr << "PCP: handle occupied" << std::endl;
 	tPclPoint point;
@@ -180,16 +393,38 @@ void srs_env_model::CPointCloudPlugin::handleOccupiedNode(srs_env_model::tButSer
 	point.g = counter % 255;
 	point.b = 128;
 */
-	m_data->push_back( point );
+	if( mp.numPartitions > 1 )
+	{
+		// Parallel crawl - buffers are merged in handlePostNodeTraversal
+		m_partPoints[mp.partition].push_back( point );
+		m_partSizes[mp.partition].push_back( it.getSize() );
+		return;
+	}
+
+	m_ocPoints.points.push_back( point );
+	m_ocSizes.push_back( it.getSize() );
 
 	++counter;
 }
 
 void srs_env_model::CPointCloudPlugin::handlePostNodeTraversal(const SMapParameters & mp)
 {
-//*
-	// If different frame id
-	if( (!m_bAsInput) && (m_ocFrameId != m_pcFrameId) )
+	// Merge partitions of the parallel crawl (in partition order, so the output is always the same)
+	for( size_t i = 0; i < m_partPoints.size(); ++i )
+	{
+		m_ocPoints.points.insert( m_ocPoints.points.end(), m_partPoints[i].begin(), m_partPoints[i].end() );
+		m_ocSizes.insert( m_ocSizes.end(), m_partSizes[i].begin(), m_partSizes[i].end() );
+		m_partPoints[i].clear();
+		m_partSizes[i].clear();
+	}
+
+	m_ocPoints.width = m_ocPoints.points.size();
+	m_ocPoints.height = 1;
+
+	// If different frame id, points are transformed when written to the output message
+	m_bTransformOutput = (!m_bAsInput) && (m_ocFrameId != m_pcFrameId);
+	m_bOutputValid = !m_bTransformOutput;
+	if( m_bTransformOutput )
 	{
 		tf::StampedTransform ocToPcTf;
 
@@ -213,16 +448,12 @@ void srs_env_model::CPointCloudPlugin::handlePostNodeTraversal(const SMapParamet
 		// Get transformation matrix
 		pcl_ros::transformAsMatrix(ocToPcTf, ocToPcTM);	// Sensor TF to defined base TF
 
-
-		// transform point cloud from sensor frame to the preset frame
-		pcl::transformPointCloud< tPclPoint >(*m_data, *m_data, ocToPcTM);
-
-
+		// Disassemble translation and rotation
+		m_ocToPcRot = ocToPcTM.block<3, 3> (0, 0);
+		m_ocToPcTrans = ocToPcTM.block<3, 1> (0, 3);
+		m_bOutputValid = true;
 	}
 
-//	PERROR( "Publishing cloud. Size: " << m_data->size() );
-
-//*/
 	// Invalidate data
 	invalidate();
 }
@@ -239,36 +470,16 @@ void srs_env_model::CPointCloudPlugin::insertCloudCallback( const  tIncommingPoi
 
 	m_bAsInput = true;
 
-	// Convert input pointcloud
-	m_data->clear();
-	if( ! isRGBCloud( cloud ) )
-	{
-		pcl::PointCloud< pcl::PointXYZ >::Ptr bufferCloud( new pcl::PointCloud< pcl::PointXYZ> );
-
-		pcl::fromROSMsg(*cloud, *bufferCloud );
-		pcl::copyPointCloud< pcl::PointXYZ, tPclPoint >( *bufferCloud, *m_data );
-
-	}
-	else
-	{
-		pcl::PointCloud< pcl::PointXYZRGB >::Ptr bufferCloud( new pcl::PointCloud< pcl::PointXYZRGB > );
-
-		pcl::fromROSMsg(*cloud, *bufferCloud);
-		pcl::copyPointCloud<pcl::PointXYZRGB, tPclPoint>( *bufferCloud, *m_data );
-	}
+	// Compose all transforms, points are transformed, filtered and downsampled in one pass
+	Eigen::Matrix4f sensorToPcTM( Eigen::Matrix4f::Identity() );
+	Eigen::Vector4f filterZ( Eigen::Vector4f::Zero() );
 
+	try {
+		// If different frame id
+		if( cloud->header.frame_id != m_pcFrameId )
+		{
+			tf::StampedTransform sensorToPcTf;
 
-	//*/
-
-	// If different frame id
-	if( cloud->header.frame_id != m_pcFrameId )
-	{
-
-	    // Some transforms
-		tf::StampedTransform sensorToPcTf;
-
-		// Get transforms
-		try {
 			// Transformation - from, to, time, waiting time
 			m_tfListener.waitForTransform(m_pcFrameId, cloud->header.frame_id,
 					cloud->header.stamp, ros::Duration(0.2));
@@ -276,28 +487,15 @@ void srs_env_model::CPointCloudPlugin::insertCloudCallback( const  tIncommingPoi
 			m_tfListener.lookupTransform(m_pcFrameId, cloud->header.frame_id,
 					cloud->header.stamp, sensorToPcTf);
 
-		} catch (tf::TransformException& ex) {
-			ROS_ERROR_STREAM("Transform error: " << ex.what() << ", quitting callback");
-			PERROR("Transform error");
-			return;
+			// Get transformation matrix
+			pcl_ros::transformAsMatrix(sensorToPcTf, sensorToPcTM);	// Sensor TF to defined base TF
 		}
 
-		Eigen::Matrix4f sensorToPcTM;
-
-		// Get transformation matrix
-		pcl_ros::transformAsMatrix(sensorToPcTf, sensorToPcTM);	// Sensor TF to defined base TF
-
-
-		// transform pointcloud from sensor frame to the preset frame
-		pcl::transformPointCloud< tPclPoint >(*m_data, *m_data, sensorToPcTM);
-	}
+		// Filter input pointcloud by height in the base frame
+		if( m_bFilterPC )
+		{
+			tf::StampedTransform pcToBaseTf;
 
-	// Filter input pointcloud
-	if( m_bFilterPC )		// TODO: Optimize this by removing redundant transforms
-	{
-		// Get transforms to and from base id
-		tf::StampedTransform pcToBaseTf, baseToPcTf;
-		try {
 			// Transformation - to, from, time, waiting time
 			m_tfListener.waitForTransform(BASE_FRAME_ID, m_pcFrameId,
 					cloud->header.stamp, ros::Duration(0.2));
@@ -305,34 +503,36 @@ void srs_env_model::CPointCloudPlugin::insertCloudCallback( const  tIncommingPoi
 			m_tfListener.lookupTransform(BASE_FRAME_ID, m_pcFrameId,
 					cloud->header.stamp, pcToBaseTf);
 
-			m_tfListener.lookupTransform(m_pcFrameId, BASE_FRAME_ID,
-					cloud->header.stamp, baseToPcTf );
+			Eigen::Matrix4f pcToBaseTM;
+			pcl_ros::transformAsMatrix(pcToBaseTf, pcToBaseTM);
 
-		} catch (tf::TransformException& ex) {
-			ROS_ERROR_STREAM("Transform error: " << ex.what() << ", quitting callback");
-			PERROR( "Transform error.");
-			return;
+			// Only z coordinate in the base frame is needed
+			filterZ = ( pcToBaseTM * sensorToPcTM ).row( 2 ).transpose();
 		}
 
-		Eigen::Matrix4f pcToBaseTM, baseToPcTM;
-
-		// Get transformation matrix
-		pcl_ros::transformAsMatrix(pcToBaseTf, pcToBaseTM);	// Sensor TF to defined base TF
-		pcl_ros::transformAsMatrix(baseToPcTf, baseToPcTM);	// Sensor TF to defined base TF
+	} catch (tf::TransformException& ex) {
+		ROS_ERROR_STREAM("Transform error: " << ex.what() << ", quitting callback");
+		PERROR("Transform error");
+		return;
+	}
 
+	// Downsample to the map resolution
+	double voxelSize( m_bDownsampleInput ? m_inputVoxelSize : 0.0 );
 
-		// transform pointcloud from pc frame to the base frame
-		pcl::transformPointCloud< tPclPoint >(*m_data, *m_data, pcToBaseTM);
+	// Convert input pointcloud
+	if( ! isRGBCloud( cloud ) )
+	{
+		pcl::PointCloud< pcl::PointXYZ >::Ptr bufferCloud( new pcl::PointCloud< pcl::PointXYZ> );
 
-		// filter height and range, also removes NANs:
-		pcl::PassThrough<tPclPoint> pass;
-		pass.setFilterFieldName("z");
-		pass.setFilterLimits(m_pointcloudMinZ, m_pointcloudMaxZ);
-		pass.setInputCloud(m_data->makeShared());
-		pass.filter(*m_data);
+		pcl::fromROSMsg(*cloud, *bufferCloud );
+		processInputCloud( *bufferCloud, sensorToPcTM, filterZ, m_pointcloudMinZ, m_pointcloudMaxZ, voxelSize, *m_data );
+	}
+	else
+	{
+		pcl::PointCloud< pcl::PointXYZRGB >::Ptr bufferCloud( new pcl::PointCloud< pcl::PointXYZRGB > );
 
-		// transform pointcloud back to pc frame from the base frame
-		pcl::transformPointCloud< tPclPoint >(*m_data, *m_data, baseToPcTM);
+		pcl::fromROSMsg(*cloud, *bufferCloud);
+		processInputCloud( *bufferCloud, sensorToPcTM, filterZ, m_pointcloudMinZ, m_pointcloudMaxZ, voxelSize, *m_data );
 	}
 
 	// Modify header
@@ -348,7 +548,8 @@ void srs_env_model::CPointCloudPlugin::insertCloudCallback( const  tIncommingPoi
 //! Should plugin publish data?
 bool srs_env_model::CPointCloudPlugin::shouldPublish()
 {
-	return( m_data->size() > 0 && m_publishPointCloud && m_pcPublisher.getNumSubscribers() > 0 );
+	size_t size( m_bAsInput ? m_data->size() : ( m_bOutputValid ? m_ocPoints.size() : 0 ) );
+	return( size > 0 && m_publishPointCloud && m_pcPublisher.getNumSubscribers() > 0 );
 }
 
 /**
@@ -0,0 +1,405 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id:$
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Vit Stancl (stancl@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: dd/mm/2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <srs_env_model/but_server/tiled_octree_file.h>
+
+#include <algorithm>
+#include <fstream>
+#include <streambuf>
+#include <cstring>
+#include <ctime>
+#include <istream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/cstdint.hpp>
+
+namespace
+{
+	/// File magic
+	const char TILES_MAGIC[8] = { 'E', 'M', 'T', 'I', 'L', 'E', 'S', 0 };
+
+	/// File format version
+	const boost::uint32_t TILES_VERSION = 1;
+
+	/// Stored file header
+	struct STilesHeader
+	{
+		char magic[8];
+		boost::uint32_t version;
+		boost::uint32_t treeDepth;
+		double resolution;
+		boost::uint32_t numTiles;
+		boost::uint32_t reserved;
+	};
+
+	/// Stored tile index entry
+	struct STileEntry
+	{
+		boost::uint16_t key[3];
+		boost::uint8_t depth;
+		boost::uint8_t bInner;
+		float logOdds;
+		boost::uint64_t offset;
+		boost::uint64_t size;
+	};
+
+	/// Read only stream buffer over the mapped memory
+	struct CMemoryBuffer : public std::streambuf
+	{
+		CMemoryBuffer( char * data, size_t size )
+		{
+			setg( data, data, data + size );
+		}
+	};
+}
+
+/**
+ * Constructor
+ */
+srs_env_model::CTiledOcTreeFile::CTiledOcTreeFile()
+: m_data( 0 )
+, m_size( 0 )
+, m_resolution( 0.0 )
+, m_treeDepth( 0 )
+, m_numUnloaded( 0 )
+{
+}
+
+/**
+ * Destructor
+ */
+srs_env_model::CTiledOcTreeFile::~CTiledOcTreeFile()
+{
+	close();
+}
+
+/**
+ * Test file header
+ */
+bool srs_env_model::CTiledOcTreeFile::isTiledFile( const std::string & filename )
+{
+	std::ifstream file( filename.c_str(), std::ios_base::in | std::ios_base::binary );
+	if( !file.is_open() )
+		return false;
+
+	char magic[8];
+	file.read( magic, sizeof(magic) );
+
+	return file.good() && memcmp( magic, TILES_MAGIC, sizeof(magic) ) == 0;
+}
+
+/**
+ * Write tree as tiles
+ */
+bool srs_env_model::CTiledOcTreeFile::write( const EMOcTree & tree, const std::string & filename, unsigned tileDepth )
+{
+	std::ofstream file( filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc );
+	if( !file.is_open() )
+		return false;
+
+	unsigned treeDepth( tree.getTreeDepth() );
+	tileDepth = std::min( tileDepth, treeDepth );
+
+	// Collect tiles - nodes of the tile depth and all larger leafs
+	std::vector< STileEntry > tiles;
+	std::vector< const EModelTreeNode * > nodes;
+
+	if( tree.size() > 0 )
+	{
+		EMOcTree::tree_iterator it, end( tree.end_tree() );
+		for( it = tree.begin_tree( tileDepth ); it != end; ++it )
+		{
+			if( !it.isLeaf() )
+				continue;
+
+			// Iterator key is the node center, get its lower corner
+			unsigned short mask( (unsigned short)( ~((1 << (treeDepth - it.getDepth())) - 1) ) );
+			octomap::OcTreeKey key( it.getKey() );
+
+			STileEntry entry;
+			for( unsigned i = 0; i < 3; ++i )
+				entry.key[i] = key[i] & mask;
+			entry.depth = it.getDepth();
+			entry.bInner = it->hasChildren() ? 1 : 0;
+			entry.logOdds = it->getLogOdds();
+			entry.offset = entry.size = 0;
+
+			tiles.push_back( entry );
+			nodes.push_back( &(*it) );
+		}
+	}
+
+	STilesHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, TILES_MAGIC, sizeof(TILES_MAGIC) );
+	header.version = TILES_VERSION;
+	header.treeDepth = treeDepth;
+	header.resolution = tree.getResolution();
+	header.numTiles = tiles.size();
+
+	// Write header and space for the index
+	file.write( (const char *)&header, sizeof(header) );
+	std::streampos indexPos( file.tellp() );
+	if( !tiles.empty() )
+		file.write( (const char *)&tiles[0], tiles.size() * sizeof(STileEntry) );
+
+	// Write tiles data
+	for( size_t i = 0; i < tiles.size(); ++i )
+	{
+		if( !tiles[i].bInner )
+			continue;
+
+		std::streampos begin( file.tellp() );
+		tree.writeBinaryNode( file, nodes[i] );
+		tiles[i].offset = begin;
+		tiles[i].size = file.tellp() - begin;
+	}
+
+	// Rewrite index with the data offsets
+	file.seekp( indexPos );
+	if( !tiles.empty() )
+		file.write( (const char *)&tiles[0], tiles.size() * sizeof(STileEntry) );
+
+	return file.good();
+}
+
+/**
+ * Open file
+ */
+bool srs_env_model::CTiledOcTreeFile::open( const std::string & filename )
+{
+	close();
+
+	int fd( ::open( filename.c_str(), O_RDONLY ) );
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || size_t(st.st_size) < sizeof(STilesHeader) )
+	{
+		::close( fd );
+		return false;
+	}
+
+	void * data( mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) );
+	::close( fd );
+
+	if( data == MAP_FAILED )
+		return false;
+
+	m_data = (char *)data;
+	m_size = st.st_size;
+
+	// Check header
+	const STilesHeader * header( (const STilesHeader *)m_data );
+	if( memcmp( header->magic, TILES_MAGIC, sizeof(TILES_MAGIC) ) != 0 || header->version != TILES_VERSION ||
+		sizeof(STilesHeader) + size_t(header->numTiles) * sizeof(STileEntry) > m_size )
+	{
+		close();
+		return false;
+	}
+
+	m_resolution = header->resolution;
+	m_treeDepth = header->treeDepth;
+
+	// Read index
+	const STileEntry * entries( (const STileEntry *)(m_data + sizeof(STilesHeader)) );
+	m_tiles.resize( header->numTiles );
+
+	double center( double(1 << (m_treeDepth - 1)) );
+
+	for( size_t i = 0; i < m_tiles.size(); ++i )
+	{
+		const STileEntry & entry( entries[i] );
+		STile & tile( m_tiles[i] );
+
+		if( entry.depth > m_treeDepth || entry.offset + entry.size > m_size )
+		{
+			close();
+			return false;
+		}
+
+		double size( m_resolution * double(1 << (m_treeDepth - entry.depth)) );
+
+		for( unsigned j = 0; j < 3; ++j )
+		{
+			tile.key[j] = entry.key[j];
+			tile.min(j) = (double(entry.key[j]) - center) * m_resolution;
+			tile.max(j) = tile.min(j) + size;
+		}
+
+		tile.depth = entry.depth;
+		tile.bInner = entry.bInner != 0;
+		tile.logOdds = entry.logOdds;
+		tile.offset = entry.offset;
+		tile.size = entry.size;
+		tile.bLoaded = false;
+		tile.bModified = false;
+		tile.lastTouch = 0;
+	}
+
+	m_numUnloaded = m_tiles.size();
+
+	return true;
+}
+
+/**
+ * Close file
+ */
+void srs_env_model::CTiledOcTreeFile::close()
+{
+	if( m_data != 0 )
+		munmap( m_data, m_size );
+
+	m_data = 0;
+	m_size = 0;
+	m_tiles.clear();
+	m_numUnloaded = 0;
+}
+
+/**
+ * Load tiles in box
+ */
+size_t srs_env_model::CTiledOcTreeFile::loadBox( EMOcTree & tree, const octomap::point3d & min, const octomap::point3d & max )
+{
+	unsigned now( (unsigned)time( NULL ) );
+
+	size_t count( 0 );
+	for( std::vector< STile >::iterator it = m_tiles.begin(); it != m_tiles.end(); ++it )
+	{
+		if( it->max.x() < min.x() || it->min.x() > max.x() ||
+			it->max.y() < min.y() || it->min.y() > max.y() ||
+			it->max.z() < min.z() || it->min.z() > max.z() )
+			continue;
+
+		it->lastTouch = now;
+
+		if( !it->bLoaded && loadTile( tree, *it ) )
+			++count;
+	}
+
+	return count;
+}
+
+/**
+ * Load all tiles
+ */
+size_t srs_env_model::CTiledOcTreeFile::loadAll( EMOcTree & tree )
+{
+	if( m_numUnloaded == 0 )
+		return 0;
+
+	size_t count( 0 );
+	for( std::vector< STile >::iterator it = m_tiles.begin(); it != m_tiles.end(); ++it )
+	{
+		if( !it->bLoaded && loadTile( tree, *it ) )
+			++count;
+	}
+
+	return count;
+}
+
+/**
+ * Drop the stored map
+ */
+void srs_env_model::CTiledOcTreeFile::discardAll()
+{
+	// Tree places of the tiles are now owned by the new data
+	close();
+}
+
+/**
+ * Evict tiles which were not touched for a while
+ */
+size_t srs_env_model::CTiledOcTreeFile::evictUntouched( EMOcTree & tree, unsigned maxAge )
+{
+	unsigned now( (unsigned)time( NULL ) );
+
+	size_t count( 0 );
+	for( std::vector< STile >::iterator it = m_tiles.begin(); it != m_tiles.end(); ++it )
+	{
+		if( !it->bLoaded || it->bModified || now - it->lastTouch <= maxAge )
+			continue;
+
+		// Changed tile keeps newer data than the file, so it stays in the tree for good
+		if( !isTileUnchanged( tree, *it ) )
+		{
+			it->bModified = true;
+			continue;
+		}
+
+		if( tree.deleteSubtree( it->key, it->depth ) )
+		{
+			it->bLoaded = false;
+			++m_numUnloaded;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Load one tile
+ */
+bool srs_env_model::CTiledOcTreeFile::loadTile( EMOcTree & tree, STile & tile )
+{
+	// Tile is marked as loaded even if the place in the tree is already used
+	// by the newer data, so it is never tried again.
+	tile.bLoaded = true;
+	tile.lastTouch = (unsigned)time( NULL );
+	--m_numUnloaded;
+
+	CMemoryBuffer buffer( m_data + tile.offset, tile.size );
+	std::istream stream( &buffer );
+
+	return tree.readSubtree( stream, tile.key, tile.depth, tile.logOdds, tile.bInner );
+}
+
+/**
+ * Compare tile subtree with the stored data
+ */
+bool srs_env_model::CTiledOcTreeFile::isTileUnchanged( const EMOcTree & tree, const STile & tile ) const
+{
+	const EModelTreeNode * node( tree.getSubtree( tile.key, tile.depth ) );
+	if( node == 0 || node->hasChildren() != tile.bInner )
+		return false;
+
+	// Leaf tile keeps its log-odds, inner tile root is computed from children
+	if( !tile.bInner )
+		return node->getLogOdds() == tile.logOdds;
+
+	std::ostringstream stream;
+	tree.writeBinaryNode( stream, node );
+	std::string data( stream.str() );
+
+	return data.size() == tile.size && memcmp( data.data(), m_data + tile.offset, tile.size ) == 0;
+}
@@ -0,0 +1,62 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id:$
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Vit Stancl (stancl@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: dd/mm/2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <srs_env_model/but_server/tiled_octree_file.h>
+
+#include <cstdlib>
+#include <iostream>
+
+#define USAGE "\nUSAGE: octomap_tiler <map.bt> <map.emt> [tile depth]\n" \
+              "  map.bt: octomap 3D map file to read\n" \
+              "  map.emt: tiled map file to write (can be used as but_server_node map)\n" \
+              "  tile depth: depth of the stored subtrees (default 8)\n"
+
+int main(int argc, char** argv){
+  if (argc < 3 || argc > 4){
+          std::cerr << USAGE << std::endl;
+          return -1;
+  }
+
+  unsigned tileDepth(8);
+  if (argc == 4)
+          tileDepth = atoi(argv[3]);
+
+  srs_env_model::EMOcTree tree(0.1);
+  if (!tree.readBinary(argv[1])){
+          std::cerr << "Could not read octomap file " << argv[1] << std::endl;
+          return -1;
+  }
+
+  if (!srs_env_model::CTiledOcTreeFile::write(tree, argv[2], tileDepth)){
+          std::cerr << "Could not write tiled map file " << argv[2] << std::endl;
+          return -1;
+  }
+
+  std::cerr << "Map with " << tree.size() << " nodes written to " << argv[2] << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,655 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id:$
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Vit Stancl (stancl@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: dd/mm/2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ros/ros.h>
+#include <pcl/io/pcd_io.h>
+
+#include <srs_env_model/but_server/octonode.h>
+#include <srs_env_model/but_server/parallel_tools.h>
+#include <srs_env_model/but_server/plugins/octomap_plugin.h>
+#include <srs_env_model/but_server/objtree/octree.h>
+#include <srs_env_model/but_server/objtree/bbox.h>
+#include <srs_env_model/but_server/objtree/plane.h>
+#include <srs_env_model/but_server/objtree/filter.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define USAGE "\nUSAGE: server_benchmark <test> [arguments]\n" \
+              "  objtree [count]: insert count boxes and count planes to the objtree and time queries (default 20000)\n" \
+              "  objtree_growth [count]: grow the objtree map from 20 m to 20 km, count boxes per step, and time fixed size queries (default 2000)\n" \
+              "  insert [threads] [cloud.pcd ...]: insert clouds (in the map frame, sensor origin set) to the octomap serially\n" \
+              "    and in parallel by 2, 4, ... threads (default all cores), synthetic Kinect frames are used without clouds\n" \
+              "  crawl <map.bt> [runs] [threads]: crawl the map by the boost signals, by the static visitor and in parallel by 2, 4, ... threads\n" \
+              "    (default 10 runs, all cores, needs running master)\n" \
+              "  speckles [map.bt|-] [cloud.pcd ...]: insert clouds and time the speckle search of the whole map and of the last scan only\n" \
+              "    (synthetic frames are used without clouds, needs running master)\n"
+
+namespace
+{
+
+/// Initial root of the objtree plugin map
+const objtree::Box pluginRootSize(-10.0f, -10.0f, -10.0f, 20.0f, 20.0f, 20.0f);
+
+/// Random number from [min, max), sequence is given by srand()
+float randomFloat(float min, float max)
+{
+    return min + (max - min) * (std::rand() / (RAND_MAX + 1.0f));
+}
+
+/// Random axis aligned box of the given size range inside the cube [-extent/2, extent/2]
+objtree::Box randomBox(float extent, float minSize, float maxSize)
+{
+    float w = randomFloat(minSize, maxSize), h = randomFloat(minSize, maxSize), d = randomFloat(minSize, maxSize);
+
+    return objtree::Box(randomFloat(-extent/2, extent/2-w), randomFloat(-extent/2, extent/2-h), randomFloat(-extent/2, extent/2-d), w, h, d);
+}
+
+/// Random plane with the given size range inside the cube [-extent/2, extent/2]
+objtree::Plane* randomPlane(float extent, float minSize, float maxSize)
+{
+    objtree::Point scale(randomFloat(minSize, maxSize), randomFloat(minSize, maxSize), randomFloat(minSize, maxSize));
+    objtree::Point pos(randomFloat(-extent/2+scale.x/2, extent/2-scale.x/2),
+                       randomFloat(-extent/2+scale.y/2, extent/2-scale.y/2),
+                       randomFloat(-extent/2+scale.z/2, extent/2-scale.z/2));
+    objtree::Vector normal(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), randomFloat(0.1f, 1.0f));
+
+    return new objtree::Plane(pos, normal, scale);
+}
+
+/// Run queries of one filter type, print time per query and average result size
+void timeQueries(const objtree::Octree &octree, const std::vector<objtree::Filter*> &filters, const char *name)
+{
+    std::vector<objtree::Object*> objects;
+    size_t found = 0;
+
+    ros::WallTime start = ros::WallTime::now();
+
+    for(size_t i = 0; i < filters.size(); i++)
+    {
+        objects.clear();
+        octree.objects(objects, filters[i]);
+        found += objects.size();
+    }
+
+    double elapsed = (ros::WallTime::now() - start).toSec();
+
+    printf("  %-10s %8.4f ms/query, %8.1f objects/query\n", name, 1000.0*elapsed/filters.size(), double(found)/filters.size());
+}
+
+void deleteFilters(std::vector<objtree::Filter*> &filters)
+{
+    for(size_t i = 0; i < filters.size(); i++)
+    {
+        delete filters[i];
+    }
+
+    filters.clear();
+}
+
+/// Number of synthetic frames used when no clouds are given
+const unsigned int numSyntheticFrames = 10;
+
+/**
+ * Synthetic Kinect frame (640x480) taken from inside of a 10 x 10 x 3 m room.
+ * Sensor moves and turns a little with each frame. Cloud is in the map frame, sensor origin is set.
+ */
+void syntheticFrame(unsigned int frame, srs_env_model::EMOcTree::typePointCloud &cloud)
+{
+    const int width = 640, height = 480;
+    const float f = 525.0f;
+    const float roomMin[3] = { -4.0f, -5.0f, 0.0f }, roomMax[3] = { 6.0f, 5.0f, 3.0f };
+
+    float origin[3] = { 0.05f*frame, 0.0f, 1.2f };
+    float yaw = 0.035f*frame;
+    float forward[3] = { std::cos(yaw), std::sin(yaw), 0.0f };
+    float right[3] = { std::sin(yaw), -std::cos(yaw), 0.0f };
+
+    cloud.clear();
+    cloud.reserve(width*height);
+    cloud.sensor_origin_ = Eigen::Vector4f(origin[0], origin[1], origin[2], 0.0f);
+
+    for(int v = 0; v < height; v++)
+    {
+        for(int u = 0; u < width; u++)
+        {
+            float x = (u - 0.5f*(width-1))/f, y = (v - 0.5f*(height-1))/f;
+            float dir[3] = { forward[0] + x*right[0], forward[1] + x*right[1], -y };
+
+            // Nearest wall hit by the ray
+            float t = 1e10f;
+            for(int i = 0; i < 3; i++)
+            {
+                if(dir[i] > 1e-6f) t = std::min(t, (roomMax[i] - origin[i])/dir[i]);
+                if(dir[i] < -1e-6f) t = std::min(t, (roomMin[i] - origin[i])/dir[i]);
+            }
+
+            pcl::PointXYZRGB point;
+            point.x = origin[0] + t*dir[0];
+            point.y = origin[1] + t*dir[1];
+            point.z = origin[2] + t*dir[2];
+            point.r = (unsigned char)(25*point.z);
+            point.g = (unsigned char)(128 + 12*point.x);
+            point.b = (unsigned char)(128 + 12*point.y);
+
+            cloud.push_back(point);
+        }
+    }
+}
+
+/// Load clouds given as arguments or create synthetic frames
+bool loadClouds(int argc, char **argv, std::vector<srs_env_model::EMOcTree::typePointCloud> &clouds)
+{
+    clouds.resize(argc > 0 ? argc : numSyntheticFrames);
+
+    for(size_t i = 0; i < clouds.size(); i++)
+    {
+        if(argc == 0)
+        {
+            syntheticFrame(i, clouds[i]);
+        }
+        else if(pcl::io::loadPCDFile(argv[i], clouds[i]) != 0)
+        {
+            std::cerr << "Could not read cloud " << argv[i] << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Number of leafs and occupied leafs of the octomap
+void countLeafs(const srs_env_model::EMOcTree &tree, size_t &leafs, size_t &occupied)
+{
+    leafs = occupied = 0;
+
+    for(srs_env_model::EMOcTree::leaf_iterator it = tree.begin_leafs(), end = tree.end_leafs(); it != end; ++it)
+    {
+        leafs++;
+        if(tree.isNodeOccupied(*it)) occupied++;
+    }
+}
+
+/**
+ * Ray insertion of recorded or synthetic clouds, serial and parallel.
+ * Each run inserts all clouds into an empty map, the maps have to be the same.
+ */
+int benchmarkInsert(int argc, char **argv)
+{
+    unsigned int maxThreads = srs_env_model::getNumThreads(argc > 0 ? atoi(argv[0]) : 0);
+
+    std::vector<srs_env_model::EMOcTree::typePointCloud> clouds;
+    if(!loadClouds(std::max(argc-1, 0), argv+1, clouds))
+        return -1;
+
+    size_t points = 0;
+    for(size_t i = 0; i < clouds.size(); i++)
+    {
+        points += clouds[i].size();
+    }
+
+    printf("insert: %zu clouds, %.0f points per cloud\n", clouds.size(), double(points)/clouds.size());
+    printf("  %8s %12s %10s %10s\n", "threads", "ms/cloud", "leafs", "occupied");
+
+    for(unsigned int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+    {
+        srs_env_model::EMOcTree tree(0.1);
+
+        ros::WallTime start = ros::WallTime::now();
+
+        for(size_t i = 0; i < clouds.size(); i++)
+        {
+            const Eigen::Vector4f &origin(clouds[i].sensor_origin_);
+            octomap::point3d sensorOrigin(origin[0], origin[1], origin[2]);
+
+            // The same calls as COctoMapPlugin::insertScan()
+            if(numThreads > 1)
+                tree.insertColoredScanParallel(clouds[i], sensorOrigin, numThreads, -1.0, true);
+            else
+                tree.insertColoredScan(clouds[i], sensorOrigin, -1.0, true);
+        }
+
+        double elapsed = (ros::WallTime::now() - start).toSec();
+
+        size_t leafs, occupied;
+        countLeafs(tree, leafs, occupied);
+
+        printf("  %8u %12.1f %10zu %10zu\n", numThreads, 1000.0*elapsed/clouds.size(), leafs, occupied);
+    }
+
+    return 0;
+}
+
+/**
+ * Octomap plugin giving access to the crawling settings.
+ */
+class CBenchmarkOctoMapPlugin : public srs_env_model::COctoMapPlugin
+{
+public:
+    CBenchmarkOctoMapPlugin(const std::string &filename) : srs_env_model::COctoMapPlugin("OctoMapPlugin", filename) {}
+
+    void setCrawlThreads(int numThreads) { m_crawlThreads = numThreads; }
+
+    void removeSpeckles() { degradeSingleSpeckles(); }
+};
+
+/// Center of a crawled leaf
+struct SLeafPoint
+{
+    float x, y, z;
+
+    bool operator<(const SLeafPoint &p) const { return x < p.x || (x == p.x && (y < p.y || (y == p.y && z < p.z))); }
+    bool operator==(const SLeafPoint &p) const { return x == p.x && y == p.y && z == p.z; }
+};
+
+typedef std::vector<SLeafPoint> tLeafPoints;
+
+/**
+ * Crawling plugin collecting centers of occupied leafs, as the point cloud plugin does.
+ * Leafs of the parallel crawl are collected per partition and merged in partition order.
+ */
+class CLeafCollector : public srs_env_model::CServerPluginBase, public srs_env_model::COctomapCrawlerBase<srs_env_model::tButServerOcTree::NodeType>
+{
+public:
+    CLeafCollector(const std::string &name) : srs_env_model::CServerPluginBase(name) {}
+
+    virtual bool shouldPublish() { return true; }
+
+    virtual void onFrameStart(const srs_env_model::SMapParameters &par)
+    {
+        m_points.clear();
+        m_partPoints.assign(par.numPartitions, tLeafPoints());
+    }
+
+    virtual void handleOccupiedNode(srs_env_model::tButServerOcIterator &it, const srs_env_model::SMapParameters &mp)
+    {
+        SLeafPoint point = { float(it.getX()), float(it.getY()), float(it.getZ()) };
+
+        if(mp.numPartitions > 1)
+            m_partPoints[mp.partition].push_back(point);
+        else
+            m_points.push_back(point);
+    }
+
+    virtual void handlePostNodeTraversal(const srs_env_model::SMapParameters &mp)
+    {
+        for(size_t i = 0; i < m_partPoints.size(); i++)
+        {
+            m_points.insert(m_points.end(), m_partPoints[i].begin(), m_partPoints[i].end());
+        }
+    }
+
+    virtual bool canCrawlParallel() const { return true; }
+
+    const tLeafPoints &points() const { return m_points; }
+
+protected:
+    tLeafPoints m_points;
+    std::vector<tLeafPoints> m_partPoints;
+};
+
+typedef srs_env_model::CCrawlingPluginHolder<CLeafCollector, srs_env_model::COctoMapPlugin> tLeafCollectorHolder;
+
+const int collectorFlags = tLeafCollectorHolder::ON_START | tLeafCollectorHolder::ON_OCCUPIED | tLeafCollectorHolder::ON_STOP;
+
+/**
+ * Full crawls of a map, nodes are dispatched through the boost signals and through the static visitor.
+ * Then the map is crawled by the static visitor in parallel, output has to be the same in all runs.
+ */
+int benchmarkCrawl(int argc, char **argv)
+{
+    if(argc < 1)
+    {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+
+    unsigned int runs = argc > 1 ? atoi(argv[1]) : 10;
+    unsigned int maxThreads = srs_env_model::getNumThreads(argc > 2 ? atoi(argv[2]) : 0);
+
+    CBenchmarkOctoMapPlugin octomap(argv[0]);
+    CLeafCollector collector("LeafCollector");
+    tLeafCollectorHolder holder(&collector, collectorFlags);
+
+    // Dispatch is compared on the serial crawl
+    octomap.setCrawlThreads(1);
+
+    printf("crawl: %u nodes, %u runs\n", octomap.getSize(), runs);
+    printf("  %-10s %12s %10s\n", "dispatch", "ms/crawl", "occupied");
+
+    holder.connect(&octomap);
+
+    ros::WallTime start = ros::WallTime::now();
+    for(unsigned int i = 0; i < runs; i++)
+    {
+        octomap.crawl(ros::Time::now());
+    }
+    double elapsed = (ros::WallTime::now() - start).toSec();
+
+    tLeafPoints signalPoints(collector.points());
+    printf("  %-10s %12.2f %10zu\n", "signals", 1000.0*elapsed/runs, signalPoints.size());
+
+    holder.disconnect();
+    holder.activate(&octomap);
+
+    start = ros::WallTime::now();
+    for(unsigned int i = 0; i < runs; i++)
+    {
+        octomap.crawl(ros::Time::now(), srs_env_model::makeCrawlerVisitor(holder));
+    }
+    elapsed = (ros::WallTime::now() - start).toSec();
+
+    printf("  %-10s %12.2f %10zu%s\n", "visitor", 1000.0*elapsed/runs, collector.points().size(),
+           collector.points() == signalPoints ? "" : " (output differs)");
+
+    // Parallel crawl visits the same leafs in a different, but always the same order
+    tLeafPoints sortedPoints(signalPoints);
+    std::sort(sortedPoints.begin(), sortedPoints.end());
+
+    for(unsigned int numThreads = 2; numThreads <= maxThreads; numThreads *= 2)
+    {
+        octomap.setCrawlThreads(numThreads);
+
+        tLeafPoints firstPoints;
+        bool bSameOrder = true;
+        elapsed = 0.0;
+
+        for(unsigned int i = 0; i < runs; i++)
+        {
+            start = ros::WallTime::now();
+            octomap.crawl(ros::Time::now(), srs_env_model::makeCrawlerVisitor(holder));
+            elapsed += (ros::WallTime::now() - start).toSec();
+
+            if(i == 0)
+                firstPoints = collector.points();
+            else
+                bSameOrder = bSameOrder && collector.points() == firstPoints;
+        }
+
+        tLeafPoints points(firstPoints);
+        std::sort(points.begin(), points.end());
+
+        char name[32];
+        snprintf(name, sizeof(name), "%u threads", numThreads);
+        printf("  %-10s %12.2f %10zu%s%s\n", name, 1000.0*elapsed/runs, firstPoints.size(),
+               points == sortedPoints ? "" : " (other leafs)", bSameOrder ? "" : " (order changes)");
+    }
+
+    return 0;
+}
+
+/**
+ * Speckle search of the whole map, as it was done after each scan before only the last scan was searched.
+ * Speckles are only counted, map is not changed.
+ */
+size_t countSpeckles(srs_env_model::tButServerOcTree &tree)
+{
+    size_t count = 0;
+
+    for(srs_env_model::tButServerOcTree::leaf_iterator it = tree.begin_leafs(), end = tree.end_leafs(); it != end; ++it)
+    {
+        if(!tree.isNodeOccupied(*it))
+            continue;
+
+        octomap::OcTreeKey nKey = it.getKey();
+        octomap::OcTreeKey key;
+        bool neighborFound = false;
+
+        for(key[2] = nKey[2] - 1; !neighborFound && key[2] <= nKey[2] + 1; ++key[2])
+        {
+            for(key[1] = nKey[1] - 1; !neighborFound && key[1] <= nKey[1] + 1; ++key[1])
+            {
+                for(key[0] = nKey[0] - 1; !neighborFound && key[0] <= nKey[0] + 1; ++key[0])
+                {
+                    if(key == nKey)
+                        continue;
+
+                    srs_env_model::tButServerOcTree::NodeType *node = tree.search(key);
+                    neighborFound = node != 0 && tree.isNodeOccupied(node);
+                }
+            }
+        }
+
+        if(!neighborFound)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * Per scan cost of the speckle removal.
+ * Whole map search (previous implementation) is compared with the search of the cells occupied by the last scan.
+ */
+int benchmarkSpeckles(int argc, char **argv)
+{
+    std::string mapFilename(argc > 0 && std::string(argv[0]) != "-" ? argv[0] : "");
+
+    std::vector<srs_env_model::EMOcTree::typePointCloud> clouds;
+    if(!loadClouds(std::max(argc-1, 0), argv+1, clouds))
+        return -1;
+
+    CBenchmarkOctoMapPlugin octomap(mapFilename);
+    srs_env_model::tButServerOcTree &tree(octomap.getData().octree);
+
+    printf("speckles: %zu clouds\n", clouds.size());
+    printf("  %6s %10s %14s %10s %14s\n", "scan", "leafs", "whole map ms", "speckles", "last scan ms");
+
+    double wholeTotal = 0.0, lastTotal = 0.0;
+
+    for(size_t i = 0; i < clouds.size(); i++)
+    {
+        const Eigen::Vector4f &origin(clouds[i].sensor_origin_);
+        tree.insertColoredScan(clouds[i], octomap::point3d(origin[0], origin[1], origin[2]), -1.0, true);
+
+        ros::WallTime start = ros::WallTime::now();
+        size_t speckles = countSpeckles(tree);
+        double whole = (ros::WallTime::now() - start).toSec();
+
+        start = ros::WallTime::now();
+        octomap.removeSpeckles();
+        double last = (ros::WallTime::now() - start).toSec();
+
+        size_t leafs, occupied;
+        countLeafs(tree, leafs, occupied);
+
+        printf("  %6zu %10zu %14.2f %10zu %14.2f\n", i, leafs, 1000.0*whole, speckles, 1000.0*last);
+
+        wholeTotal += whole;
+        lastTotal += last;
+    }
+
+    printf("  %6s %10s %14.2f %10s %14.2f\n", "mean", "", 1000.0*wholeTotal/clouds.size(), "", 1000.0*lastTotal/clouds.size());
+
+    return 0;
+}
+
+/**
+ * Objtree with tens of thousands of planes and boxes.
+ * Objects are spread with constant density, queries are of the size used by the plugin clients.
+ */
+int benchmarkObjtree(int argc, char **argv)
+{
+    unsigned int count = argc > 0 ? atoi(argv[0]) : 20000;
+    const unsigned int numQueries = 1000;
+
+    // About one object of each type per 8 m^3
+    float extent = std::pow(8.0f*count, 1.0f/3.0f);
+
+    std::srand(1);
+
+    objtree::Octree octree(pluginRootSize);
+
+    ros::WallTime start = ros::WallTime::now();
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        octree.insert(new objtree::BBox(randomBox(extent, 0.1f, 1.0f)));
+        octree.insert(randomPlane(extent, 0.2f, 2.0f));
+    }
+
+    double elapsed = (ros::WallTime::now() - start).toSec();
+
+    std::vector<objtree::Box> nodes;
+    std::vector<objtree::Object*> objects;
+    objtree::FilterZero all;
+    octree.nodes(nodes, objects, &all);
+
+    printf("objtree: %u boxes and %u planes in %.0f m cube, %zu nodes, depth %u\n", count, count, extent, nodes.size(), octree.maxDepth());
+    printf("  insert     %8.4f ms/object\n", 1000.0*elapsed/(2*count));
+
+    std::vector<objtree::Filter*> boxes, spheres, halfspaces;
+    for(unsigned int i = 0; i < numQueries; i++)
+    {
+        boxes.push_back(new objtree::FilterBox(randomBox(extent, 2.0f, 2.0f)));
+        spheres.push_back(new objtree::FilterSphere(randomFloat(-extent/2, extent/2), randomFloat(-extent/2, extent/2), randomFloat(-extent/2, extent/2), 1.0f));
+    }
+
+    // Halfspace returns about half of the map, fewer queries are enough
+    for(unsigned int i = 0; i < numQueries/50; i++)
+    {
+        halfspaces.push_back(new objtree::FilterPlane(randomFloat(-extent/2, extent/2), 0.0f, 0.0f, 1.0f, 0.0f, 0.0f));
+    }
+
+    timeQueries(octree, boxes, "box");
+    timeQueries(octree, spheres, "sphere");
+    timeQueries(octree, halfspaces, "halfspace");
+
+    deleteFilters(boxes);
+    deleteFilters(spheres);
+    deleteFilters(halfspaces);
+
+    return 0;
+}
+
+/**
+ * Objtree growing with the map.
+ * Map extent is doubled in each step and new boxes are spread over the whole extent, the root grows to contain them.
+ * Cost of a fixed size box query should grow with the depth of the tree only. Results are checked by brute force.
+ */
+int benchmarkObjtreeGrowth(int argc, char **argv)
+{
+    unsigned int count = argc > 0 ? atoi(argv[0]) : 2000;
+    const unsigned int numQueries = 1000;
+    const unsigned int numChecked = 100;
+    const float querySize = 6.0f;
+
+    std::srand(1);
+
+    objtree::Octree octree(pluginRootSize);
+    std::vector<const objtree::Object*> inserted;
+
+    printf("objtree growth: %u boxes per step, %.0f m box queries\n", count, querySize);
+    printf("  %10s %8s %6s %12s %16s %8s\n", "extent [m]", "objects", "depth", "ms/query", "objects/query", "missing");
+
+    for(float extent = 20.0f; extent <= 20480.0f; extent *= 2.0f)
+    {
+        for(unsigned int i = 0; i < count; i++)
+        {
+            objtree::BBox *box = new objtree::BBox(randomBox(extent, 0.1f, 1.0f));
+            octree.insert(box);
+            inserted.push_back(box);
+        }
+
+        // Queries around existing objects, so they never hit an empty part of the map only
+        std::vector<objtree::Filter*> filters;
+        for(unsigned int i = 0; i < numQueries; i++)
+        {
+            objtree::Box box(inserted[std::rand() % inserted.size()]->boundingBox());
+            filters.push_back(new objtree::FilterBox(objtree::Box(box.x-querySize/2, box.y-querySize/2, box.z-querySize/2, querySize, querySize, querySize)));
+        }
+
+        std::vector<objtree::Object*> objects;
+        size_t found = 0;
+
+        ros::WallTime start = ros::WallTime::now();
+
+        for(unsigned int i = 0; i < numQueries; i++)
+        {
+            objects.clear();
+            octree.objects(objects, filters[i]);
+            found += objects.size();
+        }
+
+        double elapsed = (ros::WallTime::now() - start).toSec();
+
+        // Every object intersecting the query box has to be returned
+        size_t missing = 0;
+        for(unsigned int i = 0; i < numChecked; i++)
+        {
+            objects.clear();
+            octree.objects(objects, filters[i]);
+            std::sort(objects.begin(), objects.end());
+
+            for(size_t j = 0; j < inserted.size(); j++)
+            {
+                if(filters[i]->filter(inserted[j]->boundingBox()) && !std::binary_search(objects.begin(), objects.end(), inserted[j]))
+                    missing++;
+            }
+        }
+
+        printf("  %10.0f %8u %6u %12.4f %16.1f %8zu\n", extent, octree.count(), octree.maxDepth(), 1000.0*elapsed/numQueries, double(found)/numQueries, missing);
+
+        deleteFilters(filters);
+    }
+
+    return 0;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+
+    ros::init(argc, argv, "server_benchmark");
+
+    std::string test(argv[1]);
+
+    if(test == "objtree")
+        return benchmarkObjtree(argc-2, argv+2);
+    if(test == "objtree_growth")
+        return benchmarkObjtreeGrowth(argc-2, argv+2);
+    if(test == "insert")
+        return benchmarkInsert(argc-2, argv+2);
+    if(test == "crawl")
+        return benchmarkCrawl(argc-2, argv+2);
+    if(test == "speckles")
+        return benchmarkSpeckles(argc-2, argv+2);
+
+    std::cerr << USAGE << std::endl;
+    return -1;
+}
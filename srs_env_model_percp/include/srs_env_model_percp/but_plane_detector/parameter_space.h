@@ -113,13 +113,13 @@ namespace srs_env_model_percp
 			 * @param angle2 Second angle coordinate
 			 * @param z Shift (d param) coordinate
 			 */
-			double &operator() (int angle1, int angle2, int z);
+			float &operator() (int angle1, int angle2, int z);
 
 			/**
 			 * Returns a value saved at given index
 			 * @param index Given index
 			 */
-			double &operator[] (int index);
+			float &operator[] (int index);
 
 			/**
 			 * Returns a value saved at given values
@@ -127,7 +127,7 @@ namespace srs_env_model_percp
 			 * @param angle2 Second angle value
 			 * @param z Shift (d param) value
 			 */
-			double &operator() (double angle1, double angle2, double z);
+			float &operator() (double angle1, double angle2, double z);
 
 			/**
 			 * Returns a size of this space structure in Bytes
@@ -236,7 +236,7 @@ namespace srs_env_model_percp
 			/**
 			 * Pointer to the Hough space structure
 			 */
-			double *m_data;
+			float *m_data;
 	};
 } // but_plane_detector
 
@@ -106,6 +106,23 @@ namespace srs_env_model_percp
 			 */
 			int findMaxima(std::vector<Plane<float> > &indices, double min_value);
 
+			/**
+			 * Finds maxima in given blocks only
+			 * @param blocks Low resolution indices of searched blocks
+			 * @param indices Found planes
+			 * @param values Values of bins of found planes
+			 * @param planeBlocks Low resolution indices of blocks of found planes
+			 * @param min_value Minimal bin value of found plane
+			 */
+			void findMaxima(std::vector<int> &blocks, std::vector<Plane<float> > &indices, std::vector<double> &values, std::vector<int> &planeBlocks, double min_value);
+
+			/**
+			 * Multiplies all values by given factor, blocks with all values lower than minValue are released
+			 * @param factor Multiplication factor
+			 * @param minValue Minimal value kept in the space
+			 */
+			void scale(float factor, float minValue);
+
 			/**
 			 * Adds a second volume to this with offset
 			 * @param second Second volume to be added
@@ -125,6 +142,16 @@ namespace srs_env_model_percp
 			 */
 			void addVolume(ParameterSpace &second, int angle1, int angle2, int shift, float factor);
 
+			/**
+			 * Adds a second volume multiple times, work is split among threads
+			 * Each thread except the first one adds its volumes into one of partial spaces, which are then added to this block by block
+			 * @param second Second volume to be added
+			 * @param indices Indices (see getIndex) of second volume centers
+			 * @param factors Numbers by which each added volume will be multiplied
+			 * @param partials Partial spaces of the same size as this, one for each additional thread (cleared after use)
+			 */
+			void addVolumes(ParameterSpace &second, std::vector<int> &indices, std::vector<float> &factors, std::vector<ParameterSpaceHierarchy *> &partials);
+
 			/**
 			 * Converts index in parameter space into angle value
 			 * @param index Angle axis index
@@ -184,6 +211,12 @@ namespace srs_env_model_percp
 			 */
 			void set(double angle1, double angle2, double z, double val);
 
+			/**
+			 * Returns a high resolution block, block is allocated (or taken from free blocks) if it is not present
+			 * @param lowResolutionIndex Low resolution index of block
+			 */
+			float *getBlock(int lowResolutionIndex);
+
 			/**
 			 * Returns a size of this space structure in Bytes
 			 */
@@ -245,7 +278,11 @@ namespace srs_env_model_percp
 			 */
 			static void toEuklid(float a1, float a2, float &x, float &y, float &z);
 
+			/**
+			 * Clears the space, blocks are kept for reuse
+			 */
 			void clear();
+
 			/**
 			 * Initialized flag
 			 */
@@ -349,7 +386,12 @@ namespace srs_env_model_percp
 			/**
 			 * Pointer to the low resolution structure
 			 */
-			double **m_dataLowRes;
+			float **m_dataLowRes;
+
+			/**
+			 * Blocks released by clear(), reused by getBlock()
+			 */
+			std::vector<float *> m_freeBlocks;
 	};
 
 	/**
@@ -34,6 +34,10 @@
 #ifndef BUT_PLANE_DET_SCENEMODEL_H
 #define BUT_PLANE_DET_SCENEMODEL_H
 
+// std
+#include <map>
+#include <set>
+
 //PCL
 #include <pcl/point_types.h>
 #include <pcl/point_cloud.h>
@@ -62,6 +66,16 @@
 
 namespace srs_env_model_percp
 {
+	/**
+	 * Global Hough space is rescaled when weight of new votes exceeds this value
+	 */
+	#define HOUGH_MAX_VOTE_WEIGHT 10000.0
+
+	/**
+	 * Blocks of the global Hough space with all values lower than this are released when rescaling
+	 */
+	#define HOUGH_MIN_KEPT_VALUE 0.01
+
 	class SceneModel
 	{
 		public:
@@ -76,6 +90,7 @@ namespace srs_env_model_percp
 		 * @param gauss_shift_res d parameter resolution of added Gauss function (default 11)
 		 * @param gauss_angle_sigma Sigma of added Gauss function in angle coordinates (default 11)
 		 * @param gauss_shift_sigma Sigma of added Gauss function in d parameter coordinates (default 11)
+		 * @param decay Factor by which the global Hough space is multiplied after each frame, 1.0 means no decay (default 0.98)
 		 */
 		SceneModel(	double max_depth = 3.0,
 					double min_shift = -40.0,
@@ -85,7 +100,13 @@ namespace srs_env_model_percp
 					int gauss_angle_res = 11,
 					int gauss_shift_res = 11,
 					double gauss_angle_sigma = 0.04,
-					double gauss_shift_sigma = 0.15);
+					double gauss_shift_sigma = 0.15,
+					double decay = 0.98);
+
+		/**
+		 * Destructor - frees partial spaces
+		 */
+		~SceneModel();
 
 		/**
 		 * Function adds a depth map with computed normals into existing Hough space
@@ -100,6 +121,7 @@ namespace srs_env_model_percp
 
 		/**
 		 * Function recomputes a list of planes saved in this class (scene model)
+		 * Planes of the current frame are added to the global Hough space and its maxima are searched only in changed blocks
 		 */
 		void recomputePlanes();
 
@@ -121,9 +143,14 @@ namespace srs_env_model_percp
 		ParameterSpaceHierarchy current_space;
 
 		/**
-		 * Cached Hough space aux
+		 * Cached Hough space aux - votes of one frame, blocks are reused between frames
+		 */
+		ParameterSpaceHierarchy cache_space;
+
+		/**
+		 * Partial Hough spaces - one for each additional voting thread
 		 */
-		//ParameterSpaceHierarchy cache_space;
+		std::vector<ParameterSpaceHierarchy *> partial_spaces;
 
 		/**
 		 * Discretized Gauss function
@@ -145,6 +172,21 @@ namespace srs_env_model_percp
 		 */
 		double m_depth;
 
+		/**
+		 * Global Hough space decay factor
+		 */
+		double m_decay;
+
+		/**
+		 * Weight of votes added to the global Hough space - grows instead of decaying the whole space, values divided by it are decayed values
+		 */
+		double m_voteWeight;
+
+		/**
+		 * Maxima of the global Hough space - bin values and planes, indexed by low resolution block index
+		 */
+		std::map<int, std::vector<std::pair<double, Plane<float> > > > m_maxima;
+
 		double m_angle_min;
 		double m_angle_max;
 		double m_shift_min;
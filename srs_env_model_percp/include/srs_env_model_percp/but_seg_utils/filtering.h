@@ -59,6 +59,7 @@ namespace srs_env_model_percp
 	#define MIN_DISTANCE 0.1
 	#define MAX_DISTANCE 3.1
 	#define RANSACMAX 1000
+	#define TILE_JOIN_MIN_COS 0.95
 
 	/**
 	 * Gradient extraction method enum class
@@ -130,8 +131,10 @@ namespace srs_env_model_percp
 			 * @param smallestTriangleArea Smalest randomly found triangle to be considered for plane computation (in pixels^2)
 			 * @param minRegionSize Minimal region size to be considered
 			 * @param minCandidates Minimal number of pixels in tile to start a RANSAC
+			 * @param seed Seed of tile random generators (the same seed gives the same regions regardless of number of threads)
+			 * @param numThreads Number of threads searching the tiles (0 means all cores)
 			 */
-			void independentTileRegions(cv::Mat &src, const sensor_msgs::CameraInfoConstPtr& cam_info, float minimumPlaneDistance = 0.01, float minimumTriDistance= 0.02, float minimumFloodDistance = 0.05, int tileSize = 30, int smallestTriangleArea = 100, int minRegionSize = 10, int minCandidates = 10);
+			void independentTileRegions(cv::Mat &src, const sensor_msgs::CameraInfoConstPtr& cam_info, float minimumPlaneDistance = 0.01, float minimumTriDistance= 0.02, float minimumFloodDistance = 0.05, int tileSize = 30, int smallestTriangleArea = 100, int minRegionSize = 10, int minCandidates = 10, unsigned int seed = 1, int numThreads = 0);
 
 			/**
 			 * Method computes from m_regionMatrix statistical information (fills m_planes and m_stddeviation matrices)
@@ -196,6 +199,11 @@ namespace srs_env_model_percp
 			Normals *m_normals;
 
 		private:
+			/**
+			 * Worker searching planes in tiles by RANSAC (see independentTileRegions())
+			 */
+			struct STileRansacWorker;
+
 			/**
 			 * Auxiliary method which flood fills a tile untill min_planeDistance threshold difference is met
 			 * @param tile Tile subimage of depth data
@@ -206,9 +214,11 @@ namespace srs_env_model_percp
 			 * @param plane Equation of filled plane
 			 * @param ioffset Row offset of tile
 			 * @param joffset Column offset of tile
+			 * @param processedMask Preallocated CV_8UC1 scratch matrix of tile size (cleared here)
+			 * @param unprocessed Preallocated scratch stack of seeds
 			 * @param min_planeDistance Minimal distance from plane to fill
 			 */
-			int floodFillTile(cv::Mat &tile, cv::Mat&tileMask, cv::Mat&pointMask, cv::Vec3f *points, int index, Plane<float> &plane, int ioffset, int joffset, float min_planeDistance = 0.02);
+			int floodFillTile(cv::Mat &tile, cv::Mat&tileMask, cv::Mat&pointMask, cv::Vec3f *points, int index, Plane<float> &plane, int ioffset, int joffset, cv::Mat &processedMask, std::vector<cv::Vec2i> &unprocessed, float min_planeDistance = 0.02);
 
 			/**
 			 * Auxiliary function extracts current region's plane using LSQ
@@ -334,6 +334,16 @@ namespace srs_env_model_percp
 
 		private:
 
+			/**
+			 * Function computes normals of all points using least squares regression. Point moments are summed
+			 * in integral images, so the covariance matrix of each neighborhood is obtained in constant time.
+			 * Neighborhoods crossing a depth edge are computed by getNormalLSQ or getNormalLSQAround.
+			 * @param around Use only outer neighborhood ring (LSQAROUND)
+			 * @param step Neighborhood to compute with
+			 * @param depthThreshold Threshold for depth difference outlier marking (if depth of neighbor is greater than this threshold, point is skipped)
+			 */
+			void computeNormalsLSQIntegral(bool around, int step, float depthThreshold);
+
 			/**
 			 * Helper function for "Around" functions - sets next point on outer ring
 			 * @param step Maximum distance from center (neighborhood)
@@ -63,8 +63,8 @@ ParameterSpace::ParameterSpace(double anglemin, double anglemax, double zmin, do
 	m_anglemin = anglemin;
 	m_anglemax = anglemax;
 	m_size = m_angleSize2 * m_shiftSize;
-	m_data = new double[m_size];
-	memset(m_data, 0, sizeof(double)*m_size);
+	m_data = new float[m_size];
+	memset(m_data, 0, sizeof(float)*m_size);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -72,7 +72,7 @@ ParameterSpace::ParameterSpace(double anglemin, double anglemax, double zmin, do
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ParameterSpace::~ParameterSpace()
 {
-	delete m_data;
+	delete[] m_data;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -113,7 +113,7 @@ void ParameterSpace::toEuklid(float a1, float a2, float &x, float &y, float &z)
 // @param angle2 Second angle coordinate
 // @param z Shift (d param) coordinate
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-double &ParameterSpace::operator() (int angle1, int angle2, int z)
+float &ParameterSpace::operator() (int angle1, int angle2, int z)
 {
 	assert( angle1 < m_angleSize && angle1 >= 0 && angle2 < m_angleSize && angle2 >= 0 && z < m_shiftSize && z >= 0);
 	return m_data[z * m_angleSize2 + angle2 * m_angleSize + angle1];
@@ -123,7 +123,7 @@ double &ParameterSpace::operator() (int angle1, int angle2, int z)
 // Returns a value saved at given index
 // @param index Given index
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-double &ParameterSpace::operator[](int index)
+float &ParameterSpace::operator[](int index)
 {
 	return m_data[index];
 }
@@ -333,7 +333,7 @@ double ParameterSpace::getShift(int index)
 // @param angle2 Second angle value
 // @param z Shift (d param) value
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-double &ParameterSpace::operator() (double angle1, double angle2, double z)
+float &ParameterSpace::operator() (double angle1, double angle2, double z)
 {
 	return m_data[getIndex(angle1, angle2, z)];
 }
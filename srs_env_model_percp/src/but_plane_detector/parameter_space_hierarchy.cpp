@@ -34,11 +34,226 @@
 
 #include <srs_env_model_percp/but_plane_detector/parameter_space_hierarchy.h>
 
+#include <srs_env_model/but_server/parallel_tools.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 using namespace srs_env_model_percp;
 using namespace std;
 using namespace sensor_msgs;
 using namespace cv;
 
+namespace
+{
+	/**
+	 * Adds count values of src multiplied by factor to dst
+	 */
+	inline void addScaled(float *dst, const float *src, float factor, int count)
+	{
+		int i = 0;
+#ifdef __SSE__
+		__m128 f = _mm_set1_ps(factor);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(f, _mm_loadu_ps(src + i))));
+#endif
+		for (; i < count; ++i)
+			dst[i] += factor * src[i];
+	}
+
+	/**
+	 * Worker which adds volumes - the first thread writes directly to the space, others to partial spaces
+	 */
+	struct SAddVolumesWorker
+	{
+		ParameterSpaceHierarchy *space;
+		std::vector<ParameterSpaceHierarchy *> *partials;
+		ParameterSpace *second;
+		std::vector<int> *indices;
+		std::vector<float> *factors;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(indices->size(), thread, numThreads, begin, end);
+
+			ParameterSpaceHierarchy *target = thread == 0 ? space : (*partials)[thread - 1];
+			int angle1, angle2, shift;
+			for (size_t i = begin; i < end; ++i)
+			{
+				space->fromIndex((*indices)[i], angle1, angle2, shift);
+				target->addVolume(*second, angle1, angle2, shift, (*factors)[i]);
+			}
+		}
+	};
+
+	/**
+	 * Worker which adds blocks of partial spaces to the space, each thread processes a range of blocks
+	 */
+	struct SMergeBlocksWorker
+	{
+		ParameterSpaceHierarchy *space;
+		std::vector<ParameterSpaceHierarchy *> *partials;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(space->m_loSize, thread, numThreads, begin, end);
+
+			for (size_t i = begin; i < end; ++i)
+			for (size_t p = 0; p < partials->size(); ++p)
+			{
+				float *block = (*partials)[p]->m_dataLowRes[i];
+				if (block != NULL)
+					addScaled(space->m_dataLowRes[i], block, 1.0f, space->m_hiSize);
+			}
+		}
+	};
+
+	/**
+	 * Plane found by findMaxima with its value
+	 */
+	struct SFoundPlane
+	{
+		SFoundPlane(double v, double bv, int b, const Plane<float> &p) : value(v), binValue(bv), block(b), plane(p) {}
+
+		double value;
+		double binValue;
+		int block;
+		Plane<float> plane;
+	};
+
+	/**
+	 * Worker which finds maxima in allocated blocks, each thread processes a range of blocks
+	 * Each block is copied with a halo of two bins, so all neighborhood sums are computed inside the copy
+	 */
+	struct SFindMaximaWorker
+	{
+		ParameterSpaceHierarchy *space;
+		std::vector<int> *blocks;
+		std::vector<std::vector<SFoundPlane> > *found;
+		double minValue;
+
+		/**
+		 * Copies block with its halo to values, bins outside of the space or in not allocated blocks are zero
+		 */
+		void copyBlock(int angle1Start, int angle2Start, int shiftStart, float *values)
+		{
+			const int size = DEFAULT_BIN_SIZE + 4;
+			for (int z = 0; z < size; ++z)
+			for (int y = 0; y < size; ++y)
+			{
+				float *row = values + (z * size + y) * size;
+				int shift = shiftStart - 2 + z;
+				int angle2 = angle2Start - 2 + y;
+				int angle1 = angle1Start - 2;
+				if (shift < 0 || shift >= space->m_shiftSize || angle2 < 0 || angle2 >= space->m_angleSize)
+				{
+					std::fill(row, row + size, 0.0f);
+					continue;
+				}
+
+				// row crosses three blocks - two bins of the previous one, the whole block and two bins of the next one
+				for (int x = 0; x < size; )
+				{
+					int count = x == 0 || x == size - 2 ? 2 : DEFAULT_BIN_SIZE;
+					if (angle1 + x < 0 || angle1 + x >= space->m_angleSize)
+						std::fill(row + x, row + x + count, 0.0f);
+					else
+					{
+						IndexStruct index = space->getIndex(angle1 + x, angle2, shift);
+						const float *block = space->m_dataLowRes[index.lowResolutionIndex];
+						if (block == NULL)
+							std::fill(row + x, row + x + count, 0.0f);
+						else
+							std::copy(block + index.highResolutionIndex, block + index.highResolutionIndex + count, row + x);
+					}
+					x += count;
+				}
+			}
+		}
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(blocks->size(), thread, numThreads, begin, end);
+
+			const int size = DEFAULT_BIN_SIZE + 4;
+			const int sizeZ = size * size;
+			std::vector<float> values(size * sizeZ), sums(size * sizeZ), maxima(size * sizeZ), aux(size * sizeZ);
+			std::vector<SFoundPlane> &planes = (*found)[thread];
+
+			for (size_t b = begin; b < end; ++b)
+			{
+				int lowIndex = (*blocks)[b];
+				const float *block = space->m_dataLowRes[lowIndex];
+				if (block == NULL || *std::max_element(block, block + space->m_hiSize) <= minValue)
+					continue;
+
+				int angle1Start, angle2Start, shiftStart;
+				space->fromIndex(lowIndex * space->m_hiSize, angle1Start, angle2Start, shiftStart);
+				copyBlock(angle1Start, angle2Start, shiftStart, &values[0]);
+
+				// sums of bin and its six neighbors - block with halo of one bin
+				for (int z = 1; z < size - 1; ++z)
+				for (int y = 1; y < size - 1; ++y)
+				for (int x = 1, i = z * sizeZ + y * size + 1; x < size - 1; ++x, ++i)
+					sums[i] = values[i] + values[i-1] + values[i+1] + values[i-size] + values[i+size] + values[i-sizeZ] + values[i+sizeZ];
+
+				// maximum of sums in 3x3x3 neighborhood, separately in each axis
+				for (int z = 1; z < size - 1; ++z)
+				for (int y = 1; y < size - 1; ++y)
+				for (int x = 2, i = z * sizeZ + y * size + 2; x < size - 2; ++x, ++i)
+					maxima[i] = std::max(sums[i], std::max(sums[i-1], sums[i+1]));
+				for (int z = 1; z < size - 1; ++z)
+				for (int y = 2; y < size - 2; ++y)
+				for (int x = 2, i = z * sizeZ + y * size + 2; x < size - 2; ++x, ++i)
+					aux[i] = std::max(maxima[i], std::max(maxima[i-size], maxima[i+size]));
+				for (int z = 2; z < size - 2; ++z)
+				for (int y = 2; y < size - 2; ++y)
+				for (int x = 2, i = z * sizeZ + y * size + 2; x < size - 2; ++x, ++i)
+					maxima[i] = std::max(aux[i], std::max(aux[i-sizeZ], aux[i+sizeZ]));
+
+				for (int z = 2; z < size - 2; ++z)
+				for (int y = 2; y < size - 2; ++y)
+				for (int x = 2, i = z * sizeZ + y * size + 2; x < size - 2; ++x, ++i)
+				{
+					int angle1 = angle1Start + x - 2;
+					int angle2 = angle2Start + y - 2;
+					int shift = shiftStart + z - 2;
+					if (values[i] <= minValue || sums[i] < maxima[i] ||
+						angle1 < 1 || angle1 >= space->m_angleSize ||
+						angle2 < 1 || angle2 >= space->m_angleSize ||
+						shift < 1 || shift >= space->m_shiftSize)
+						continue;
+
+					float a, b, c;
+					double aroundx = 0;
+					double aroundy = 0;
+					double aroundz = 0;
+					double arounds = 0;
+					for (int dx = -1; dx <= 1; ++dx)
+					for (int dy = -1; dy <= 1; ++dy)
+					for (int dz = -1; dz <= 1; ++dz)
+					{
+						ParameterSpaceHierarchy::toEuklid(space->getAngle(angle1 + dx), space->getAngle(angle2 + dy), a, b, c);
+						aroundx += a;
+						aroundy += b;
+						aroundz += c;
+						arounds += space->getShift(shift + dz);
+					}
+					aroundx /= 7.0;
+					aroundy /= 7.0;
+					aroundz /= 7.0;
+					arounds /= 7.0;
+					planes.push_back(SFoundPlane(sums[i], values[i], lowIndex, Plane<float>(aroundx, aroundy, aroundz, arounds)));
+				}
+			}
+		}
+	};
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Constructor - creates and allocates a space (angle X angle X shift)
 // @param anglemin Minimal angle in space
@@ -75,7 +290,7 @@ ParameterSpaceHierarchy::ParameterSpaceHierarchy(double anglemin, double anglema
 
 	m_hiSize = DEFAULT_BIN_SIZE*DEFAULT_BIN_SIZE*DEFAULT_BIN_SIZE;
 	m_hiSize2 = DEFAULT_BIN_SIZE*DEFAULT_BIN_SIZE;
-	m_dataLowRes = (double **)malloc(sizeof(double*)*m_loSize);
+	m_dataLowRes = (float **)malloc(sizeof(float*)*m_loSize);
 	for (int i = 0; i < m_loSize; ++i)
 		m_dataLowRes[i] = NULL;
 }
@@ -88,19 +303,47 @@ ParameterSpaceHierarchy::~ParameterSpaceHierarchy()
 	for (int i = 0; i < m_loSize; ++i)
 		if (m_dataLowRes[i] != NULL) free(m_dataLowRes[i]);
 
+	for (unsigned int i = 0; i < m_freeBlocks.size(); ++i)
+		free(m_freeBlocks[i]);
+
 	free(m_dataLowRes);
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Clears the space, blocks are kept for reuse
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void ParameterSpaceHierarchy::clear()
 {
 	for (int i = 0; i < m_loSize; ++i)
 	{
-		if (m_dataLowRes[i] != NULL) free(m_dataLowRes[i]);
+		if (m_dataLowRes[i] != NULL) m_freeBlocks.push_back(m_dataLowRes[i]);
 		m_dataLowRes[i] = NULL;
 	}
 
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns a high resolution block, block is allocated (or taken from free blocks) if it is not present
+// @param lowResolutionIndex Low resolution index of block
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+float *ParameterSpaceHierarchy::getBlock(int lowResolutionIndex)
+{
+	float *block = m_dataLowRes[lowResolutionIndex];
+	if (block == NULL)
+	{
+		if (m_freeBlocks.empty())
+			block = (float *)malloc(sizeof(float) * m_hiSize);
+		else
+		{
+			block = m_freeBlocks.back();
+			m_freeBlocks.pop_back();
+		}
+		memset(block, 0, m_hiSize * sizeof(float));
+		m_dataLowRes[lowResolutionIndex] = block;
+	}
+	return block;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Conversion from Euclidian representation of normal (x, y, z) to parametrized (a1, a2)
 // @param x X vector coordinate
@@ -162,12 +405,7 @@ double ParameterSpaceHierarchy::get(int angle1, int angle2, int z)
 void ParameterSpaceHierarchy::set(int angle1, int angle2, int z, double val)
 {
 	IndexStruct index = getIndex(angle1, angle2, z);
-	if (m_dataLowRes[index.lowResolutionIndex] == NULL)
-	{
-		m_dataLowRes[index.lowResolutionIndex] = (double *)malloc(sizeof(double) *m_hiSize);
-		memset(m_dataLowRes[index.lowResolutionIndex], 0, m_hiSize * sizeof(double));
-	}
-	m_dataLowRes[index.lowResolutionIndex][index.highResolutionIndex] = val;
+	getBlock(index.lowResolutionIndex)[index.highResolutionIndex] = val;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -189,12 +427,7 @@ double ParameterSpaceHierarchy::get(int index)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void ParameterSpaceHierarchy::set(int index, double val)
 {
-	if (m_dataLowRes[index / m_hiSize] == NULL)
-	{
-		m_dataLowRes[index / m_hiSize] = (double *)malloc(sizeof(double) *m_hiSize);
-		memset(m_dataLowRes[index / m_hiSize], 0, m_hiSize * sizeof(double));
-	}
-	m_dataLowRes[index / m_hiSize][index % m_hiSize] = val;
+	getBlock(index / m_hiSize)[index % m_hiSize] = val;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -285,24 +518,7 @@ void ParameterSpaceHierarchy::getIndex(double angle1, double angle2, double z, i
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void ParameterSpaceHierarchy::addVolume(ParameterSpace &second, int angle1, int angle2, int shift)
 {
-	//std::cout << angle1 << " " << angle2 << " " << shift << " " << std::endl;
-	double secondAngleHalf = second.m_angleSize / 2;
-	double secondShiftHalf = second.m_shiftSize / 2;
-	int shiftThis, angle1This, angle2This;
-	int shiftS, angle1S, angle2S;
-
-	for (shiftS = 0, shiftThis = shift - secondShiftHalf; shiftS < second.m_shiftSize; ++shiftS, ++shiftThis)
-	for (angle2S=0, angle2This = angle2 - secondAngleHalf; angle2S < second.m_angleSize; ++angle2S, ++angle2This)
-	for (angle1S=0, angle1This = angle1 - secondAngleHalf; angle1S < second.m_angleSize; ++angle1S, ++angle1This)
-	{
-		if (angle1This >= 0 && angle1This < m_angleSize &&
-			angle2This >= 0 && angle2This < m_angleSize &&
-			shiftThis  >= 0 && shiftThis < m_shiftSize)
-		{
-			set(angle1This, angle2This, shiftThis, get(angle1This, angle2This, shiftThis) + second(angle1S, angle2S, shiftS));
-		}
-
-	}
+	addVolume(second, angle1, angle2, shift, 1.0f);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -315,25 +531,75 @@ void ParameterSpaceHierarchy::addVolume(ParameterSpace &second, int angle1, int
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void ParameterSpaceHierarchy::addVolume(ParameterSpace &second, int angle1, int angle2, int shift, float factor)
 {
-	double secondAngleHalf = second.m_angleSize / 2;
-	double secondShiftHalf = second.m_shiftSize / 2;
-	int shiftThis, angle1This, angle2This;
-	int shiftS, angle1S, angle2S;
-
-	for (shiftS = 0, shiftThis = shift - secondShiftHalf; shiftS < second.m_shiftSize; ++shiftS, ++shiftThis)
-	for (angle2S=0, angle2This = angle2 - secondAngleHalf; angle2S < second.m_angleSize; ++angle2S, ++angle2This)
-	for (angle1S=0, angle1This = angle1 - secondAngleHalf; angle1S < second.m_angleSize; ++angle1S, ++angle1This)
+	// position of second volume origin in this space
+	int angle1Offset = angle1 - second.m_angleSize / 2;
+	int angle2Offset = angle2 - second.m_angleSize / 2;
+	int shiftOffset = shift - second.m_shiftSize / 2;
+
+	// clip second volume to this space
+	int angle1From = std::max(angle1Offset, 0);
+	int angle1To = std::min(angle1Offset + second.m_angleSize, m_angleSize);
+	int angle2From = std::max(angle2Offset, 0);
+	int angle2To = std::min(angle2Offset + second.m_angleSize, m_angleSize);
+	int shiftFrom = std::max(shiftOffset, 0);
+	int shiftTo = std::min(shiftOffset + second.m_shiftSize, m_shiftSize);
+
+	for (int shiftThis = shiftFrom; shiftThis < shiftTo; ++shiftThis)
+	for (int angle2This = angle2From; angle2This < angle2To; ++angle2This)
 	{
-		if (angle1This >= 0 && angle1This < m_angleSize &&
-			angle2This >= 0 && angle2This < m_angleSize &&
-			shiftThis  >= 0 && shiftThis < m_shiftSize)
+		const float *row = &second(0, angle2This - angle2Offset, shiftThis - shiftOffset) - angle1Offset;
+
+		// row is continuous in each block, so it is split at block borders
+		for (int angle1This = angle1From; angle1This < angle1To; )
 		{
-			set(angle1This, angle2This, shiftThis, get(angle1This, angle2This, shiftThis) + factor * second(angle1S, angle2S, shiftS));
+			int count = std::min(angle1To, (angle1This / DEFAULT_BIN_SIZE + 1) * DEFAULT_BIN_SIZE) - angle1This;
+			IndexStruct index = getIndex(angle1This, angle2This, shiftThis);
+			addScaled(getBlock(index.lowResolutionIndex) + index.highResolutionIndex, row + angle1This, factor, count);
+			angle1This += count;
 		}
-
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Adds a second volume multiple times, work is split among threads
+// @param second Second volume to be added
+// @param indices Indices (see getIndex) of second volume centers
+// @param factors Numbers by which each added volume will be multiplied
+// @param partials Partial spaces of the same size as this, one for each additional thread (cleared after use)
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void ParameterSpaceHierarchy::addVolumes(ParameterSpace &second, std::vector<int> &indices, std::vector<float> &factors, std::vector<ParameterSpaceHierarchy *> &partials)
+{
+	unsigned numThreads = partials.size() + 1;
+
+	SAddVolumesWorker addWorker;
+	addWorker.space = this;
+	addWorker.partials = &partials;
+	addWorker.second = &second;
+	addWorker.indices = &indices;
+	addWorker.factors = &factors;
+	srs_env_model::runParallel(numThreads, addWorker);
+
+	if (partials.empty())
+		return;
+
+	// allocate all blocks used by partial spaces, so merging threads do not touch free blocks
+	for (int i = 0; i < m_loSize; ++i)
+	for (unsigned int p = 0; p < partials.size(); ++p)
+		if (partials[p]->m_dataLowRes[i] != NULL)
+		{
+			getBlock(i);
+			break;
+		}
+
+	SMergeBlocksWorker mergeWorker;
+	mergeWorker.space = this;
+	mergeWorker.partials = &partials;
+	srs_env_model::runParallel(numThreads, mergeWorker);
+
+	for (unsigned int p = 0; p < partials.size(); ++p)
+		partials[p]->clear();
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Finds maximas in this and saves them as planes to given vector
 // @param indices Found planes
@@ -341,92 +607,96 @@ void ParameterSpaceHierarchy::addVolume(ParameterSpace &second, int angle1, int
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 int ParameterSpaceHierarchy::findMaxima(std::vector<Plane<float> > &indices, double min_value)
 {
-	float a, b, c;
 	int maxind = -1;
 	float max = -1;
-	int angle1, angle2, shift;
-
-	ParameterSpaceHierarchyFullIterator it(this);
 
-	// pass all non null points
-	while (not it.end)
+	std::vector<int> blocks;
+	for (int i = 0; i < m_loSize; ++i)
+		if (m_dataLowRes[i] != NULL)
+			blocks.push_back(i);
+
+	unsigned numThreads = srs_env_model::getNumThreads(0);
+	std::vector<std::vector<SFoundPlane> > found(numThreads);
+
+	SFindMaximaWorker worker;
+	worker.space = this;
+	worker.blocks = &blocks;
+	worker.found = &found;
+	worker.minValue = min_value;
+	srs_env_model::runParallel(numThreads, worker);
+
+	// threads process continuous ranges of blocks, so planes are in the order of indices
+	for (unsigned t = 0; t < found.size(); ++t)
+	for (unsigned int i = 0; i < found[t].size(); ++i)
 	{
-		double val = it.getVal();
-		if (val > min_value)
+		double val = found[t][i].value;
+		Plane<float> &plane = found[t][i].plane;
+		std::cout << "Found plane size: " << val << " eq: " << plane.a <<" "<< plane.b <<" "<< plane.c <<" "<< plane.d <<" "<< std::endl;
+		indices.push_back(plane);
+		if (val > max)
 		{
-			this->fromIndex(it.currentI, angle1, angle2, shift);
-			if (angle1 >= 1 && angle1 < m_angleSize &&
-				angle2 >= 1 && angle2 < m_angleSize &&
-				shift >= 1 && shift < m_shiftSize)
-			{
-				val +=  get(angle1-1, angle2, shift) +
-						get(angle1+1, angle2, shift) +
-						get(angle1, angle2-1, shift) +
-						get(angle1, angle2+1, shift) +
-						get(angle1, angle2, shift+1) +
-						get(angle1, angle2, shift-1);
-
-				bool ok = true;
-				double aux;
-				int xx, yy, zz;
-				for (int x = -1; x <= 1; ++x)
-				for (int y = -1; y <= 1; ++y)
-				for (int z = -1; z <= 1; ++z)
-				{
-					xx = angle1 + x;
-					yy = angle2 + y;
-					zz = shift + z;
-					aux = 	get(xx, yy, zz) +
-							get(xx-1, yy, zz) +
-							get(xx+1, yy, zz) +
-							get(xx, yy-1, zz) +
-							get(xx, yy+1, zz) +
-							get(xx, yy, zz+1) +
-							get(xx, yy, zz-1);
-						if (val < aux)
-						{
-							ok = false;
-							break;
-						}
-					}
-
-					if (ok)
-					{
-						double aroundx = 0;
-						double aroundy = 0;
-						double aroundz = 0;
-						double arounds = 0;
-						for (int x = -1; x <= 1; ++x)
-						for (int y = -1; y <= 1; ++y)
-						for (int z = -1; z <= 1; ++z)
-						{
-							xx = angle1 + x;
-							yy = angle2 + y;
-							zz = shift + z;
-							toEuklid(getAngle(xx), getAngle(yy), a, b, c);
-							aroundx += a;
-							aroundy += b;
-							aroundz += c;
-							arounds += getShift(zz);
-						}
-						aroundx /= 7.0;
-						aroundy /= 7.0;
-						aroundz /= 7.0;
-						arounds /= 7.0;
-						std::cout << "Found plane size: " << val << " eq: " << aroundx <<" "<< aroundy <<" "<< aroundz <<" "<< arounds <<" "<< std::endl;
-						indices.push_back(Plane<float>(aroundx, aroundy, aroundz, arounds));
-						if (val > max)
-						{
-							max = val;
-							maxind = indices.size() - 1;
-						}
-					}
-			}
+			max = val;
+			maxind = indices.size() - 1;
 		}
-		++it;
 	}
 	return maxind;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Finds maxima in given blocks only
+// @param blocks Low resolution indices of searched blocks
+// @param indices Found planes
+// @param values Values of bins of found planes
+// @param planeBlocks Low resolution indices of blocks of found planes
+// @param min_value Minimal bin value of found plane
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void ParameterSpaceHierarchy::findMaxima(std::vector<int> &blocks, std::vector<Plane<float> > &indices, std::vector<double> &values, std::vector<int> &planeBlocks, double min_value)
+{
+	unsigned numThreads = srs_env_model::getNumThreads(0);
+	std::vector<std::vector<SFoundPlane> > found(numThreads);
+
+	SFindMaximaWorker worker;
+	worker.space = this;
+	worker.blocks = &blocks;
+	worker.found = &found;
+	worker.minValue = min_value;
+	srs_env_model::runParallel(numThreads, worker);
+
+	for (unsigned t = 0; t < found.size(); ++t)
+	for (unsigned int i = 0; i < found[t].size(); ++i)
+	{
+		indices.push_back(found[t][i].plane);
+		values.push_back(found[t][i].binValue);
+		planeBlocks.push_back(found[t][i].block);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Multiplies all values by given factor, blocks with all values lower than minValue are released
+// @param factor Multiplication factor
+// @param minValue Minimal value kept in the space
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void ParameterSpaceHierarchy::scale(float factor, float minValue)
+{
+	for (int i = 0; i < m_loSize; ++i)
+	{
+		float *block = m_dataLowRes[i];
+		if (block == NULL)
+			continue;
+
+		float max = 0;
+		for (int j = 0; j < m_hiSize; ++j)
+		{
+			block[j] *= factor;
+			max = std::max(max, block[j]);
+		}
 
+		if (max < minValue)
+		{
+			m_freeBlocks.push_back(block);
+			m_dataLowRes[i] = NULL;
+		}
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -484,13 +754,7 @@ double ParameterSpaceHierarchy::get(double angle1, double angle2, double z)
 void ParameterSpaceHierarchy::set(double angle1, double angle2, double z, double val)
 {
 	IndexStruct index = getIndex(angle1, angle2, z);
-
-	if (m_dataLowRes[index.lowResolutionIndex] == NULL)
-		{
-			m_dataLowRes[index.lowResolutionIndex] = (double *)malloc(sizeof(double) *m_hiSize);
-			memset(m_dataLowRes[index.lowResolutionIndex], 0, m_hiSize * sizeof(double));
-		}
-		m_dataLowRes[index.lowResolutionIndex][index.highResolutionIndex] = val;
+	getBlock(index.lowResolutionIndex)[index.highResolutionIndex] = val;
 }
 
 
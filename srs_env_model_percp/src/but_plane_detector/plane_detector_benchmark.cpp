@@ -0,0 +1,355 @@
+/******************************************************************************
+ * \file
+ *
+ * $Id: plane_detector_benchmark.cpp $
+ *
+ * Copyright (C) Brno University of Technology
+ *
+ * This file is part of software developed by dcgm-robotics@FIT group.
+ *
+ * Author: Rostislav Hulik (ihulik@fit.vutbr.cz)
+ * Supervised by: Michal Spanel (spanel@fit.vutbr.cz)
+ * Date: 2012
+ *
+ * This file is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Description:
+ * Offline benchmark of the plane detector
+ *
+ * Feeds depth frames into the scene model the same way as the detector node does
+ * and measures time and Hough space memory per frame. Also measures the tile RANSAC
+ * segmentation for different numbers of threads. Frames are either recorded
+ * 16 bit depth images (in millimeters) or synthetic frames of a simple room.
+ *
+ */
+
+#include <srs_env_model_percp/but_plane_detector/scene_model.h>
+#include <srs_env_model_percp/but_seg_utils/normals.h>
+#include <srs_env_model_percp/but_seg_utils/filtering.h>
+#include <srs_env_model/but_server/parallel_tools.h>
+
+#include <ros/ros.h>
+
+// OpenCV 2
+#include <opencv2/highgui/highgui.hpp>
+
+#include <sensor_msgs/CameraInfo.h>
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+using namespace sensor_msgs;
+
+#define USAGE "Usage: \n" \
+              "  plane_detector_benchmark <test> [<frames> | <depth.png> ...]\n" \
+              "    test    - addnext: time of SceneModel::AddNext() and Hough space memory per frame\n" \
+              "              regions: time of Regions::independentTileRegions() for 1, 2, 4, ... threads\n" \
+              "    frames  - number of synthetic frames (default 20)\n" \
+              "    depth   - recorded 16 bit depth images in millimeters (640x480)"
+
+namespace srs_env_model_percp
+{
+	/**
+	 * Size of benchmark frames (Kinect resolution)
+	 */
+	const int FRAME_WIDTH = 640;
+	const int FRAME_HEIGHT = 480;
+
+	/**
+	 * Scene model exposing memory occupied by its Hough spaces
+	 */
+	class BenchmarkSceneModel : public SceneModel
+	{
+		public:
+			BenchmarkSceneModel() : SceneModel(3.0, -20.0, 20.0, 512, 4096, 11, 11, 0.02, 0.05)
+			{}
+
+			/**
+			 * Returns memory allocated by all Hough spaces in Bytes
+			 */
+			double houghSpaceSize()
+			{
+				double size = space.getSize() + current_space.getSize() + cache_space.getSize();
+				for (unsigned int i = 0; i < partial_spaces.size(); ++i)
+					size += partial_spaces[i]->getSize();
+				return size * sizeof(float);
+			}
+	};
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Returns camera info with Kinect intrinsics
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	CameraInfoPtr kinectCameraInfo()
+	{
+		CameraInfoPtr cam_info(new CameraInfo);
+		cam_info->width = FRAME_WIDTH;
+		cam_info->height = FRAME_HEIGHT;
+		cam_info->K[0] = 525.0;
+		cam_info->K[2] = 319.5;
+		cam_info->K[4] = 525.0;
+		cam_info->K[5] = 239.5;
+		cam_info->K[8] = 1.0;
+		return cam_info;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Renders a synthetic depth frame of a room (floor, ceiling, three walls and a tilted board)
+	// Camera moves slightly between frames, so the planes shift in the Hough space as they do with a real sensor
+	// @param frame Frame number
+	// @param cam_info Camera info used for rendering
+	// @param depth Output CV_16UC1 depth matrix in millimeters
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	void syntheticFrame(int frame, const CameraInfoConstPtr& cam_info, Mat &depth)
+	{
+		// planes n.p = d in camera coordinates (x right, y down, z forward)
+		const int numPlanes = 6;
+		const float planes[numPlanes][4] = {{ 0.0,  1.0,  0.0,  1.2},	// floor
+											{ 0.0, -1.0,  0.0,  1.4},	// ceiling
+											{ 0.0,  0.0,  1.0,  4.0},	// back wall
+											{-1.0,  0.0,  0.0,  1.8},	// left wall
+											{ 1.0,  0.0,  0.0,  2.1},	// right wall
+											{ 0.5,  0.0,  0.866, 2.0}};	// tilted board
+
+		float origin[3] = {0.01f * frame, 0.005f * frame, 0.0f};
+		srand(frame + 1);
+
+		depth.create(FRAME_HEIGHT, FRAME_WIDTH, CV_16UC1);
+		for (int i = 0; i < FRAME_HEIGHT; ++i)
+			for (int j = 0; j < FRAME_WIDTH; ++j)
+			{
+				float dir[3] = {(float)((j - cam_info->K[2]) / cam_info->K[0]), (float)((i - cam_info->K[5]) / cam_info->K[4]), 1.0f};
+				float nearest = FLT_MAX;
+
+				for (int p = 0; p < numPlanes; ++p)
+				{
+					float dot = planes[p][0] * dir[0] + planes[p][1] * dir[1] + planes[p][2] * dir[2];
+					if (dot <= 0.0)
+						continue;
+
+					float t = (planes[p][3] - planes[p][0] * origin[0] - planes[p][1] * origin[1] - planes[p][2] * origin[2]) / dot;
+
+					// board is only 1x1 m large
+					if (p == numPlanes - 1 && (fabs(t * dir[1]) > 0.5 || fabs(t * dir[0] - 0.4) > 0.5))
+						continue;
+
+					if (t > 0.0 && t < nearest)
+						nearest = t;
+				}
+
+				// sensor noise about 2 mm, max range of Kinect
+				float noise = (rand() % 5 - 2) * 0.001;
+				depth.at<unsigned short>(i, j) = (nearest < 8.0) ? (unsigned short)((nearest + noise) * 1000.0) : 0;
+			}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Loads a recorded frame or renders a synthetic one
+	// @param files Recorded depth images, synthetic frames are used if empty
+	// @param frame Frame number
+	// @param cam_info Camera info, its size is updated to the size of the frame
+	// @param depth Output CV_16UC1 depth matrix in millimeters
+	// @return False if the recorded image is not a 16 bit depth image
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool loadFrame(const std::vector<std::string> &files, int frame, CameraInfoPtr &cam_info, Mat &depth)
+	{
+		if (files.empty())
+		{
+			syntheticFrame(frame, cam_info, depth);
+			return true;
+		}
+
+		depth = imread(files[frame], -1);
+		if (depth.type() != CV_16UC1)
+		{
+			cerr << "Skipping " << files[frame] << " - not a 16 bit depth image" << endl;
+			return false;
+		}
+		cam_info->width = depth.cols;
+		cam_info->height = depth.rows;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Returns peak resident memory of this process in kB (0 if it is not available)
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	long peakMemory()
+	{
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line))
+			if (line.compare(0, 6, "VmHWM:") == 0)
+				return atol(line.c_str() + 6);
+		return 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Runs the detector pipeline of the node on all frames and prints time and memory of each step
+	// @param files Recorded depth images, synthetic frames are used if empty
+	// @param numFrames Number of synthetic frames
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	void benchmarkAddNext(const std::vector<std::string> &files, int numFrames)
+	{
+		CameraInfoPtr cam_info = kinectCameraInfo();
+		BenchmarkSceneModel model;
+
+		if (!files.empty())
+			numFrames = files.size();
+
+		double normalsTotal = 0.0, addTotal = 0.0, recomputeTotal = 0.0;
+		int measured = 0;
+
+		printf("frame  normals [ms]  AddNext [ms]  recomputePlanes [ms]  planes  Hough space [MB]  peak RSS [MB]\n");
+		for (int frame = 0; frame < numFrames; ++frame)
+		{
+			Mat depth;
+			if (!loadFrame(files, frame, cam_info, depth))
+				continue;
+
+			ros::WallTime start = ros::WallTime::now();
+			Normals normal(depth, cam_info, NormalType::LSQAROUND);
+			ros::WallTime normalsDone = ros::WallTime::now();
+			model.AddNext(depth, cam_info, normal);
+			ros::WallTime addDone = ros::WallTime::now();
+			model.recomputePlanes();
+			ros::WallTime recomputeDone = ros::WallTime::now();
+
+			double normalsTime = (normalsDone - start).toSec() * 1000.0;
+			double addTime = (addDone - normalsDone).toSec() * 1000.0;
+			double recomputeTime = (recomputeDone - addDone).toSec() * 1000.0;
+			normalsTotal += normalsTime;
+			addTotal += addTime;
+			recomputeTotal += recomputeTime;
+			++measured;
+
+			printf("%5d  %12.2f  %12.2f  %20.2f  %6u  %16.2f  %13.2f\n", frame, normalsTime, addTime, recomputeTime,
+					(unsigned int)model.planes.size(), model.houghSpaceSize() / 1000000.0, peakMemory() / 1000.0);
+		}
+
+		if (measured > 0)
+			printf("mean   %12.2f  %12.2f  %20.2f\n", normalsTotal / measured, addTotal / measured, recomputeTotal / measured);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Segments all frames by tile RANSAC with 1, 2, 4, ... threads and prints mean time per frame
+	// Regions found with the same seed are compared to the single thread ones, they have to be identical
+	// @param files Recorded depth images, synthetic frames are used if empty
+	// @param numFrames Number of synthetic frames
+	// @return Number of frames whose regions depend on the number of threads
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int benchmarkRegions(const std::vector<std::string> &files, int numFrames)
+	{
+		CameraInfoPtr cam_info = kinectCameraInfo();
+
+		if (!files.empty())
+			numFrames = files.size();
+
+		std::vector<unsigned int> threadCounts;
+		unsigned int maxThreads = srs_env_model::getNumThreads(0);
+		for (unsigned int threads = 1; threads < maxThreads; threads *= 2)
+			threadCounts.push_back(threads);
+		threadCounts.push_back(maxThreads);
+
+		std::vector<double> totalTime(threadCounts.size(), 0.0);
+		std::vector<int> differentFrames(threadCounts.size(), 0);
+		int measured = 0;
+
+		for (int frame = 0; frame < numFrames; ++frame)
+		{
+			Mat depth;
+			if (!loadFrame(files, frame, cam_info, depth))
+				continue;
+
+			// normals are shared, only the segmentation is measured
+			Normals normal(depth, cam_info, NormalType::LSQAROUND);
+			Mat reference;
+
+			for (unsigned int t = 0; t < threadCounts.size(); ++t)
+			{
+				Regions reg(&normal);
+
+				ros::WallTime start = ros::WallTime::now();
+				reg.independentTileRegions(depth, cam_info, 0.01, 0.02, 0.05, 30, 100, 10, 10, 1, threadCounts[t]);
+				totalTime[t] += (ros::WallTime::now() - start).toSec() * 1000.0;
+
+				if (t == 0)
+					reference = reg.m_regionMatrix.clone();
+				else if (countNonZero(reg.m_regionMatrix != reference) > 0)
+					++differentFrames[t];
+			}
+			++measured;
+		}
+
+		int different = 0;
+		printf("threads  independentTileRegions [ms]  frames with different regions\n");
+		for (unsigned int t = 0; t < threadCounts.size() && measured > 0; ++t)
+		{
+			printf("%7u  %27.2f  %30d\n", threadCounts[t], totalTime[t] / measured, differentFrames[t]);
+			different += differentFrames[t];
+		}
+
+		return different;
+	}
+}
+
+/**
+ * Main benchmark body
+ */
+int main( int argc, char** argv )
+{
+	using namespace srs_env_model_percp;
+
+	if (argc < 2)
+	{
+		cerr << USAGE << endl;
+		return 1;
+	}
+
+	ros::init(argc, argv, "plane_detector_benchmark");
+
+	std::vector<std::string> files;
+	int numFrames = 20;
+	if (argc == 3 && atoi(argv[2]) > 0)
+		numFrames = atoi(argv[2]);
+	else
+		for (int i = 2; i < argc; ++i)
+			files.push_back(argv[i]);
+
+	std::string test = argv[1];
+	if (test == "addnext")
+		benchmarkAddNext(files, numFrames);
+	else if (test == "regions")
+	{
+		if (benchmarkRegions(files, numFrames) > 0)
+		{
+			cerr << "Regions differ between numbers of threads" << endl;
+			return 1;
+		}
+	}
+	else
+	{
+		cerr << USAGE << endl;
+		return 1;
+	}
+
+	return 0;
+}
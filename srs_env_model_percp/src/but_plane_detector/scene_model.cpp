@@ -37,6 +37,8 @@
 #include <pcl/segmentation/extract_clusters.h>
 #include <pcl/filters/statistical_outlier_removal.h>
 
+#include <srs_env_model/but_server/parallel_tools.h>
+
 using namespace pcl;
 using namespace cv;
 
@@ -54,6 +56,7 @@ namespace srs_env_model_percp
 	// @param gauss_shift_res d parameter resolution of added Gauss function (default 11)
 	// @param gauss_angle_sigma Sigma of added Gauss function in angle coordinates (default 11)
 	// @param gauss_shift_sigma Sigma of added Gauss function in d parameter coordinates (default 11)
+	// @param decay Factor by which the global Hough space is multiplied after each frame, 1.0 means no decay (default 0.98)
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	SceneModel::SceneModel(	double max_depth,
 							double min_shift,
@@ -63,9 +66,11 @@ namespace srs_env_model_percp
 							int gauss_angle_res,
 							int gauss_shift_res,
 							double gauss_angle_sigma,
-							double gauss_shift_sigma) :	scene_cloud(new PointCloud<PointXYZRGB>),
+							double gauss_shift_sigma,
+							double decay) :	scene_cloud(new PointCloud<PointXYZRGB>),
 														space(-M_PI, M_PI, min_shift, max_shift, angle_resolution, shift_resolution),
 														current_space(-M_PI, M_PI, min_shift, max_shift, angle_resolution, shift_resolution),
+														cache_space(-M_PI, M_PI, min_shift, max_shift, angle_resolution, shift_resolution),
 														gauss(-(gauss_angle_res/2) * space.m_angleStep, (gauss_angle_res/2) * space.m_angleStep, -(gauss_shift_res/2) * space.m_shiftStep, (gauss_shift_res/2) * space.m_shiftStep, gauss_angle_res, gauss_shift_res)
 	{
 		/////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -81,20 +86,38 @@ namespace srs_env_model_percp
 
 		m_depth = max_depth;
 
+		m_decay = decay;
+		m_voteWeight = 1.0;
+
 		// init of HS
-		std::cout << "Parameter space size: " << space.getSize()*sizeof(double) / 1000000.0 << " MB" << std::endl;
+		std::cout << "Parameter space size: " << space.getSize()*sizeof(float) / 1000000.0 << " MB" << std::endl;
 		std::cout << "Parameter shift step: " << space.m_shiftStep << std::endl;
 		std::cout << "Parameter angle step: " << space.m_angleStep << std::endl;
-		std::cout << "Gauss space size: " << gauss.m_size*sizeof(double) / 1000000.0 << " MB" << std::endl;
+		std::cout << "Gauss space size: " << gauss.m_size*sizeof(float) / 1000000.0 << " MB" << std::endl;
 		std::cout << "Gauss shift step: " << gauss.m_shiftStep << std::endl;
 		std::cout << "Gauss angle step: " << gauss.m_angleStep << std::endl;
 
 		// generate Gauss function in gauss space
 		gauss.generateGaussIn(gauss_angle_sigma, gauss_shift_sigma);
+
+		// one partial space for each additional thread
+		unsigned numThreads = srs_env_model::getNumThreads(0);
+		for (unsigned i = 1; i < numThreads; ++i)
+			partial_spaces.push_back(new ParameterSpaceHierarchy(-M_PI, M_PI, min_shift, max_shift, angle_resolution, shift_resolution));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Destructor
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	SceneModel::~SceneModel()
+	{
+		for (unsigned i = 0; i < partial_spaces.size(); ++i)
+			delete partial_spaces[i];
 	}
 
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Function recomputes a list of planes saved in this class (scene model)
+	// Planes of the current frame are added to the global Hough space and its maxima are searched only in changed blocks
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	void SceneModel::recomputePlanes()
 	{
@@ -133,13 +156,22 @@ namespace srs_env_model_percp
 
 		float a1, a2;
 		int ai1, ai2, zi;
+		std::set<int> changed;
 		// apply planes to the global model as gauss functions
 		for (unsigned int i = 0; i < planes.size(); ++i)
 		{
 			current_space.toAngles(planes[i].a, planes[i].b, planes[i].c, a1, a2);
 			current_space.getIndex(a1, a2, planes[i].d, ai1, ai2, zi);
 
-			space.addVolume(gauss, ai1, ai2, zi);
+			space.addVolume(gauss, ai1, ai2, zi, m_voteWeight);
+
+			// maxima search looks two bins around, so blocks in this distance from gauss are changed too
+			int angleHalf = gauss.m_angleSize / 2 + 2;
+			int shiftHalf = gauss.m_shiftSize / 2 + 2;
+			for (int z = std::max(zi - shiftHalf, 0) / DEFAULT_BIN_SIZE; z <= std::min(zi + shiftHalf, space.m_shiftSize - 1) / DEFAULT_BIN_SIZE; ++z)
+			for (int y = std::max(ai2 - angleHalf, 0) / DEFAULT_BIN_SIZE; y <= std::min(ai2 + angleHalf, space.m_angleSize - 1) / DEFAULT_BIN_SIZE; ++y)
+			for (int x = std::max(ai1 - angleHalf, 0) / DEFAULT_BIN_SIZE; x <= std::min(ai1 + angleHalf, space.m_angleSize - 1) / DEFAULT_BIN_SIZE; ++x)
+				changed.insert(z * space.m_angleLoSize2 + y * space.m_angleLoSize + x);
 		}
 		std::cout << "Adding into global" << std::endl;
 		/////////////////////////////////////////////////////////////////////////////////////////////////
@@ -229,7 +261,60 @@ namespace srs_env_model_percp
 
 		aux.clear();
 		counts.clear();
-		space.findMaxima(planes, 0.7);
+
+		// search maxima in changed blocks, maxima of other blocks only decay
+		double minValue = 0.7 * m_voteWeight;
+		std::vector<int> blocks(changed.begin(), changed.end());
+		std::vector<double> values;
+		std::vector<int> planeBlocks;
+		space.findMaxima(blocks, aux, values, planeBlocks, minValue);
+
+		for (unsigned int i = 0; i < blocks.size(); ++i)
+			m_maxima.erase(blocks[i]);
+		for (unsigned int i = 0; i < aux.size(); ++i)
+			m_maxima[planeBlocks[i]].push_back(std::make_pair(values[i], aux[i]));
+
+		std::map<int, std::vector<std::pair<double, Plane<float> > > >::iterator it = m_maxima.begin();
+		while (it != m_maxima.end())
+		{
+			std::vector<std::pair<double, Plane<float> > > &maxima = it->second;
+			for (unsigned int i = 0; i < maxima.size(); )
+			{
+				if (maxima[i].first > minValue)
+				{
+					planes.push_back(maxima[i].second);
+					++i;
+				}
+				else
+					maxima.erase(maxima.begin() + i);
+			}
+
+			if (maxima.empty())
+				m_maxima.erase(it++);
+			else
+				++it;
+		}
+
+		// weight of next votes grows, the global space is rescaled (and faded blocks released) only sometimes
+		m_voteWeight /= m_decay;
+		if (m_voteWeight > HOUGH_MAX_VOTE_WEIGHT)
+		{
+			space.scale(1.0 / m_voteWeight, HOUGH_MIN_KEPT_VALUE);
+
+			it = m_maxima.begin();
+			while (it != m_maxima.end())
+			{
+				if (space.m_dataLowRes[it->first] == NULL)
+				{
+					m_maxima.erase(it++);
+					continue;
+				}
+				for (unsigned int i = 0; i < it->second.size(); ++i)
+					it->second[i].first /= m_voteWeight;
+				++it;
+			}
+			m_voteWeight = 1.0;
+		}
 //		for (unsigned int i = 0; i < aux.size(); ++i)
 //
 //		if (not used[i])
@@ -269,7 +354,7 @@ namespace srs_env_model_percp
 		while (not it.end)
 		{
 			val = it.getVal();
-			if (val != 0.0 && val < minValue)
+			if (val != 0.0 && val < minValue * m_voteWeight)
 			{
 				it.setVal(0.0);
 			}
@@ -279,7 +364,7 @@ namespace srs_env_model_percp
 
 	void SceneModel::AddNext(Normals &normals)
 	{
-		ParameterSpaceHierarchy cache_space(m_angle_min, m_angle_max, m_shift_min, m_shift_max, m_angle_res, m_shift_res);
+		cache_space.clear();
 		current_space.clear();
 
 		int maxi = normals.m_points.rows;
@@ -326,7 +411,8 @@ namespace srs_env_model_percp
 
 		// fire up the iterator on cache space
 		ParameterSpaceHierarchyFullIterator it(&cache_space);
-		int i, j, k;
+		std::vector<int> indices;
+		std::vector<float> factors;
 		double val;
 		// for each point in cache space which is not zero, write a multiplied gauss into the HT
 		while (not it.end)
@@ -334,13 +420,14 @@ namespace srs_env_model_percp
 			val = it.getVal();
 			if (val > 0.0)
 			{
-				current_space.fromIndex(it.currentI, i, j, k);
-				current_space.addVolume(gauss, i, j, k, val);
+				indices.push_back(it.currentI);
+				factors.push_back(val);
 			}
 			++it;
 		}
+		current_space.addVolumes(gauss, indices, factors, partial_spaces);
 
-		std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(double) / 1000000.0 << " MB" << std::endl;
+		std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(float) / 1000000.0 << " MB" << std::endl;
 	}
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Function adds a depth map with computed normals into existing Hough space
@@ -350,7 +437,7 @@ namespace srs_env_model_percp
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	void SceneModel::AddNext(Mat &depth, const sensor_msgs::CameraInfoConstPtr& cam_info, Normals &normals)
 	{
-		ParameterSpaceHierarchy cache_space(m_angle_min, m_angle_max, m_shift_min, m_shift_max, m_angle_res, m_shift_res);
+		cache_space.clear();
 		current_space.clear();
 
 		int maxi = normals.m_points.rows;
@@ -401,7 +488,8 @@ namespace srs_env_model_percp
 
 			// fire up the iterator on cache space
 			ParameterSpaceHierarchyFullIterator it(&cache_space);
-			int i, j, k;
+			std::vector<int> indices;
+			std::vector<float> factors;
 			double val;
 			// for each point in cache space which is not zero, write a multiplied gauss into the HT
 			while (not it.end)
@@ -409,13 +497,14 @@ namespace srs_env_model_percp
 				val = it.getVal();
 				if (val > 0.0)
 				{
-					current_space.fromIndex(it.currentI, i, j, k);
-					current_space.addVolume(gauss, i, j, k, val);
+					indices.push_back(it.currentI);
+					factors.push_back(val);
 				}
 				++it;
 			}
+			current_space.addVolumes(gauss, indices, factors, partial_spaces);
 
-			std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(double) / 1000000.0 << " MB" << std::endl;
+			std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(float) / 1000000.0 << " MB" << std::endl;
 
 //			//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //			// Control visualisaation - uncoment to see HT space
@@ -599,6 +688,6 @@ namespace srs_env_model_percp
 //				++it;
 //			}
 //
-//			std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(double) / 1000000.0 << " MB" << std::endl;
+//			std::cout << "New parameter space size: " << (double)current_space.getSize()*sizeof(float) / 1000000.0 << " MB" << std::endl;
 	}
 } // but_plane_detector
@@ -42,6 +42,10 @@
 #include <Eigen/Core>
 #include <Eigen/Eigenvalues>
 
+#include <srs_env_model/but_server/parallel_tools.h>
+
+#include <stdlib.h>
+
 using namespace sensor_msgs;
 using namespace cv;
 
@@ -542,12 +546,14 @@ void Regions::gradientPlanePredictor(Mat &src, Mat& dst, float differenceThresho
 // @param plane Equation of filled plane
 // @param ioffset Row offset of tile
 // @param joffset Column offset of tile
+// @param processedMask Preallocated CV_8UC1 scratch matrix of tile size (cleared here)
+// @param unprocessed Preallocated scratch stack of seeds
 // @param min_planeDistance Minimal distance from plane to fill
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-int Regions::floodFillTile(Mat &tile, Mat&tileMask, Mat&pointMask, Vec3f *points, int index, Plane<float> &plane, int ioffset, int joffset, float min_planeDistance /*0.02*/)
+int Regions::floodFillTile(Mat &tile, Mat&tileMask, Mat&pointMask, Vec3f *points, int index, Plane<float> &plane, int ioffset, int joffset, Mat &processedMask, std::vector<Vec2i> &unprocessed, float min_planeDistance /*0.02*/)
 {
-	std::vector<Vec2i> unprocessed;
-	Mat processedMask = Mat::zeros(tileMask.size(), CV_8UC1);
+	unprocessed.clear();
+	processedMask.setTo(0);
 	unprocessed.push_back(Vec2i(points[0][0] - ioffset, points[0][1] - joffset));
 
 	// if some of points is non zero (was filled before), bail
@@ -751,8 +757,167 @@ void Regions::fillEverything(Plane<float> &plane, Mat & depth, Mat & mask, Mat &
 	}
 }
 
+namespace
+{
+	/**
+	 * Find root of the label in the union-find forest (with path halving)
+	 */
+	int findRoot(std::vector<int> &parent, int label)
+	{
+		while (parent[label] != label)
+		{
+			parent[label] = parent[parent[label]];
+			label = parent[label];
+		}
+		return label;
+	}
+
+	/**
+	 * Join two labels, the smaller label becomes the root (so the result does not depend on order of joins)
+	 */
+	void joinLabels(std::vector<int> &parent, int a, int b)
+	{
+		a = findRoot(parent, a);
+		b = findRoot(parent, b);
+		if (a < b)
+			parent[b] = a;
+		else if (b < a)
+			parent[a] = b;
+	}
+} // anonymous namespace
+
+/**
+ * Worker which searches tiles for planes. Tiles are interleaved between threads and each tile uses
+ * its own random generator seeded from the tile index, so the found regions do not depend on number of threads.
+ * Found region is written into the tile window of the mask with label tileIndex + 1.
+ */
+struct Regions::STileRansacWorker
+{
+	Regions *regions;
+	Mat *input;
+	Mat *mask;
+	std::vector<Plane<float> > *tilePlanes;
+	std::vector<unsigned char> *tileFound;
+	int tileSize;
+	int tileCols;
+	int numTiles;
+	float minimumPlaneDistance;
+	float minimumTriDistance;
+	int smallestTriangleArea;
+	int minRegionSize;
+	int minCandidates;
+	unsigned int seed;
+
+	void operator()(unsigned thread, unsigned numThreads)
+	{
+		// scratch buffers shared by all tiles of this thread
+		std::vector<Vec3f> candidates;
+		std::vector<Vec3f> candidatesInt;
+		std::vector<Vec3f> regionPoints;
+		std::vector<Vec2i> unprocessed;
+		Mat tileMask(tileSize, tileSize, CV_32SC1);
+		Mat processedMask(tileSize, tileSize, CV_8UC1);
+		candidates.reserve(tileSize * tileSize);
+		candidatesInt.reserve(tileSize * tileSize);
+		regionPoints.reserve(tileSize * tileSize);
+
+		Vec3f points[3];
+		Vec3f pointsInt[3];
+		Vec3f normal;
+		float normalnorm;
+
+		for (int tile = thread; tile < numTiles; tile += numThreads)
+		{
+			int tilei = (tile / tileCols) * tileSize;
+			int tilej = (tile % tileCols) * tileSize;
+			unsigned int tileSeed = seed + 7919 * tile;
+
+			Mat currentPoints = regions->m_normals->m_points(Rect(tilej, tilei, tileSize, tileSize));
+			Mat currentWindow = (*input)(Rect(tilej, tilei, tileSize, tileSize));
+
+			// get all points in tile (used in RANSAC)
+			candidates.clear();
+			candidatesInt.clear();
+			for (int i = tilei; i < tilei+tileSize; ++i)
+			for (int j = tilej; j < tilej+tileSize; ++j)
+			{
+				candidates.push_back(regions->m_normals->m_points.at<Vec3f>(i,j));
+				candidatesInt.push_back(Vec3f(i,j,0));
+			}
+
+			int xsize = candidates.size();
+
+			// if there is less than minCandidates candidate points, skip the tile
+			if (xsize < minCandidates)
+				continue;
+
+			// GO ransac
+			for (unsigned int formax = 0; formax < RANSACMAX; ++formax)
+			{
+				// get three triangle points
+				for (int k = 0; k < 3; ++k)
+				{
+					int random = rand_r(&tileSeed) % xsize;
+					points[k] = candidates[random];
+					pointsInt[k] = candidatesInt[random];
+				}
+
+				if (points[0][2] < MIN_DISTANCE ||
+					points[1][2] < MIN_DISTANCE ||
+					points[2][2] < MIN_DISTANCE ||
+					points[0][2] > MAX_DISTANCE ||
+					points[1][2] > MAX_DISTANCE ||
+					points[2][2] > MAX_DISTANCE ||
+					norm((pointsInt[1] - pointsInt[0]).cross(pointsInt[2] - pointsInt[0])) < smallestTriangleArea )
+				continue;
+
+				// compute normal of random triangle
+				normal = (points[1]-points[0]).cross((points[2]-points[0]));
+				normalnorm = norm(normal);
+				normal[0] /= normalnorm;
+				normal[1] /= normalnorm;
+				normal[2] /= normalnorm;
+				Plane<float> plane(	normal[0], normal[1], normal[2],
+						-(normal[0]*points[0][0] + normal[1]*points[0][1] + normal[2]*points[0][2]));
+
+				// flood fill tile with current region
+				tileMask.setTo(0);
+				int size = regions->floodFillTile(currentWindow, tileMask, currentPoints, pointsInt, 1, plane, tilei, tilej, processedMask, unprocessed, minimumTriDistance);
+
+				// if we found sufficient big region
+				if (size > minRegionSize)
+				{
+					// fill the rest of tile and get least squares plane
+					regionPoints.clear();
+					for (int i = 0; i < tileSize; ++i)
+					for (int j = 0; j < tileSize; ++j)
+					{
+						if (tileMask.at<int>(i,j) == 0 && plane.distance(currentPoints.at<Vec3f>(i, j)) < minimumPlaneDistance)
+							tileMask.at<int>(i,j) = 1;
+
+						if (tileMask.at<int>(i,j) == 1)
+							regionPoints.push_back(currentPoints.at<Vec3f>(i, j));
+					}
+
+					(*tilePlanes)[tile] = Normals::LeastSquaresPlane(regionPoints);
+					(*tileFound)[tile] = 1;
+
+					// save region into whole image mask (tiles do not overlap, so no locking is needed)
+					for (int i = 0; i < tileSize; ++i)
+					for (int j = 0; j < tileSize; ++j)
+						mask->at<int>(tilei+i, tilej+j) = tileMask.at<int>(i,j) == 1 ? tile + 1 : 0;
+
+					// we do not need to search anymore here
+					break;
+				} // if sufficient big region
+			} // RANSAC loop
+		} // tile loop
+	}
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Method segments a depth image using own tile plane searching RANSAC method.
+// Tiles are searched in parallel, regions of neighbouring tiles are then joined when one of them would flood fill the other.
 // @param src Input CV_16UC depth matrix (raw input from kinect)
 // @param cam_info Camera info message (ROS)
 // @param minimumPlaneDistance Minimal distance threshold from triangle plane in whole tile (in meters)
@@ -762,11 +927,12 @@ void Regions::fillEverything(Plane<float> &plane, Mat & depth, Mat & mask, Mat &
 // @param smallestTriangleArea Smalest randomly found triangle to be considered for plane computation (in pixels^2)
 // @param minRegionSize Minimal region size to be considered
 // @param minCandidates Minimal number of pixels in tile to start a RANSAC
+// @param seed Seed of tile random generators (the same seed gives the same regions regardless of number of threads)
+// @param numThreads Number of threads searching the tiles (0 means all cores)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void Regions::independentTileRegions(Mat &src, const CameraInfoConstPtr& cam_info, float minimumPlaneDistance, float minimumTriDistance, float minimumFloodDistance, int tileSize, int smallestTriangleArea, int minRegionSize, int minCandidates)
+void Regions::independentTileRegions(Mat &src, const CameraInfoConstPtr& cam_info, float minimumPlaneDistance, float minimumTriDistance, float minimumFloodDistance, int tileSize, int smallestTriangleArea, int minRegionSize, int minCandidates, unsigned int seed, int numThreads)
 {
 	Mat input(src.size(), CV_32FC1);
-	Mat output(src.size(), CV_32FC1);
 
 	Mat mask = Mat::zeros(src.size(), CV_32SC1);
 	src.convertTo(input, CV_32F);
@@ -775,132 +941,113 @@ void Regions::independentTileRegions(Mat &src, const CameraInfoConstPtr& cam_inf
 	if (m_normals == NULL)
 		m_normals = new Normals(src, cam_info, NORMAL_COMPUTATION_TYPE, NORMAL_COMPUTATION_SIZE);
 
-
-	int tileCenteri, tileCenterj;
-	Vec3f points[3];
-	Vec3f pointsInt[3];
-	int random;
-	Vec3f normal;
-	float normalnorm;
-	int currentIndex = 1;
-	cv::Mat currentWindow, currentWindowMask, currentPoints;
+	// tiles start below maxrow/maxcol
 	int maxrow = input.rows - tileSize;
 	int maxcol = input.cols - tileSize;
-	std::vector<Plane<float> > planes;
-	std::vector<int > indices;
-
-	// for each of tiles...
-	for (int tilei = 0; tilei < maxrow; tilei+=tileSize)
-	for (int tilej = 0; tilej < maxcol; tilej+=tileSize)
+	int tileRows = maxrow > 0 ? (maxrow + tileSize - 1) / tileSize : 0;
+	int tileCols = maxcol > 0 ? (maxcol + tileSize - 1) / tileSize : 0;
+	int numTiles = tileRows * tileCols;
+
+	std::vector<Plane<float> > tilePlanes(numTiles, Plane<float>(0.0, 0.0, 0.0, 0.0));
+	std::vector<unsigned char> tileFound(numTiles, 0);
+
+	// search all tiles in parallel
+	STileRansacWorker worker;
+	worker.regions = this;
+	worker.input = &input;
+	worker.mask = &mask;
+	worker.tilePlanes = &tilePlanes;
+	worker.tileFound = &tileFound;
+	worker.tileSize = tileSize;
+	worker.tileCols = tileCols;
+	worker.numTiles = numTiles;
+	worker.minimumPlaneDistance = minimumPlaneDistance;
+	worker.minimumTriDistance = minimumTriDistance;
+	worker.smallestTriangleArea = smallestTriangleArea;
+	worker.minRegionSize = minRegionSize;
+	worker.minCandidates = minCandidates;
+	worker.seed = seed;
+	srs_env_model::runParallel(std::min<unsigned>(srs_env_model::getNumThreads(numThreads), std::max(numTiles, 1)), worker);
+
+	// join regions of neighbouring tiles with parallel planes if a pixel of one region touching the other one is close to the other's plane
+	std::vector<int> parent(numTiles + 1);
+	for (int i = 0; i <= numTiles; ++i)
+		parent[i] = i;
+
+	for (int tile = 0; tile < numTiles; ++tile)
 	{
-		tileCenteri = tilei + tileSize/2;
-		tileCenterj = tilej + tileSize/2;
-		std::vector<Vec3f> candidates;
-		std::vector<Vec3f> candidatesInt;
+		if (!tileFound[tile])
+			continue;
+
+		int tilei = (tile / tileCols) * tileSize;
+		int tilej = (tile % tileCols) * tileSize;
 
-		// get all points in tile (used in RANSAC)
-		for (int i = tilei; i < tilei+tileSize; ++i)
-		for (int j = tilej; j < tilej+tileSize; ++j)
-			if (mask.at<int>(i,j) == 0)
+		// right neighbour (d = 0) and bottom neighbour (d = 1)
+		for (int d = 0; d < 2; ++d)
+		{
+			int other = d == 0 ? tile + 1 : tile + tileCols;
+			if ((d == 0 && (tile % tileCols) == tileCols - 1) || other >= numTiles || !tileFound[other])
+				continue;
+
+			// planes must be nearly parallel, otherwise a plane fitted across a depth step would bridge two surfaces
+			Plane<float> &plane = tilePlanes[tile];
+			Plane<float> &otherPlane = tilePlanes[other];
+			if (std::abs(plane.a*otherPlane.a + plane.b*otherPlane.b + plane.c*otherPlane.c) < TILE_JOIN_MIN_COS)
+				continue;
+
+			bool touching = false;
+			for (int k = 0; k < tileSize && !touching; ++k)
+			for (int l = -1; l <= 1 && !touching; ++l)
 			{
-				candidates.push_back(m_normals->m_points.at<Vec3f>(i,j));
-				candidatesInt.push_back(Vec3f(i,j,0));
+				if (k + l < 0 || k + l >= tileSize)
+					continue;
+
+				// pixel of this tile on the border and its neighbour in the other tile
+				int i = d == 0 ? tilei + k : tilei + tileSize - 1;
+				int j = d == 0 ? tilej + tileSize - 1 : tilej + k;
+				int oi = d == 0 ? i + l : i + 1;
+				int oj = d == 0 ? j + 1 : j + l;
+
+				if (mask.at<int>(i, j) == tile + 1 && mask.at<int>(oi, oj) == other + 1 &&
+					(plane.distance(m_normals->m_points.at<Vec3f>(oi, oj)) < minimumFloodDistance ||
+					 otherPlane.distance(m_normals->m_points.at<Vec3f>(i, j)) < minimumFloodDistance))
+					touching = true;
 			}
 
-		int xsize = candidates.size();
-
-		// if there is less than 10 candidate points, skip the tile
-		if (xsize < minCandidates)
-		continue;
+			if (touching)
+				joinLabels(parent, tile + 1, other + 1);
+		}
+	}
 
-		// GO ransac
-		for (unsigned int formax = 0; formax < RANSACMAX; ++formax)
-		{
-			// get three triangle points
-			random = ((float)xsize*rand())/RAND_MAX;
-			points[0] = candidates[random];
-			pointsInt[0] = candidatesInt[random];
-			random = ((float)xsize*rand())/RAND_MAX;
-			points[1] = candidates[random];
-			pointsInt[1] = candidatesInt[random];
-			random = ((float)xsize*rand())/RAND_MAX;
-			points[2] = candidates[random];
-			pointsInt[2] = candidatesInt[random];
-
-
-			if (points[0][2] < MIN_DISTANCE ||
-				points[1][2] < MIN_DISTANCE ||
-				points[2][2] < MIN_DISTANCE ||
-				points[0][2] > MAX_DISTANCE ||
-				points[1][2] > MAX_DISTANCE ||
-				points[2][2] > MAX_DISTANCE ||
-				norm((pointsInt[1] - pointsInt[0]).cross(pointsInt[2] - pointsInt[0])) < smallestTriangleArea )
+	// relabel joined regions to consecutive indices (in order of tiles)
+	std::vector<int> labels(numTiles + 1, 0);
+	int currentIndex = 1;
+	for (int tile = 0; tile < numTiles; ++tile)
+	{
+		if (!tileFound[tile])
 			continue;
 
+		int root = findRoot(parent, tile + 1);
+		if (labels[root] == 0)
+			labels[root] = currentIndex++;
+		labels[tile + 1] = labels[root];
+	}
 
-			// compute normal of random triangle
-			normal = (points[1]-points[0]).cross((points[2]-points[0]));
-			normalnorm = norm(normal);
-			normal[0] /= normalnorm;
-			normal[1] /= normalnorm;
-			normal[2] /= normalnorm;
-			Plane<float> plane(	normal[0], normal[1], normal[2],
-					-(normal[0]*points[0][0] + normal[1]*points[0][1] + normal[2]*points[0][2]));
-
-			// get current tile windows
-			currentPoints = m_normals->m_points(Rect(tilej, tilei, tileSize, tileSize));
-			currentWindow = input(Rect(tilej, tilei, tileSize, tileSize));
-			mask(Rect(tilej, tilei, tileSize, tileSize)).copyTo(currentWindowMask);
-
-			// flood fill tile with current region
-			int size = floodFillTile(currentWindow, currentWindowMask, currentPoints, pointsInt, currentIndex, plane, tilei, tilej, minimumTriDistance);
-
-			// if we found sufficient big region
-			if (size > minRegionSize)
-			{
-				// get border and least squares normal
-				std::vector<Vec2i> border;
-				std::vector<Vec3f> points;
-				for (int i = 0; i < tileSize; ++i)
-				for (int j = 0; j < tileSize; ++j)
-				{
-					if (currentWindowMask.at<int>(i,j) == currentIndex)
-						points.push_back(currentPoints.at<Vec3f>(i, j));
-				}
-
-				// fill the rest of tile
-				for (int i = 0; i < tileSize; ++i)
-				for (int j = 0; j < tileSize; ++j)
-				{
-					if (currentWindowMask.at<int>(i,j) == 0 && plane.distance(currentPoints.at<Vec3f>(i, j)) < minimumPlaneDistance)
-						currentWindowMask.at<int>(i,j) = currentIndex;
-				}
+	for (int i = 0; i < mask.rows; ++i)
+	{
+		int *row = mask.ptr<int>(i);
+		for (int j = 0; j < mask.cols; ++j)
+			row[j] = labels[row[j]];
+	}
 
-				points.clear();
-				std::vector<Vec3f> points2;
-				for (int i = 0; i < tileSize; ++i)
-				for (int j = 0; j < tileSize; ++j)
-				{
-					if (currentWindowMask.at<int>(i,j) == currentIndex)
-						points2.push_back(currentPoints.at<Vec3f>(i, j));
-				}
+	// floodFillRest() - the whole image fill of each tile region, it depends on previous fills, so it is serial
+	for (int tile = 0; tile < numTiles; ++tile)
+	{
+		if (!tileFound[tile])
+			continue;
 
-				plane = Normals::LeastSquaresPlane(points2);
-				indices.push_back(currentIndex);
-				planes.push_back(plane);
-
-				// save mask into whole image mask
-				currentWindow = mask(Rect(tilej, tilei, tileSize, tileSize));
-				currentWindowMask.copyTo(currentWindow);
-
-				// floodFillRest()
-				fillEverything(plane, input, mask, m_normals->m_points, tilei, tilej, tileSize, currentIndex, minimumFloodDistance);
-				++currentIndex;
-				// we do not need to search anymore here
-				break;
-			} // if sufficient big region
-		} // RANSAC loop
-	} // tile loop
+		fillEverything(tilePlanes[tile], input, mask, m_normals->m_points, (tile / tileCols) * tileSize, (tile % tileCols) * tileSize, tileSize, labels[tile + 1], minimumFloodDistance);
+	}
 
 	m_regionMatrix = Mat(src.size(), CV_32SC1);
 	mask.convertTo(m_regionMatrix, CV_32SC1);
@@ -36,6 +36,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <float.h>
+
+// Boost
+#include <boost/thread/mutex.hpp>
+
+// Parallel helpers
+#include <srs_env_model/but_server/parallel_tools.h>
 
 // Eigen
 #include <Eigen/Core>
@@ -57,6 +64,216 @@ using namespace cv;
 namespace srs_env_model_percp
 {
 
+namespace
+{
+	/**
+	 * Number of moments summed in integral images - count, x, y, z, xx, xy, xz, yy, yz, zz
+	 */
+	const int MOMENTS = 10;
+
+	/**
+	 * Buffers of the integral normal computation - kept between frames, so they are not allocated again for each frame
+	 */
+	struct SIntegralBuffers
+	{
+		/**
+		 * Integral images of point moments, (rows + 1) x (cols + 1) x MOMENTS values
+		 */
+		std::vector<double> moments;
+
+		/**
+		 * Point depths with invalid points set to FLT_MAX - neighborhood minimum is computed from it
+		 */
+		cv::Mat depthMin;
+
+		/**
+		 * Point depths with invalid points set to zero - neighborhood maximum is computed from it
+		 */
+		cv::Mat depthMax;
+
+		/**
+		 * Buffers are shared by all Normals instances
+		 */
+		boost::mutex mutex;
+	};
+
+	SIntegralBuffers integralBuffers;
+
+	/**
+	 * Worker which sums point moments along image rows and fills depth images
+	 */
+	struct SRowMomentsWorker
+	{
+		const cv::Mat *points;
+		double *moments;
+		cv::Mat *depthMin;
+		cv::Mat *depthMax;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(points->rows, thread, numThreads, begin, end);
+
+			size_t stride = (points->cols + 1) * MOMENTS;
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Vec3f *point = points->ptr<Vec3f>(i);
+				float *minRow = depthMin->ptr<float>(i);
+				float *maxRow = depthMax->ptr<float>(i);
+				double *sum = moments + (i + 1) * stride;
+
+				std::fill(sum, sum + MOMENTS, 0.0);
+				for (int j = 0; j < points->cols; ++j, sum += MOMENTS)
+				{
+					double x = point[j][0];
+					double y = point[j][1];
+					double z = point[j][2];
+					double *next = sum + MOMENTS;
+
+					if (z > 0)
+					{
+						next[0] = sum[0] + 1.0;
+						next[1] = sum[1] + x;
+						next[2] = sum[2] + y;
+						next[3] = sum[3] + z;
+						next[4] = sum[4] + x*x;
+						next[5] = sum[5] + x*y;
+						next[6] = sum[6] + x*z;
+						next[7] = sum[7] + y*y;
+						next[8] = sum[8] + y*z;
+						next[9] = sum[9] + z*z;
+						minRow[j] = point[j][2];
+						maxRow[j] = point[j][2];
+					}
+					else
+					{
+						std::copy(sum, next, next);
+						minRow[j] = FLT_MAX;
+						maxRow[j] = 0.0;
+					}
+				}
+			}
+		}
+	};
+
+	/**
+	 * Worker which sums row sums along image columns - each thread processes a block of columns
+	 */
+	struct SColumnMomentsWorker
+	{
+		int rows;
+		size_t stride;
+		double *moments;
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(stride, thread, numThreads, begin, end);
+
+			for (int i = 1; i < rows; ++i)
+			{
+				const double *prev = moments + (i - 1) * stride;
+				double *row = moments + i * stride;
+				for (size_t k = begin; k < end; ++k)
+					row[k] += prev[k];
+			}
+		}
+	};
+
+	/**
+	 * Worker which computes normals of image rows from the integral images
+	 */
+	struct SIntegralNormalWorker
+	{
+		Normals *normals;
+		const double *moments;
+		const cv::Mat *depthMin;
+		const cv::Mat *depthMax;
+		bool around;
+		int step;
+		float depthThreshold;
+
+		/**
+		 * Adds (sign = 1) or subtracts (sign = -1) moments of points in rectangle [i0, i1) x [j0, j1)
+		 */
+		void addRect(double *sum, int i0, int j0, int i1, int j1, double sign)
+		{
+			size_t stride = (normals->m_points.cols + 1) * MOMENTS;
+			const double *a = moments + i0 * stride + j0 * MOMENTS;
+			const double *b = moments + i0 * stride + j1 * MOMENTS;
+			const double *c = moments + i1 * stride + j0 * MOMENTS;
+			const double *d = moments + i1 * stride + j1 * MOMENTS;
+			for (int k = 0; k < MOMENTS; ++k)
+				sum[k] += sign * (d[k] - b[k] - c[k] + a[k]);
+		}
+
+		void operator()(unsigned thread, unsigned numThreads)
+		{
+			size_t begin, end;
+			srs_env_model::getThreadRange(normals->m_points.rows, thread, numThreads, begin, end);
+
+			Vec3f nullvector(0.0, 0.0, 0.0);
+			Vec4f nullvector4(0.0, 0.0, 0.0, 0.0);
+			Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+
+			for (int i = begin; i < (int)end; ++i)
+			for (int j = 0; j < normals->m_points.cols; ++j)
+			{
+				Vec3f center = normals->m_points.at<Vec3f>(i, j);
+				Vec4f &plane = normals->m_planes.at<Vec4f>(i, j);
+				if (center == nullvector || i < step || j < step || i >= normals->m_points.rows-step || j >= normals->m_points.cols-step)
+				{
+					plane = nullvector4;
+					continue;
+				}
+
+				// Some neighbor is farther than depthThreshold - points must be selected one by one
+				if (center[2] < depthThreshold || (around && step < 1) ||
+					depthMax->at<float>(i, j) - center[2] >= depthThreshold || center[2] - depthMin->at<float>(i, j) >= depthThreshold)
+				{
+					plane = around ? normals->getNormalLSQAround(i, j, step, depthThreshold) : normals->getNormalLSQ(i, j, step, depthThreshold);
+					continue;
+				}
+
+				double sum[MOMENTS] = { 0.0 };
+				addRect(sum, i-step, j-step, i+step+1, j+step+1, 1.0);
+				if (around)
+					addRect(sum, i-step+1, j-step+1, i+step, j+step, -1.0);
+
+				double n = sum[0];
+				if (n < 3)
+				{
+					plane = nullvector4;
+					continue;
+				}
+
+				Eigen::Vector3d centroid(sum[1] / n, sum[2] / n, sum[3] / n);
+				Eigen::Matrix3d tensor;
+				tensor(0, 0) = sum[4] - sum[1]*centroid[0];
+				tensor(0, 1) = sum[5] - sum[1]*centroid[1];
+				tensor(0, 2) = sum[6] - sum[1]*centroid[2];
+				tensor(1, 1) = sum[7] - sum[2]*centroid[1];
+				tensor(1, 2) = sum[8] - sum[2]*centroid[2];
+				tensor(2, 2) = sum[9] - sum[3]*centroid[2];
+				tensor(1, 0) = tensor(0, 1);
+				tensor(2, 0) = tensor(0, 2);
+				tensor(2, 1) = tensor(1, 2);
+
+				// eigenvector of the smallest eigenvalue is the plane normal
+				solver.computeDirect(tensor);
+				Eigen::Vector3d normal = solver.eigenvectors().col(0);
+				double norm = normal.norm();
+				if (norm != 0)
+					normal /= norm;
+				if (normal[2] < 0)
+					normal = -normal;
+
+				plane = Vec4f(normal[0], normal[1], normal[2], -normal.dot(centroid));
+			}
+		}
+	};
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Constructor - computes real point positions (in scene coordinates) and normals and initiates all variables
 // @param points Input CV_16UC depth matrix (raw input from kinect)
@@ -196,35 +413,11 @@ Normals::Normals(cv::Mat &points, const CameraInfoConstPtr& cam_info, int normal
 			}
 		else if (normalType & NormalType::LSQ)
 			{
-				for (int i = 0; i < points.rows; ++i)
-					for (int j = 0; j < points.cols; ++j)
-					{
-						Vec3f realPoint = m_points.at<Vec3f>(i, j);
-						if (realPoint != nullvector)
-						{
-							Vec4f normal = getNormalLSQ(i, j, neighborhood, threshold);
-							m_planes.at<Vec4f>(i, j) = normal;
-						}
-						else
-						{
-							m_planes.at<Vec4f>(i, j) = nullvector4;
-						}
-					}
+				computeNormalsLSQIntegral(false, neighborhood, threshold);
 			}
 		else if (normalType & NormalType::LSQAROUND)
 			{
-				for (int i = 0; i < points.rows; ++i)
-					for (int j = 0; j < points.cols; ++j)
-					{
-						Vec3f realPoint = m_points.at<Vec3f>(i, j);
-						if (realPoint != nullvector)
-						{
-							Vec4f normal= getNormalLSQAround(i, j, neighborhood, threshold);
-							m_planes.at<Vec4f>(i, j) = normal;
-						}
-						else
-							m_planes.at<Vec4f>(i, j) = nullvector4;
-					}
+				computeNormalsLSQIntegral(true, neighborhood, threshold);
 			}
 		else if (normalType & NormalType::LTS)
 			{
@@ -547,6 +740,59 @@ cv::Vec4f Normals::getNormalLSQAround(int i, int j, int step, float depthThresho
 	return Vec4f(plane.a, plane.b, plane.c, plane.d);
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function computes normals of all points using least squares regression from integral images of point moments
+// @param around Use only outer neighborhood ring (LSQAROUND)
+// @param step Neighborhood to compute with
+// @param depthThreshold Threshold for depth difference outlier marking (if depth of neighbor is greater than this threshold, point is skipped)
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void Normals::computeNormalsLSQIntegral(bool around, int step, float depthThreshold)
+{
+	boost::mutex::scoped_lock lock(integralBuffers.mutex);
+
+	unsigned numThreads = srs_env_model::getNumThreads(0);
+	size_t stride = (m_points.cols + 1) * MOMENTS;
+
+	integralBuffers.moments.resize((m_points.rows + 1) * stride);
+	integralBuffers.depthMin.create(m_points.size(), CV_32FC1);
+	integralBuffers.depthMax.create(m_points.size(), CV_32FC1);
+	double *moments = &integralBuffers.moments[0];
+	std::fill(moments, moments + stride, 0.0);
+
+	//////////////////////////////////////////
+	// sum moments - rows first, columns then
+	SRowMomentsWorker rowWorker;
+	rowWorker.points = &m_points;
+	rowWorker.moments = moments;
+	rowWorker.depthMin = &integralBuffers.depthMin;
+	rowWorker.depthMax = &integralBuffers.depthMax;
+	srs_env_model::runParallel(numThreads, rowWorker);
+
+	SColumnMomentsWorker columnWorker;
+	columnWorker.rows = m_points.rows + 1;
+	columnWorker.stride = stride;
+	columnWorker.moments = moments;
+	srs_env_model::runParallel(numThreads, columnWorker);
+
+	//////////////////////////////////////////
+	// depth range of each neighborhood
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2*step+1, 2*step+1));
+	cv::erode(integralBuffers.depthMin, integralBuffers.depthMin, element);
+	cv::dilate(integralBuffers.depthMax, integralBuffers.depthMax, element);
+
+	//////////////////////////////////////////
+	// solve neighborhood planes
+	SIntegralNormalWorker normalWorker;
+	normalWorker.normals = this;
+	normalWorker.moments = moments;
+	normalWorker.depthMin = &integralBuffers.depthMin;
+	normalWorker.depthMax = &integralBuffers.depthMax;
+	normalWorker.around = around;
+	normalWorker.step = step;
+	normalWorker.depthThreshold = depthThreshold;
+	srs_env_model::runParallel(numThreads, normalWorker);
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Function computes normal for point (i, j) using least trimmed squares regression
 // @param i row index